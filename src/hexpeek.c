@@ -117,7 +117,12 @@ bool streamableCommand(int cmd)
     case CMD_PRINT:
     case CMD_OFFSET:
     case CMD_SEARCH:
+    case CMD_REGEX:
     case CMD_DIFF:
+    case CMD_STATS:
+    case CMD_HASH:
+    case CMD_MANIFEST:
+    case CMD_VERIFY:
         return true;
     default:
         return false;
@@ -142,6 +147,36 @@ bool writeableCommand(int cmd)
     }
 }
 
+/**
+ * @brief Return true for commands that must see the infiles with their
+ *        write-behind caches written out, i.e. all but reads that go through
+ *        the caches (print, search and diff) and replaces that they take.
+ *
+ * @param ppc Pointer to a ParsedCommand structure.
+ */
+bool flushingCommand(ParsedCommand const *ppc)
+{
+    switch(ppc->cmd)
+    {
+    case CMD_REPLACE:
+        return ! cacheAccepts(ppc);
+    case CMD_STATS:
+    case CMD_HASH:
+    case CMD_MANIFEST:
+    case CMD_VERIFY:
+    case CMD_INSERT:
+    case CMD_KILL:
+    case CMD_OPS:
+    case CMD_UNDO:
+    case CMD_COMMIT:
+    case CMD_BEGIN:
+    case CMD_SYNC:
+        return true;
+    default:
+        return false;
+    }
+}
+
 /**
  * @brief Return true for read or write commands that affect the file offest.
  *
@@ -445,11 +480,8 @@ rc_t convertText(char const *str, hoff_t memlim, hoff_t maxlim, hoff_t deflen,
         }
         else
         {
-            hoff_t before_at = -1;
-            SAVE_OFFSET(DT_FD(result->fz.fi), before_at);
             rc = readat(DT_FD(result->fz.fi), result->fz.start,
                         result->mem.octets_mal, result->mem.count);
-            RESTORE_OFFSET(DT_FD(result->fz.fi), before_at);
         }
         checkrc(rc);
     }
@@ -638,6 +670,16 @@ rc_t ascertainCommand(char const *cmdstr, bool full_validate, ParsedCommand *ppr
             ppr->cmd = CMD_OFFSET;
         else if(strnconsume(&cmdstr, "search", 6) == 0)
             ppr->cmd = CMD_SEARCH;
+        else if(strnconsume(&cmdstr, "regex", 5) == 0)
+            ppr->cmd = CMD_REGEX;
+        else if(strnconsume(&cmdstr, "stats", 5) == 0)
+            ppr->cmd = CMD_STATS;
+        else if(strnconsume(&cmdstr, "hash", 4) == 0)
+            ppr->cmd = CMD_HASH;
+        else if(strnconsume(&cmdstr, "manifest", 8) == 0)
+            ppr->cmd = CMD_MANIFEST;
+        else if(strnconsume(&cmdstr, "verify", 6) == 0)
+            ppr->cmd = CMD_VERIFY;
         else if(strnconsume(&cmdstr, "replace", 7) == 0)
             ppr->cmd = CMD_REPLACE;
         else if(strnconsume(&cmdstr, "insert", 6) == 0)
@@ -650,6 +692,12 @@ rc_t ascertainCommand(char const *cmdstr, bool full_validate, ParsedCommand *ppr
             ppr->cmd = CMD_OPS;
         else if(strnconsume(&cmdstr, "undo", 4) == 0)
             ppr->cmd = CMD_UNDO;
+        else if(strnconsume(&cmdstr, "commit", 6) == 0)
+            ppr->cmd = CMD_COMMIT;
+        else if(strnconsume(&cmdstr, "begin", 5) == 0)
+            ppr->cmd = CMD_BEGIN;
+        else if(strnconsume(&cmdstr, "sync", 4) == 0)
+            ppr->cmd = CMD_SYNC;
         else if(strnconsume(&cmdstr, "q", 1) == 0)
             ppr->cmd = CMD_QUIT;
         else if(strnconsume(&cmdstr, "h", 1) == 0)
@@ -731,7 +779,7 @@ rc_t ascertainCommand(char const *cmdstr, bool full_validate, ParsedCommand *ppr
             rc = ascertainFileZone(cmdstr, -1, &ppr->fz, &cmdstr);
             if(rc)
                 goto end;
-            if( ! memberof(*cmdstr, "+pvos/~rik "))
+            if( ! memberof(*cmdstr, "+pvos/~rikhm "))
             {
                 rc = RC_USER;
                 malcmd("unexpected text after filezone input\n");
@@ -790,7 +838,10 @@ rc_t ascertainCommand(char const *cmdstr, bool full_validate, ParsedCommand *ppr
         // Commands which require space when optional argument is given
         case CMD_HELP:
         case CMD_RESET:
+        case CMD_STATS:
+        case CMD_HASH:
         case CMD_UNDO:
+        case CMD_COMMIT:
             if(*cmdstr != '\0' && ! iswhspace(*cmdstr))
             {
                 rc = RC_USER;
@@ -807,6 +858,9 @@ rc_t ascertainCommand(char const *cmdstr, bool full_validate, ParsedCommand *ppr
         case CMD_MARGIN:
         case CMD_SCALAR:
         case CMD_SEARCH:
+        case CMD_REGEX:
+        case CMD_MANIFEST:
+        case CMD_VERIFY:
         case CMD_REPLACE:
         case CMD_INSERT:
             if( ! iswhspace(*cmdstr))
@@ -874,9 +928,16 @@ rc_t ascertainCommand(char const *cmdstr, bool full_validate, ParsedCommand *ppr
     switch(ppr->cmd)
     {
     case CMD_SEARCH:
-        rc = convertText(ppr->arg_t, SRCHSZ, SRCHSZ, 1, true, &ppr->arg_cv);
+        // filezone patterns larger than SRCHSZ are streamed, not loaded
+        rc = convertText(ppr->arg_t, SRCHSZ, HOFF_MAX, 1, true, &ppr->arg_cv);
         if(rc)
             goto end;
+        if(ppr->arg_cv.mem.count > SRCHSZ)
+        {
+            rc = RC_USER;
+            malcmd("excessive input length\n");
+            goto end;
+        }
         break;
     case CMD_DIFF:
         if(ppr->fz.len != HOFF_NIL)
@@ -928,6 +989,11 @@ rc_t ascertainCommand(char const *cmdstr, bool full_validate, ParsedCommand *ppr
             ppr->fz.len = 1;
             break;
         case CMD_SEARCH:
+        case CMD_REGEX:
+        case CMD_STATS:
+        case CMD_HASH:
+        case CMD_MANIFEST:
+        case CMD_VERIFY:
             ppr->fz.len = HOFF_MAX;
             break;
         case CMD_DIFF:
@@ -1059,25 +1125,91 @@ void genFormattedFileName(int fi, int bidx)
     assert(printed > 0 && printed < length);
 }
 
+#define BACKUP_TAG_MAX    (1 + 16)
 #define BACKUP_EXT_MAX(s) (1 + ((s) ? strlen((s)) : MAX_DEC+1+MAX_DEC) + \
-                           2 + MAX_DEC + 1 + strlen(BACKUP_EXT) + 1)
-#define BACKUP_EXT_FILE   ".%s"           ".f%d." BACKUP_EXT
-#define BACKUP_EXT_FD     ".%" PRIdMAX "-%d.d%d." BACKUP_EXT
+                           1 + BACKUP_TAG_MAX + 1 + strlen(BACKUP_EXT) + 1)
+#define BACKUP_EXT_FILE   ".%s"           ".%s." BACKUP_EXT
+#define BACKUP_EXT_FD     ".%" PRIdMAX "-%d.%s." BACKUP_EXT
+#define BACKUP_EXT_DIR    "%s/.%s.%016" PRIX64 ".%s." BACKUP_EXT
 
 /**
- * @brief Generate a path name for a backup file to be created.
+ * @brief Generate a path name in Params.backup_dir for a backup file. An
+ *        XXH64 hash of the absolute path of the infile is part of the name, so
+ *        that infiles of the same name in different directories do not share
+ *        backup files. Unlike device and inode numbers, the path stays the
+ *        same across reboots and remounts; the identity recorded in the
+ *        backup header catches a different file at the same path (see
+ *        checkIdentity()).
  *
  * @param[in] dname Path of infile to which this backup will correspond.
  * @param[in] dfd File descriptor of corresponding infile.
- * @param[in] bidx Backup index in domain [0, BACKUP_FILE_COUNT).
+ * @param[in] tag Tag of at most BACKUP_TAG_MAX characters.
  * @return Malloc-d buffer of path text.
  */
-char *genBackupName(char const *dname, int dfd, int bidx)
+static char *genDirName(char const *dname, int dfd, char const *tag)
+{
+    int printed = 0;
+    size_t totlen = 0;
+    char *tot_mal = NULL, *abs_mal = NULL;
+    char const *ident = NULL;
+    HashCtx hc;
+    uint8_t digest[HASH_MAXDIGEST];
+    uint64_t hash = 0;
+    char fdbuf[MAX_DEC + 1 + MAX_DEC + 1];
+    char basebuf[dname ? strlen(dname) + 1 : 1];
+    char const *bname = fdbuf;
+
+    if(dname)
+    {
+        strncpy(basebuf, dname, sizeof basebuf);
+        basebuf[sizeof basebuf - 1] = '\0';
+        bname = basename(basebuf);
+        abs_mal = realpath(dname, NULL);
+        ident = (abs_mal ? abs_mal : dname);
+    }
+    else
+    {
+        snprintf(fdbuf, sizeof fdbuf, "%" PRIdMAX "-%d", (intmax_t)getppid(),
+                 dfd);
+        ident = fdbuf;
+    }
+
+    hashInit(&hc, HASH_XXH64);
+    hashUpdate(&hc, ident, strlen(ident));
+    hashFinal(&hc, digest);
+    for(int ix = 0; ix < 8; ix++)
+        hash = (hash << 8) | digest[ix];
+    free(abs_mal);
+
+    totlen = strlen(Params.backup_dir) + 2 + strlen(bname) + 1 + 16 + 1 +
+             BACKUP_TAG_MAX + 1 + strlen(BACKUP_EXT) + 1;
+    tot_mal = Malloc(totlen);
+    printed = snprintf(tot_mal, totlen, BACKUP_EXT_DIR, Params.backup_dir,
+                       bname, hash, tag);
+    assert(printed > 0 && (size_t)printed < totlen);
+    return tot_mal;
+}
+
+/**
+ * @brief Generate a path name for a backup file given the tag that tells it
+ *        apart from the other backup files of the same infile.
+ *
+ * @param[in] dname Path of infile to which this backup will correspond.
+ * @param[in] dfd File descriptor of corresponding infile.
+ * @param[in] tag Tag of at most BACKUP_TAG_MAX characters.
+ * @return Malloc-d buffer of path text.
+ */
+static char *genTaggedName(char const *dname, int dfd, char const *tag)
 {
     int printed = 0;
     size_t totlen = BACKUP_EXT_MAX(dname), avail = 0;
     char *tot_mal = NULL;
 
+    assert(strlen(tag) <= BACKUP_TAG_MAX);
+
+    if(Params.backup_dir)
+        return genDirName(dname, dfd, tag);
+
     tot_mal = Malloc(totlen);
 
     if(dname)
@@ -1095,13 +1227,13 @@ char *genBackupName(char const *dname, int dfd, int bidx)
         assert(at >= tot_mal);
 
         avail = totlen + at - tot_mal;
-        printed = snprintf(at, totlen + avail, BACKUP_EXT_FILE, bname, bidx);
+        printed = snprintf(at, totlen + avail, BACKUP_EXT_FILE, bname, tag);
     }
     else
     {
         avail = totlen;
         printed = snprintf(tot_mal, avail, BACKUP_EXT_FD, (intmax_t)getppid(),
-                           dfd, bidx);
+                           dfd, tag);
     }
 
     tot_mal[totlen - 1] = '\0';
@@ -1109,6 +1241,37 @@ char *genBackupName(char const *dname, int dfd, int bidx)
     return tot_mal;
 }
 
+/**
+ * @brief Generate a path name for a backup file to be created.
+ *
+ * @param[in] dname Path of infile to which this backup will correspond.
+ * @param[in] dfd File descriptor of corresponding infile.
+ * @param[in] bidx Backup index in domain [0, BACKUP_FILE_COUNT).
+ * @return Malloc-d buffer of path text.
+ */
+char *genBackupName(char const *dname, int dfd, int bidx)
+{
+    char tag[BACKUP_TAG_MAX + 1];
+    snprintf(tag, sizeof tag, dname ? "f%d" : "d%d", bidx);
+    return genTaggedName(dname, dfd, tag);
+}
+
+/**
+ * @brief Generate a path name for a journal segment: a backup file of an
+ *        earlier round, moved aside by -journal (see hexpeek_journal.c).
+ *
+ * @param[in] dname Path of infile to which the segment corresponds.
+ * @param[in] dfd File descriptor of corresponding infile.
+ * @param[in] firstop First operation recorded in the segment.
+ * @return Malloc-d buffer of path text.
+ */
+char *genSegmentName(char const *dname, int dfd, uint64_t firstop)
+{
+    char tag[BACKUP_TAG_MAX + 1];
+    snprintf(tag, sizeof tag, "j%016" PRIX64, firstop);
+    return genTaggedName(dname, dfd, tag);
+}
+
 /**
  * @brief Open backup files for a given infile file index.
  *
@@ -1120,6 +1283,13 @@ rc_t openBackupFiles(int df, int flags)
 {
     rc_t rc = RC_UNSPEC;
 
+    if(flags & O_CREAT)
+    {
+        rc = journalCheck(df);
+        if(rc)
+            goto end;
+    }
+
     for(int bidx = 0; bidx < BACKUP_FILE_COUNT; bidx++)
     {
         // Get the backup file name
@@ -1172,7 +1342,7 @@ rc_t openBackupFiles(int df, int flags)
             if(rc)
                 goto end;
 
-            if(Params.backup_sync)
+            if(Params.backup_sync != BACKUP_SYNC_NONE)
             {
                 rc = hexpeek_sync(BK_FD(df, bidx));
                 if(rc)
@@ -1366,8 +1536,14 @@ end:
  */
 rc_t closeFiles(rc_t rc)
 {
+    // Backup files that are kept must not be left waiting on a group sync
+    if((rc > RC_DIFF || ! BackupUnlinkAllowed) && syncBackups())
+        rc = RC_CRIT;
+
     for(int fi = 0; fi < MAX_INFILES; fi++)
     {
+        overlayClose(fi);
+        journalClose(fi, rc <= RC_DIFF && BackupUnlinkAllowed);
         if(DT_FD(fi) >= 0 && close(DT_FD(fi)))
         {
             if(rc <= RC_DIFF)
@@ -2327,6 +2503,247 @@ end:
     return rc;
 }
 
+#define RK_BASE 0x100000001B3ULL
+
+/**
+ * @brief Sequential reader used by searchFileZone(), which keeps two such
+ *        cursors in the same file at once; each positions explicitly before
+ *        reading so the cursors may be interleaved.
+ */
+typedef struct
+{
+    int fd;
+    hoff_t next;
+    hoff_t idx;
+    hoff_t len;
+    uint8_t buf[BUFSZ];
+} ZoneCursor;
+
+/**
+ * @brief Refill a ZoneCursor.
+ *
+ * @return RC_OK if data is available, RC_DONE on EOF, else RC_CRIT
+ */
+static rc_t zcFill(ZoneCursor *zc)
+{
+    rc_t rc = seekto(zc->fd, zc->next);
+    if(rc)
+        return rc;
+    zc->len = hexpeek_read(zc->fd, zc->buf, BUFSZ);
+    if(zc->len < 0)
+        return RC_CRIT;
+    zc->idx = 0;
+    zc->next += zc->len;
+    return zc->len ? RC_OK : RC_DONE;
+}
+
+/**
+ * @brief Compare length octets at two file offsets in BUFSZ chunks.
+ *
+ * @return RC_OK if equal, RC_DIFF if different, else a hexpeek error code
+ */
+static rc_t zoneCompare(int fd0, hoff_t at0, int fd1, hoff_t at1,
+                        hoff_t length)
+{
+    rc_t rc = RC_UNSPEC;
+    uint8_t bufs[2][BUFSZ];
+
+    for(hoff_t done = 0; done < length; )
+    {
+        hoff_t cnt = MIN(BUFSZ, length - done);
+        rc = readat(fd0, at0 + done, bufs[0], cnt);
+        checkrc(rc);
+        rc = readat(fd1, at1 + done, bufs[1], cnt);
+        checkrc(rc);
+        if(memcmp(bufs[0], bufs[1], cnt))
+        {
+            rc = RC_DIFF;
+            goto end;
+        }
+        done += cnt;
+    }
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Search a filezone for the contents of another filezone of any size.
+ *        Candidates are found with a Rabin-Karp rolling hash computed over
+ *        two streaming cursors (the octets entering and leaving the window)
+ *        and are confirmed with a streaming compare, so neither the pattern
+ *        nor the window is ever held in memory.
+ *
+ * @param[in] hay Filezone to be searched
+ * @param[in] ndl Filezone containing the pattern
+ * @param[out] match File offset of first match, or -1 if none
+ * @param[out] scanned Count of octets passed over
+ * @return RC_OK on success; else a hexpeek error code
+ */
+static rc_t searchFileZone(FileZone const *hay, FileZone const *ndl,
+                           hoff_t *match, hoff_t *scanned)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t const m = ndl->len;
+    uint64_t h_ndl = 0, h_win = 0, b_pow = 1, b_sq = RK_BASE;
+    ZoneCursor *cin = NULL, *cout = NULL;
+
+    *match = -1;
+    *scanned = 0;
+
+    if( ! isseekable(hay->fi) || ! isseekable(ndl->fi))
+    {
+        rc = RC_USER;
+        prerr("filezone patterns longer than " MS(SRCHSZ) " require seekable "
+              "files\n");
+        goto end;
+    }
+
+    cin = Malloc(sizeof *cin);
+    cout = Malloc(sizeof *cout);
+
+    // B^m for removing the octet leaving the window
+    for(hoff_t ex = m; ex > 0; ex >>= 1, b_sq *= b_sq)
+    {
+        if(ex & 1)
+            b_pow *= b_sq;
+    }
+
+    // Hash the pattern
+    cin->fd = DT_FD(ndl->fi);
+    cin->next = ndl->start;
+    for(hoff_t ix = 0; ix < m; ix++, cin->idx++)
+    {
+        if(cin->idx >= cin->len && (rc = zcFill(cin)) != RC_OK)
+        {
+            if(rc == RC_DONE)
+            {
+                rc = RC_USER;
+                prerr(EofErrString, DT_NAME(ndl->fi));
+            }
+            goto end;
+        }
+        h_ndl = h_ndl * RK_BASE + cin->buf[cin->idx];
+    }
+
+    // Hash the first window
+    cin->fd = cout->fd = DT_FD(hay->fi);
+    cin->next = cout->next = hay->start;
+    cin->idx = cin->len = cout->idx = cout->len = 0;
+    if(hay->len < m)
+        goto done;
+    for(hoff_t ix = 0; ix < m; ix++, cin->idx++)
+    {
+        if(cin->idx >= cin->len && (rc = zcFill(cin)) != RC_OK)
+        {
+            if(rc == RC_DONE)
+            {
+                *scanned = ix;
+                goto done;
+            }
+            goto end;
+        }
+        h_win = h_win * RK_BASE + cin->buf[cin->idx];
+    }
+
+    // Roll the window through the zone
+    for(hoff_t at = hay->start; ; at++, cin->idx++, cout->idx++)
+    {
+        if(h_win == h_ndl)
+        {
+            rc = zoneCompare(DT_FD(hay->fi), at, DT_FD(ndl->fi), ndl->start, m);
+            if(rc == RC_OK)
+            {
+                *match = at;
+                goto done;
+            }
+            else if(rc != RC_DIFF)
+                goto end;
+            trace("hash collision at " TRC_hoff "\n", trchoff(at));
+        }
+        if(at + 1 - hay->start > hay->len - m)
+        {
+            *scanned = at + 1 - hay->start;
+            goto done;
+        }
+        if(cin->idx >= cin->len && (rc = zcFill(cin)) != RC_OK)
+        {
+            if(rc == RC_DONE)
+            {
+                *scanned = at + 1 - hay->start;
+                goto done;
+            }
+            goto end;
+        }
+        if(cout->idx >= cout->len && (rc = zcFill(cout)) != RC_OK)
+            goto end; // RC_DONE is impossible here: cin is further ahead
+        h_win = h_win * RK_BASE + cin->buf[cin->idx] -
+                cout->buf[cout->idx] * b_pow;
+    }
+
+done:
+    rc = RC_OK;
+
+end:
+    free(cin);
+    free(cout);
+    return rc;
+}
+
+/**
+ * @brief Report the result of a search: move to and display the match, or
+ *        say the search failed.
+ *
+ * @param[in] fi Infile file index searched
+ * @param[in] match File offset of the match, or negative if none
+ * @param[in] scanned Count of octets passed over without a match
+ * @param[in] match_len Length of the match
+ * @param[out] octets_processed Amount of data processed by the search
+ * @return RC_OK on success; else a hexpeek error code
+ */
+static rc_t reportMatch(int fi, hoff_t match, hoff_t scanned, hoff_t match_len,
+                        hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+
+    if(match < 0)
+    {
+        if(DispSrchDef && interactive())
+            console("Search failed.\n");
+        *octets_processed = scanned;
+    }
+    else
+    {
+        DT_AT(fi) = match;
+        if(DispSrchDef)
+        {
+            ParsedCommand toprint;
+            ParsedCommand_init(&toprint);
+            toprint.cmd = CMD_PRINT;
+            toprint.fz.fi = fi;
+            toprint.fz.start = match;
+            toprint.fz.len = DispSrchDef;
+            toprint.print_off = true;
+            toprint.arg_t = "";
+            rc = processCommand(&toprint);
+            if(rc)
+                goto end;
+        }
+        else
+        {
+            consoleOutf(PRI_hoff "%s", prihoff(match), LineTerm);
+        }
+        *octets_processed = match_len; // file already moved to match
+    }
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
 /**
  * @brief Execute a search command.
  *
@@ -2339,10 +2756,22 @@ rc_t processCommand_search(ParsedCommand const *ppc, hoff_t *octets_processed)
     rc_t rc = RC_UNSPEC;
     hoff_t match = (hoff_t)-1, prev_rd = 0;
     uint8_t rd_buf[SRCHSZ * 2];
-    hoff_t const sh_cnt = ppc->arg_cv.mem.count;
+    hoff_t sh_cnt = ppc->arg_cv.mem.count;
     uint8_t const *sh_ptr = ppc->arg_cv.mem.octets_mal;
     uint8_t const *sh_masks = ppc->arg_cv.mem.masks_mal;
 
+    if(sh_cnt == 0 && ppc->arg_cv.fz.len > 0)
+    {
+        // Pattern is a filezone too large to have been read into memory
+        sh_cnt = ppc->arg_cv.fz.len;
+        rc = searchFileZone(&ppc->fz, &ppc->arg_cv.fz, &match, &prev_rd);
+        if(rc)
+            goto end;
+        if(match >= 0)
+            prev_rd = match - ppc->fz.start + 1;
+        goto done;
+    }
+
     if(sh_cnt == 0)
     {
         // no-op
@@ -2398,34 +2827,178 @@ rc_t processCommand_search(ParsedCommand const *ppc, hoff_t *octets_processed)
     }
 
 done:
-    if(match < 0)
+    rc = reportMatch(ppc->fz.fi, match, prev_rd, sh_cnt, octets_processed);
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Execute a regex search command.
+ *
+ * @param[in] ppc Pointer to a ParsedCommand structure.
+ * @param[out] octets_processed Amount of data processed by this function
+ * @return RC_OK on success; else a hexpeek error code
+ */
+rc_t processCommand_regex(ParsedCommand const *ppc, hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    ByteRegex *rx = NULL;
+    hoff_t match = HOFF_NIL, match_len = 0, scanned = 0;
+
+    rc = regexCompile(ppc->arg_t, DispMode, &rx);
+    if(rc)
+        goto end;
+
+    rc = regexSearch(rx, &ppc->fz, &match, &match_len, &scanned);
+    if(rc)
+        goto end;
+
+    rc = reportMatch(ppc->fz.fi, match, scanned, match_len, octets_processed);
+
+end:
+    regexFree(rx);
+    return rc;
+}
+
+/**
+ * @brief Execute a hash command. The argument is an optional algorithm name
+ *        followed by an optional leaf size selecting tree mode.
+ *
+ * @param[in] ppc Pointer to a ParsedCommand structure.
+ * @param[out] octets_processed Amount of data processed by this function
+ * @return RC_OK on success; else a hexpeek error code
+ */
+rc_t processCommand_hash(ParsedCommand const *ppc, hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    char name[0x10];
+    char const *arg = ppc->arg_t;
+    size_t nlen = strcspn(arg, " ");
+    int algo = HASH_CRC32C;
+    hoff_t leafsz = 0;
+
+    if(nlen > 0)
     {
-        if(DispSrchDef && interactive())
-            console("Search failed.\n");
-        *octets_processed = prev_rd;
+        if(nlen >= sizeof name)
+            nlen = sizeof name - 1;
+        memcpy(name, arg, nlen);
+        name[nlen] = '\0';
+        algo = hashAlgorithm(name);
+        if(algo < 0)
+        {
+            rc = RC_USER;
+            malcmd("unknown hash algorithm '%s'\n", name);
+            goto end;
+        }
+        arg += strspn(arg + nlen, " ") + nlen;
     }
-    else
+    if(*arg != '\0')
     {
-        DT_AT(ppc->fz.fi) = match;
-        if(DispSrchDef)
+        rc = strtosz(arg, &leafsz);
+        if(rc)
+            goto end;
+        if(leafsz == 0)
         {
-            ParsedCommand toprint;
-            ParsedCommand_init(&toprint);
-            toprint.cmd = CMD_PRINT;
-            toprint.fz.fi = ppc->fz.fi;
-            toprint.fz.start = match;
-            toprint.fz.len = DispSrchDef;
-            toprint.print_off = true;
-            toprint.arg_t = "";
-            rc = processCommand(&toprint);
-            if(rc)
-                goto end;
+            rc = RC_USER;
+            malcmd("leaf size must be positive\n");
+            goto end;
         }
+    }
+
+    rc = hashZone(&ppc->fz, algo, leafsz, octets_processed);
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Execute a manifest command. The argument is the manifest path,
+ *        optionally preceded by a block size.
+ *
+ * @param[in] ppc Pointer to a ParsedCommand structure.
+ * @param[out] octets_processed Amount of data processed by this function
+ * @return RC_OK on success; else a hexpeek error code
+ */
+rc_t processCommand_manifest(ParsedCommand const *ppc,
+                             hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    char const *path = ppc->arg_t;
+    char const *sep = strchr(path, ' ');
+    hoff_t blksz = DEF_MANIFEST_BLKSZ;
+
+    if(sep)
+    {
+        char numstr[sep - path + 1];
+        memcpy(numstr, path, sep - path);
+        numstr[sep - path] = '\0';
+        if(strtosz(numstr, &blksz) != RC_OK)
+            blksz = DEF_MANIFEST_BLKSZ; // space in the path
         else
+            path = sep + strspn(sep, " ");
+    }
+    if(blksz == 0)
+    {
+        rc = RC_USER;
+        malcmd("block size must be positive\n");
+        goto end;
+    }
+
+    rc = manifestWrite(&ppc->fz, blksz, path, octets_processed);
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Source of the new data of a replace written by replaceChunk().
+ */
+typedef struct
+{
+    ParsedCommand const *ppc;
+    uint8_t const *pat;  // pattern to repeat, or NULL to copy ppc->arg_cv.fz
+    hoff_t src_len;      // length after which the new data repeats
+} ReplaceSource;
+
+/**
+ * @brief Write part of the new data of a replace (see makePipedBackup()).
+ *
+ * @param[in] vp Pointer to a ReplaceSource
+ * @param[in] rel Offset of the part from start of the replace
+ * @param[in] len Length of the part
+ * @return RC_OK on success; else a hexpeek error code
+ */
+static rc_t replaceChunk(void *vp, hoff_t rel, hoff_t len)
+{
+    rc_t rc = RC_UNSPEC;
+    ReplaceSource const *rs = vp;
+    int fd = DT_FD(rs->ppc->fz.fi);
+    hoff_t at = rs->ppc->fz.start;
+
+    while(len > 0)
+    {
+        hoff_t phase = rel % rs->src_len;
+        hoff_t cnt = MIN(len, rs->src_len - phase);
+        if(rs->pat && phase == 0)
         {
-            consoleOutf(PRI_hoff "%s", prihoff(match), LineTerm);
+            cnt = len;
+            rc = fillat(fd, at + rel, rs->pat, rs->src_len, cnt);
         }
-        *octets_processed = sh_cnt; // file already moved to match
+        else if(rs->pat)
+        {
+            rc = writeat(fd, at + rel, rs->pat + phase, cnt);
+        }
+        else
+        {
+            rc = filecpy(DT_FD(rs->ppc->arg_cv.fz.fi),
+                         rs->ppc->arg_cv.fz.start + phase, cnt,
+                         fd, at + rel, cnt);
+        }
+        if(rc)
+            goto end;
+        rel += cnt;
+        len -= cnt;
     }
 
     rc = RC_OK;
@@ -2480,6 +3053,49 @@ rc_t processCommand_changedata(ParsedCommand *ppc, hoff_t *octets_processed,
               trchoff(filesize(ppc->fz.fi)), trchoff(ppc->fz.start));
     }
 
+    if(overlayActive(ppc->fz.fi))
+    {
+        rc = overlayChange(ppc, octets_processed);
+        goto end;
+    }
+
+    if(cacheAccepts(ppc))
+    {
+        rc = cacheReplace(ppc, octets_processed);
+        goto end;
+    }
+
+    if(wr_ptr && ppc->fz.len >= 2 * wr_cnt)
+    {
+        // Optimize repeated write
+        hoff_t step = wr_cnt;
+        while(wr_cnt + step <= MIN(ppc->arg_cv.mem.sz, ppc->fz.len))
+        {
+            memcpy(wr_ptr + wr_cnt, wr_ptr, step);
+            wr_cnt += step;
+        }
+    }
+
+    // A long replace is saved and written in a pipeline, unless its source
+    // can not be read at any offset or is overwritten by it
+    if(ppc->cmd == CMD_REPLACE &&
+       (wr_ptr || (isseekable(ppc->arg_cv.fz.fi) &&
+                   (ppc->arg_cv.fz.fi != ppc->fz.fi ||
+                    ppc->arg_cv.fz.start + wr_cnt <= ppc->fz.start ||
+                    ppc->fz.start + ppc->fz.len <= ppc->arg_cv.fz.start))))
+    {
+        ReplaceSource rs = { ppc, wr_ptr, wr_cnt };
+        rc = makePipedBackup(ppc, replaceChunk, &rs, bked);
+        if(rc != RC_NIL)
+        {
+            if(rc == RC_OK)
+                *octets_processed = ppc->fz.len;
+            if(rc == RC_OK && wr_ptr)
+                ppc->fz.len = 0;
+            goto end;
+        }
+    }
+
     rc = makeBackup(ppc);
     if(rc)
         goto end;
@@ -2494,28 +3110,12 @@ rc_t processCommand_changedata(ParsedCommand *ppc, hoff_t *octets_processed,
 
     if(wr_ptr)
     {
-        if(ppc->fz.len >= 2 * wr_cnt)
-        {
-            // Optimize repeated write
-            hoff_t step = wr_cnt;
-            while(wr_cnt + step <= MIN(ppc->arg_cv.mem.sz, ppc->fz.len))
-            {
-                memcpy(wr_ptr + wr_cnt, wr_ptr, step);
-                wr_cnt += step;
-            }
-        }
-        while(ppc->fz.len > 0)
-        {
-            hoff_t try_len = MIN(ppc->fz.len, wr_cnt);
-            if(hexpeek_write(DT_FD(ppc->fz.fi), wr_ptr, try_len) != try_len)
-            {
-                rc = RC_CRIT;
-                goto end;
-            }
-            wr_tot += try_len;
-            ppc->fz.len -= try_len;
-            plugin(2, NULL);
-        }
+        rc = fillat(DT_FD(ppc->fz.fi), ppc->fz.start, wr_ptr, wr_cnt,
+                    ppc->fz.len);
+        if(rc)
+            goto end;
+        wr_tot += ppc->fz.len;
+        ppc->fz.len = 0;
     }
     else
     {
@@ -2652,7 +3252,7 @@ rc_t processCommand(ParsedCommand *ppc)
         if(ppc->incr_pre)
         {
             hoff_t incr_len = ppc->fz.len;
-            if(ppc->cmd == CMD_SEARCH)
+            if(ppc->cmd == CMD_SEARCH || ppc->cmd == CMD_REGEX)
                 incr_len = 1;
             else if(ppc->diff_srch)
                 incr_len = MAX(DispSrchDef, 1);
@@ -2672,6 +3272,14 @@ rc_t processCommand(ParsedCommand *ppc)
             goto end;
     }
 
+    // Write out cached replaces the command would otherwise miss
+    if(flushingCommand(ppc))
+    {
+        rc = cacheFlushAll();
+        if(rc)
+            goto end;
+    }
+
     // Do specific command processing
     rc = processShared(ppc->cmd, ppc->subtype, ppc->arg_t, Params.disp_mode);
     if(rc == RC_OK)
@@ -2744,10 +3352,43 @@ rc_t processCommand(ParsedCommand *ppc)
     {
         rc = processCommand_search(ppc, &octets_processed);
     }
+    else if(ppc->cmd == CMD_REGEX)
+    {
+        rc = processCommand_regex(ppc, &octets_processed);
+    }
     else if(ppc->cmd == CMD_DIFF)
     {
         rc = processCommand_diff(ppc, &octets_processed);
     }
+    else if(ppc->cmd == CMD_STATS)
+    {
+        hoff_t blksz = DEF_STATS_BLKSZ;
+        if(*ppc->arg_t != '\0')
+        {
+            rc = strtosz(ppc->arg_t, &blksz);
+            if(rc)
+                goto end;
+            if(blksz == 0)
+            {
+                rc = RC_USER;
+                malcmd("block size must be positive\n");
+                goto end;
+            }
+        }
+        rc = statsZone(&ppc->fz, blksz, &octets_processed);
+    }
+    else if(ppc->cmd == CMD_HASH)
+    {
+        rc = processCommand_hash(ppc, &octets_processed);
+    }
+    else if(ppc->cmd == CMD_MANIFEST)
+    {
+        rc = processCommand_manifest(ppc, &octets_processed);
+    }
+    else if(ppc->cmd == CMD_VERIFY)
+    {
+        rc = manifestVerify(&ppc->fz, ppc->arg_t, &octets_processed);
+    }
     else if(ppc->cmd == CMD_REPLACE || ppc->cmd == CMD_INSERT)
     {
         rc = processCommand_changedata(ppc, &octets_processed, &backup_done);
@@ -2768,6 +3409,11 @@ rc_t processCommand(ParsedCommand *ppc)
                 goto end;
             }
         }
+        if(overlayActive(ppc->fz.fi))
+        {
+            rc = overlayChange(ppc, &octets_processed);
+            goto done;
+        }
         rc = makeBackup(ppc);
         if(rc)
             goto end;
@@ -2778,7 +3424,10 @@ rc_t processCommand(ParsedCommand *ppc)
     }
     else if(ppc->cmd == CMD_OPS)
     {
-        rc = recoverBackup(0, -1);
+        if(overlayActive(0))
+            overlayOps(0);
+        else
+            rc = recoverBackup(0, -1);
     }
     else if(ppc->cmd == CMD_UNDO)
     {
@@ -2794,7 +3443,30 @@ rc_t processCommand(ParsedCommand *ppc)
                 goto end;
             }
         }
-        rc = recoverBackup(0, (int)tmpl);
+        if(overlayActive(0))
+            overlayUndo(0, (int)tmpl);
+        else
+            rc = recoverBackup(0, (int)tmpl);
+    }
+    else if(ppc->cmd == CMD_COMMIT)
+    {
+        bool bked = false;
+        rc = overlayCommit(0, ppc->arg_t, &bked);
+        if(bked)
+            DT_OPCNT(0)++;
+    }
+    else if(ppc->cmd == CMD_BEGIN)
+    {
+        rc = overlayBegin(0);
+    }
+    else if(ppc->cmd == CMD_SYNC)
+    {
+        rc = syncBackups();
+        for(int fi = 0; fi < MAX_INFILES && rc == RC_OK; fi++)
+        {
+            if(DT_FD(fi) >= 0 && (DT_MODE(fi) & O_RDWR))
+                rc = hexpeek_sync(DT_FD(fi));
+        }
     }
     else
     {
@@ -2969,6 +3641,20 @@ int main(int argc, char **argv)
         goto end;
     }
 
+    // Start edit overlays over writeable infiles
+    if(Params.overlay && ! (Params.recover_interactive || Params.recover_auto))
+    {
+        for(int fi = 0; fi < MAX_INFILES; fi++)
+        {
+            if(DT_FD(fi) >= 0 && (DT_MODE(fi) & O_RDWR))
+            {
+                rc = overlayOpen(fi);
+                if(rc)
+                    goto end;
+            }
+        }
+    }
+
     plugin(0, NULL);
 
     // Do requested operation
@@ -2979,20 +3665,48 @@ int main(int argc, char **argv)
     }
     else if(Params.command)
     {
+        if(Params.batch)
+        {
+            rc = overlayBegin(0);
+            if(rc)
+                goto end;
+        }
         rc = processInput(Params.command, true);
         if(rc == RC_DONE)
             rc = RC_OK;
+        if(Params.batch && (rc == RC_OK || rc == RC_DIFF) && overlayActive(0))
+        {
+            // A failed batch is discarded along with the overlay
+            bool bked = false;
+            rc_t crc = overlayCommit(0, NULL, &bked);
+            if(bked)
+                DT_OPCNT(0)++;
+            if(crc)
+                rc = crc;
+        }
     }
     else if(Params.do_pack)
     {
         rc = pack(0, STDOUT_FILENO);
     }
+    else if(Params.patch_path)
+    {
+        rc = patchApply(0, Params.patch_path);
+    }
     else
     {
         introduce(true);
 
-        while((input_line = consoleIn()) != NULL)
+        for(;;)
         {
+            // Do not leave a group of backup ops unsynced while idle
+            if(interactive() && syncBackups())
+            {
+                rc = RC_CRIT;
+                goto end;
+            }
+            if((input_line = consoleIn()) == NULL)
+                break;
             rc = processInput(input_line, false);
             if(rc == RC_DONE)
             {
@@ -3010,6 +3724,8 @@ int main(int argc, char **argv)
 
     // Cleanup
 end:
+    if(cacheFlushAll())
+        rc = RC_CRIT;
     plugin(-1, NULL);
     rc = closeFiles(rc);
     terminate(rc);
@@ -36,9 +36,12 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <pthread.h>
 
 /**
  * @file hexpeek.h
@@ -87,6 +90,9 @@
 
 #define BACKUP_FILE_COUNT 2
 
+// Marks a command string that was cut short: set just after its terminator
+#define OP_CMD_TRUNCATED '~'
+
 #define PERM (S_IRUSR | S_IWUSR)
 
 #define TERMINAL_WIDTH 80
@@ -153,8 +159,16 @@
 #define CMD_KILL       29
 #define CMD_OPS        30
 #define CMD_UNDO       31
+#define CMD_REGEX      32
+#define CMD_STATS      33
+#define CMD_HASH       34
+#define CMD_MANIFEST   35
+#define CMD_VERIFY     36
+#define CMD_COMMIT     37
+#define CMD_BEGIN      38
+#define CMD_SYNC       39
 #define CMD_MIN        CMD_QUIT
-#define CMD_MAX        CMD_UNDO
+#define CMD_MAX        CMD_SYNC
 
 //----------------------------- Type Definitions -----------------------------//
 
@@ -285,10 +299,39 @@ typedef struct
  * Enter interactive recovery run mode on program start.
  * @var Settings::recover_auto
  * Enter automatic recovery run mode on program start.
+ * @var Settings::recover_finish
+ * In recovery run mode, finish an interrupted file size adjustment and keep the
+ * recorded operations instead of reverting them.
+ * @var Settings::recover_check
+ * In recovery run mode, only check the backup records against their CRCs.
+ * @var Settings::recover_dryrun
+ * In recovery run mode, only print what recovery would do.
  * @var Settings::backup_depth
  * Minimum number of operations to backup (0 disables backup mode).
  * @var Settings::backup_sync
- * Aggressively sync backup to disk.
+ * How backup files are synced to disk (one of BACKUP_SYNC_*).
+ * @var Settings::backup_compress
+ * Compress the larger regions saved to backup files.
+ * @var Settings::backup_dir
+ * Directory in which to place backup files, or NULL to place them next to
+ * their infiles.
+ * @var Settings::unsafe_group
+ * The user accepts that BACKUP_SYNC_GROUP is not safe against a system crash.
+ * @var Settings::sync_group_ops
+ * With BACKUP_SYNC_GROUP, sync after at most this many backup operations.
+ * @var Settings::sync_group_ms
+ * With BACKUP_SYNC_GROUP, sync once this many milliseconds have passed since
+ * the first unsynced backup operation (checked at each operation).
+ * @var Settings::journal
+ * Keep backup files of earlier rounds as journal segments, up to this many
+ * octets per infile (0 disables).
+ * @var Settings::overlay
+ * Record edits of writeable infiles in an overlay until commit.
+ * @var Settings::batch
+ * Run the command string as one transaction on $0 (as if begin ... commit).
+ * @var Settings::writeback
+ * Octets of replaced data to hold per infile in the write-behind cache (0
+ * disables the cache).
  * @var Settings::permissive
  * Allow weird and potentially destructive commands.
  * @var Settings::fail_strict
@@ -300,6 +343,8 @@ typedef struct
  * Enter command run mode on program start and execute command string.
  * @var Settings::do_pack
  * Enter -pack mode to turn a hex dump back into binary file data.
+ * @var Settings::patch_path
+ * Enter -patch mode to apply the patch file at this path to $0.
  * @var Settings::infiles
  * Array of FileAttr structs representing infiles specified on the command line.
  * @var Settings::trace_fp
@@ -332,13 +377,26 @@ typedef struct
     int assume_ttys;
     bool recover_interactive;
     bool recover_auto;
+    bool recover_finish;
+    bool recover_check;
+    bool recover_dryrun;
     long backup_depth;
-    bool backup_sync;
+    int backup_sync;
+    bool backup_compress;
+    char const *backup_dir;
+    bool unsafe_group;
+    long sync_group_ops;
+    long sync_group_ms;
+    hoff_t journal;
+    bool overlay;
+    bool batch;
+    hoff_t writeback;
     int permissive;
     int fail_strict;
     int editable_console;
     char *command;
     bool do_pack;
+    char const *patch_path;
     FileAttr infiles[MAX_INFILES];
     FILE *trace_fp;
 } Settings;
@@ -373,6 +431,25 @@ typedef struct
 
 void FileZone_init(FileZone *zone);
 
+/**
+ * @struct FileExtent
+ *
+ * @brief Struct representing a run of octets at a file offset, held in memory.
+ *
+ * @var FileExtent::at
+ * File offset of the run.
+ * @var FileExtent::len
+ * Length of the run.
+ * @var FileExtent::data
+ * Octets of the run, or NULL where they are to be read from the file.
+ */
+typedef struct
+{
+    hoff_t at;
+    hoff_t len;
+    uint8_t const *data;
+} FileExtent;
+
 /**
  * @struct ConvertedText
  *
@@ -494,6 +571,8 @@ extern uintmax_t Masks[MASK_COUNT];
 
 extern uint8_t CharLookup[OCTET_COUNT];
 
+extern pthread_t MainThread;
+
 extern char *GeneratedCommand_mal;
 
 extern char *CleanString_mal;
@@ -639,12 +718,6 @@ rc_t hexpeek_open(char const *path, int flags, mode_t mode, int *fd);
 
 hoff_t hexpeek_seek(int descriptor, hoff_t offset, int whence);
 
-#define SAVE_OFFSET(d, o) \
-    assert(((o) = hexpeek_seek((d), 0, SEEK_CUR)) != -1);
-
-#define RESTORE_OFFSET(d, o) \
-    assert(hexpeek_seek((d), (o), SEEK_SET) == (o));
-
 rc_t seekto(int descriptor, hoff_t offset);
 
 ssize_t readfull(int descriptor, void *buf, size_t count);
@@ -657,6 +730,10 @@ rc_t hexpeek_stat(int descriptor, struct stat *fileinfo);
 
 rc_t hexpeek_sync(int descriptor);
 
+rc_t hexpeek_datasync(int descriptor);
+
+void hexpeek_startsync(int descriptor, hoff_t at, hoff_t len);
+
 rc_t hexpeek_syncdir(char const *path);
 
 rc_t hexpeek_truncate(int descriptor, hoff_t len);
@@ -673,11 +750,31 @@ rc_t readat(int descriptor, hoff_t at, void *buf, hoff_t count);
 
 rc_t writeat(int descriptor, hoff_t at, const void *buf, hoff_t count);
 
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+rc_t writevat(int descriptor, hoff_t at, struct iovec *iov, int iovcnt);
+
+rc_t fillat(int descriptor, hoff_t at, uint8_t const *pat, hoff_t pat_len,
+            hoff_t length);
+
+size_t sparseMap(int fd, hoff_t at, hoff_t len, FileExtent **pp_runs_mal);
+
 rc_t filecpy(int src_fd, hoff_t src_at, hoff_t src_len,
              int dst_fd, hoff_t dst_at, hoff_t dst_len);
 
+bool cloneable(int src_fd, hoff_t src_at, int dst_fd, hoff_t dst_at,
+               hoff_t length);
+
 rc_t lclcpy(int fd, hoff_t src_at, hoff_t dst_at, hoff_t length);
 
+// Length of the tail that a short shift moves per journalled window
+#define SHIFT_WINDOW (BUFSZ * 0x100)
+
+rc_t shiftTail(int data_fi, hoff_t pos, hoff_t amt, hoff_t f_sz, hoff_t moved,
+               int backup_fd);
+
 rc_t adjustSize(int data_fi, hoff_t pos, hoff_t amt, int backup_fd);
 
 //------------------------------- Backup File --------------------------------//
@@ -687,16 +784,181 @@ rc_t adjustSize(int data_fi, hoff_t pos, hoff_t amt, int backup_fd);
 #define MAX_BACKUP_DEPTH  0x20
 #define DEFAULT_BACKUP_DEPTH 8
 
+// Backup sync policies (Settings::backup_sync), weakest first
+#define BACKUP_SYNC_NONE  0 // never sync (process crash safe)
+#define BACKUP_SYNC_GROUP 1 // fdatasync per group of ops
+#define BACKUP_SYNC_DATA  2 // fdatasync twice per op
+#define BACKUP_SYNC_FULL  3 // fsync twice per op
+
+#define DEFAULT_SYNC_GROUP_OPS 0x10
+#define DEFAULT_SYNC_GROUP_MS  0x64
+
 int backupFd(int data_fi);
 
 rc_t makeBackup(ParsedCommand const *ppc);
 
-rc_t makeAdjBackup(int data_fi, int backup_fd, hoff_t sv_from);
+// Write len octets of the new data of a replace at offset rel from its start
+typedef rc_t (*ChunkWriter)(void *ctx, hoff_t rel, hoff_t len);
+
+rc_t makePipedBackup(ParsedCommand const *ppc, ChunkWriter write_fn, void *ctx,
+                     bool *bked);
+
+rc_t makeScatterBackup(int data_fi, FileExtent const *exts, size_t count,
+                       hoff_t pos, hoff_t amt, char const *origcmd);
+
+rc_t makeAdjRangeBackup(int data_fi, int backup_fd, hoff_t at, hoff_t amt,
+                        hoff_t sv_from, hoff_t sv_len);
+
+rc_t makeShiftBackup(int data_fi, int backup_fd, hoff_t pos, hoff_t amt);
+
+rc_t markShiftBackup(int data_fi, int backup_fd, hoff_t moved,
+                     uint8_t const *win, hoff_t win_len);
 
 rc_t clearAdjBackup(int backup_fd, void *vp);
 
 rc_t recoverBackup(int data_fi, int what);
 
+rc_t syncBackups(void);
+
+char *genBackupName(char const *dname, int dfd, int bidx);
+char *genSegmentName(char const *dname, int dfd, uint64_t firstop);
+
+//---------------------------------- Journal ---------------------------------//
+
+rc_t journalCheck(int data_fi);
+
+bool journalHas(int data_fi, uint64_t firstop);
+
+rc_t journalOpen(int data_fi, uint64_t firstop, int *fd);
+
+char const *journalName(int fd);
+
+rc_t journalArchive(int data_fi, int bidx, uint64_t firstop);
+
+rc_t journalRestore(int data_fi, int bidx, uint64_t firstop);
+
+void journalClose(int data_fi, bool discard);
+
+//-------------------------------- Byte Regex --------------------------------//
+
+typedef struct ByteRegex ByteRegex;
+
+rc_t regexCompile(char const *str, int mode, ByteRegex **prx);
+
+void regexFree(ByteRegex *rx);
+
+rc_t regexSearch(ByteRegex *rx, FileZone const *fz,
+                 hoff_t *match, hoff_t *match_len, hoff_t *scanned);
+
+//---------------------------------- Codec -----------------------------------//
+
+size_t lzEncode(uint8_t const *src, size_t len, uint8_t *dst, size_t cap);
+
+bool lzDecode(uint8_t const *src, size_t len, uint8_t *dst, size_t raw_len);
+
+//-------------------------------- Statistics --------------------------------//
+
+#define DEF_STATS_BLKSZ BUFSZ
+
+rc_t statsZone(FileZone const *fz, hoff_t blksz, hoff_t *octets_processed);
+
+//----------------------------------- Hash -----------------------------------//
+
+#define HASH_CRC32C    0
+#define HASH_CRC32     1
+#define HASH_XXH64     2
+#define HASH_SHA256    3
+#define HASH_COUNT     4
+#define HASH_MAXDIGEST 32
+
+/**
+ * @struct HashCtx
+ *
+ * @brief State of an incremental hash computation. total counts the octets
+ *        hashed so far, which also locates any partial block held in mem.
+ */
+typedef struct
+{
+    int algo;
+    uint64_t total;
+    union
+    {
+        uint32_t crc;
+        struct { uint64_t v[4]; uint8_t mem[32]; } xxh;
+        struct { uint32_t h[8]; uint8_t mem[64]; } sha;
+    } st;
+} HashCtx;
+
+int hashAlgorithm(char const *name);
+
+char const *hashName(int algo);
+
+size_t hashInit(HashCtx *hc, int algo);
+
+void hashUpdate(HashCtx *hc, void const *buf, size_t len);
+
+void hashFinal(HashCtx *hc, uint8_t *digest);
+
+rc_t hashBlocks(int fi, hoff_t at, hoff_t end, int algo, hoff_t blksz,
+                hoff_t count, uint8_t *digests);
+
+rc_t hashZone(FileZone const *fz, int algo, hoff_t leafsz,
+              hoff_t *octets_processed);
+
+//--------------------------------- Manifest ---------------------------------//
+
+#define DEF_MANIFEST_BLKSZ BUFSZ
+
+rc_t manifestWrite(FileZone const *fz, hoff_t blksz, char const *path,
+                   hoff_t *octets_processed);
+
+rc_t manifestVerify(FileZone const *fz, char const *path,
+                    hoff_t *octets_processed);
+
+//--------------------------------- Overlay ----------------------------------//
+
+bool overlayActive(int fi);
+
+rc_t overlayOpen(int fi);
+
+void overlayClose(int fi);
+
+rc_t overlayBegin(int fi);
+
+hoff_t overlaySize(int fi);
+
+hoff_t overlaySeek(int fi, hoff_t offset, int whence);
+
+hoff_t overlayPread(int fi, void *buf, hoff_t count, hoff_t at);
+
+hoff_t overlayRead(int fi, void *buf, hoff_t count);
+
+rc_t overlayChange(ParsedCommand *ppc, hoff_t *octets_processed);
+
+void overlayOps(int fi);
+
+void overlayUndo(int fi, int count);
+
+rc_t overlayCommit(int fi, char const *path, bool *bked);
+
+//------------------------------- Write Cache --------------------------------//
+
+bool cacheActive(int fi);
+
+bool cacheAccepts(ParsedCommand const *ppc);
+
+void cacheRead(int fi, hoff_t at, void *buf, hoff_t count);
+
+rc_t cacheReplace(ParsedCommand *ppc, hoff_t *octets_processed);
+
+rc_t cacheFlush(int fi);
+
+rc_t cacheFlushAll(void);
+
+//---------------------------------- Patch -----------------------------------//
+
+rc_t patchApply(int fi, char const *path);
+
 //--------------------------- Settings Processing ----------------------------//
 
 hoff_t outputWidth(int part, int formode, hoff_t linewh);
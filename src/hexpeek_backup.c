@@ -29,8 +29,11 @@
 #include <hexpeek.h>
 
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 /**
  * @file hexpeek_backup.c
@@ -40,19 +43,50 @@
 //-------------------------------- Constants ---------------------------------//
 
 #define HDR_MAGIC_SZ   0x10
-#define HDR_MAGIC_DATA PRGNM " bk v0\0\0\0"
+#define HDR_MAGIC_DATA PRGNM " bk v2\0\0\0"
+// Common prefix of the header magic of every backup file format version
+#define HDR_MAGIC_STEM PRGNM " bk v"
 
 #define OPINFO_MAGIC_SZ   0xF
 #define OPINFO_MAGIC_DATA "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\0\0\0"
+// Magic of an operation whose saved data is a sequence of ScatterRec records
+#define OPINFO_MAGIC_SCATTER \
+    "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\0\0\x01"
+// Magic of a file adjustment operation that moves the tail without saving it
+#define OPINFO_MAGIC_SHIFT \
+    "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\0\0\x02"
 
 #define OP_STATUS_BACKUP_START  0xB0
+#define OP_STATUS_BACKUP_PART   0xBA // saved_len is as much as is saved so far
 #define OP_STATUS_BACKUP_DONE   0xBD
 #define OP_STATUS_RECOVERY_DONE 0xDD
 
 #define OP_SZ  0x100
-#define OP_MID (OPINFO_MAGIC_SZ + sizeof(uint8_t) + 6 * sizeof(hoff_t))
+#define OP_CRC_SZ 4
+#define OP_MID (OPINFO_MAGIC_SZ + 2 * sizeof(uint8_t) + 7 * sizeof(hoff_t) + \
+                2 * OP_CRC_SZ)
 
-#define OP_CMD_TRUNCATED '~'
+// Codecs of the saved data of a backup operation (BackupOp::codec)
+#define CODEC_RAW   0 // the saved octets as they are
+#define CODEC_CHUNK 1 // a sequence of SavedChunk records (see encodeSaved())
+#define CODEC_CLONE 2 // as CODEC_RAW, but cloned from the data file
+
+// Saved data of at least this length is stored with CODEC_CHUNK
+#define CODEC_MIN BUFSZ
+
+// Kinds of SavedChunk
+#define CHUNK_RAW  0 // enc_len == raw_len octets as they are
+#define CHUNK_LZ   1 // enc_len octets of lzEncode() output
+#define CHUNK_FILL 2 // raw_len copies of the fill octet, nothing stored
+#define CHUNK_HOLE 3 // a hole in the data file, nothing stored
+
+// Length of data file octets in a chunk other than a hole, at most
+#define CHUNK_SZ (BUFSZ * 4)
+
+// Length saved between progress marks of a pipelined replace, and the length
+// of a replace from which it is pipelined (see makePipedBackup())
+#define PIPE_CHUNK (BUFSZ * 0x100)
+#define PIPE_MIN   (PIPE_CHUNK * 2)
 
 /**
  * @struct BackupOp
@@ -77,8 +111,37 @@
  * is zero.
  * @var BackupOp::saved_len
  * Length of saved data region.
+ * @var BackupOp::stored_len
+ * Length of the saved data as stored in the backup file, which is saved_len
+ * unless it is compressed.
+ * @var BackupOp::codec
+ * How the saved data is stored (one of CODEC_*).
+ * @var BackupOp::hdr_crc
+ * CRC32C of the op with the status octet and this field zeroed (see sealOp()).
+ * The status octet is left out as it is written by itself.
+ * @var BackupOp::data_crc
+ * CRC32C of the stored_len octets stored at saved_at. Octets stored with
+ * CODEC_CLONE never pass through hexpeek, so their CRC is taken from the data
+ * file region they were cloned from, which is read but not written again.
  * @var BackupOp::origcmd
  * Locally encoded human readable original command string.
+ *
+ * A file size adjustment made by fallocate() block operations is recorded in
+ * compact form: size_adj is non-zero, last_at is the block aligned file offset
+ * of the fallocate() operation and saved data covers only the partial block, if
+ * any, that was overwritten before it.
+ *
+ * A file adjustment made by moving the tail (magic OPINFO_MAGIC_SHIFT, see
+ * makeShiftBackup()) has size_orig and size_adj as above, saved_from is the
+ * offset at which the tail began and last_at is the length of the tail moved so
+ * far, which is advanced as the move goes. A short shift journals the part of
+ * the window of the tail it moves next (SHIFT_WINDOW at most) that the move
+ * overwrites, as its saved data (see markShiftBackup()); a long shift saves
+ * none.
+ *
+ * A scatter operation (magic OPINFO_MAGIC_SCATTER) with a non-zero size_adj
+ * also shifted the file tail at saved_from, as an insert or kill would (see
+ * makeScatterBackup()).
  */
 typedef struct
 {
@@ -93,12 +156,65 @@ typedef struct
     // Offsets in backup file
     hoff_t saved_at;
     hoff_t saved_len;
+    hoff_t stored_len;
+    uint8_t codec;
+    // Integrity checks
+    uint8_t hdr_crc[OP_CRC_SZ];
+    uint8_t data_crc[OP_CRC_SZ];
     // Nul-terminated string in local encoding
     char origcmd[OP_SZ - OP_MID];
 } __attribute__((packed)) BackupOp;
 
 #define LAST_ADJ_OPIDX MAX_BACKUP_DEPTH
 
+#define IS_SCATTER(p_op) \
+    (memcmp((p_op)->magic, OPINFO_MAGIC_SCATTER, OPINFO_MAGIC_SZ) == 0)
+#define IS_SHIFT(p_op) \
+    (memcmp((p_op)->magic, OPINFO_MAGIC_SHIFT, OPINFO_MAGIC_SZ) == 0)
+
+/**
+ * @struct ScatterRec
+ *
+ * @brief Packed record header in the saved data of a scatter operation (see
+ *        makeScatterBackup()), followed by len saved octets.
+ *
+ * @var ScatterRec::at
+ * Data file offset of the saved run.
+ * @var ScatterRec::len
+ * Length of the saved run.
+ */
+typedef struct
+{
+    hoff_t at;
+    hoff_t len;
+} __attribute__((packed)) ScatterRec;
+
+/**
+ * @struct SavedChunk
+ *
+ * @brief Packed record header in saved data stored with CODEC_CHUNK, followed
+ *        by enc_len stored octets.
+ *
+ * @var SavedChunk::kind
+ * Kind of chunk (one of CHUNK_*).
+ * @var SavedChunk::fill
+ * For CHUNK_FILL, the octet value of the run; otherwise zero.
+ * @var SavedChunk::reserved
+ * Reserved space which should be zero.
+ * @var SavedChunk::enc_len
+ * Length of the stored octets following the header.
+ * @var SavedChunk::raw_len
+ * Length of data file octets represented by the chunk.
+ */
+typedef struct
+{
+    uint8_t kind;
+    uint8_t fill;
+    uint8_t reserved[2];
+    uint32_t enc_len;
+    hoff_t raw_len;
+} __attribute__((packed)) SavedChunk;
+
 /**
  * @struct BackupHeader
  *
@@ -109,6 +225,12 @@ typedef struct
  * @var BackupHeader::firstop
  * First operation represented in this backup file (whenever we roll over to a
  * new backup file out of the pair, this value is set to current opcnt).
+ * @var BackupHeader::data_dev
+ * Device number of the data file (see checkIdentity()).
+ * @var BackupHeader::data_ino
+ * Inode number of the data file, or zero if not recorded.
+ * @var BackupHeader::data_size
+ * Size of the data file when the header was written.
  * @var BackupHeader::reserved
  * Reserved space which should be zero. 
  * @var BackupHeader::ops
@@ -120,7 +242,11 @@ typedef struct
 {
     uint8_t magic[HDR_MAGIC_SZ];
     uint64_t firstop;
-    uint8_t reserved[sizeof(BackupOp) - HDR_MAGIC_SZ - sizeof(uint64_t)];
+    uint64_t data_dev;
+    uint64_t data_ino;
+    hoff_t data_size;
+    uint8_t reserved[sizeof(BackupOp) - HDR_MAGIC_SZ - 3 * sizeof(uint64_t) -
+                     sizeof(hoff_t)];
     BackupOp ops[MAX_BACKUP_DEPTH + 1];
     uint8_t reserved2[0x4000 - (MAX_BACKUP_DEPTH + 2) * sizeof(BackupOp)];
 } __attribute__((packed)) BackupHeader;
@@ -140,10 +266,44 @@ typedef struct
 #define BKFL_RFIN_PTR(poh)  BKFL_BFIN_PTR(poh)
 #define BKFL_RFIN_LEN       BKFL_BFIN_LEN
 
+// Sync a backup file at a point where the backup protocol orders its writes
 #define sync(d) \
-    if(Params.backup_sync && (rc = hexpeek_sync(d)) != RC_OK) \
+    if((rc = syncBackup(d)) != RC_OK) \
         goto end;
 
+//------------------------------- Header Cache -------------------------------//
+
+/**
+ * @struct HeaderCache
+ *
+ * @brief In-memory copy of the header of one backup file. While valid, it is
+ *        kept identical to the header on disk: every header write goes through
+ *        the copy, so ops need not re-read the whole header from the file.
+ *
+ * @var HeaderCache::fd
+ * Backup file descriptor the copy belongs to.
+ * @var HeaderCache::valid
+ * True if hdr has been read and validated (or written) and is current.
+ * @var HeaderCache::hdr
+ * The header.
+ * @var HeaderCache::unsynced
+ * With BACKUP_SYNC_GROUP, true if the backup file has been written since the
+ * last group sync.
+ */
+typedef struct
+{
+    int fd;
+    bool valid;
+    BackupHeader hdr;
+    bool unsynced;
+} HeaderCache;
+
+static HeaderCache HeaderCaches[MAX_INFILES * BACKUP_FILE_COUNT];
+
+// With BACKUP_SYNC_GROUP, count and start time of the unsynced backup ops
+static long GroupOps = 0;
+static struct timespec GroupStart;
+
 //-------------------------------- Functions ---------------------------------//
 
 /**
@@ -178,6 +338,142 @@ static int mostRecentOp(BackupHeader const *ph)
     return max_op;
 }
 
+/**
+ * @brief Compute the CRC32C of a backup operation as kept in hdr_crc.
+ *
+ * @param[in] p_op Backup operation
+ * @param[out] crc Set to the CRC
+ */
+static void opCrc(BackupOp const *p_op, uint8_t *crc)
+{
+    BackupOp op = *p_op;
+    HashCtx hc;
+    uint8_t digest[HASH_MAXDIGEST];
+
+    op.status = 0;
+    memset(op.hdr_crc, 0, OP_CRC_SZ);
+    hashInit(&hc, HASH_CRC32C);
+    hashUpdate(&hc, &op, sizeof op);
+    hashFinal(&hc, digest);
+    memcpy(crc, digest, OP_CRC_SZ);
+}
+
+/**
+ * @brief Set hdr_crc of a backup operation to match its other fields, as must
+ *        be done before every write of a whole op that is not cleared.
+ *
+ * @param[in,out] p_op Backup operation
+ */
+static void sealOp(BackupOp *p_op)
+{
+    uint8_t crc[OP_CRC_SZ];
+    opCrc(p_op, crc);
+    memcpy(p_op->hdr_crc, crc, OP_CRC_SZ);
+}
+
+/**
+ * @brief Add a file region to a CRC32C computation.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] at File offset of the region
+ * @param[in] len Length of the region
+ * @param[in,out] p_hc Hash context
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t crcRange(int fd, hoff_t at, hoff_t len, HashCtx *p_hc)
+{
+    rc_t rc = RC_UNSPEC;
+    uint8_t *buf_mal = Malloc(CHUNK_SZ);
+
+    for(hoff_t rel = 0, cnt = 0; rel < len; rel += cnt)
+    {
+        cnt = MIN(CHUNK_SZ, len - rel);
+        rc = readat(fd, at + rel, buf_mal, cnt);
+        checkrc(rc);
+        hashUpdate(p_hc, buf_mal, (size_t)cnt);
+    }
+
+    rc = RC_OK;
+
+end:
+    free(buf_mal);
+    return rc;
+}
+
+/**
+ * @brief Finish a CRC32C computation into a data_crc field, leaving the hash
+ *        context usable to go on with.
+ *
+ * @param[in] p_hc Hash context
+ * @param[out] crc Field to set
+ */
+static void crcFinal(HashCtx const *p_hc, uint8_t *crc)
+{
+    HashCtx hc = *p_hc;
+    uint8_t digest[HASH_MAXDIGEST];
+
+    hashFinal(&hc, digest);
+    memcpy(crc, digest, OP_CRC_SZ);
+}
+
+/**
+ * @brief Copy a data file region into a backup file through a buffer, adding
+ *        the octets to a CRC32C computation on the way, so what is stored
+ *        need not be read back to checksum it.
+ *
+ * @param[in] data_fd Data file descriptor
+ * @param[in] from Data file offset of the region
+ * @param[in] len Length of the region
+ * @param[in] backup_fd Backup file descriptor
+ * @param[in] at Backup file offset at which to write
+ * @param[in,out] p_hc Hash context
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t copySaved(int data_fd, hoff_t from, hoff_t len, int backup_fd,
+                      hoff_t at, HashCtx *p_hc)
+{
+    rc_t rc = RC_UNSPEC;
+    uint8_t *buf_mal = Malloc(CHUNK_SZ);
+
+    for(hoff_t rel = 0, cnt = 0; rel < len; rel += cnt)
+    {
+        progress(rel, len, 1);
+        cnt = MIN(CHUNK_SZ, len - rel);
+        rc = readat(data_fd, from + rel, buf_mal, cnt);
+        checkrc(rc);
+        hashUpdate(p_hc, buf_mal, (size_t)cnt);
+        rc = writeat(backup_fd, at + rel, buf_mal, cnt);
+        checkrc(rc);
+        plugin(2, NULL);
+    }
+    progress(-1, len, 1);
+
+    rc = RC_OK;
+
+end:
+    free(buf_mal);
+    return rc;
+}
+
+/**
+ * @brief Choose how to store the saved data of a data file region: cloned
+ *        where the file system can, which beats compressing it; else
+ *        compressed, unless -backup raw is given or there is too little of it;
+ *        else as is. Finding out whether it can be cloned clones its first
+ *        block into the backup file.
+ *
+ * @return One of CODEC_*
+ */
+static uint8_t pickCodec(int data_fd, hoff_t from, hoff_t len, int backup_fd,
+                         hoff_t at)
+{
+    if(cloneable(data_fd, from, backup_fd, at, len))
+        return CODEC_CLONE;
+    if(Params.backup_compress && len >= CODEC_MIN)
+        return CODEC_CHUNK;
+    return CODEC_RAW;
+}
+
 /**
  * @brief Check validity of specified backup operation.
  *
@@ -188,7 +484,11 @@ static int mostRecentOp(BackupHeader const *ph)
  */
 static int checkOp(BackupHeader const *ph, int cur, int prv)
 {
-    if(memcmp(ph->ops[cur].magic, OPINFO_MAGIC_DATA, OPINFO_MAGIC_SZ))
+    uint8_t crc[OP_CRC_SZ];
+
+    if(memcmp(ph->ops[cur].magic, OPINFO_MAGIC_DATA, OPINFO_MAGIC_SZ) &&
+       (cur == LAST_ADJ_OPIDX ? ! IS_SHIFT(&ph->ops[cur]) :
+                                ! IS_SCATTER(&ph->ops[cur])))
         return 2;
     else if(ph->ops[cur].size_orig < 0)
         return 3;
@@ -200,10 +500,17 @@ static int checkOp(BackupHeader const *ph, int cur, int prv)
         return 6;
     else if(ph->ops[cur].saved_len > 0 && cur > 0 && prv >= 0 &&
             ph->ops[cur].saved_at <
-            ph->ops[prv].saved_at + ph->ops[prv].saved_len)
+            ph->ops[prv].saved_at + ph->ops[prv].stored_len)
         return 7;
     else if(ph->ops[cur].origcmd[sizeof ph->ops[cur].origcmd - 1] != '\0')
         return 8;
+    else if(ph->ops[cur].stored_len < 0 || ph->ops[cur].codec > CODEC_CLONE ||
+            (ph->ops[cur].codec != CODEC_CHUNK &&
+             ph->ops[cur].stored_len != ph->ops[cur].saved_len))
+        return 9;
+    opCrc(&ph->ops[cur], crc);
+    if(memcmp(crc, ph->ops[cur].hdr_crc, OP_CRC_SZ))
+        return 10;
     return 0;
 }
 
@@ -222,6 +529,14 @@ static rc_t checkHeader(BackupHeader const *ph)
 
     if(memcmp(ph->magic, HDR_MAGIC_DATA, HDR_MAGIC_SZ))
     {
+        if( ! memcmp(ph->magic, HDR_MAGIC_STEM, strlen(HDR_MAGIC_STEM)) &&
+            ph->magic[strlen(HDR_MAGIC_STEM)] !=
+            HDR_MAGIC_DATA[strlen(HDR_MAGIC_STEM)])
+        {
+            prerr("backup file format v%c is not supported by this version of "
+                  PRGNM ", finish its recovery with the " PRGNM
+                  " that wrote it\n", ph->magic[strlen(HDR_MAGIC_STEM)]);
+        }
         mark = 1;
         rc = RC_CRIT;
         goto end;
@@ -258,27 +573,77 @@ end:
 }
 
 /**
- * @brief Read data from the provided file descriptor into a BackupHeader and
- *        perform validity checking on it.
+ * @brief Find the HeaderCache slot of a backup file.
+ *
+ * @param[in] backup_fd File descriptor of backup file
+ * @return Pointer to the slot, its fd field set to backup_fd
+ */
+static HeaderCache *headerSlot(int backup_fd)
+{
+    for(int fi = 0; fi < MAX_INFILES; fi++)
+    {
+        for(int bidx = 0; bidx < BACKUP_FILE_COUNT; bidx++)
+        {
+            HeaderCache *slot = &HeaderCaches[fi * BACKUP_FILE_COUNT + bidx];
+            if(BK_FD(fi, bidx) != backup_fd)
+                continue;
+            if(slot->fd != backup_fd)
+            {
+                slot->fd = backup_fd;
+                slot->valid = false;
+                slot->unsynced = false;
+            }
+            return slot;
+        }
+    }
+    die();
+    return NULL;
+}
+
+/**
+ * @brief Forget the in-memory header of a backup file, e.g. after a failed
+ *        write left it unknown whether it matches the file. The next use
+ *        re-reads and re-validates it.
+ *
+ * @param[in] backup_fd File descriptor of backup file
+ */
+static void dropHeader(int backup_fd)
+{
+    if(backup_fd >= 0)
+        headerSlot(backup_fd)->valid = false;
+}
+
+/**
+ * @brief Get the header of a backup file, reading it from the file and
+ *        performing validity checking on it only if it is not already held in
+ *        memory.
  *
  * @param[in] backup_fd File descriptor of backup file
- * @param[out] p_hdr BackupHeader pointer to which to output struct data
+ * @param[out] pp_hdr Set to the in-memory header, which the caller may modify
+ *             as long as it writes the same change to the file
  * @return RC_OK if read and validation were successful
  */
-static rc_t readHeader(int backup_fd, BackupHeader *p_hdr)
+static rc_t readHeader(int backup_fd, BackupHeader **pp_hdr)
 {
     rc_t rc = RC_UNSPEC;
+    HeaderCache *slot = headerSlot(backup_fd);
 
-    rc = readat(backup_fd, 0, p_hdr, sizeof *p_hdr);
-    checkrc(rc);
-
-    rc = checkHeader(p_hdr);
-    if(rc)
+    if( ! slot->valid)
     {
-        prerr("%s header is malformed!\n", fdname(backup_fd));
-        goto end;
+        rc = readat(backup_fd, 0, &slot->hdr, sizeof slot->hdr);
+        checkrc(rc);
+
+        rc = checkHeader(&slot->hdr);
+        if(rc)
+        {
+            prerr("%s header is malformed!\n", fdname(backup_fd));
+            goto end;
+        }
+        slot->valid = true;
     }
 
+    *pp_hdr = &slot->hdr;
+
     rc = RC_OK;
 
 end:
@@ -286,21 +651,38 @@ end:
 }
 
 /**
- * @brief Read and validate header data from a given file descriptor and then
+ * @brief Backup file offset after the saved data of the most recent op.
+ *
+ * @param[in] p_hdr Pointer to a BackupHeader
+ * @return File offset of next location for backup op data
+ */
+static hoff_t nextAt(BackupHeader const *p_hdr)
+{
+    int max_op = mostRecentOp(p_hdr);
+    if(max_op < 0)
+        return ceilbound(sizeof *p_hdr, PAGESZ);
+    else
+        return ceilbound(p_hdr->ops[max_op].saved_at +
+                         p_hdr->ops[max_op].stored_len, PAGESZ);
+}
+
+/**
+ * @brief Get and validate the header of a given backup file and then
  *        determine file offset of next location to write backup operation data.
  *
  * @param[in] backup_fd File descriptor of backup file
- * @param[out] p_hdr BackupHeader pointer to which to output struct data
+ * @param[out] pp_hdr Set to the in-memory header (see readHeader())
  * @param[out] next_at File offset of next location for backup op data
  * @return RC_OK on success, else a hexpeek error code
  */
-static rc_t getHeader(int backup_fd, BackupHeader *p_hdr, hoff_t *next_at)
+static rc_t getHeader(int backup_fd, BackupHeader **pp_hdr, hoff_t *next_at)
 {
     rc_t rc = RC_UNSPEC;
-    int max_op = -1;
+    BackupHeader *p_hdr = NULL;
 
-    rc = readHeader(backup_fd, p_hdr);
+    rc = readHeader(backup_fd, &p_hdr);
     checkrc(rc);
+    *pp_hdr = p_hdr;
 
     if(p_hdr->ops[LAST_ADJ_OPIDX].status)
     {
@@ -309,12 +691,7 @@ static rc_t getHeader(int backup_fd, BackupHeader *p_hdr, hoff_t *next_at)
         goto end;
     }
 
-    max_op = mostRecentOp(p_hdr);
-    if(max_op < 0)
-        *next_at = ceilbound(sizeof *p_hdr, PAGESZ);
-    else
-        *next_at = ceilbound(p_hdr->ops[max_op].saved_at +
-                             p_hdr->ops[max_op].saved_len, PAGESZ);
+    *next_at = nextAt(p_hdr);
 
     rc = RC_OK;
 
@@ -323,457 +700,2715 @@ end:
 }
 
 /**
- * @brief Write backup data for a backup operation.
+ * @brief Sync a backup file at one of the points where the backup protocol
+ *        orders its writes (saved data before the status octet, status octet
+ *        before the data file is written), as Params.backup_sync directs:
+ *        - BACKUP_SYNC_FULL : fsync()
+ *        - BACKUP_SYNC_DATA : fdatasync(), which still flushes the file size
+ *        - otherwise        : nothing; see groupSync() for BACKUP_SYNC_GROUP
  *
- * @param[in] data_fi Infile file index
- * @param[in] backup_fd File descriptor of a backup file
- * @param[in] opix Operation index
- * @param[in,out] p_op Struct containing backup operation data to write to
- *                backup file. This function sets the status field.
+ * @param[in] backup_fd File descriptor of backup file
  * @return RC_OK on success, else a hexpeek error code
  */
-static rc_t writeOp(int data_fi, int backup_fd, int opix, BackupOp *p_op)
+static rc_t syncBackup(int backup_fd)
 {
-    rc_t rc = RC_UNSPEC;
-
-    plugin(3, (void*)0);
-
-    rc = writeat(backup_fd, BKFL_OPINFO_OFF(opix), p_op, sizeof *p_op);
-    checkrc(rc);
+    switch(Params.backup_sync)
+    {
+    case BACKUP_SYNC_FULL:
+        return hexpeek_sync(backup_fd);
+    case BACKUP_SYNC_DATA:
+        return hexpeek_datasync(backup_fd);
+    default:
+        return RC_OK;
+    }
+}
 
-    rc = filecpy(DT_FD(data_fi), p_op->saved_from, p_op->saved_len,
-                 backup_fd,      p_op->saved_at,   p_op->saved_len);
-    checkrc(rc);
+/**
+ * @brief Sync every backup file written since the last group sync (see
+ *        groupSync()). Only BACKUP_SYNC_GROUP leaves backup files unsynced, so
+ *        under any other policy this does nothing.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t syncBackups(void)
+{
+    rc_t rc = RC_UNSPEC;
 
-    sync(backup_fd);
-    p_op->status = OP_STATUS_BACKUP_DONE;
-    rc = writeat(backup_fd, BKFL_BFIN_OFF(opix),
-                 BKFL_BFIN_PTR(p_op), BKFL_BFIN_LEN);
-    checkrc(rc);
-    sync(backup_fd);
+    for(int ix = 0; ix < MAX_INFILES * BACKUP_FILE_COUNT; ix++)
+    {
+        HeaderCache *slot = &HeaderCaches[ix];
+        if( ! slot->unsynced)
+            continue;
+        rc = hexpeek_datasync(slot->fd);
+        checkrc(rc);
+        slot->unsynced = false;
+    }
+    GroupOps = 0;
 
     rc = RC_OK;
 
 end:
-    plugin(3, (void*)1);
     return rc;
 }
 
 /**
- * @brief Perform backup operations corresponding to the command represented
- *        by the provided ParsedCommand structure.
+ * @brief Account for a completed backup op under BACKUP_SYNC_GROUP: start
+ *        writeback of its saved data, and sync all written backup files once
+ *        Params.sync_group_ops ops, or Params.sync_group_ms milliseconds since
+ *        the first of them, have gone unsynced.
  *
- * @param[in] ppc Pointer to a ParsedCommand structure.
- * @param Returns RC_OK on success, else a hexpeek error code
+ *        A process crash loses nothing under this policy, as the written data
+ *        is in the page cache. A system crash or power loss may lose the
+ *        backups of the ops since the last group sync while their data file
+ *        writes survive, so those ops can not be recovered: data file writes
+ *        are not held back until their group is synced. This is why the
+ *        policy must be asked for with -unsafegroup. The group is also synced
+ *        before waiting at the interactive prompt, and on exit if backups are
+ *        kept.
+ *
+ * @param[in] backup_fd File descriptor of backup file
+ * @param[in] p_op Completed backup op
+ * @return RC_OK on success, else a hexpeek error code
  */
-rc_t makeBackup(ParsedCommand const *ppc)
+static rc_t groupSync(int backup_fd, BackupOp const *p_op)
 {
     rc_t rc = RC_UNSPEC;
-    int opix = 0, backup_fd = 0;
-    hoff_t sv_at = HOFF_NIL;
-    BackupHeader header;
-    BackupOp *p_op = NULL;
+    struct timespec now;
+    long elapsed_ms = 0;
 
-    if(BackupDepth <= 0)
+    if(Params.backup_sync != BACKUP_SYNC_GROUP)
     {
         rc = RC_OK;
         goto end;
     }
 
-    traceEntry("%" PRIu64, DT_OPCNT(ppc->fz.fi));
+    hexpeek_startsync(backup_fd, p_op->saved_at, p_op->stored_len);
+    headerSlot(backup_fd)->unsynced = true;
 
-    assert(ppc);
-    assert(ppc->fz.start >= 0);
-    assert(ppc->fz.len >= 0);
-    memset(&header, 0, sizeof header);
+    if(clock_gettime(CLOCK_MONOTONIC, &now))
+        die();
+    if(GroupOps++ == 0)
+        GroupStart = now;
+    elapsed_ms = (now.tv_sec - GroupStart.tv_sec) * 1000 +
+                 (now.tv_nsec - GroupStart.tv_nsec) / 1000000;
 
-    if(DT_OPCNT(ppc->fz.fi) == UINT64_MAX)
-    {
-        rc = RC_CRIT;
-        prerr("64 bit operation counter would overflow, aborting.\n");
-        goto end;
-    }
+    if(GroupOps >= Params.sync_group_ops || elapsed_ms >= Params.sync_group_ms)
+        rc = syncBackups();
+    else
+        rc = RC_OK;
 
-    opix = DT_OPCNT(ppc->fz.fi) % BackupDepth;
-    p_op = &header.ops[opix];
-    backup_fd = backupFd(ppc->fz.fi);
-    assert(backup_fd >= 0);
+end:
+    return rc;
+}
 
-    // If start of round, need to truncate backup file and write a new Header
-    if(opix == 0)
-    {
-        memcpy(header.magic, HDR_MAGIC_DATA, HDR_MAGIC_SZ);
-        header.firstop = DT_OPCNT(ppc->fz.fi);
-        rc = hexpeek_truncate(backup_fd, 0);
-        checkrc(rc);
-        rc = writeat(backup_fd, 0, &header, sizeof header);
-        checkrc(rc);
-        sv_at = ceilbound(sizeof header, PAGESZ);
-    }
-    else
+/**
+ * @brief Write the records of a scatter backup operation (see
+ *        makeScatterBackup()) with pwritev() batches, each pairing a record
+ *        header with the saved octets of its run, adding them to the CRC in
+ *        *p_hc as they go. A run without its octets in memory ends the batch
+ *        and is copied from the data file CHUNK_SZ at a time.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t writeScatter(int data_fd, int backup_fd, hoff_t at,
+                         FileExtent const *exts, size_t count, HashCtx *p_hc)
+{
+    rc_t rc = RC_UNSPEC;
+    size_t batch = IOV_MAX / 2, cnt = 0;
+    hoff_t len = 0;
+    ScatterRec *recs_mal = Malloc(MAX(1, MIN(count, batch)) * sizeof *recs_mal);
+    struct iovec *iov_mal = Malloc(MAX(1, 2 * MIN(count, batch)) *
+                                   sizeof *iov_mal);
+    uint8_t *buf_mal = NULL;
+
+    for(size_t ix = 0; ix <= count; ix++)
     {
-        rc = getHeader(backup_fd, &header, &sv_at);
-        checkrc(rc);
-        if(p_op->status && p_op->status != OP_STATUS_RECOVERY_DONE)
+        if(cnt > 0 && (ix == count || cnt == batch || ! exts[ix].data))
         {
-            prerr("%s header is malformed: unexpected operation present!\n",
-                  fdname(backup_fd));
-            goto end;
+            rc = writevat(backup_fd, at, iov_mal, (int)(2 * cnt));
+            checkrc(rc);
+            at += len;
+            cnt = 0;
+            len = 0;
         }
-    }
+        if(ix == count)
+            break;
 
-    memset(p_op, 0, sizeof *p_op);
-    memcpy(p_op->magic, OPINFO_MAGIC_DATA, OPINFO_MAGIC_SZ);
-    p_op->status        = OP_STATUS_BACKUP_START;
-    p_op->size_orig     = filesize(ppc->fz.fi);
-    p_op->last_at       = Params.infiles[ppc->fz.fi].last_at;
-    p_op->saved_from    = ppc->fz.start;
-    p_op->saved_at      = sv_at;
-    switch(ppc->cmd)
-    {
-    case CMD_REPLACE:
-        p_op->size_adj  = 0;
-        p_op->saved_len = ppc->fz.len;
-        break;
-    case CMD_INSERT:
-        p_op->size_adj  = ppc->fz.len;
-        p_op->saved_len = 0;
-        break;
-    case CMD_KILL:
-        p_op->size_adj  = -ppc->fz.len;
-        p_op->saved_len = ppc->fz.len;
-        break;
-    default:
-        die();
-    }
-    if(p_op->saved_from + p_op->saved_len > p_op->size_orig)
-        p_op->saved_len = MAX(0, p_op->size_orig - p_op->saved_from);
+        recs_mal[cnt].at = exts[ix].at;
+        recs_mal[cnt].len = exts[ix].len;
+        hashUpdate(p_hc, &recs_mal[cnt], sizeof recs_mal[cnt]);
+        if(exts[ix].data)
+        {
+            iov_mal[2 * cnt].iov_base = &recs_mal[cnt];
+            iov_mal[2 * cnt].iov_len = sizeof recs_mal[cnt];
+            iov_mal[2 * cnt + 1].iov_base = (void*)exts[ix].data;
+            iov_mal[2 * cnt + 1].iov_len = (size_t)exts[ix].len;
+            len += sizeof recs_mal[cnt] + exts[ix].len;
+            hashUpdate(p_hc, exts[ix].data, (size_t)exts[ix].len);
+            cnt++;
+            continue;
+        }
 
-    if(ppc->origcmd)
-    {
-        strncpy(p_op->origcmd, ppc->origcmd, sizeof p_op->origcmd - 1);
-        if(strlen(ppc->origcmd) > sizeof p_op->origcmd - 1)
+        rc = writeat(backup_fd, at, &recs_mal[cnt], sizeof recs_mal[cnt]);
+        checkrc(rc);
+        at += sizeof recs_mal[cnt];
+        if( ! buf_mal)
+            buf_mal = Malloc(CHUNK_SZ);
+        for(hoff_t rel = 0, sz = 0; rel < exts[ix].len; rel += sz)
         {
-            p_op->origcmd[sizeof p_op->origcmd - 3] = '\0';
-            p_op->origcmd[sizeof p_op->origcmd - 2] = OP_CMD_TRUNCATED;
+            sz = MIN(CHUNK_SZ, exts[ix].len - rel);
+            rc = readat(data_fd, exts[ix].at + rel, buf_mal, sz);
+            checkrc(rc);
+            hashUpdate(p_hc, buf_mal, (size_t)sz);
+            rc = writeat(backup_fd, at, buf_mal, sz);
+            checkrc(rc);
+            at += sz;
         }
     }
 
-    rc = writeOp(ppc->fz.fi, backup_fd, opix, p_op);
-    checkrc(rc);
-
     rc = RC_OK;
 
 end:
-    if(rc)
+    free(recs_mal);
+    free(iov_mal);
+    free(buf_mal);
+    return rc;
+}
+
+/**
+ * @brief Save a data file region to a backup file with CODEC_CHUNK: holes in
+ *        the region are recorded as such, without reading them; runs of one
+ *        octet value as just that octet; and the rest in chunks of CHUNK_SZ,
+ *        compressed with lzEncode() unless that saves less than 1/16. The
+ *        holes are taken from a map made beforehand with sparseMap(), so the
+ *        file offset of data_fd is left alone.
+ *
+ * @param[in] data_fd Data file descriptor
+ * @param[in] from Data file offset of the region
+ * @param[in] len Length of the region
+ * @param[in] runs Runs of data of a region of the data file covering this one
+ * @param[in] nrun Number of runs
+ * @param[in] backup_fd Backup file descriptor
+ * @param[in] at Backup file offset at which to write
+ * @param[out] p_stored Set to the length written to the backup file
+ * @param[in,out] p_hc Hash context to which the written octets are added
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t encodeSaved(int data_fd, hoff_t from, hoff_t len,
+                        FileExtent const *runs, size_t nrun, int backup_fd,
+                        hoff_t at, hoff_t *p_stored, HashCtx *p_hc)
+{
+    rc_t rc = RC_UNSPEC;
+    uint8_t *raw_mal = Malloc(CHUNK_SZ), *enc_mal = Malloc(CHUNK_SZ);
+    hoff_t rel = 0, run_end = 0, stored = 0;
+    size_t rx = 0;
+    bool hole = false;
+
+    while(rel < len)
+    {
+        SavedChunk ch;
+        struct iovec iov[2];
+        size_t enc = 0;
+        hoff_t ix = 0;
+
+        if(rel == run_end)
+        {
+            // The run of data containing from + rel, or the hole before the
+            // next one
+            for( ; rx < nrun && runs[rx].at + runs[rx].len <= from + rel; rx++)
+                ;
+            hole = (rx == nrun || runs[rx].at > from + rel);
+            if(rx == nrun)
+                run_end = len;
+            else if(hole)
+                run_end = MIN(len, runs[rx].at - from);
+            else
+                run_end = MIN(len, runs[rx].at + runs[rx].len - from);
+        }
+
+        memset(&ch, 0, sizeof ch);
+        iov[0].iov_base = &ch;
+        iov[0].iov_len = sizeof ch;
+        if(hole)
+        {
+            ch.kind = CHUNK_HOLE;
+            ch.raw_len = run_end - rel;
+        }
+        else
+        {
+            ch.raw_len = MIN(CHUNK_SZ, run_end - rel);
+            rc = readat(data_fd, from + rel, raw_mal, ch.raw_len);
+            checkrc(rc);
+            for(ix = 1; ix < ch.raw_len && raw_mal[ix] == raw_mal[0]; ix++)
+                ;
+            if(ix == ch.raw_len)
+            {
+                ch.kind = CHUNK_FILL;
+                ch.fill = raw_mal[0];
+            }
+            else if((enc = lzEncode(raw_mal, (size_t)ch.raw_len, enc_mal,
+                                    (size_t)(ch.raw_len - ch.raw_len / 0x10))))
+            {
+                ch.kind = CHUNK_LZ;
+                ch.enc_len = (uint32_t)enc;
+                iov[1].iov_base = enc_mal;
+            }
+            else
+            {
+                ch.kind = CHUNK_RAW;
+                ch.enc_len = (uint32_t)ch.raw_len;
+                iov[1].iov_base = raw_mal;
+            }
+            iov[1].iov_len = ch.enc_len;
+        }
+
+        rc = writevat(backup_fd, at + stored, iov, ch.enc_len ? 2 : 1);
+        checkrc(rc);
+        hashUpdate(p_hc, &ch, sizeof ch);
+        if(ch.enc_len)
+            hashUpdate(p_hc, iov[1].iov_base, ch.enc_len);
+        stored += sizeof ch + ch.enc_len;
+        rel += ch.raw_len;
+        progress(rel, len, 1);
+    }
+    progress(-1, len, 1);
+
+    *p_stored = stored;
+
+    rc = RC_OK;
+
+end:
+    free(raw_mal);
+    free(enc_mal);
+    return rc;
+}
+
+/**
+ * @brief Write backup data for a backup operation.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] backup_fd File descriptor of a backup file
+ * @param[in] opix Operation index
+ * @param[in,out] p_op Struct containing backup operation data to write to
+ *                backup file. This function sets the status field.
+ * @param[in] exts For a scatter operation, the runs to save; else NULL to save
+ *            the data file region given in p_op
+ * @param[in] count Number of runs in exts
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t writeOp(int data_fi, int backup_fd, int opix, BackupOp *p_op,
+                    FileExtent const *exts, size_t count)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t stored = 0;
+    HashCtx hc;
+
+    plugin(3, (void*)0);
+
+    p_op->stored_len = p_op->saved_len;
+    if( ! exts)
+    {
+        p_op->codec = pickCodec(DT_FD(data_fi), p_op->saved_from,
+                                p_op->saved_len, backup_fd, p_op->saved_at);
+    }
+
+    sealOp(p_op);
+    rc = writeat(backup_fd, BKFL_OPINFO_OFF(opix), p_op, sizeof *p_op);
+    checkrc(rc);
+
+    hashInit(&hc, HASH_CRC32C);
+    if(exts)
+    {
+        rc = writeScatter(DT_FD(data_fi), backup_fd, p_op->saved_at, exts,
+                          count, &hc);
+    }
+    else if(p_op->codec == CODEC_CHUNK)
+    {
+        FileExtent *runs_mal = NULL;
+        size_t nrun = sparseMap(DT_FD(data_fi), p_op->saved_from,
+                                p_op->saved_len, &runs_mal);
+        rc = encodeSaved(DT_FD(data_fi), p_op->saved_from, p_op->saved_len,
+                         runs_mal, nrun, backup_fd, p_op->saved_at, &stored,
+                         &hc);
+        free(runs_mal);
+    }
+    else if(p_op->codec == CODEC_CLONE)
+    {
+        rc = filecpy(DT_FD(data_fi), p_op->saved_from, p_op->saved_len,
+                     backup_fd,      p_op->saved_at,   p_op->saved_len);
+        if(rc == RC_OK)
+        {
+            rc = crcRange(DT_FD(data_fi), p_op->saved_from, p_op->saved_len,
+                          &hc);
+        }
+    }
+    else
+    {
+        rc = copySaved(DT_FD(data_fi), p_op->saved_from, p_op->saved_len,
+                       backup_fd, p_op->saved_at, &hc);
+    }
+    checkrc(rc);
+
+    // The stored length and CRC are only known now
+    if(p_op->codec == CODEC_CHUNK)
+        p_op->stored_len = stored;
+    crcFinal(&hc, p_op->data_crc);
+    sealOp(p_op);
+    rc = writeat(backup_fd, BKFL_OPINFO_OFF(opix), p_op, sizeof *p_op);
+    checkrc(rc);
+
+    sync(backup_fd);
+    p_op->status = OP_STATUS_BACKUP_DONE;
+    rc = writeat(backup_fd, BKFL_BFIN_OFF(opix),
+                 BKFL_BFIN_PTR(p_op), BKFL_BFIN_LEN);
+    checkrc(rc);
+    sync(backup_fd);
+
+    rc = groupSync(backup_fd, p_op);
+    checkrc(rc);
+
+    rc = RC_OK;
+
+end:
+    if(rc)
+        dropHeader(backup_fd);
+    plugin(3, (void*)1);
+    return rc;
+}
+
+/**
+ * @brief With -journal, at the start of a round, move the backup file about
+ *        to be reused aside as a journal segment if it holds an earlier round.
+ *        A round that undo has already reverted is overwritten as usual.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in,out] p_backup_fd Backup file descriptor, replaced if moved aside
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t archiveRound(int data_fi, int *p_backup_fd)
+{
+    rc_t rc = RC_UNSPEC;
+    int bidx = (DT_OPCNT(data_fi) / BackupDepth) % BACKUP_FILE_COUNT;
+    BackupHeader *p_old = NULL;
+    struct stat info;
+
+    rc = hexpeek_stat(*p_backup_fd, &info);
+    checkrc(rc);
+    if(info.st_size > 0)
+    {
+        rc = readHeader(*p_backup_fd, &p_old);
+        checkrc(rc);
+        if(p_old->firstop < DT_OPCNT(data_fi))
+        {
+            dropHeader(*p_backup_fd);
+            rc = journalArchive(data_fi, bidx, p_old->firstop);
+            checkrc(rc);
+            *p_backup_fd = BK_FD(data_fi, bidx);
+        }
+    }
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Start a new backup operation for a data file: pick its op index and
+ *        backup file, get the header (or write a fresh one at the start of a
+ *        round) and fill in the fields of the op that do not depend on what
+ *        is saved.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] origcmd Command string to record, or NULL
+ * @param[out] pp_hdr Set to the in-memory header (see readHeader())
+ * @param[out] p_opix Op index of the new operation
+ * @param[out] p_backup_fd Backup file descriptor
+ * @param[out] p_sv_at Backup file offset at which saved data may begin
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t startOp(int data_fi, char const *origcmd, BackupHeader **pp_hdr,
+                    int *p_opix, int *p_backup_fd, hoff_t *p_sv_at)
+{
+    rc_t rc = RC_UNSPEC;
+    int opix = 0, backup_fd = -1, max_op = -1;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_op = NULL;
+    struct stat info;
+
+    if(DT_OPCNT(data_fi) == UINT64_MAX)
+    {
+        rc = RC_CRIT;
+        prerr("64 bit operation counter would overflow, aborting.\n");
+        goto end;
+    }
+
+    opix = DT_OPCNT(data_fi) % BackupDepth;
+    backup_fd = backupFd(data_fi);
+    assert(backup_fd >= 0);
+
+    // If start of round, need to truncate backup file and write a new Header
+    if(opix == 0)
+    {
+        HeaderCache *slot = NULL;
+        if(Params.journal > 0)
+        {
+            rc = archiveRound(data_fi, &backup_fd);
+            checkrc(rc);
+        }
+        slot = headerSlot(backup_fd);
+        slot->valid = false;
+        p_hdr = &slot->hdr;
+        memset(p_hdr, 0, sizeof *p_hdr);
+        memcpy(p_hdr->magic, HDR_MAGIC_DATA, HDR_MAGIC_SZ);
+        p_hdr->firstop = DT_OPCNT(data_fi);
+        rc = hexpeek_stat(DT_FD(data_fi), &info);
+        checkrc(rc);
+        p_hdr->data_dev = (uint64_t)info.st_dev;
+        p_hdr->data_ino = (uint64_t)info.st_ino;
+        p_hdr->data_size = info.st_size;
+        rc = hexpeek_truncate(backup_fd, 0);
+        checkrc(rc);
+        rc = writeat(backup_fd, 0, p_hdr, sizeof *p_hdr);
+        checkrc(rc);
+        slot->valid = true;
+        *p_sv_at = ceilbound(sizeof *p_hdr, PAGESZ);
+    }
+    else
+    {
+        rc = getHeader(backup_fd, &p_hdr, p_sv_at);
+        checkrc(rc);
+        if(p_hdr->ops[opix].status &&
+           p_hdr->ops[opix].status != OP_STATUS_RECOVERY_DONE)
+        {
+            rc = RC_CRIT;
+            prerr("%s header is malformed: unexpected operation present!\n",
+                  fdname(backup_fd));
+            goto end;
+        }
+
+        // Ops at and above opix were reverted by undo and are superseded by
+        // this one; clear them so their saved data is not in the way
+        max_op = mostRecentOp(p_hdr);
+        if(max_op >= opix)
+        {
+            memset(&p_hdr->ops[opix], 0,
+                   (max_op - opix + 1) * sizeof(BackupOp));
+            if(max_op > opix)
+            {
+                rc = writeat(backup_fd, BKFL_OPINFO_OFF(opix + 1),
+                             &p_hdr->ops[opix + 1],
+                             (max_op - opix) * sizeof(BackupOp));
+                if(rc)
+                {
+                    dropHeader(backup_fd);
+                    goto end;
+                }
+            }
+            *p_sv_at = nextAt(p_hdr);
+        }
+    }
+
+    p_op = &p_hdr->ops[opix];
+    memset(p_op, 0, sizeof *p_op);
+    memcpy(p_op->magic, OPINFO_MAGIC_DATA, OPINFO_MAGIC_SZ);
+    p_op->status        = OP_STATUS_BACKUP_START;
+    p_op->size_orig     = filesize(data_fi);
+    p_op->last_at       = Params.infiles[data_fi].last_at;
+
+    if(origcmd)
+    {
+        strncpy(p_op->origcmd, origcmd, sizeof p_op->origcmd - 1);
+        if(strlen(origcmd) > sizeof p_op->origcmd - 1)
+        {
+            p_op->origcmd[sizeof p_op->origcmd - 3] = '\0';
+            p_op->origcmd[sizeof p_op->origcmd - 2] = OP_CMD_TRUNCATED;
+        }
+    }
+
+    *pp_hdr = p_hdr;
+    *p_opix = opix;
+    *p_backup_fd = backup_fd;
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Perform backup operations corresponding to the command represented
+ *        by the provided ParsedCommand structure.
+ *
+ * @param[in] ppc Pointer to a ParsedCommand structure.
+ * @param Returns RC_OK on success, else a hexpeek error code
+ */
+rc_t makeBackup(ParsedCommand const *ppc)
+{
+    rc_t rc = RC_UNSPEC;
+    int opix = 0, backup_fd = 0;
+    hoff_t sv_at = HOFF_NIL;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_op = NULL;
+
+    if(BackupDepth <= 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    traceEntry("%" PRIu64, DT_OPCNT(ppc->fz.fi));
+
+    assert(ppc);
+    assert(ppc->fz.start >= 0);
+    assert(ppc->fz.len >= 0);
+
+    rc = startOp(ppc->fz.fi, ppc->origcmd, &p_hdr, &opix, &backup_fd, &sv_at);
+    checkrc(rc);
+    p_op = &p_hdr->ops[opix];
+
+    p_op->saved_from    = ppc->fz.start;
+    p_op->saved_at      = sv_at + ppc->fz.start % PAGESZ; // allow cloning
+    switch(ppc->cmd)
+    {
+    case CMD_REPLACE:
+        p_op->size_adj  = 0;
+        p_op->saved_len = ppc->fz.len;
+        break;
+    case CMD_INSERT:
+        p_op->size_adj  = ppc->fz.len;
+        p_op->saved_len = 0;
+        break;
+    case CMD_KILL:
+        p_op->size_adj  = -ppc->fz.len;
+        p_op->saved_len = ppc->fz.len;
+        break;
+    default:
+        die();
+    }
+    if(p_op->saved_from + p_op->saved_len > p_op->size_orig)
+        p_op->saved_len = MAX(0, p_op->size_orig - p_op->saved_from);
+
+    rc = writeOp(ppc->fz.fi, backup_fd, opix, p_op, NULL, 0);
+    checkrc(rc);
+
+    rc = RC_OK;
+
+end:
+    if(rc)
         prerr("backup failed\n");
     traceExit(TRC_rc, rc);
     return rc;
 }
 
 /**
- * @brief Make backup for file adjustment operation (insert / kill).
+ * @brief Shared state of makePipedBackup() and its writer thread.
+ */
+typedef struct
+{
+    ChunkWriter write_fn;
+    void *ctx;
+    hoff_t marked;   // length of saved data recorded, which may be overwritten
+    hoff_t written;  // length of new data written
+    bool stop;       // no more will be marked
+    rc_t rc;         // error of the writer
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} PipeState;
+
+/**
+ * @brief Writer: write new data up to the recorded length each time it grows,
+ *        until stopped or an error occurs.
+ */
+static void *pipeWriter(void *vp)
+{
+    PipeState *ps = vp;
+
+    pthread_mutex_lock(&ps->lock);
+    for(;;)
+    {
+        hoff_t rel = ps->written, len = ps->marked - ps->written;
+        rc_t rc = RC_UNSPEC;
+        if(len == 0)
+        {
+            if(ps->stop)
+                break;
+            pthread_cond_wait(&ps->cond, &ps->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&ps->lock);
+        rc = ps->write_fn(ps->ctx, rel, len);
+        pthread_mutex_lock(&ps->lock);
+        if(rc)
+        {
+            ps->rc = rc;
+            break;
+        }
+        ps->written = rel + len;
+    }
+    pthread_mutex_unlock(&ps->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Back up a long replace within the data file and write its new data
+ *        in a pipeline, rather than writing the data only once all of it is
+ *        saved. The region is saved PIPE_CHUNK at a time. After each chunk
+ *        the op is marked with the length saved so far, with status
+ *        OP_STATUS_BACKUP_PART until the last, and the backup is synced
+ *        before and after the mark as by writeOp(). A writer thread overwrites
+ *        the data file up to each mark while the next chunk is saved. So no
+ *        octet is overwritten before its original is recorded, and recovery
+ *        restores just the part that is.
+ *
+ * @param[in] ppc Pointer to a ParsedCommand structure for a replace
+ * @param[in] write_fn Function which writes new data (see ChunkWriter)
+ * @param[in] ctx Argument for write_fn
+ * @param[out] bked Set to true if the op was recorded, even on failure
+ * @return RC_OK on success, RC_NIL if the replace is not to be pipelined (no
+ *         backup, too short or not within the file), else a hexpeek error code
+ */
+rc_t makePipedBackup(ParsedCommand const *ppc, ChunkWriter write_fn, void *ctx,
+                     bool *bked)
+{
+    rc_t rc = RC_UNSPEC;
+    int opix = 0, backup_fd = -1, data_fd = DT_FD(ppc->fz.fi);
+    hoff_t sv_at = HOFF_NIL, saved = 0, stored = 0, st = 0;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_op = NULL;
+    HashCtx hc;
+    PipeState ps;
+    pthread_t writer;
+    FileExtent *runs_mal = NULL;
+    size_t nrun = 0;
+    bool started = false;
+
+    assert(ppc->cmd == CMD_REPLACE);
+
+    memset(&ps, 0, sizeof ps);
+    ps.write_fn = write_fn;
+    ps.ctx = ctx;
+    pthread_mutex_init(&ps.lock, NULL);
+    pthread_cond_init(&ps.cond, NULL);
+
+    if(BackupDepth <= 0 || ppc->fz.len < PIPE_MIN ||
+       ppc->fz.start + ppc->fz.len > filesize(ppc->fz.fi))
+    {
+        rc = RC_NIL;
+        goto end;
+    }
+
+    traceEntry("%" PRIu64, DT_OPCNT(ppc->fz.fi));
+
+    rc = startOp(ppc->fz.fi, ppc->origcmd, &p_hdr, &opix, &backup_fd, &sv_at);
+    checkrc(rc);
+    p_op = &p_hdr->ops[opix];
+    p_op->size_adj   = 0;
+    p_op->saved_from = ppc->fz.start;
+    p_op->saved_at   = sv_at + ppc->fz.start % PAGESZ; // allow cloning
+    p_op->saved_len  = 0;
+    p_op->stored_len = 0;
+    p_op->codec      = pickCodec(data_fd, p_op->saved_from, ppc->fz.len,
+                                 backup_fd, p_op->saved_at);
+
+    // Saving and writing overlap, so unlike writeOp() there is no backup
+    // phase to exempt from simulated deaths with plugin(3, ...)
+    sealOp(p_op);
+    rc = writeat(backup_fd, BKFL_OPINFO_OFF(opix), p_op, sizeof *p_op);
+    checkrc(rc);
+    hashInit(&hc, HASH_CRC32C);
+
+    // Finding holes moves the file offset, so do it before the writer starts
+    if(p_op->codec == CODEC_CHUNK)
+        nrun = sparseMap(data_fd, p_op->saved_from, ppc->fz.len, &runs_mal);
+
+    if(pthread_create(&writer, NULL, pipeWriter, &ps))
+        die();
+    started = true;
+
+    while(saved < ppc->fz.len)
+    {
+        hoff_t len = MIN(PIPE_CHUNK, ppc->fz.len - saved);
+
+        if(p_op->codec == CODEC_CHUNK)
+        {
+            rc = encodeSaved(data_fd, p_op->saved_from + saved, len,
+                             runs_mal, nrun, backup_fd,
+                             p_op->saved_at + stored, &st, &hc);
+        }
+        else if(p_op->codec == CODEC_CLONE)
+        {
+            st = len;
+            rc = filecpy(data_fd,   p_op->saved_from + saved, len,
+                         backup_fd, p_op->saved_at + stored,  len);
+            // The writer has not reached this part, so it is still original
+            if(rc == RC_OK)
+                rc = crcRange(data_fd, p_op->saved_from + saved, len, &hc);
+        }
+        else
+        {
+            st = len;
+            rc = copySaved(data_fd, p_op->saved_from + saved, len,
+                           backup_fd, p_op->saved_at + stored, &hc);
+        }
+        checkrc(rc);
+
+        sync(backup_fd);
+        saved += len;
+        stored += st;
+        p_op->saved_len = saved;
+        p_op->stored_len = stored;
+        p_op->status = (saved < ppc->fz.len ? OP_STATUS_BACKUP_PART :
+                                              OP_STATUS_BACKUP_DONE);
+        crcFinal(&hc, p_op->data_crc);
+        sealOp(p_op);
+        rc = writeat(backup_fd, BKFL_OPINFO_OFF(opix), p_op, sizeof *p_op);
+        checkrc(rc);
+        sync(backup_fd);
+        *bked = true;
+
+        pthread_mutex_lock(&ps.lock);
+        rc = ps.rc;
+        ps.marked = saved;
+        pthread_cond_signal(&ps.cond);
+        pthread_mutex_unlock(&ps.lock);
+        checkrc(rc);
+        plugin(2, NULL);
+    }
+
+    rc = groupSync(backup_fd, p_op);
+    checkrc(rc);
+
+    rc = RC_OK;
+
+end:
+    if(rc && rc != RC_NIL && backup_fd >= 0)
+    {
+        dropHeader(backup_fd);
+        prerr("backup failed\n");
+    }
+    if(started)
+    {
+        pthread_mutex_lock(&ps.lock);
+        ps.stop = true;
+        pthread_cond_signal(&ps.cond);
+        pthread_mutex_unlock(&ps.lock);
+        pthread_join(writer, NULL);
+        // An error of the writer has been reported where it occurred
+        if(rc == RC_OK)
+            rc = ps.rc;
+    }
+    pthread_mutex_destroy(&ps.lock);
+    pthread_cond_destroy(&ps.cond);
+    free(runs_mal);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Back up scattered runs of a data file as one backup operation, e.g.
+ *        before a patch is applied. The saved data is a sequence of records,
+ *        each a ScatterRec followed by the original octets of the run.
+ *
+ *        The operation may also shift the file tail by amt at pos, as with
+ *        adjustSize(), before the runs are overwritten: recovery then reverses
+ *        the shift before it restores the runs, which are in the offsets of
+ *        the file before the shift.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] exts Runs to save, in ascending order of offset, none of which
+ *            may extend past end of file, each with its original octets or
+ *            with NULL data to have them read from the file
+ * @param[in] count Number of runs
+ * @param[in] pos File offset of the tail shift, if any (see adjustSize())
+ * @param[in] amt Amount of the tail shift, or zero if none
+ * @param[in] origcmd Command string to record
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t makeScatterBackup(int data_fi, FileExtent const *exts, size_t count,
+                       hoff_t pos, hoff_t amt, char const *origcmd)
+{
+    rc_t rc = RC_UNSPEC;
+    int opix = 0, backup_fd = 0;
+    hoff_t sv_at = HOFF_NIL;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_op = NULL;
+
+    if(BackupDepth <= 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    traceEntry("%d, %zu, " TRC_hoff ", " TRC_hoff, data_fi, count,
+               trchoff(pos), trchoff(amt));
+
+    rc = startOp(data_fi, origcmd, &p_hdr, &opix, &backup_fd, &sv_at);
+    checkrc(rc);
+    p_op = &p_hdr->ops[opix];
+
+    memcpy(p_op->magic, OPINFO_MAGIC_SCATTER, OPINFO_MAGIC_SZ);
+    p_op->size_adj   = amt;
+    p_op->saved_from = (amt ? pos : count > 0 ? exts[0].at : 0);
+    p_op->saved_at   = sv_at;
+    p_op->saved_len  = 0;
+    for(size_t ix = 0; ix < count; ix++)
+    {
+        assert(exts[ix].at + exts[ix].len <= p_op->size_orig);
+        p_op->saved_len += sizeof(ScatterRec) + exts[ix].len;
+    }
+
+    rc = writeOp(data_fi, backup_fd, opix, p_op, exts, count);
+    checkrc(rc);
+
+    rc = RC_OK;
+
+end:
+    if(rc)
+        prerr("backup failed\n");
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Make compact backup for file adjustment operation (insert / kill) that
+ *        is done by fallocate() block operations rather than by moving the
+ *        file tail.
+ *
+ * @param[in] data_fi Infile file index.
+ * @param[in] backup_fd Backup file descriptor.
+ * @param[in] at Block aligned file offset of the fallocate() operation.
+ * @param[in] amt Amount of file adjustment (positive inserts, negative kills).
+ * @param[in] sv_from File offset from which to save data.
+ * @param[in] sv_len Length of data to save (less than one block).
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t makeAdjRangeBackup(int data_fi, int backup_fd, hoff_t at, hoff_t amt,
+                        hoff_t sv_from, hoff_t sv_len)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t sv_at = -1;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_op = NULL;
+
+    if(backup_fd < 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    traceEntry("%d, %d, " TRC_hoff ", " TRC_hoff ", " TRC_hoff ", " TRC_hoff,
+               data_fi, backup_fd, trchoff(at), trchoff(amt),
+               trchoff(sv_from), trchoff(sv_len));
+
+    assert(amt != 0);
+
+    rc = getHeader(backup_fd, &p_hdr, &sv_at);
+    checkrc(rc);
+
+    p_op = &p_hdr->ops[LAST_ADJ_OPIDX];
+    memset(p_op, 0, sizeof *p_op);
+    memcpy(p_op->magic, OPINFO_MAGIC_DATA, OPINFO_MAGIC_SZ);
+    p_op->status     = OP_STATUS_BACKUP_START;
+    p_op->size_orig  = filesize(data_fi);
+    p_op->size_adj   = amt;
+    p_op->last_at    = at;
+    p_op->saved_from = sv_from;
+    p_op->saved_at   = sv_at + sv_from % PAGESZ;
+    p_op->saved_len  = sv_len;
+
+    rc = writeOp(data_fi, backup_fd, LAST_ADJ_OPIDX, p_op, NULL, 0);
+    checkrc(rc);
+
+    rc = RC_OK;
+
+end:
+    if(rc)
+        prerr("backup failed\n");
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Make backup for file adjustment operation (insert / kill) that moves
+ *        the file tail (see shiftTail()). The move records its progress with
+ *        markShiftBackup(), so that recovery can finish an interrupted move,
+ *        which the command is then reverted from.
+ *
+ * @param[in] data_fi Infile file index.
+ * @param[in] backup_fd Backup file descriptor.
+ * @param[in] pos File offset at which the tail begins.
+ * @param[in] amt Amount of file adjustment (positive inserts, negative kills).
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t makeShiftBackup(int data_fi, int backup_fd, hoff_t pos, hoff_t amt)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t sv_at = -1;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_op = NULL;
+
+    if(backup_fd < 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    traceEntry("%d, %d, " TRC_hoff ", " TRC_hoff,
+               data_fi, backup_fd, trchoff(pos), trchoff(amt));
+
+    assert(amt != 0);
+
+    rc = getHeader(backup_fd, &p_hdr, &sv_at);
+    checkrc(rc);
+
+    p_op = &p_hdr->ops[LAST_ADJ_OPIDX];
+    memset(p_op, 0, sizeof *p_op);
+    memcpy(p_op->magic, OPINFO_MAGIC_SHIFT, OPINFO_MAGIC_SZ);
+    p_op->status     = OP_STATUS_BACKUP_START;
+    p_op->size_orig  = filesize(data_fi);
+    p_op->size_adj   = amt;
+    p_op->last_at    = 0;
+    p_op->saved_from = pos;
+    p_op->saved_at   = sv_at;
+    p_op->saved_len  = 0;
+
+    rc = writeOp(data_fi, backup_fd, LAST_ADJ_OPIDX, p_op, NULL, 0);
+    checkrc(rc);
+
+    rc = RC_OK;
+
+end:
+    if(rc)
+        prerr("backup failed\n");
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Return the backup file offset of the window journal slot that a
+ *        short shift (see markShiftBackup()) uses for the window it moves
+ *        after moved octets of the tail. Windows begin at multiples of
+ *        SHIFT_WINDOW, and alternate between two slots from base.
+ */
+static hoff_t windowSlot(hoff_t base, hoff_t moved)
+{
+    return base + (moved / SHIFT_WINDOW % 2) * SHIFT_WINDOW;
+}
+
+/**
+ * @brief Record the progress of a tail move begun with makeShiftBackup(). The
+ *        data file is synced first, so the recorded length never runs ahead
+ *        of the moved data; unless backups are never synced, the mark is
+ *        synced before the move goes on, as it is all recovery has to go by.
+ *
+ *        A short shift moves its tail a window at a time, each of which
+ *        overwrites part of its own source. Given that part of the window, it
+ *        is journalled first, in the one of two slots that the last mark does
+ *        not refer to, and the mark records it as the saved data of the op:
+ *        recovery writes the window to its destination again, the journalled
+ *        part from the backup file and the rest from the data file, and goes
+ *        on from after it.
+ *
+ * @param[in] data_fi Infile file index.
+ * @param[in] backup_fd Backup file descriptor.
+ * @param[in] moved Length of the tail moved so far.
+ * @param[in] win If non-NULL, the overwritten part of the window of the tail
+ *            to be moved next (see moveWindows())
+ * @param[in] win_len Length of that part (SHIFT_WINDOW at most)
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t markShiftBackup(int data_fi, int backup_fd, hoff_t moved,
+                     uint8_t const *win, hoff_t win_len)
+{
+    rc_t rc = RC_UNSPEC;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_op = NULL;
+    HashCtx hc;
+
+    traceEntry("%d, %d, " TRC_hoff ", %p, " TRC_hoff, data_fi, backup_fd,
+               trchoff(moved), win, trchoff(win_len));
+
+    rc = readHeader(backup_fd, &p_hdr);
+    checkrc(rc);
+    p_op = &p_hdr->ops[LAST_ADJ_OPIDX];
+    assert(IS_SHIFT(p_op));
+
+    if(win)
+    {
+        assert(win_len <= SHIFT_WINDOW && moved % SHIFT_WINDOW == 0);
+        p_op->saved_at = windowSlot(nextAt(p_hdr), moved);
+        rc = writeat(backup_fd, p_op->saved_at, win, win_len);
+        checkrc(rc);
+        hashInit(&hc, HASH_CRC32C);
+        hashUpdate(&hc, win, (size_t)win_len);
+        crcFinal(&hc, p_op->data_crc);
+    }
+
+    if(Params.backup_sync != BACKUP_SYNC_NONE)
+    {
+        rc = hexpeek_datasync(DT_FD(data_fi));
+        checkrc(rc);
+        if(win)
+        {
+            rc = hexpeek_datasync(backup_fd);
+            checkrc(rc);
+        }
+    }
+
+    p_op->last_at = moved;
+    p_op->saved_len = p_op->stored_len = (win ? win_len : 0);
+    sealOp(p_op);
+    rc = writeat(backup_fd, BKFL_OPINFO_OFF(LAST_ADJ_OPIDX),
+                 p_op, sizeof *p_op);
+    checkrc(rc);
+
+    if(Params.backup_sync != BACKUP_SYNC_NONE)
+    {
+        rc = hexpeek_datasync(backup_fd);
+        checkrc(rc);
+    }
+
+    rc = RC_OK;
+
+end:
+    if(rc)
+        dropHeader(backup_fd);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Clear backup op data for a file adjustment operation (insert / kill).
+ *
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in,out] vp Pointer to a BackupOp structure, ultimately zeroed, or NULL
+ *                for the one in the in-memory header
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t clearAdjBackup(int backup_fd, void *vp)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t sv_at = HOFF_NIL;
+    BackupHeader *p_hdr = NULL;
+    BackupOp *p_adj = (BackupOp*)vp;
+
+    if(backup_fd < 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    traceEntry("%d, %p", backup_fd, p_adj);
+
+    if( ! p_adj)
+    {
+        rc = readHeader(backup_fd, &p_hdr);
+        checkrc(rc);
+        p_adj = &p_hdr->ops[LAST_ADJ_OPIDX];
+    }
+
+    // A journalled window may be in the second of its two slots
+    if(p_adj->status && p_adj->saved_len)
+        sv_at = p_adj->saved_at -
+                (IS_SHIFT(p_adj) ? windowSlot(0, p_adj->last_at) : 0);
+
+    memset(p_adj, 0, sizeof *p_adj);
+    rc = writeat(backup_fd, BKFL_OPINFO_OFF(LAST_ADJ_OPIDX),
+                 p_adj, sizeof *p_adj);
+    checkrc(rc);
+    if(vp && headerSlot(backup_fd)->valid)
+    {
+        memset(&headerSlot(backup_fd)->hdr.ops[LAST_ADJ_OPIDX], 0,
+               sizeof *p_adj);
+    }
+
+    if(sv_at != HOFF_NIL)
+    {
+        rc = hexpeek_truncate(backup_fd, sv_at);
+        checkrc(rc);
+    }
+
+    sync(backup_fd);
+
+    rc = RC_OK;
+
+end:
+    if(rc)
+        dropHeader(backup_fd);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @struct RecoveryCounts
+ *
+ * @brief Store counters for recovery operations.
+ *
+ * @var RecoveryCounts::total
+ * Count of recovery operations attempted in total.
+ * @var RecoveryCounts::prev
+ * Count of recovery operations that were already recovered on a previous run.
+ * @var RecoveryCounts::reverted
+ * Count of recovery operations that were successfully reverted.
+ * @var RecoveryCounts::finished
+ * Count of interrupted file size adjustments that were finished (-finish).
+ * @var RecoveryCounts::noncompl
+ * Count of recovery operations skipped due to backup operation not completing.
+ * @var RecoveryCounts::failed
+ * Count of recovery recovery operations that were attempted but failed.
+ */
+typedef struct
+{
+    int total;
+    int prev;
+    int reverted;
+    int finished;
+    int noncompl;
+    int failed;
+} RecoveryCounts;
+
+#define OPFMT      "#x%" PRIX64
+#define OPNUM      ((p_hdr)->firstop + (opix))
+#define OPTRUNC(s) ( ( (s)[sizeof (s) - 3] == '\0' && \
+                       (s)[sizeof (s) - 2] == OP_CMD_TRUNCATED ) ? \
+                     " (truncated)" : "")
+
+/**
+ * @brief Check the header of a SavedChunk.
+ *
+ * @return Zero if all validity checks passed; otherwise non-zero
+ */
+static int checkChunk(SavedChunk const *p_ch)
+{
+    if(p_ch->raw_len <= 0)
+        return 1;
+    else if(p_ch->kind != CHUNK_HOLE && p_ch->raw_len > CHUNK_SZ)
+        return 2;
+    switch(p_ch->kind)
+    {
+    case CHUNK_RAW:
+        return p_ch->enc_len != p_ch->raw_len ? 3 : 0;
+    case CHUNK_LZ:
+        return p_ch->enc_len == 0 || p_ch->enc_len >= p_ch->raw_len ? 4 : 0;
+    case CHUNK_FILL:
+        return p_ch->enc_len != 0 ? 5 : 0;
+    case CHUNK_HOLE:
+        return p_ch->enc_len != 0 || p_ch->fill != 0 ? 6 : 0;
+    default:
+        return 7;
+    }
+}
+
+/**
+ * @struct ChunkEntry
+ *
+ * @brief A SavedChunk of saved data stored with CODEC_CHUNK, as found by
+ *        indexSaved().
+ *
+ * @var ChunkEntry::from
+ * Offset in the saved data of the first octet the chunk represents.
+ * @var ChunkEntry::at
+ * Backup file offset of the chunk header.
+ * @var ChunkEntry::ch
+ * The chunk header.
+ */
+typedef struct
+{
+    hoff_t from;
+    hoff_t at;
+    SavedChunk ch;
+} ChunkEntry;
+
+/**
+ * @struct ChunkIndex
+ *
+ * @brief The chunks of the saved data of a backup operation, in order.
+ */
+typedef struct
+{
+    ChunkEntry *list_mal;
+    size_t count;
+} ChunkIndex;
+
+/**
+ * @brief Walk the chunk headers of saved data stored with CODEC_CHUNK once,
+ *        so that restoreSaved() can find the chunks of any part of it without
+ *        walking them again. For any other codec the index is left empty.
+ *
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] p_op Pointer to the BackupOp
+ * @param[out] ci The index, whose list the caller must free
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t indexSaved(int backup_fd, BackupOp const *p_op, ChunkIndex *ci)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t at = p_op->saved_at, end = p_op->saved_at + p_op->stored_len;
+    hoff_t ch_from = 0;
+    size_t cap = 0;
+
+    memset(ci, 0, sizeof *ci);
+    if(p_op->codec != CODEC_CHUNK)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    while(at < end)
+    {
+        SavedChunk ch;
+
+        if(at + (hoff_t)sizeof ch > end)
+        {
+            rc = RC_CRIT;
+            prerr("%s has malformed saved data!\n", fdname(backup_fd));
+            goto end;
+        }
+        rc = readat(backup_fd, at, &ch, sizeof ch);
+        checkrc(rc);
+        if(checkChunk(&ch) || at + (hoff_t)sizeof ch + ch.enc_len > end)
+        {
+            rc = RC_CRIT;
+            prerr("%s has malformed saved data!\n", fdname(backup_fd));
+            goto end;
+        }
+
+        if(ci->count == cap)
+        {
+            size_t ncap = MAX(2 * cap, 0x40);
+            ChunkEntry *grown = Malloc(ncap * sizeof *grown);
+            if(ci->count)
+                memcpy(grown, ci->list_mal, ci->count * sizeof *grown);
+            free(ci->list_mal);
+            ci->list_mal = grown;
+            cap = ncap;
+        }
+        ci->list_mal[ci->count].from = ch_from;
+        ci->list_mal[ci->count].at = at;
+        ci->list_mal[ci->count++].ch = ch;
+
+        at += sizeof ch + ch.enc_len;
+        ch_from += ch.raw_len;
+    }
+
+    rc = RC_OK;
+
+end:
+    if(rc)
+    {
+        free(ci->list_mal);
+        memset(ci, 0, sizeof *ci);
+    }
+    return rc;
+}
+
+/**
+ * @brief Restore part of the saved data of a backup operation, decoding it if
+ *        it is stored with CODEC_CHUNK (see encodeSaved()). The chunks of the
+ *        part are found in an index made by indexSaved(); holes and fill runs
+ *        are written with fillat(), so a hole is punched again where the file
+ *        allows it.
+ *
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] p_op Pointer to the BackupOp
+ * @param[in] ci Index of the chunks of the saved data, or NULL to make one
+ * @param[in] rel Offset in the saved data at which to begin
+ * @param[in] len Length of saved data to restore
+ * @param[in] dst_fd File descriptor to which to write
+ * @param[in] dst_at File offset at which to write
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t restoreSaved(int backup_fd, BackupOp const *p_op,
+                         ChunkIndex const *ci, hoff_t rel, hoff_t len,
+                         int dst_fd, hoff_t dst_at)
+{
+    rc_t rc = RC_UNSPEC;
+    ChunkIndex own;
+    size_t lo = 0, hi = 0;
+    hoff_t done = 0;
+    uint8_t *raw_mal = NULL, *enc_mal = NULL;
+
+    assert(rel >= 0 && len >= 0 && rel + len <= p_op->saved_len);
+
+    memset(&own, 0, sizeof own);
+
+    if(p_op->codec != CODEC_CHUNK)
+    {
+        rc = filecpy(backup_fd, p_op->saved_at + rel, len, dst_fd, dst_at, len);
+        goto end;
+    }
+
+    if( ! ci)
+    {
+        rc = indexSaved(backup_fd, p_op, &own);
+        checkrc(rc);
+        ci = &own;
+    }
+
+    // Find the last chunk that begins at or before rel
+    for(hi = ci->count; hi - lo > 1; )
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(ci->list_mal[mid].from <= rel)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    raw_mal = Malloc(CHUNK_SZ);
+    enc_mal = Malloc(CHUNK_SZ);
+
+    for(size_t ix = lo; done < len; ix++)
+    {
+        ChunkEntry const *ce = NULL;
+        hoff_t off = 0, cnt = 0;
+
+        if(ix >= ci->count)
+        {
+            rc = RC_CRIT;
+            prerr("%s has malformed saved data!\n", fdname(backup_fd));
+            goto end;
+        }
+
+        ce = &ci->list_mal[ix];
+        off = rel + done - ce->from;
+        cnt = MIN(ce->ch.raw_len - off, len - done);
+        switch(ce->ch.kind)
+        {
+        case CHUNK_RAW:
+            rc = filecpy(backup_fd, ce->at + sizeof ce->ch + off, cnt,
+                         dst_fd, dst_at + done, cnt);
+            break;
+        case CHUNK_LZ:
+            rc = readat(backup_fd, ce->at + sizeof ce->ch, enc_mal,
+                        ce->ch.enc_len);
+            checkrc(rc);
+            if( ! lzDecode(enc_mal, ce->ch.enc_len, raw_mal,
+                           (size_t)ce->ch.raw_len))
+            {
+                rc = RC_CRIT;
+                prerr("%s has malformed saved data!\n", fdname(backup_fd));
+                goto end;
+            }
+            rc = writeat(dst_fd, dst_at + done, raw_mal + off, cnt);
+            break;
+        default:
+            memset(raw_mal, ce->ch.fill, MIN(cnt, CHUNK_SZ));
+            rc = fillat(dst_fd, dst_at + done, raw_mal, MIN(cnt, CHUNK_SZ),
+                        cnt);
+            break;
+        }
+        checkrc(rc);
+        done += cnt;
+        plugin(2, NULL);
+    }
+
+    rc = RC_OK;
+
+end:
+    free(own.list_mal);
+    free(raw_mal);
+    free(enc_mal);
+    return rc;
+}
+
+/**
+ * @brief Restore the runs saved by a scatter backup operation (see
+ *        makeScatterBackup()). Runs are read back in batches of records; a
+ *        run too long for the batch buffer is copied directly.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] p_op Pointer to a scatter BackupOp
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t recoverScatter(int data_fi, int backup_fd, BackupOp const *p_op)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t f_sz = filesize(data_fi), rel = 0, bufsz = BUFSZ * 0x10;
+    uint8_t *buf_mal = Malloc(bufsz);
+
+    // Octets written past the original end of file are simply cut off
+    if(f_sz < p_op->size_orig)
+    {
+        rc = RC_CRIT;
+        prerr("data file size is wrong!\n");
+        goto end;
+    }
+    if(f_sz > p_op->size_orig)
+    {
+        rc = hexpeek_truncate(DT_FD(data_fi), p_op->size_orig);
+        checkrc(rc);
+    }
+
+    while(rel < p_op->saved_len)
+    {
+        hoff_t cnt = MIN(bufsz, p_op->saved_len - rel), pos = 0;
+        rc = readat(backup_fd, p_op->saved_at + rel, buf_mal, cnt);
+        checkrc(rc);
+        while(pos + (hoff_t)sizeof(ScatterRec) <= cnt)
+        {
+            ScatterRec rec;
+            memcpy(&rec, buf_mal + pos, sizeof rec);
+            if(rec.at < 0 || rec.len < 0 ||
+               rec.at + rec.len > p_op->size_orig ||
+               rel + pos + (hoff_t)sizeof rec + rec.len > p_op->saved_len)
+            {
+                rc = RC_CRIT;
+                prerr("%s has a malformed scatter record!\n",
+                      fdname(backup_fd));
+                goto end;
+            }
+            if(pos + (hoff_t)sizeof rec + rec.len <= cnt)
+            {
+                rc = writeat(DT_FD(data_fi), rec.at,
+                             buf_mal + pos + sizeof rec, rec.len);
+                checkrc(rc);
+            }
+            else if(pos == 0)
+            {
+                rc = filecpy(backup_fd, p_op->saved_at + rel + sizeof rec,
+                             rec.len, DT_FD(data_fi), rec.at, rec.len);
+                checkrc(rc);
+            }
+            else
+            {
+                break; // reread from this record
+            }
+            pos += sizeof rec + rec.len;
+            plugin(2, NULL);
+        }
+        if(pos == 0)
+        {
+            rc = RC_CRIT;
+            prerr("%s has a malformed scatter record!\n", fdname(backup_fd));
+            goto end;
+        }
+        rel += pos;
+    }
+
+    rc = RC_OK;
+
+end:
+    free(buf_mal);
+    return rc;
+}
+
+#define CHECK_MAXTHREADS 0x10
+
+/**
+ * @struct RecordCheck
+ *
+ * @brief A backup record whose saved data checkRecords() is to check.
+ *
+ * @var RecordCheck::fd
+ * Descriptor of the backup file or journal segment holding the record.
+ * @var RecordCheck::p_op
+ * The record.
+ * @var RecordCheck::opnum
+ * Number of the operation, or UINT64_MAX for a file size adjustment.
+ * @var RecordCheck::rc
+ * RC_OK if the saved data is intact.
+ */
+typedef struct
+{
+    int fd;
+    BackupOp const *p_op;
+    uint64_t opnum;
+    rc_t rc;
+} RecordCheck;
+
+/**
+ * @brief Shared state for the workers of checkRecords().
+ */
+typedef struct
+{
+    RecordCheck *recs;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} CheckState;
+
+/**
+ * @brief Worker: claim records one at a time and check the CRC of the saved
+ *        data of each.
+ */
+static void *checkWorker(void *vp)
+{
+    CheckState *cs = vp;
+
+    for(;;)
+    {
+        RecordCheck *rec = NULL;
+        HashCtx hc;
+        uint8_t crc[OP_CRC_SZ];
+
+        pthread_mutex_lock(&cs->lock);
+        if(cs->next < cs->count)
+            rec = &cs->recs[cs->next++];
+        pthread_mutex_unlock(&cs->lock);
+        if( ! rec)
+            break;
+
+        hashInit(&hc, HASH_CRC32C);
+        rec->rc = crcRange(rec->fd, rec->p_op->saved_at, rec->p_op->stored_len,
+                           &hc);
+        crcFinal(&hc, crc);
+        if(rec->rc == RC_OK && memcmp(crc, rec->p_op->data_crc, OP_CRC_SZ))
+            rec->rc = RC_CRIT;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Add the records of a backup file that recovery would revert, those
+ *        whose backup is done or partly done, to a list for checkRecords().
+ *
+ * @param[in,out] recs List, with room for MAX_BACKUP_DEPTH + 1 more records
+ * @param[in,out] p_count Length of the list
+ * @param[in] fd Descriptor of the backup file or journal segment
+ * @param[in] p_hdr Its header, which must outlive the list
+ * @param[in] adj_only Whether to add only the record of an interrupted file
+ *            size adjustment, as that is all recovery with -finish applies
+ */
+static void addRecords(RecordCheck *recs, int *p_count, int fd,
+                       BackupHeader const *p_hdr, bool adj_only)
+{
+    for(int opix = LAST_ADJ_OPIDX; opix >= (adj_only ? LAST_ADJ_OPIDX : 0);
+        opix--)
+    {
+        uint8_t status = p_hdr->ops[opix].status;
+        if(status != OP_STATUS_BACKUP_DONE && status != OP_STATUS_BACKUP_PART)
+            continue;
+        recs[*p_count].fd = fd;
+        recs[*p_count].p_op = &p_hdr->ops[opix];
+        recs[*p_count].opnum = (opix == LAST_ADJ_OPIDX ? UINT64_MAX : OPNUM);
+        recs[*p_count].rc = RC_UNSPEC;
+        ++*p_count;
+    }
+}
+
+/**
+ * @brief Check the saved data of backup records against their CRCs, several
+ *        records at once, and report each that is corrupt. Headers are
+ *        checked as they are read (see checkOp()), so with this a recovery
+ *        can refuse a damaged backup before it writes anything.
+ *
+ * @param[in,out] recs Records to check (see addRecords())
+ * @param[in] count Number of records
+ * @return RC_OK if all are intact, else RC_CRIT
+ */
+static rc_t checkRecords(RecordCheck *recs, int count)
+{
+    rc_t rc = RC_UNSPEC;
+    CheckState cs;
+    pthread_t threads[CHECK_MAXTHREADS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthr = (int)MIN(MIN(MAX(ncpu, 1), CHECK_MAXTHREADS), count);
+    int started = 0;
+
+    traceEntry("%d", count);
+
+    memset(&cs, 0, sizeof cs);
+    cs.recs = recs;
+    cs.count = count;
+    pthread_mutex_init(&cs.lock, NULL);
+
+    for( ; started < nthr; started++)
+    {
+        if(pthread_create(&threads[started], NULL, checkWorker, &cs) != 0)
+            break;
+    }
+    if(started == 0)
+        checkWorker(&cs);
+    for(int th = 0; th < started; th++)
+        pthread_join(threads[th], NULL);
+
+    rc = RC_OK;
+    for(int ix = 0; ix < count; ix++)
+    {
+        if(recs[ix].rc == RC_OK)
+            continue;
+        rc = RC_CRIT;
+        if(recs[ix].opnum == UINT64_MAX)
+            prerr("Backup record for file size adjustment is corrupt!\n");
+        else
+            prerr("Backup record " OPFMT " is corrupt!\n", recs[ix].opnum);
+    }
+
+    pthread_mutex_destroy(&cs.lock);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Check the saved data of one backup record against its CRC (see
+ *        checkRecords()), e.g. once the user has chosen to revert it.
+ *
+ * @param[in] fd Descriptor of the backup file or journal segment
+ * @param[in] p_op The record
+ * @param[in] opnum Number of the operation, or UINT64_MAX for a file size
+ *            adjustment
+ * @return RC_OK if it is intact, else RC_CRIT
+ */
+static rc_t checkRecord(int fd, BackupOp const *p_op, uint64_t opnum)
+{
+    RecordCheck rec;
+
+    rec.fd = fd;
+    rec.p_op = p_op;
+    rec.opnum = opnum;
+    rec.rc = RC_UNSPEC;
+    return checkRecords(&rec, 1);
+}
+
+/**
+ * @brief Perform a recovery operation of a backup operation specified by
+ *        p_hdr and opix.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] ask Boolean whether to prompt before reverting operations
+ * @param[in] opix Backup operation index into p_hdr->ops[]
+ * @param[in,out] p_hdr Pointer to a BackupHeader. This function sets the status
+ *                field.
+ * @param[out] p_cnt If non-NULL, write statistics for recovery operations
+ * @return RC_OK on successful recovery, else a hexpeek error code
+ */
+static rc_t recoverOp(int data_fi, int backup_fd, bool ask, int opix,
+                      BackupHeader *p_hdr, RecoveryCounts *p_cnt)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t f_sz = HOFF_NIL, post_sz = HOFF_NIL;
+
+    traceEntry("%d, %d, %d, %p, %p", data_fi, backup_fd, opix, p_hdr, p_cnt);
+
+    BackupOp *p_op = &p_hdr->ops[opix];
+
+    switch(p_op->status)
+    {
+    case OP_STATUS_BACKUP_START:
+        console("  Backup record " OPFMT " incomplete, skipping.\n", OPNUM);
+        if(p_cnt) p_cnt->noncompl++;
+        break;
+    case OP_STATUS_BACKUP_PART:
+    case OP_STATUS_BACKUP_DONE:
+        if(p_op->size_adj < 0 && p_op->saved_len == 0)
+        {
+            rc = RC_CRIT;
+            prerr("Backup record " OPFMT " has no data!\n", OPNUM);
+            goto end;
+        }
+
+        if(ask && consoleAsk("  Revert operation " OPFMT " '%s'%s",
+                             OPNUM, p_op->origcmd, OPTRUNC(p_op->origcmd)))
+        {
+            rc = RC_DONE;
+            goto end;
+        }
+        // When asked, the record is checked only once it is to be reverted
+        if(ask)
+        {
+            rc = checkRecord(backup_fd, p_op, OPNUM);
+            checkrc(rc);
+        }
+    
+        if(IS_SCATTER(p_op))
+        {
+            f_sz = filesize(data_fi);
+            post_sz = p_op->size_orig + p_op->size_adj;
+            if(p_op->size_adj == 0 || f_sz == p_op->size_orig)
+            {
+                // No shift, or it was not made
+            }
+            else if(p_op->saved_from - MIN(0, p_op->size_adj) >=
+                    p_op->size_orig)
+            {
+                // Without a tail to move, the shift only changed the size;
+                // what a kill cut off is among the runs restored below
+                rc = hexpeek_truncate(DT_FD(data_fi), p_op->size_orig);
+                checkrc(rc);
+            }
+            else if(f_sz == post_sz)
+            {
+                rc = adjustSize(data_fi, p_op->saved_from, -p_op->size_adj,
+                                backup_fd);
+                checkrc(rc);
+            }
+            else
+            {
+                rc = RC_CRIT;
+                prerr("data file size is wrong!\n");
+                goto end;
+            }
+            rc = recoverScatter(data_fi, backup_fd, p_op);
+            checkrc(rc);
+        }
+        else
+        {
+            f_sz = filesize(data_fi);
+            post_sz = p_op->size_orig + p_op->size_adj;
+            if(f_sz == p_op->size_orig)
+            {
+                // Nothing to do, file size is same as original.
+            }
+            else if(f_sz == post_sz)
+            {
+                // Previous file size adjustment completed, so just reverse it.
+                rc = adjustSize(data_fi, p_op->saved_from, -p_op->size_adj,
+                                backup_fd);
+                checkrc(rc);
+            }
+            else if(p_op->size_adj >= 0 &&
+                    p_op->saved_from + p_op->saved_len >= p_op->size_orig &&
+                    f_sz > p_op->size_orig)
+            {
+                // An append operation did not complete, truncate it.
+                rc = hexpeek_truncate(DT_FD(data_fi), p_op->size_orig);
+                checkrc(rc);
+            }
+            else if(p_op->size_adj == 0 &&
+                    p_op->saved_from + p_op->saved_len >= p_op->size_orig)
+            {
+                // A committed batch shrank the file; everything from
+                // saved_from to the original end of file was saved, so just
+                // restore it.
+                rc = hexpeek_truncate(DT_FD(data_fi), p_op->size_orig);
+                checkrc(rc);
+            }
+            else
+            {
+                // The interruption of a file size adjustment should be
+                // handled by recoverAdjOp() - it should not be possible to
+                // reach this case.
+                rc = RC_CRIT;
+                prerr("data file size is wrong!\n");
+                goto end;
+            }
+    
+            rc = restoreSaved(backup_fd, p_op, NULL, 0, p_op->saved_len,
+                              DT_FD(data_fi), p_op->saved_from);
+            checkrc(rc);
+        }
+
+        p_op->status = OP_STATUS_RECOVERY_DONE;
+        rc = writeat(backup_fd, BKFL_RFIN_OFF(opix),
+                     BKFL_RFIN_PTR(p_op), BKFL_RFIN_LEN);
+        checkrc(rc);
+
+        sync(backup_fd);
+
+        Params.infiles[data_fi].at = p_op->last_at;
+        if(DT_OPCNT(data_fi) > 0)
+            DT_OPCNT(data_fi)--;
+
+        if(p_cnt) p_cnt->reverted++;
+        break;
+    case OP_STATUS_RECOVERY_DONE:
+        console("  Backup record " OPFMT " previously recovered, skipping.\n",
+                OPNUM);
+        if(p_cnt) p_cnt->prev++;
+        break;
+    default:
+        rc = RC_CRIT;
+        prerr("Backup record " OPFMT " has unknown status!\n", OPNUM);
+        goto end;
+    }
+
+    rc = RC_OK;
+
+end:
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Recover a file adjustment backup operation in compact form (see
+ *        makeAdjRangeBackup()). Since the fallocate() operation itself is
+ *        atomic, the data file is either left in its original state or with
+ *        the adjustment fully made. In the latter case the adjustment is
+ *        reversed afterward by recoverOp() for the command that made it.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] p_adj Pointer to a BackupOp in compact form.
+ * @return RC_OK on successful recovery, else a hexpeek error code
+ */
+static rc_t recoverAdjRange(int data_fi, int backup_fd, BackupOp const *p_adj)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t f_sz = filesize(data_fi);
+
+    traceEntry("%d, %d, %p", data_fi, backup_fd, p_adj);
+
+    if(f_sz == p_adj->size_orig)
+    {
+        // Restore partial block that may have been overwritten before a kill.
+        rc = restoreSaved(backup_fd, p_adj, NULL, 0, p_adj->saved_len,
+                          DT_FD(data_fi), p_adj->saved_from);
+        checkrc(rc);
+    }
+    else if(f_sz == p_adj->size_orig + p_adj->size_adj)
+    {
+        // After an insert the partial block before the insertion point must be
+        // moved back in front of the inserted range; redo it in case it was
+        // interrupted.
+        if(p_adj->size_adj > 0 && p_adj->saved_from > p_adj->last_at)
+        {
+            rc = lclcpy(DT_FD(data_fi), p_adj->last_at + p_adj->size_adj,
+                        p_adj->last_at, p_adj->saved_from - p_adj->last_at);
+            checkrc(rc);
+        }
+    }
+    else
+    {
+        rc = RC_CRIT;
+        prerr("data file size is wrong!\n");
+        goto end;
+    }
+
+    rc = RC_OK;
+
+end:
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Recover a file adjustment backup operation that moved the tail (see
+ *        makeShiftBackup()) by finishing the move. Then, as after a finished
+ *        move, the adjustment is reversed afterward by recoverOp() for the
+ *        command that made it, unless recovery stops there.
+ *
+ *        A move is finished from its last mark: a journalled window is written
+ *        to its destination again first (see markShiftBackup()), and the rest
+ *        of the tail is moved as by adjustSize(). The part of the window that
+ *        was not journalled is as long as the shift distance at most, and
+ *        comes first in the window moving forward and last moving backward.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] p_adj Pointer to a BackupOp in shift form.
+ * @return RC_OK on successful recovery, else a hexpeek error code
+ */
+static rc_t recoverShift(int data_fi, int backup_fd, BackupOp const *p_adj)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t f_sz = filesize(data_fi);
+    hoff_t post_sz = p_adj->size_orig + p_adj->size_adj;
+    hoff_t length = MAX(0, p_adj->size_orig - p_adj->saved_from);
+    hoff_t left = length - p_adj->last_at, moved = p_adj->last_at;
+    hoff_t win_len = MIN(SHIFT_WINDOW, left);
+    // Length of the part of the window read from the data file
+    hoff_t in_file = win_len - p_adj->saved_len;
+    hoff_t dist = (p_adj->size_adj < 0 ? -p_adj->size_adj : p_adj->size_adj);
+    // The part of the tail left to move is its start when moving forward
+    hoff_t rel = (p_adj->size_adj > 0 ? left - win_len : moved);
+
+    traceEntry("%d, %d, %p", data_fi, backup_fd, p_adj);
+
+    if(p_adj->size_adj < 0 && f_sz == post_sz)
+    {
+        // The kill was truncated, so the move had completed.
+    }
+    else if(f_sz < p_adj->size_orig ||
+            f_sz > MAX(p_adj->size_orig, post_sz) ||
+            left < 0 || left > length || (p_adj->saved_len &&
+            (in_file < 0 || in_file > dist)))
+    {
+        rc = RC_CRIT;
+        prerr("data file size is wrong!\n");
+        goto end;
+    }
+    else
+    {
+        if(p_adj->saved_len)
+        {
+            hoff_t win_at = p_adj->saved_from + rel;
+            hoff_t file_rel = (p_adj->size_adj > 0 ? 0 : p_adj->saved_len);
+            hoff_t jnl_rel = (p_adj->size_adj > 0 ? in_file : 0);
+            rc = restoreSaved(backup_fd, p_adj, NULL, 0, p_adj->saved_len,
+                              DT_FD(data_fi),
+                              win_at + jnl_rel + p_adj->size_adj);
+            checkrc(rc);
+            rc = lclcpy(DT_FD(data_fi), win_at + file_rel,
+                        win_at + file_rel + p_adj->size_adj, in_file);
+            checkrc(rc);
+            moved += win_len;
+        }
+        rc = shiftTail(data_fi, p_adj->saved_from, p_adj->size_adj,
+                       p_adj->size_orig, moved, backup_fd);
+        checkrc(rc);
+    }
+
+    rc = RC_OK;
+
+end:
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Perform a recovery operation of a file adjustment backup operation
+ *        specified in p_adj.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] ask Boolean whether to prompt before reverting operations
+ * @param[in,out] p_adj Pointer to a BackupOp.
+ * @param[out] p_cnt If non-NULL, write statistics for recovery operations
+ * @return RC_OK on successful recovery, else a hexpeek error code
+ */
+static rc_t recoverAdjOp(int data_fi, int backup_fd, bool ask, BackupOp *p_adj,
+                         RecoveryCounts *p_cnt)
+{
+    rc_t rc = RC_UNSPEC;
+
+    traceEntry("%d, %d, %p, %p", data_fi, backup_fd, p_adj, p_cnt);
+
+    if(p_adj->status == 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    if(p_cnt) p_cnt->total++;
+
+    switch(p_adj->status)
+    {
+    case OP_STATUS_BACKUP_START:
+        console("  Backup record for file size adjustment incomplete, "
+                "skipping.\n");
+        if(p_cnt) p_cnt->noncompl++;
+        break;
+    case OP_STATUS_BACKUP_DONE:
+        // Finishing the move of an insert would leave the old octets where
+        // the inserted ones go, as those are not recorded
+        if(Params.recover_finish && IS_SHIFT(p_adj) && p_adj->size_adj > 0)
+        {
+            rc = RC_CRIT;
+            prerr("an interrupted insert can not be finished; recover without"
+                  " -finish to revert it\n");
+            goto end;
+        }
+        if(ask && consoleAsk("  A file size adjustment was interrupted, %s",
+                             Params.recover_finish ? "finish" : "revert"))
+        {
+            rc = RC_DONE;
+            goto end;
+        }
+        if(ask)
+        {
+            rc = checkRecord(backup_fd, p_adj, UINT64_MAX);
+            checkrc(rc);
+        }
+        if(IS_SHIFT(p_adj))
+        {
+            rc = recoverShift(data_fi, backup_fd, p_adj);
+            checkrc(rc);
+        }
+        else if(Params.recover_finish)
+        {
+            rc = RC_CRIT;
+            prerr("file size adjustment can not be finished\n");
+            goto end;
+        }
+        else if(p_adj->size_adj)
+        {
+            rc = recoverAdjRange(data_fi, backup_fd, p_adj);
+            checkrc(rc);
+        }
+        else
+        {
+            rc = hexpeek_truncate(DT_FD(data_fi),
+                                  p_adj->saved_from + p_adj->saved_len);
+            checkrc(rc);
+            rc = restoreSaved(backup_fd, p_adj, NULL, 0, p_adj->saved_len,
+                              DT_FD(data_fi), p_adj->saved_from);
+            checkrc(rc);
+        }
+        sync(backup_fd);
+        rc = clearAdjBackup(backup_fd, p_adj);
+        checkrc(rc);
+        if(Params.recover_finish)
+        {
+            console("  File size adjustment successfully finished.\n");
+            if(p_cnt) p_cnt->finished++;
+        }
+        else
+        {
+            console("  File size adjustment successfully reverted.\n");
+            if(p_cnt) p_cnt->reverted++;
+        }
+        break;
+    case OP_STATUS_RECOVERY_DONE:
+        console("  Backup record for file size adjustment previously "
+                "recovered, skipping.\n");
+        if(p_cnt) p_cnt->prev++;
+    default:
+        rc = RC_CRIT;
+        prerr("backup record for file size adjustment has unknown status!\n");
+        goto end;
+    }
+
+    rc = RC_OK;
+
+end:
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+#define RESTORE_CHUNK      (BUFSZ * 0x100)
+#define RESTORE_MAXTHREADS 0x10
+
+// Whether recovery reverts a backup operation (rather than skipping it)
+#define IS_LIVE(p_op) ((p_op)->status == OP_STATUS_BACKUP_DONE || \
+                       (p_op)->status == OP_STATUS_BACKUP_PART)
+
+/**
+ * @struct RestoreRange
+ *
+ * @brief A data file range to be written from the saved data of one backup
+ *        operation.
+ *
+ * @var RestoreRange::p_op
+ * The backup operation.
+ * @var RestoreRange::src
+ * Offset in the saved data of the operation at which the range begins, or for
+ * a scatter operation the backup file offset.
+ * @var RestoreRange::at
+ * Data file offset of the range.
+ * @var RestoreRange::len
+ * Length of the range.
+ * @var RestoreRange::opix
+ * Operation index of the backup operation.
+ */
+typedef struct
+{
+    BackupOp const *p_op;
+    hoff_t src;
+    hoff_t at;
+    hoff_t len;
+    int opix;
+} RestoreRange;
+
+/**
+ * @struct RangeList
+ *
+ * @brief Growable list of RestoreRange structs.
+ */
+typedef struct
+{
+    RestoreRange *list_mal;
+    size_t count;
+    size_t cap;
+} RangeList;
+
+/**
+ * @struct RestorePlan
+ *
+ * @brief What revertRun() writes to revert a run of backup operations.
+ *
+ * @var RestorePlan::size
+ * Data file size after the run is reverted.
+ * @var RestorePlan::pieces
+ * Non-overlapping ranges, in order of data file offset.
+ */
+typedef struct
+{
+    hoff_t size;
+    RangeList pieces;
+} RestorePlan;
+
+/**
+ * @struct RangeEdge
+ *
+ * @brief Start or end of a RestoreRange, for the sweep in planRun().
+ */
+typedef struct
+{
+    hoff_t pos;
+    bool end;
+    size_t idx;
+} RangeEdge;
+
+/**
+ * @brief Shared state for the workers of runPlan().
+ */
+typedef struct
+{
+    int data_fd;
+    int backup_fd;
+    RangeList const *pieces;
+    ChunkIndex const *index; // by operation index (see indexSaved())
+    size_t next;     // next piece to claim from
+    hoff_t off;      // offset in that piece of the next chunk
+    hoff_t claimed;  // octets claimed so far, for progress
+    hoff_t total;    // octets in all pieces
+    rc_t rc;
+    pthread_mutex_t lock;
+} RestoreState;
+
+/**
+ * @brief Append a range to a list, extending the last range instead if the new
+ *        one continues it in both the data file and the saved data.
+ */
+static void pushRange(RangeList *rl, BackupOp const *p_op, int opix,
+                      hoff_t src, hoff_t at, hoff_t len)
+{
+    RestoreRange *last = (rl->count ? &rl->list_mal[rl->count - 1] : NULL);
+
+    if(len <= 0)
+        return;
+    if(last && last->p_op == p_op && last->at + last->len == at &&
+       last->src + last->len == src)
+    {
+        last->len += len;
+        return;
+    }
+    if(rl->count == rl->cap)
+    {
+        size_t ncap = MAX(2 * rl->cap, 0x40);
+        RestoreRange *grown = Malloc(ncap * sizeof *grown);
+        if(rl->count)
+            memcpy(grown, rl->list_mal, rl->count * sizeof *grown);
+        free(rl->list_mal);
+        rl->list_mal = grown;
+        rl->cap = ncap;
+    }
+    last = &rl->list_mal[rl->count++];
+    last->p_op = p_op;
+    last->opix = opix;
+    last->src = src;
+    last->at = at;
+    last->len = len;
+}
+
+/**
+ * @brief Add the data file ranges that reverting a backup operation writes to
+ *        a list: the saved range, or for a scatter operation each saved run.
  *
- * @param[in] data_fi Infile file index.
- * @param[in] backup_fd Backup file descriptor.
- * @param[in] sv_from File offset from which to save data.
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] p_op Pointer to the BackupOp
+ * @param[in] opix Its operation index
+ * @param[in,out] rl List to which to add
  * @return RC_OK on success, else a hexpeek error code
  */
-rc_t makeAdjBackup(int data_fi, int backup_fd, hoff_t sv_from)
+static rc_t opRanges(int backup_fd, BackupOp const *p_op, int opix,
+                     RangeList *rl)
 {
     rc_t rc = RC_UNSPEC;
-    hoff_t sv_at = -1;
-    BackupHeader header;
-    BackupOp *p_op = &header.ops[LAST_ADJ_OPIDX];
 
-    if(backup_fd < 0)
+    if( ! IS_SCATTER(p_op))
     {
+        pushRange(rl, p_op, opix, 0, p_op->saved_from, p_op->saved_len);
         rc = RC_OK;
         goto end;
     }
 
-    traceEntry("%d, %d, " TRC_hoff, data_fi, backup_fd, trchoff(sv_from));
+    for(hoff_t rel = 0; rel < p_op->saved_len; )
+    {
+        ScatterRec rec;
+        if(rel + (hoff_t)sizeof rec > p_op->saved_len)
+        {
+            rc = RC_CRIT;
+            prerr("%s has a malformed scatter record!\n", fdname(backup_fd));
+            goto end;
+        }
+        rc = readat(backup_fd, p_op->saved_at + rel, &rec, sizeof rec);
+        checkrc(rc);
+        if(rec.at < 0 || rec.len < 0 ||
+           rec.at + rec.len > p_op->size_orig ||
+           rel + (hoff_t)sizeof rec + rec.len > p_op->saved_len)
+        {
+            rc = RC_CRIT;
+            prerr("%s has a malformed scatter record!\n", fdname(backup_fd));
+            goto end;
+        }
+        pushRange(rl, p_op, opix, p_op->saved_at + rel + sizeof rec, rec.at,
+                  rec.len);
+        rel += sizeof rec + rec.len;
+    }
 
-    rc = getHeader(backup_fd, &header, &sv_at);
-    checkrc(rc);
+    rc = RC_OK;
 
-    memset(p_op, 0, sizeof *p_op);
-    memcpy(p_op->magic, OPINFO_MAGIC_DATA, OPINFO_MAGIC_SZ);
-    p_op->status     = OP_STATUS_BACKUP_START;
-    p_op->saved_from = sv_from;
-    p_op->saved_at   = sv_at;
-    p_op->saved_len  = MAX(0, filesize(data_fi) - sv_from);
+end:
+    return rc;
+}
 
-    rc = writeOp(data_fi, backup_fd, LAST_ADJ_OPIDX, p_op);
-    checkrc(rc);
+/**
+ * @brief qsort() comparator ordering range edges by offset, ends before
+ *        starts.
+ */
+static int compareEdge(void const *a, void const *b)
+{
+    RangeEdge const *ea = a, *eb = b;
+    if(ea->pos != eb->pos)
+        return ea->pos < eb->pos ? -1 : 1;
+    return (int)eb->end - (int)ea->end;
+}
+
+/**
+ * @brief Plan the revert of a run of backup operations, none of which
+ *        adjusts the file size by moving data (see recoverRange()). Reverted
+ *        one at a time, newest first, each operation writes back its saved
+ *        data and the octets of the oldest one that saved an offset are what
+ *        remain there; so the plan writes each offset once, from the oldest
+ *        operation that saved it, and sets the file size once, to the size
+ *        before the oldest operation.
+ *
+ *        The size the file had between operations is checked as recoverOp()
+ *        would check it. Since the plan only writes saved data, a planned
+ *        revert that was interrupted is simply done again; the file is then
+ *        already at the size it is reverted to.
+ *
+ * @param[in] backup_fd Backup file file descriptor
+ * @param[in] p_hdr Pointer to the BackupHeader
+ * @param[in] top Operation index of the newest operation of the run
+ * @param[in] bot Operation index of the oldest operation of the run
+ * @param[in] f_sz Current data file size
+ * @param[out] plan The plan, whose pieces the caller must free
+ * @return RC_OK on success, RC_NIL if the run must be reverted one operation
+ *         at a time, else a hexpeek error code
+ */
+static rc_t planRun(int backup_fd, BackupHeader const *p_hdr, int top, int bot,
+                    hoff_t f_sz, RestorePlan *plan)
+{
+    rc_t rc = RC_UNSPEC;
+    RangeList ranges;
+    RangeEdge *edges_mal = NULL;
+    size_t nedge = 0;
+    int active[MAX_BACKUP_DEPTH];
+    size_t cur_rng[MAX_BACKUP_DEPTH];
+    hoff_t cur = f_sz;
+    bool newest = true;
+
+    memset(&ranges, 0, sizeof ranges);
+    memset(active, 0, sizeof active);
+    memset(cur_rng, 0, sizeof cur_rng);
+    memset(plan, 0, sizeof *plan);
+    plan->size = f_sz;
+
+    for(int opix = bot; opix <= top; opix++)
+    {
+        if(IS_LIVE(&p_hdr->ops[opix]))
+        {
+            plan->size = p_hdr->ops[opix].size_orig;
+            break;
+        }
+    }
+
+    for(int opix = top; opix >= bot; opix--)
+    {
+        BackupOp const *p_op = &p_hdr->ops[opix];
+        if( ! IS_LIVE(p_op))
+            continue;
+        if(cur != p_op->size_orig &&
+           ! (IS_SCATTER(p_op) && cur > p_op->size_orig) &&
+           ! ( ! IS_SCATTER(p_op) &&
+               p_op->saved_from + p_op->saved_len >= p_op->size_orig) &&
+           ! (newest && f_sz == plan->size))
+        {
+            rc = RC_NIL;
+            goto end;
+        }
+        newest = false;
+        cur = p_op->size_orig;
+        rc = opRanges(backup_fd, p_op, opix, &ranges);
+        checkrc(rc);
+    }
+
+    edges_mal = Malloc(MAX(2 * ranges.count, 1) * sizeof *edges_mal);
+    for(size_t ix = 0; ix < ranges.count; ix++)
+    {
+        edges_mal[nedge].pos = ranges.list_mal[ix].at;
+        edges_mal[nedge].end = false;
+        edges_mal[nedge++].idx = ix;
+        edges_mal[nedge].pos = ranges.list_mal[ix].at + ranges.list_mal[ix].len;
+        edges_mal[nedge].end = true;
+        edges_mal[nedge++].idx = ix;
+    }
+    qsort(edges_mal, nedge, sizeof *edges_mal, compareEdge);
+
+    // Sweep the edges keeping count of the ranges of each operation that
+    // cover the current offset; the oldest operation covering it wins.
+    for(size_t ex = 0; ex < nedge; )
+    {
+        hoff_t pos = edges_mal[ex].pos;
+        int win = -1;
+
+        for( ; ex < nedge && edges_mal[ex].pos == pos; ex++)
+        {
+            RestoreRange const *rr = &ranges.list_mal[edges_mal[ex].idx];
+            if(edges_mal[ex].end)
+            {
+                active[rr->opix]--;
+            }
+            else if(active[rr->opix]++)
+            {
+                // Overlapping runs of one scatter operation
+                rc = RC_NIL;
+                goto end;
+            }
+            else
+            {
+                cur_rng[rr->opix] = edges_mal[ex].idx;
+            }
+        }
+        if(ex == nedge || pos >= plan->size)
+            break;
+
+        for(int opix = bot; opix <= top && win < 0; opix++)
+            if(active[opix])
+                win = opix;
+        if(win >= 0)
+        {
+            RestoreRange const *rr = &ranges.list_mal[cur_rng[win]];
+            hoff_t next = MIN(edges_mal[ex].pos, plan->size);
+            pushRange(&plan->pieces, rr->p_op, rr->opix,
+                      rr->src + (pos - rr->at), pos, next - pos);
+        }
+    }
 
     rc = RC_OK;
 
 end:
     if(rc)
-        prerr("backup failed\n");
-    traceExit(TRC_rc, rc);
+    {
+        free(plan->pieces.list_mal);
+        memset(&plan->pieces, 0, sizeof plan->pieces);
+    }
+    free(ranges.list_mal);
+    free(edges_mal);
     return rc;
 }
 
 /**
- * @brief Clear backup op data for a file adjustment operation (insert / kill).
+ * @brief Worker: claim chunks of the pieces of a plan one at a time and write
+ *        each from the backup file. The calling thread of runPlan() works too,
+ *        and is the one whose progress shows.
+ */
+static void *restoreWorker(void *vp)
+{
+    RestoreState *rs = vp;
+
+    for(;;)
+    {
+        RestoreRange const *rr = NULL;
+        hoff_t rel = 0, cnt = 0;
+        rc_t rc = RC_UNSPEC;
+
+        pthread_mutex_lock(&rs->lock);
+        if(rs->rc == RC_OK && rs->next < rs->pieces->count)
+        {
+            rr = &rs->pieces->list_mal[rs->next];
+            rel = rs->off;
+            cnt = MIN(RESTORE_CHUNK, rr->len - rel);
+            rs->off += cnt;
+            if(rs->off == rr->len)
+            {
+                rs->next++;
+                rs->off = 0;
+            }
+            progress(rs->claimed, rs->total, 1);
+            rs->claimed += cnt;
+        }
+        pthread_mutex_unlock(&rs->lock);
+        if( ! rr)
+            break;
+
+        if(IS_SCATTER(rr->p_op))
+            rc = filecpy(rs->backup_fd, rr->src + rel, cnt, rs->data_fd,
+                         rr->at + rel, cnt);
+        else
+            rc = restoreSaved(rs->backup_fd, rr->p_op, &rs->index[rr->opix],
+                              rr->src + rel, cnt, rs->data_fd, rr->at + rel);
+        if(rc)
+        {
+            pthread_mutex_lock(&rs->lock);
+            if(rs->rc == RC_OK)
+                rs->rc = rc;
+            pthread_mutex_unlock(&rs->lock);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Carry out a plan made by planRun(): set the file size, then write
+ *        the pieces using several threads, the calling thread among them. The
+ *        pieces do not overlap, so their chunks can be written in any order.
+ *        The chunk headers of each operation's saved data are walked once,
+ *        up front, rather than for every chunk written.
  *
+ * @param[in] data_fi Infile file index
  * @param[in] backup_fd Backup file file descriptor
- * @param[in,out] vp Pointer to a BackupOp structure, ultimately zeroed
+ * @param[in] plan The plan
  * @return RC_OK on success, else a hexpeek error code
  */
-rc_t clearAdjBackup(int backup_fd, void *vp)
+static rc_t runPlan(int data_fi, int backup_fd, RestorePlan const *plan)
 {
     rc_t rc = RC_UNSPEC;
-    hoff_t sv_at = HOFF_NIL;
-    BackupHeader storage;
-    BackupOp *p_adj = (BackupOp*)vp;
+    RestoreState rs;
+    ChunkIndex index[MAX_BACKUP_DEPTH];
+    bool indexed[MAX_BACKUP_DEPTH];
+    pthread_t threads[RESTORE_MAXTHREADS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthr = (int)MIN(MAX(ncpu, 1), RESTORE_MAXTHREADS), started = 0;
+    hoff_t chunks = 0;
 
-    if(backup_fd < 0)
-    {
-        rc = RC_OK;
-        goto end;
-    }
+    traceEntry("%d, %d, %zu", data_fi, backup_fd, plan->pieces.count);
 
-    traceEntry("%d, %p", backup_fd, p_adj);
+    memset(&rs, 0, sizeof rs);
+    memset(index, 0, sizeof index);
+    memset(indexed, 0, sizeof indexed);
 
-    if( ! p_adj)
+    if(filesize(data_fi) != plan->size)
     {
-        rc = readHeader(backup_fd, &storage);
+        rc = hexpeek_truncate(DT_FD(data_fi), plan->size);
         checkrc(rc);
-        p_adj = &storage.ops[LAST_ADJ_OPIDX];
     }
 
-    if(p_adj->status && p_adj->saved_len)
-        sv_at = p_adj->saved_at;
+    for(size_t ix = 0; ix < plan->pieces.count; ix++)
+    {
+        RestoreRange const *rr = &plan->pieces.list_mal[ix];
+        chunks += (rr->len + RESTORE_CHUNK - 1) / RESTORE_CHUNK;
+        rs.total += rr->len;
+        if( ! IS_SCATTER(rr->p_op) && ! indexed[rr->opix])
+        {
+            rc = indexSaved(backup_fd, rr->p_op, &index[rr->opix]);
+            checkrc(rc);
+            indexed[rr->opix] = true;
+        }
+    }
 
-    memset(p_adj, 0, sizeof *p_adj);
-    rc = writeat(backup_fd, BKFL_OPINFO_OFF(LAST_ADJ_OPIDX),
-                 p_adj, sizeof *p_adj);
-    checkrc(rc);
+    rs.data_fd = DT_FD(data_fi);
+    rs.backup_fd = backup_fd;
+    rs.pieces = &plan->pieces;
+    rs.index = index;
+    rs.rc = RC_OK;
+    pthread_mutex_init(&rs.lock, NULL);
 
-    if(sv_at != HOFF_NIL)
+    for( ; started < MIN(nthr, chunks) - 1; started++)
     {
-        rc = hexpeek_truncate(backup_fd, sv_at);
-        checkrc(rc);
+        if(pthread_create(&threads[started], NULL, restoreWorker, &rs) != 0)
+            break;
     }
+    restoreWorker(&rs);
+    for(int th = 0; th < started; th++)
+        pthread_join(threads[th], NULL);
+    progress(-1, rs.total, 1);
 
-    sync(backup_fd);
-
-    rc = RC_OK;
+    pthread_mutex_destroy(&rs.lock);
+    rc = rs.rc;
 
 end:
+    for(int opix = 0; opix < MAX_BACKUP_DEPTH; opix++)
+        free(index[opix].list_mal);
     traceExit(TRC_rc, rc);
     return rc;
 }
 
 /**
- * @struct RecoveryCounts
- *
- * @brief Store counters for recovery operations.
+ * @brief Print a plan made by planRun() for a dry run.
  *
- * @var RecoveryCounts::total
- * Count of recovery operations attempted in total.
- * @var RecoveryCounts::prev
- * Count of recovery operations that were already recovered on a previous run.
- * @var RecoveryCounts::reverted
- * Count of recovery operations that were successfully reverted.
- * @var RecoveryCounts::noncompl
- * Count of recovery operations skipped due to backup operation not completing.
- * @var RecoveryCounts::failed
- * Count of recovery recovery operations that were attempted but failed.
+ * @param[in] p_hdr Pointer to the BackupHeader the plan was made from
+ * @param[in] plan The plan
+ * @param[in] f_sz Data file size before the plan is carried out
  */
-typedef struct
+static void printPlan(BackupHeader const *p_hdr, RestorePlan const *plan,
+                      hoff_t f_sz)
 {
-    int total;
-    int prev;
-    int reverted;
-    int noncompl;
-    int failed;
-} RecoveryCounts;
-
-#define OPFMT      "#x%" PRIX64
-#define OPNUM      ((p_hdr)->firstop + (opix))
-#define OPTRUNC(s) ( ( (s)[sizeof (s) - 3] == '\0' && \
-                       (s)[sizeof (s) - 2] == OP_CMD_TRUNCATED ) ? \
-                     " (truncated)" : "")
+    if(plan->size != f_sz)
+        console("    Set file size to #x%" PRIX64 "\n", (uint64_t)plan->size);
+    for(size_t ix = 0; ix < plan->pieces.count; ix++)
+    {
+        RestoreRange const *rr = &plan->pieces.list_mal[ix];
+        int opix = rr->opix;
+        console("    Restore #x%" PRIX64 " (#x%" PRIX64 " octets) from "
+                "operation " OPFMT "\n", (uint64_t)rr->at, (uint64_t)rr->len,
+                OPNUM);
+    }
+}
 
 /**
- * @brief Perform a recovery operation of a backup operation specified by
- *        p_hdr and opix.
+ * @brief Revert a run of backup operations by a plan made by planRun(), or
+ *        one at a time with recoverOp() if the run can not be planned. The
+ *        data file is synced once after the plan is carried out, before the
+ *        operations are all marked recovered.
  *
  * @param[in] data_fi Infile file index
  * @param[in] backup_fd Backup file file descriptor
- * @param[in] ask Boolean whether to prompt before reverting operations
- * @param[in] opix Backup operation index into p_hdr->ops[]
  * @param[in,out] p_hdr Pointer to a BackupHeader. This function sets the status
- *                field.
+ *                fields.
+ * @param[in] top Operation index of the newest operation of the run
+ * @param[in] bot Operation index of the oldest operation of the run
  * @param[out] p_cnt If non-NULL, write statistics for recovery operations
+ * @param[in,out] p_dry If non-NULL, only print what would be done, starting
+ *                from the data file size *p_dry and updating it
  * @return RC_OK on successful recovery, else a hexpeek error code
  */
-static rc_t recoverOp(int data_fi, int backup_fd, bool ask, int opix,
-                      BackupHeader *p_hdr, RecoveryCounts *p_cnt)
+static rc_t revertRun(int data_fi, int backup_fd, BackupHeader *p_hdr, int top,
+                      int bot, RecoveryCounts *p_cnt, hoff_t *p_dry)
 {
     rc_t rc = RC_UNSPEC;
-    hoff_t f_sz = HOFF_NIL, post_sz = HOFF_NIL;
+    RestorePlan plan;
+    hoff_t f_sz = (p_dry ? *p_dry : filesize(data_fi));
+    int live = 0;
 
-    traceEntry("%d, %d, %d, %p, %p", data_fi, backup_fd, opix, p_hdr, p_cnt);
+    traceEntry("%d, %d, %p, %d, %d", data_fi, backup_fd, p_hdr, top, bot);
 
-    BackupOp *p_op = &p_hdr->ops[opix];
+    memset(&plan, 0, sizeof plan);
 
-    switch(p_op->status)
+    rc = planRun(backup_fd, p_hdr, top, bot, f_sz, &plan);
+    if(rc == RC_NIL && p_dry)
     {
-    case OP_STATUS_BACKUP_START:
-        console("  Backup record " OPFMT " incomplete, skipping.\n", OPNUM);
-        if(p_cnt) p_cnt->noncompl++;
-        break;
-    case OP_STATUS_BACKUP_DONE:
-        if(p_op->size_adj < 0 && p_op->saved_len == 0)
-        {
-            rc = RC_CRIT;
-            prerr("Backup record " OPFMT " has no data!\n", OPNUM);
-            goto end;
-        }
-
-        if(ask && consoleAsk("  Revert operation " OPFMT " '%s'%s",
-                             OPNUM, p_op->origcmd, OPTRUNC(p_op->origcmd)))
-        {
-            rc = RC_DONE;
-            goto end;
-        }
-    
-        f_sz = filesize(data_fi);
-        post_sz = p_op->size_orig + p_op->size_adj;
-        if(f_sz == p_op->size_orig)
-        {
-            // Nothing to do, file size is same as original.
-        }
-        else if(f_sz == post_sz)
+        for(int opix = top; opix >= bot; opix--)
         {
-            // Previous file size adjustment completed, so just reverse it.
-            rc = adjustSize(data_fi, p_op->saved_from, -p_op->size_adj,
-                            backup_fd);
-            checkrc(rc);
+            BackupOp const *p_op = &p_hdr->ops[opix];
+            if( ! IS_LIVE(p_op))
+                continue;
+            console("  Revert operation " OPFMT " '%s'%s (by itself)\n",
+                    OPNUM, p_op->origcmd, OPTRUNC(p_op->origcmd));
+            *p_dry = p_op->size_orig;
         }
-        else if(p_op->size_adj >= 0 &&
-                p_op->saved_from + p_op->saved_len >= p_op->size_orig &&
-                f_sz > p_op->size_orig)
+        rc = RC_OK;
+        goto end;
+    }
+    else if(rc == RC_NIL)
+    {
+        for(int opix = top; opix >= bot; opix--)
         {
-            // An append operation did not complete, truncate it.
-            rc = hexpeek_truncate(DT_FD(data_fi), p_op->size_orig);
+            rc = recoverOp(data_fi, backup_fd, false, opix, p_hdr, p_cnt);
             checkrc(rc);
         }
-        else
+        goto end;
+    }
+    checkrc(rc);
+
+    // Records that are skipped are only reported
+    for(int opix = top; opix >= bot; opix--)
+    {
+        if(IS_LIVE(&p_hdr->ops[opix]))
         {
-            // The interruption of a file size adjustment should be handled by
-            // recoverAdjOp() - it should not be possible to reach this case.
-            rc = RC_CRIT;
-            prerr("data file size is wrong!\n");
-            goto end;
+            live++;
+            continue;
         }
-    
-        rc = filecpy(backup_fd,      p_op->saved_at,   p_op->saved_len,
-                     DT_FD(data_fi), p_op->saved_from, p_op->saved_len);
+        rc = recoverOp(data_fi, backup_fd, false, opix, p_hdr, p_cnt);
         checkrc(rc);
+    }
+    if(live == 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
 
-        p_op->status = OP_STATUS_RECOVERY_DONE;
-        rc = writeat(backup_fd, BKFL_RFIN_OFF(opix),
-                     BKFL_RFIN_PTR(p_op), BKFL_RFIN_LEN);
-        checkrc(rc);
+    if(p_dry)
+    {
+        for(int opix = top; opix >= bot; opix--)
+        {
+            BackupOp const *p_op = &p_hdr->ops[opix];
+            if(IS_LIVE(p_op))
+                console("  Revert operation " OPFMT " '%s'%s\n", OPNUM,
+                        p_op->origcmd, OPTRUNC(p_op->origcmd));
+        }
+        printPlan(p_hdr, &plan, f_sz);
+        *p_dry = plan.size;
+        rc = RC_OK;
+        goto end;
+    }
 
-        sync(backup_fd);
+    rc = runPlan(data_fi, backup_fd, &plan);
+    checkrc(rc);
+    rc = hexpeek_datasync(DT_FD(data_fi));
+    checkrc(rc);
 
+    for(int opix = top; opix >= bot; opix--)
+    {
+        BackupOp *p_op = &p_hdr->ops[opix];
+        if( ! IS_LIVE(p_op))
+            continue;
+        p_op->status = OP_STATUS_RECOVERY_DONE;
         Params.infiles[data_fi].at = p_op->last_at;
         if(DT_OPCNT(data_fi) > 0)
             DT_OPCNT(data_fi)--;
-
         if(p_cnt) p_cnt->reverted++;
-        break;
-    case OP_STATUS_RECOVERY_DONE:
-        console("  Backup record " OPFMT " previously recovered, skipping.\n",
-                OPNUM);
-        if(p_cnt) p_cnt->prev++;
-        break;
-    default:
-        rc = RC_CRIT;
-        prerr("Backup record " OPFMT " has unknown status!\n", OPNUM);
-        goto end;
     }
 
+    // The operations of the run are adjacent in the header, so their status
+    // octets go in one write along with the unchanged octets between them
+    rc = writeat(backup_fd, BKFL_RFIN_OFF(bot), BKFL_RFIN_PTR(&p_hdr->ops[bot]),
+                 BKFL_RFIN_OFF(top) - BKFL_RFIN_OFF(bot) + BKFL_RFIN_LEN);
+    checkrc(rc);
+
+    sync(backup_fd);
+
     rc = RC_OK;
 
 end:
+    free(plan.pieces.list_mal);
     traceExit(TRC_rc, rc);
     return rc;
 }
 
 /**
- * @brief Perform a recovery operation of a file adjustment backup operation
- *        specified in p_adj.
+ * @brief Revert the backup operations of a backup file from operation index hi
+ *        down to lo. Operations that adjust the file size by moving data
+ *        change the offsets of the data after them, so they are reverted one
+ *        at a time with recoverOp(); the runs of operations between them are
+ *        each reverted by revertRun().
  *
  * @param[in] data_fi Infile file index
  * @param[in] backup_fd Backup file file descriptor
- * @param[in] ask Boolean whether to prompt before reverting operations
- * @param[in,out] p_adj Pointer to a BackupOp.
+ * @param[in,out] p_hdr Pointer to a BackupHeader
+ * @param[in] hi Operation index of the newest operation to revert
+ * @param[in] lo Operation index of the oldest operation to revert
  * @param[out] p_cnt If non-NULL, write statistics for recovery operations
+ * @param[in,out] p_dry As for revertRun()
  * @return RC_OK on successful recovery, else a hexpeek error code
  */
-static rc_t recoverAdjOp(int data_fi, int backup_fd, bool ask, BackupOp *p_adj,
-                         RecoveryCounts *p_cnt)
+static rc_t recoverRange(int data_fi, int backup_fd, BackupHeader *p_hdr,
+                         int hi, int lo, RecoveryCounts *p_cnt, hoff_t *p_dry)
 {
     rc_t rc = RC_UNSPEC;
 
-    traceEntry("%d, %d, %p, %p", data_fi, backup_fd, p_adj, p_cnt);
-
-    if(p_adj->status == 0)
-    {
-        rc = RC_OK;
-        goto end;
-    }
-
-    if(p_cnt) p_cnt->total++;
-
-    switch(p_adj->status)
+    for(int top = hi, bot = hi; top >= lo; top = bot - 1)
     {
-    case OP_STATUS_BACKUP_START:
-        console("  Backup record for file size adjustment incomplete, "
-                "skipping.\n");
-        if(p_cnt) p_cnt->noncompl++;
-        break;
-    case OP_STATUS_BACKUP_DONE:
-        if(ask &&
-           consoleAsk("  A file size adjustment was interrupted, revert"))
+        int opix = top;
+        BackupOp const *p_op = &p_hdr->ops[opix];
+        if(IS_LIVE(p_op) && p_op->size_adj)
         {
-            rc = RC_DONE;
-            goto end;
+            bot = top;
+            if(p_dry)
+            {
+                console("  Revert operation " OPFMT " '%s'%s\n", OPNUM,
+                        p_op->origcmd, OPTRUNC(p_op->origcmd));
+                *p_dry = p_op->size_orig;
+            }
+            else
+            {
+                rc = recoverOp(data_fi, backup_fd, false, opix, p_hdr, p_cnt);
+                checkrc(rc);
+            }
+            continue;
         }
-        rc = hexpeek_truncate(DT_FD(data_fi),
-                              p_adj->saved_from + p_adj->saved_len);
-        checkrc(rc);
-        rc = filecpy(backup_fd,      p_adj->saved_at,   p_adj->saved_len,
-                     DT_FD(data_fi), p_adj->saved_from, p_adj->saved_len);
-        checkrc(rc);
-        sync(backup_fd);
-        rc = clearAdjBackup(backup_fd, p_adj);
+        for(bot = top; bot > lo; bot--)
+        {
+            p_op = &p_hdr->ops[bot - 1];
+            if(IS_LIVE(p_op) && p_op->size_adj)
+                break;
+        }
+        rc = revertRun(data_fi, backup_fd, p_hdr, top, bot, p_cnt, p_dry);
         checkrc(rc);
-        console("  File size adjustment successfully reverted.\n");
-        if(p_cnt) p_cnt->reverted++;
-        break;
-    case OP_STATUS_RECOVERY_DONE:
-        console("  Backup record for file size adjustment previously "
-                "recovered, skipping.\n");
-        if(p_cnt) p_cnt->prev++;
-    default:
-        rc = RC_CRIT;
-        prerr("backup record for file size adjustment has unknown status!\n");
-        goto end;
     }
 
     rc = RC_OK;
 
 end:
-    traceExit(TRC_rc, rc);
     return rc;
 }
 
@@ -785,27 +3420,63 @@ end:
  * @param[in,out] p_hdr Pointer to a BackupHeader
  * @param[out] uncompleted If there are any recovery operations that could not
  *             complete, set this to true
+ * @param[in,out] p_dry If non-NULL, only print the recovery plan (see
+ *                revertRun())
  * @return RC_OK on successful recovery, else a hexpeek error code
  */
 static rc_t recoverBackupFile(int data_fi,
                               int backup_fd,
                               BackupHeader *p_hdr,
-                              bool *uncompleted)
+                              bool *uncompleted,
+                              hoff_t *p_dry)
 {
     rc_t rc = RC_UNSPEC;
     int max_op = 0;
     RecoveryCounts counts;
+    BackupOp const *p_adj = &p_hdr->ops[LAST_ADJ_OPIDX];
 
     memset(&counts, 0, sizeof counts);
 
-    console("\nRecovery from %s starting.\n", fdname(backup_fd));
+    if(p_dry)
+        console("\nRecovery plan for %s:\n", fdname(backup_fd));
+    else
+        console("\nRecovery from %s starting.\n", fdname(backup_fd));
 
     max_op = mostRecentOp(p_hdr);
     counts.total += max_op;
 
-    rc = recoverAdjOp(data_fi, backup_fd, ! Params.recover_auto,
-                      p_hdr->ops + LAST_ADJ_OPIDX, &counts);
-    checkrc(rc);
+    if(p_dry && p_adj->status == OP_STATUS_BACKUP_DONE)
+    {
+        console("  Revert interrupted file size adjustment\n");
+        if(IS_SHIFT(p_adj))
+            *p_dry = p_adj->size_orig + p_adj->size_adj;
+        else if( ! p_adj->size_adj)
+            *p_dry = p_adj->saved_from + p_adj->saved_len;
+    }
+    else
+    {
+        rc = recoverAdjOp(data_fi, backup_fd, ! Params.recover_auto,
+                          p_hdr->ops + LAST_ADJ_OPIDX, &counts);
+        checkrc(rc);
+    }
+
+    if(Params.recover_finish)
+    {
+        // Keep the operations for a later recovery to revert
+        rc = hexpeek_sync(DT_FD(data_fi));
+        checkrc(rc);
+        rc = RC_DONE;
+        goto end;
+    }
+
+    // Without prompting, the operations are reverted by plan
+    if(p_dry || Params.recover_auto)
+    {
+        rc = recoverRange(data_fi, backup_fd, p_hdr, max_op, 0, &counts, p_dry);
+        checkrc(rc);
+        rc = RC_OK;
+        goto end;
+    }
 
     // Note that this code will process, without error, a backup file that
     // contains non-complete backup records between complete backup records
@@ -813,16 +3484,22 @@ static rc_t recoverBackupFile(int data_fi,
     // program. Consider adding a pre-check that such a gap does not exist.
     for(int cur_op = max_op; cur_op >= 0; cur_op--)
     {
-        rc = recoverOp(data_fi, backup_fd, ! Params.recover_auto, cur_op, p_hdr,
-                       &counts);
+        rc = recoverOp(data_fi, backup_fd, true, cur_op, p_hdr, &counts);
         checkrc(rc);
     }
 
     rc = RC_OK;
 
 end:
+    if(p_dry)
+        return rc;
     console("\n");
-    if(rc == RC_DONE)
+    if(rc == RC_DONE && Params.recover_finish)
+    {
+        console("Recovery from %s kept the operations recorded in it:\n",
+                fdname(backup_fd));
+    }
+    else if(rc == RC_DONE)
     {
         console("Recovery from %s was terminated by user:\n",fdname(backup_fd));
     }
@@ -840,11 +3517,17 @@ end:
         console("No recovery from %s was attempted:\n", fdname(backup_fd));
     }
     int nonproc = counts.total + 1 - counts.prev - counts.reverted
-                                   - counts.noncompl - counts.failed;
+                                   - counts.finished - counts.noncompl
+                                   - counts.failed;
     console("  x%X backup record%s previously recovered\n",
             plrztn(counts.prev));
     console("  x%X backup record%s successfully reverted\n",
             plrztn(counts.reverted));
+    if(Params.recover_finish)
+    {
+        console("  x%X backup record%s successfully finished\n",
+                plrztn(counts.finished));
+    }
     console("  x%X backup record%s skipped due to incompletion\n",
             plrztn(counts.noncompl));
     console("  x%X backup record%s failed recovery attempt\n",
@@ -864,29 +3547,258 @@ end:
     return rc;
 }
 
+/**
+ * @brief Process one backup file for recoverBackup(): with what INT_MAX, as
+ *        recoverBackupFile(); otherwise list or revert, newest first, its
+ *        operations not yet recovered, counting them in *p_counter.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] backup_fd Descriptor of the backup file or journal segment
+ * @param[in,out] p_hdr Header of the backup file
+ * @param[in] what As for recoverBackup()
+ * @param[in,out] p_counter Count of operations listed or reverted so far
+ * @param[out] uncompleted Set to true if not all operations were recovered
+ * @param[in,out] p_dry As for recoverBackupFile()
+ * @return RC_OK on success, RC_DONE if the user terminated recovery or what
+ *         operations have been reverted, else a hexpeek error code
+ */
+static rc_t recoverFile(int data_fi, int backup_fd, BackupHeader *p_hdr,
+                        int what, int *p_counter, bool *uncompleted,
+                        hoff_t *p_dry)
+{
+    rc_t rc = RC_UNSPEC;
+    int hi = -1, lo = -1;
+    bool limit = false;
+
+    if(what == INT_MAX)
+    {
+        rc = recoverBackupFile(data_fi, backup_fd, p_hdr, uncompleted, p_dry);
+        goto end;
+    }
+
+    for(int opix = mostRecentOp(p_hdr); opix >= 0; opix--)
+    {
+        if(p_hdr->ops[opix].status == OP_STATUS_RECOVERY_DONE)
+            continue;
+        if(what != -1 && *p_counter >= what)
+        {
+            limit = true;
+            break;
+        }
+        ++*p_counter; // 1 based index
+        if(what == -1)
+        {
+            console("%X, operation " OPFMT ", command '%s'%s\n",
+                    *p_counter, OPNUM, p_hdr->ops[opix].origcmd,
+                    OPTRUNC(p_hdr->ops[opix].origcmd));
+        }
+        else
+        {
+            if(hi < 0)
+                hi = opix;
+            lo = opix;
+        }
+    }
+
+    if(hi >= 0)
+    {
+        rc = recoverRange(data_fi, backup_fd, p_hdr, hi, lo, NULL, NULL);
+        checkrc(rc);
+    }
+
+    rc = (limit ? RC_DONE : RC_OK);
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Check that a backup file was made for the data file being recovered,
+ *        by the device and inode numbers recorded in its header. With
+ *        -backupdir, where the names of backup files are all that ties them to
+ *        their data files, this guards against one left behind by a file since
+ *        replaced at the same path. In interactive recovery the user may go on
+ *        regardless, e.g. after copying a file together with its backup files.
+ *        Device numbers need not survive a reboot or remount, so if only the
+ *        device differs this just warns, asking in interactive recovery.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] p_hdr Header of the backup file
+ * @param[in] name Name of the backup file
+ * @return RC_OK if it matches or the user chose to go on, else RC_CRIT
+ */
+static rc_t checkIdentity(int data_fi, BackupHeader const *p_hdr,
+                          char const *name)
+{
+    rc_t rc = RC_UNSPEC;
+    struct stat info;
+
+    if(p_hdr->data_ino == 0)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    rc = hexpeek_stat(DT_FD(data_fi), &info);
+    checkrc(rc);
+    if((uint64_t)info.st_dev == p_hdr->data_dev &&
+       (uint64_t)info.st_ino == p_hdr->data_ino)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    if((uint64_t)info.st_ino == p_hdr->data_ino)
+    {
+        prwarn("%s was made for a file of the same inode on device #x%" PRIX64
+               ", not #x%" PRIX64 ", which may have been renumbered\n", name,
+               p_hdr->data_dev, (uint64_t)info.st_dev);
+        if(Params.recover_interactive && consoleAsk("Recover from it") != 0)
+            rc = RC_CRIT;
+        else
+            rc = RC_OK;
+        goto end;
+    }
+
+    prerr("%s was made for another file (device #x%" PRIX64 ", inode #x%"
+          PRIX64 ", size #x%" PRIX64 ")\n", name, p_hdr->data_dev,
+          p_hdr->data_ino, (uint64_t)p_hdr->data_size);
+    if(Params.recover_interactive && consoleAsk("Recover from it anyway") == 0)
+        rc = RC_OK;
+    else
+        rc = RC_CRIT;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Find the journal segment (see hexpeek_journal.c) of the round
+ *        before that of the older of two backup files. A round is as long as
+ *        the difference of their first operations.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] p_new Header of the newer backup file
+ * @param[in] p_old Header of the older backup file
+ * @param[out] p_firstop First operation of the segment
+ * @return true if there is such a segment
+ */
+static bool olderSegment(int data_fi, BackupHeader const *p_new,
+                         BackupHeader const *p_old, uint64_t *p_firstop)
+{
+    uint64_t step = p_new->firstop - p_old->firstop;
+
+    if(p_new->firstop <= p_old->firstop || p_old->firstop < step)
+        return false;
+    *p_firstop = p_old->firstop - step;
+    return journalHas(data_fi, *p_firstop);
+}
+
+/**
+ * @brief Read the header of a journal segment, first moving the segment into
+ *        place as a backup file if its operations are to be reverted.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] bidx Backup index of the backup file the segment replaces
+ * @param[in] firstop First operation of the segment
+ * @param[in] restore Whether to move the segment into place
+ * @param[in] check Whether to check the saved data of its records
+ * @param[out] p_hdr Header of the segment
+ * @param[out] p_fd Descriptor of the segment: the backup file if it was moved
+ *             into place, else one the caller must close
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t loadSegment(int data_fi, int bidx, uint64_t firstop, bool restore,
+                        bool check, BackupHeader *p_hdr, int *p_fd)
+{
+    rc_t rc = RC_UNSPEC;
+    int fd = -1, count = 0;
+    RecordCheck recs[MAX_BACKUP_DEPTH + 1];
+    char name[0x40];
+
+    if(restore)
+    {
+        rc = journalRestore(data_fi, bidx, firstop);
+        checkrc(rc);
+        dropHeader(BK_FD(data_fi, bidx));
+        rc = readat(BK_FD(data_fi, bidx), 0, p_hdr, sizeof *p_hdr);
+    }
+    else
+    {
+        rc = journalOpen(data_fi, firstop, &fd);
+        checkrc(rc);
+        rc = readat(fd, 0, p_hdr, sizeof *p_hdr);
+    }
+    checkrc(rc);
+
+    if(checkHeader(p_hdr) || p_hdr->firstop != firstop)
+    {
+        rc = RC_CRIT;
+        prerr("journal segment #x%" PRIX64 " header is malformed!\n", firstop);
+        goto end;
+    }
+
+    snprintf(name, sizeof name, "journal segment #x%" PRIX64, firstop);
+    rc = checkIdentity(data_fi, p_hdr, name);
+    checkrc(rc);
+
+    if(check)
+    {
+        addRecords(recs, &count, restore ? BK_FD(data_fi, bidx) : fd, p_hdr,
+                   false);
+        rc = checkRecords(recs, count);
+        checkrc(rc);
+    }
+
+    *p_fd = (restore ? BK_FD(data_fi, bidx) : fd);
+    fd = -1;
+    rc = RC_OK;
+
+end:
+    if(fd >= 0)
+        close(fd);
+    return rc;
+}
+
 /**
  * @brief Perform available recovery operations on an infile.
  *
  * @param[in] data_fi Infile file index
  * @param[in] what Specify what specifically this call should do
  *            - -1      : print recoverable operations
- *            - INT_MAX : prompt for recovery or auto recover
+ *            - INT_MAX : prompt for recovery or auto recover, or with
+ *                        Params.recover_check only check the backup records,
+ *                        or with Params.recover_dryrun only print the plan
  *            - <DEPTH> : recover up to DEPTH operations
  */
 rc_t recoverBackup(int data_fi, int what)
 {
     rc_t rc = RC_UNSPEC;
     int *backup_fds = Params.infiles[data_fi].bk_fds;
-    int files_count = 0, files_successful = 0;
-    bool ops_uncompleted = false;
+    int files_count = 0, files_successful = 0, counter = 0, checks = 0;
+    int seg_fd = -1;
+    bool ops_uncompleted = false, check_only = false, dry = false;
+    bool restore = false, asked = false;
+    hoff_t dry_size = HOFF_NIL;
     BackupHeader hrs[BACKUP_FILE_COUNT];
     int sorted[BACKUP_FILE_COUNT];
+    RecordCheck recs[BACKUP_FILE_COUNT * (MAX_BACKUP_DEPTH + 1)];
+    uint64_t firstop = 0;
 
     memset(&hrs, 0, sizeof hrs);
     for(int bidx = 0; bidx < BACKUP_FILE_COUNT; bidx++)
         sorted[bidx] = -1;
 
-    if(what == INT_MAX)
+    check_only = (what == INT_MAX && Params.recover_check);
+    dry = (what == INT_MAX && Params.recover_dryrun);
+    dry_size = filesize(data_fi);
+    restore = (what != -1 && ! check_only && ! dry);
+    asked = (what == INT_MAX && ! check_only && ! dry && ! Params.recover_auto);
+    if(check_only)
+        console("\nBackup check starting.\n");
+    else if(dry)
+        console("\nRecovery dry run starting.\n");
+    else if(what == INT_MAX)
         console("\nRecovery starting.\n");
 
     // Read and validate the Header of each backup file
@@ -896,6 +3808,13 @@ rc_t recoverBackup(int data_fi, int what)
         if(backup_fds[bidx] < 0)
             continue;
         files_count++;
+        if(headerSlot(backup_fds[bidx])->valid)
+        {
+            memcpy(&hrs[bidx], &headerSlot(backup_fds[bidx])->hdr,
+                   sizeof hrs[bidx]);
+            sorted[bidx] = bidx;
+            continue;
+        }
         rc = seekto(backup_fds[bidx], 0);
         checkrc(rc);
         rdsz = readfull(backup_fds[bidx], &hrs[bidx], sizeof hrs[bidx]);
@@ -926,6 +3845,8 @@ rc_t recoverBackup(int data_fi, int what)
             prerr("%s header is malformed!\n", fdname(backup_fds[bidx]));
             goto end;
         }
+        rc = checkIdentity(data_fi, &hrs[bidx], fdname(backup_fds[bidx]));
+        checkrc(rc);
         sorted[bidx] = bidx;
     }
 
@@ -940,78 +3861,120 @@ rc_t recoverBackup(int data_fi, int what)
     #error
 #endif
 
-    if(what == INT_MAX)
+    // Refuse to touch the data file unless the saved data of every record to
+    // be applied is intact; a corrupt record that is not applied is no reason
+    // to refuse. With -finish only the interrupted file size adjustment of the
+    // newest backup file is applied, and records the user is asked about are
+    // checked once accepted (see recoverOp()). Journal segments are checked
+    // as they are loaded.
+    if(what == INT_MAX && ! asked)
     {
         for(int st_idx = 0; st_idx < files_count; st_idx++)
         {
-            rc = recoverBackupFile(data_fi, BK_FD(data_fi, sorted[st_idx]),
-                                   &hrs[sorted[st_idx]], &ops_uncompleted);
-            if(rc == RC_DONE)
-            {
-                rc = RC_OK;
-                goto end;
-            }
-            else if(rc)
-            {
-                goto end;
-            }
+            bool finish = (Params.recover_finish && ! check_only);
+            if(finish && st_idx > 0)
+                break;
+            addRecords(recs, &checks, backup_fds[sorted[st_idx]],
+                       &hrs[sorted[st_idx]], finish);
+        }
+        rc = checkRecords(recs, checks);
+        checkrc(rc);
+    }
+
+    for(int st_idx = 0; st_idx < files_count && ! check_only; st_idx++)
+    {
+        rc = recoverFile(data_fi, backup_fds[sorted[st_idx]],
+                         &hrs[sorted[st_idx]], what, &counter, &ops_uncompleted,
+                         dry ? &dry_size : NULL);
+        if(rc == RC_DONE)
+            goto done;
+        checkrc(rc);
+        files_successful++;
+    }
+
+    // Go on into journal segments, each taking the place of the newer backup
+    // file (the older one of which is already processed)
+    for(int newer = sorted[0], older = sorted[1], swap = 0;
+        newer >= 0 && older >= 0 &&
+        olderSegment(data_fi, &hrs[newer], &hrs[older], &firstop);
+        swap = newer, newer = older, older = swap)
+    {
+        if(what != -1 && what != INT_MAX && counter >= what)
+            goto done;
+        if(seg_fd >= 0 && ! restore)
+            close(seg_fd);
+        seg_fd = -1;
+        rc = loadSegment(data_fi, newer, firstop, restore,
+                         what == INT_MAX && ! asked, &hrs[newer], &seg_fd);
+        checkrc(rc);
+        files_count++;
+        if(check_only)
+        {
             files_successful++;
+            continue;
         }
+        rc = recoverFile(data_fi, seg_fd, &hrs[newer], what, &counter,
+                         &ops_uncompleted, dry ? &dry_size : NULL);
+        if(rc == RC_DONE)
+            goto done;
+        checkrc(rc);
+        files_successful++;
+    }
+
+    if(what == INT_MAX && ! check_only && ! dry)
+    {
         console("\nSyncing data file...\n");
         rc = hexpeek_sync(DT_FD(data_fi));
         checkrc(rc);
         console("Sync complete.\n");
     }
-    else
-    {
-        for(int st_idx = 0, counter = 0; st_idx < files_count; st_idx++)
-        {
-            BackupHeader *p_hdr = &hrs[sorted[st_idx]];
-            for(int opix = mostRecentOp(p_hdr); opix >= 0; opix--)
-            {
-                if(p_hdr->ops[opix].status != OP_STATUS_RECOVERY_DONE)
-                {
-                    counter++; // 1 based index
-                    if(what == -1)
-                    {
-                        console("%X, operation " OPFMT ", command '%s'%s\n",
-                                counter, OPNUM,
-                                p_hdr->ops[opix].origcmd,
-                                OPTRUNC(p_hdr->ops[opix].origcmd));
-                    }
-                    else if(counter <= what)
-                    {
-                        rc = recoverOp(data_fi, BK_FD(data_fi, sorted[st_idx]),
-                                       false, opix, &hrs[sorted[st_idx]], NULL);
-                        if(rc)
-                            goto end;
-                    }
-                    else
-                    {
-                        goto done;
-                    }
-                }
-            }
-        }
 /*
-        if(what > 0)
-        {
-            // Getting here means the undo depth was greater than the number of
-            // operations available to recover. Currently this is not treated as
-            // an error or warning condition.
-        }
-*/
+    else if(what > 0)
+    {
+        // Getting here means the undo depth was greater than the number of
+        // operations available to recover. Currently this is not treated as
+        // an error or warning condition.
     }
+*/
 
 done:
     rc = RC_OK;
 
 end:
-    if(what == INT_MAX)
+    if(seg_fd >= 0 && ! restore)
+        close(seg_fd);
+    // Recovery writes to the headers read above, so the in-memory copies are
+    // stale; the next backup op re-reads and re-validates them.
+    if(what != -1)
+    {
+        for(int bidx = 0; bidx < BACKUP_FILE_COUNT; bidx++)
+            dropHeader(backup_fds[bidx]);
+    }
+    if(dry)
+    {
+        if(rc)
+            console("\nRecovery dry run FAILED.\n");
+        else
+            console("\nRecovery dry run complete, data file size would be #x%"
+                    PRIX64 "; nothing was changed.\n", (uint64_t)dry_size);
+        // Keep the backup files for the recovery the plan was made for
+        BackupUnlinkAllowed = false;
+    }
+    else if(check_only)
+    {
+        if(rc)
+            console("\nBackup check FAILED.\n");
+        else
+            console("\nBackup check complete, x%X backup file%s intact.\n",
+                    plrztn(files_count));
+        // Keep the backup files for the recovery the check was made for
+        BackupUnlinkAllowed = false;
+    }
+    else if(what == INT_MAX)
     {
         if(rc)
             console("\nRecovery FAILED.\n");
-        else if(files_count != files_successful)
+        else if(files_count != files_successful && ! Params.recover_finish)
             console("\nRecovery skipped.\n");
         else
             console("\nRecovery complete.\n");
@@ -0,0 +1,391 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#define SRCNAME "hexpeek_cache.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+/**
+ * @file hexpeek_cache.c
+ * @brief Write-behind cache (-writeback): replace commands that stay within
+ *        a writeable infile are held in memory as dirty extents, which print,
+ *        search and diff read through, and written out together later.
+ *
+ * The cache of an infile is flushed when it holds the -writeback number of
+ * octets, on sync, before any command other than a replace that it takes or
+ * one of the reads above, and on exit. Each flush is backed up as a single
+ * operation, so undo reverts everything written by the last flush.
+ */
+
+#define CACHE_CMDS_SZ 0x100
+
+/**
+ * @struct Dirty
+ *
+ * @brief A run of replaced octets not yet written to the infile.
+ *
+ * @var Dirty::at
+ * File offset of the run.
+ * @var Dirty::len
+ * Length of the run.
+ * @var Dirty::data_mal
+ * Malloc()-d octets of the run.
+ */
+typedef struct
+{
+    hoff_t at;
+    hoff_t len;
+    uint8_t *data_mal;
+} Dirty;
+
+/**
+ * @struct WriteCache
+ *
+ * @brief Write-behind cache state of one infile.
+ *
+ * @var WriteCache::ext_mal
+ * Malloc()-d array of dirty runs, in order of offset, none overlapping or
+ * touching another.
+ * @var WriteCache::count
+ * Number of dirty runs.
+ * @var WriteCache::cap
+ * Allocated size of ext_mal.
+ * @var WriteCache::octets
+ * Total length of the dirty runs.
+ * @var WriteCache::last_at
+ * File offset before the first cached replace, restored on undo.
+ * @var WriteCache::cmds
+ * Cached command strings, joined by "; ". Once too long, they are cut short
+ * and marked with OP_CMD_TRUNCATED, and no more are added.
+ * @var WriteCache::seekable
+ * Whether the infile is seekable: 1 if so, -1 if not, 0 if not yet known.
+ */
+typedef struct
+{
+    Dirty *ext_mal;
+    size_t count;
+    size_t cap;
+    hoff_t octets;
+    hoff_t last_at;
+    char cmds[CACHE_CMDS_SZ];
+    int seekable;
+} WriteCache;
+
+static WriteCache Caches[MAX_INFILES];
+
+/**
+ * @brief Return index of the first dirty run that ends at or after offset at.
+ */
+static size_t findDirty(WriteCache const *wc, hoff_t at)
+{
+    size_t lo = 0, hi = wc->count;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(wc->ext_mal[mid].at + wc->ext_mal[mid].len < at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Return whether the given infile has replaced octets in its
+ *        write-behind cache.
+ */
+bool cacheActive(int fi)
+{
+    return (fi >= 0 && fi < MAX_INFILES && Caches[fi].count > 0);
+}
+
+/**
+ * @brief Return whether a command can be taken by the write-behind cache: a
+ *        replace with literal data, of no more than the -writeback size, that
+ *        does not extend a seekable, writeable infile without an overlay.
+ *
+ * @param[in] ppc Pointer to a ParsedCommand structure
+ */
+bool cacheAccepts(ParsedCommand const *ppc)
+{
+    int fi = ppc->fz.fi;
+    WriteCache *wc = NULL;
+
+    if(Params.writeback <= 0 || ppc->cmd != CMD_REPLACE || fi < 0 ||
+       ppc->arg_cv.mem.count <= 0 || ppc->fz.len > Params.writeback ||
+       ! (DT_MODE(fi) & O_RDWR) || overlayActive(fi))
+        return false;
+    wc = &Caches[fi];
+    if(wc->seekable == 0)
+        wc->seekable = isseekable(fi) ? 1 : -1;
+    if(wc->seekable < 0)
+        return false;
+    return (ppc->fz.start <= filesize(fi) - ppc->fz.len);
+}
+
+/**
+ * @brief Copy the replaced octets the write-behind cache holds for [at,
+ *        at+count) of an infile over the octets just read from it into buf.
+ *
+ * @param[in] fi Infile file index
+ * @param[in] at File offset buf was read from
+ * @param[in,out] buf Buffer holding count octets read from the infile
+ * @param[in] count Number of octets in buf
+ */
+void cacheRead(int fi, hoff_t at, void *buf, hoff_t count)
+{
+    WriteCache const *wc = NULL;
+
+    if( ! cacheActive(fi))
+        return;
+    wc = &Caches[fi];
+    for(size_t ix = findDirty(wc, at);
+        ix < wc->count && wc->ext_mal[ix].at < at + count; ix++)
+    {
+        Dirty const *dt = &wc->ext_mal[ix];
+        hoff_t lo = MAX(at, dt->at);
+        hoff_t hi = MIN(at + count, dt->at + dt->len);
+        if(lo < hi)
+            memcpy((uint8_t*)buf + (lo - at), dt->data_mal + (lo - dt->at),
+                   (size_t)(hi - lo));
+    }
+}
+
+/**
+ * @brief Take a replace command (see cacheAccepts()) into the write-behind
+ *        cache of its infile, merging it with the dirty runs it overlaps or
+ *        touches, and flush the cache once it holds -writeback octets.
+ *
+ * @param[in,out] ppc Command to take (the pattern buffer may be expanded)
+ * @param[out] octets_processed Octets replaced
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t cacheReplace(ParsedCommand *ppc, hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    int fi = ppc->fz.fi;
+    WriteCache *wc = &Caches[fi];
+    hoff_t at = ppc->fz.start, len = ppc->fz.len, from = at, to = at + len;
+    hoff_t pat_len = ppc->arg_cv.mem.count;
+    uint8_t const *pat = ppc->arg_cv.mem.octets_mal;
+    size_t first = findDirty(wc, at), last = first;
+    Dirty merged;
+
+    traceEntry("%d, " TRC_hoff ", " TRC_hoff, fi, trchoff(at), trchoff(len));
+
+    // Runs from first up to last are joined with the new one
+    while(last < wc->count && wc->ext_mal[last].at <= to)
+    {
+        from = MIN(from, wc->ext_mal[last].at);
+        to = MAX(to, wc->ext_mal[last].at + wc->ext_mal[last].len);
+        last++;
+    }
+
+    merged.at = from;
+    merged.len = to - from;
+    merged.data_mal = Malloc((size_t)merged.len);
+    for(size_t ix = first; ix < last; ix++)
+    {
+        Dirty *dt = &wc->ext_mal[ix];
+        memcpy(merged.data_mal + (dt->at - from), dt->data_mal,
+               (size_t)dt->len);
+        wc->octets -= dt->len;
+        free(dt->data_mal);
+    }
+    for(hoff_t done = 0; done < len; done += pat_len)
+        memcpy(merged.data_mal + (at - from) + done, pat,
+               (size_t)MIN(pat_len, len - done));
+
+    if(wc->count == 0)
+    {
+        wc->last_at = Params.infiles[fi].last_at;
+        memset(wc->cmds, 0, sizeof wc->cmds);
+    }
+    if(first == last && wc->count == wc->cap)
+    {
+        size_t ncap = MAX(2 * wc->cap, 0x10);
+        Dirty *grown = Malloc(ncap * sizeof *grown);
+        if(wc->count)
+            memcpy(grown, wc->ext_mal, wc->count * sizeof *grown);
+        free(wc->ext_mal);
+        wc->ext_mal = grown;
+        wc->cap = ncap;
+    }
+    if(last != first + 1)
+        memmove(&wc->ext_mal[first + 1], &wc->ext_mal[last],
+                (wc->count - last) * sizeof *wc->ext_mal);
+    wc->count = wc->count + 1 - (last - first);
+    wc->ext_mal[first] = merged;
+    wc->octets += merged.len;
+
+    if(ppc->origcmd && wc->cmds[sizeof wc->cmds - 2] != OP_CMD_TRUNCATED)
+    {
+        size_t used = strlen(wc->cmds);
+        int n = snprintf(wc->cmds + used, sizeof wc->cmds - used, "%s%s",
+                         used ? "; " : "", ppc->origcmd);
+        if(n < 0 || (size_t)n >= sizeof wc->cmds - used)
+        {
+            wc->cmds[sizeof wc->cmds - 3] = '\0';
+            wc->cmds[sizeof wc->cmds - 2] = OP_CMD_TRUNCATED;
+        }
+    }
+    *octets_processed = len;
+
+    if(wc->octets >= Params.writeback)
+    {
+        rc = cacheFlush(fi);
+        checkrc(rc);
+    }
+
+    rc = RC_OK;
+
+end:
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Write out the write-behind cache of an infile. The original octets
+ *        of all dirty runs are backed up first, as one operation. If the
+ *        flush fails, the runs are kept in the cache, so no replaced octets
+ *        are lost. A write that fails once the backup is made leaves the
+ *        infile partly written, so the operation is reverted first: a later
+ *        flush would otherwise back up replaced octets as original ones. If
+ *        it can not be reverted, the runs are dropped and the operation is
+ *        left for undo or recovery to revert.
+ *
+ * @param[in] fi Infile file index
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t cacheFlush(int fi)
+{
+    rc_t rc = RC_UNSPEC;
+    WriteCache *wc = &Caches[fi];
+    Dirty *ext_mal = wc->ext_mal;
+    size_t count = wc->count, cap = wc->cap;
+    hoff_t octets = wc->octets;
+    FileExtent *saved_mal = NULL;
+    uint8_t *orig_mal = NULL;
+    hoff_t orig_len = 0, keep_at = Params.infiles[fi].last_at;
+    bool dropped = false;
+
+    if(count == 0)
+        return RC_OK;
+
+    traceEntry("%d, %zu", fi, count);
+
+    // Detach the runs, so that reads below see the infile itself
+    wc->ext_mal = NULL;
+    wc->count = 0;
+    wc->cap = 0;
+    wc->octets = 0;
+
+    saved_mal = Malloc(count * sizeof *saved_mal);
+    for(size_t ix = 0; ix < count; ix++)
+        orig_len += ext_mal[ix].len;
+    orig_mal = Malloc((size_t)orig_len);
+    orig_len = 0;
+    for(size_t ix = 0; ix < count; ix++)
+    {
+        rc = readat(DT_FD(fi), ext_mal[ix].at, orig_mal + orig_len,
+                    ext_mal[ix].len);
+        checkrc(rc);
+        saved_mal[ix].at = ext_mal[ix].at;
+        saved_mal[ix].len = ext_mal[ix].len;
+        saved_mal[ix].data = orig_mal + orig_len;
+        orig_len += ext_mal[ix].len;
+    }
+
+    // An undo returns to where the first cached replace was made
+    Params.infiles[fi].last_at = wc->last_at;
+    rc = makeScatterBackup(fi, saved_mal, count, 0, 0, wc->cmds);
+    Params.infiles[fi].last_at = keep_at;
+    checkrc(rc);
+    if(BackupDepth > 0)
+        DT_OPCNT(fi)++;
+
+    for(size_t ix = 0; ix < count; ix++)
+    {
+        rc = writeat(DT_FD(fi), ext_mal[ix].at, ext_mal[ix].data_mal,
+                     ext_mal[ix].len);
+        if(rc != RC_OK && BackupDepth > 0)
+        {
+            if(recoverBackup(fi, 1) != RC_OK)
+            {
+                prerr("flush of %s failed partway and could not be reverted, "
+                      "undo or recover it\n", DT_NAME(fi));
+                dropped = true;
+            }
+            Params.infiles[fi].last_at = keep_at;
+        }
+        checkrc(rc);
+        plugin(2, NULL);
+    }
+
+    rc = RC_OK;
+
+end:
+    if(rc != RC_OK && ! dropped)
+    {
+        // Put the runs back: they are written again by the next flush
+        wc->ext_mal = ext_mal;
+        wc->count = count;
+        wc->cap = cap;
+        wc->octets = octets;
+    }
+    else
+    {
+        for(size_t ix = 0; ix < count; ix++)
+            free(ext_mal[ix].data_mal);
+        free(ext_mal);
+    }
+    free(saved_mal);
+    free(orig_mal);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Write out the write-behind caches of all infiles.
+ *
+ * @return RC_OK on success, else the first hexpeek error code encountered
+ */
+rc_t cacheFlushAll(void)
+{
+    rc_t rc = RC_OK;
+    for(int fi = 0; fi < MAX_INFILES; fi++)
+    {
+        rc_t frc = cacheFlush(fi);
+        if(frc && rc == RC_OK)
+            rc = frc;
+    }
+    return rc;
+}
@@ -0,0 +1,228 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#define SRCNAME "hexpeek_codec.c"
+
+#include <hexpeek.h>
+
+#include <string.h>
+
+/**
+ * @file hexpeek_codec.c
+ * @brief Fast LZ77 block codec for backup data (see writeOp()).
+ *
+ * The format is that of LZ4 blocks: a sequence is a token octet whose high
+ * nibble is the literal length and low nibble the match length less
+ * LZ_MINMATCH, either nibble 0xF being continued by octets up to and including
+ * the first below 0xFF which are added to it; then the literals; then the
+ * two octet little endian offset of the match, and any match length octets.
+ * The last sequence of a block has literals only. Blocks are at most a backup
+ * chunk long, so a 4096 entry hash table finds matches well enough.
+ */
+
+#define LZ_MINMATCH 4
+#define LZ_MAXOFF   0xFFFF
+#define LZ_HASHLOG  12
+#define LZ_EMPTY    UINT32_MAX
+
+/**
+ * @brief Hash of the LZ_MINMATCH octets at p.
+ */
+static inline uint32_t lzHash(uint8_t const *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return (v * 2654435761u) >> (32 - LZ_HASHLOG);
+}
+
+/**
+ * @brief Write the continuation octets of a length whose nibble is 0xF.
+ *
+ * @return Offset in dst after the octets written
+ */
+static size_t lzPutLength(uint8_t *dst, size_t op, size_t n)
+{
+    for( ; n >= 0xFF; n -= 0xFF)
+        dst[op++] = 0xFF;
+    dst[op++] = (uint8_t)n;
+    return op;
+}
+
+/**
+ * @brief Read the continuation octets of a length whose nibble is 0xF.
+ *
+ * @return true on success, false if src ends first
+ */
+static bool lzGetLength(uint8_t const *src, size_t len, size_t *p_ip,
+                        size_t *p_n)
+{
+    uint8_t oc = 0;
+    do
+    {
+        if(*p_ip >= len)
+            return false;
+        oc = src[(*p_ip)++];
+        *p_n += oc;
+    } while(oc == 0xFF);
+    return true;
+}
+
+/**
+ * @brief Append one sequence to dst.
+ *
+ * @param[in] mlen Match length, or 0 for the last sequence
+ * @return true on success, false if it would not fit in cap octets
+ */
+static bool lzSequence(uint8_t *dst, size_t cap, size_t *p_op,
+                       uint8_t const *lit, size_t lit_len,
+                       size_t off, size_t mlen)
+{
+    size_t op = *p_op, tok = 0;
+
+    if(op + 1 + lit_len + lit_len / 0xFF + 1 +
+       (mlen ? 2 + mlen / 0xFF + 1 : 0) > cap)
+        return false;
+
+    tok = op++;
+    dst[tok] = (uint8_t)(MIN(lit_len, 0xF) << 4);
+    if(lit_len >= 0xF)
+        op = lzPutLength(dst, op, lit_len - 0xF);
+    memcpy(dst + op, lit, lit_len);
+    op += lit_len;
+
+    if(mlen)
+    {
+        mlen -= LZ_MINMATCH;
+        dst[op++] = (uint8_t)off;
+        dst[op++] = (uint8_t)(off >> 8);
+        dst[tok] |= (uint8_t)MIN(mlen, 0xF);
+        if(mlen >= 0xF)
+            op = lzPutLength(dst, op, mlen - 0xF);
+    }
+
+    *p_op = op;
+    return true;
+}
+
+/**
+ * @brief Compress a block. Incompressible stretches are skipped over with a
+ *        growing stride, so they cost little more than a copy.
+ *
+ * @param[in] src Data to compress
+ * @param[in] len Length of src (less than 4 GiB)
+ * @param[out] dst Buffer for the compressed block
+ * @param[in] cap Size of dst
+ * @return Length of the compressed block, or 0 if it would exceed cap
+ */
+size_t lzEncode(uint8_t const *src, size_t len, uint8_t *dst, size_t cap)
+{
+    uint32_t tbl[1 << LZ_HASHLOG];
+    size_t ip = 0, anchor = 0, op = 0;
+
+    memset(tbl, 0xFF, sizeof tbl);
+
+    while(ip + LZ_MINMATCH <= len)
+    {
+        uint32_t hh = lzHash(src + ip);
+        size_t ref = tbl[hh], mlen = LZ_MINMATCH;
+        tbl[hh] = (uint32_t)ip;
+        if(ref == LZ_EMPTY || ip - ref > LZ_MAXOFF ||
+           memcmp(src + ref, src + ip, LZ_MINMATCH))
+        {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+
+        while(ip + mlen < len && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+        while(ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1])
+        {
+            ip--;
+            ref--;
+            mlen++;
+        }
+
+        if( ! lzSequence(dst, cap, &op, src + anchor, ip - anchor,
+                         ip - ref, mlen))
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if( ! lzSequence(dst, cap, &op, src + anchor, len - anchor, 0, 0))
+        return 0;
+    return op;
+}
+
+/**
+ * @brief Decompress a block made by lzEncode(), checking every length and
+ *        offset against the buffers.
+ *
+ * @param[in] src Compressed block
+ * @param[in] len Length of src
+ * @param[out] dst Buffer for the data
+ * @param[in] raw_len Length of the data, which must be exactly that
+ * @return true on success, false if the block is malformed
+ */
+bool lzDecode(uint8_t const *src, size_t len, uint8_t *dst, size_t raw_len)
+{
+    size_t ip = 0, op = 0;
+
+    while(ip < len)
+    {
+        uint8_t tok = src[ip++];
+        size_t lit = tok >> 4, mlen = tok & 0xF, off = 0;
+
+        if(lit == 0xF && ! lzGetLength(src, len, &ip, &lit))
+            return false;
+        if(lit > len - ip || lit > raw_len - op)
+            return false;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if(ip == len)
+            break;
+
+        if(len - ip < 2)
+            return false;
+        off = (size_t)src[ip] | (size_t)src[ip + 1] << 8;
+        ip += 2;
+        if(mlen == 0xF && ! lzGetLength(src, len, &ip, &mlen))
+            return false;
+        mlen += LZ_MINMATCH;
+        if(off == 0 || off > op || mlen > raw_len - op)
+            return false;
+        if(off >= mlen)
+            memcpy(dst + op, dst + op - off, mlen);
+        else
+            for(size_t ix = 0; ix < mlen; ix++)
+                dst[op + ix] = dst[op + ix - off];
+        op += mlen;
+    }
+
+    return op == raw_len;
+}
@@ -105,6 +105,7 @@ char const UsageStringShort[] =
 "  -dump , -list   Dump a whole single file in hexadecimal.\n"
 "  -pack           Treat infile as a "PRGNM" dump and pack it back into binary.\n"
 "  -diff           Diff two files in hexadecimal.\n"
+"  -patch <FILE>   Check and apply a patch file to a single infile.\n"
 "  -s <START>      With -dump or -diff, start output at given file offset.\n"
 "  -l <LEN>        Like -s, but stop output after <LEN> octets are processed.\n"
 "  -o <OUTFILE>    Write output to the given file.\n"
@@ -188,6 +189,14 @@ char const UsageStringLong[] =
 "\n"
 "    -diff           Diff two files. Same as \"-x '$0@0:max~$1@0:max'\".\n"
 "\n"
+"    -patch <FILE>   Apply the patch in FILE to the infile. FILE may be the\n"
+"                    output of -diff, an IPS patch, or lines of the form\n"
+"                    \"OFFSET NEW\" or \"OFFSET OLD NEW\" in hexadecimal ('#'\n"
+"                    starts a comment). Every old octet the patch names is\n"
+"                    checked first; on any mismatch nothing is written. The\n"
+"                    edits are then applied together as one backup operation.\n"
+"                    If the infile is read-only, the patch is only checked.\n"
+"\n"
 "    -s <START>      With -dump or -diff, start output at given file offset.\n"
 "\n"
 "    -l <LEN>        Like -s, but stop output after <LEN> octets are processed.\n"
@@ -241,10 +250,81 @@ char const UsageStringLong[] =
 "                    number therebetween. The default depth is "
                                       MS(DEFAULT_BACKUP_DEPTH) ".\n"
 "\n"
-"    -backup sync    Aggressively sync backup to disk.\n"
+"    -backup sync    Aggressively sync backup to disk: fsync twice per\n"
+"                    operation. See BACKUP AND RECOVERY.\n"
+"\n"
+"    -backup datasync\n"
+"                    Like sync, but with fdatasync (file times not flushed).\n"
+"\n"
+"    -backup group   Sync backup to disk once per group of operations (see\n"
+"                    -syncgroup) instead of twice per operation. Data file\n"
+"                    writes are not held back until their group is synced,\n"
+"                    so this is not safe against a system crash or power\n"
+"                    loss and requires -unsafegroup. See BACKUP AND RECOVERY.\n"
+"\n"
+"    -unsafegroup    Accept that the operations of the last unsynced group\n"
+"                    may not be recoverable after a system crash or power\n"
+"                    loss, as -backup group and -syncgroup require.\n"
+"\n"
+"    -backup raw     Save data to backup files as is, without compression.\n"
+"                    Saving is then a plain copy. Where the file system can\n"
+"                    clone the data instead, it is saved by cloning either\n"
+"                    way.\n"
+"\n"
+"    -backupdir <DIR>\n"
+"                    Place backup files in DIR, e.g. on faster storage than\n"
+"                    the data file, instead of next to the data file. Their\n"
+"                    names include a hash of the absolute path of the data\n"
+"                    file, and recovery refuses backup files made for another\n"
+"                    file at that path. Give the same option to -recover.\n"
+"\n"
+"    -syncgroup <OPS>,<MS>\n"
+"                    Select -backup group (which requires -unsafegroup),\n"
+"                    syncing after at most OPS operations or once MS\n"
+"                    milliseconds have passed since the first unsynced one\n"
+"                    (checked at each operation). Any unsynced operations are\n"
+"                    also synced before waiting at the interactive prompt.\n"
+"                    The default is "
+                                      MS(DEFAULT_SYNC_GROUP_OPS) ","
+                                      MS(DEFAULT_SYNC_GROUP_MS) ".\n"
+"\n"
+"    -journal <SIZE> Instead of overwriting the backup file of the round of\n"
+"                    operations before last, keep it as a journal segment, so\n"
+"                    undo and recovery can go back any number of operations.\n"
+"                    The oldest segments are unlinked once those of a file\n"
+"                    exceed SIZE octets.\n"
+"\n"
+"    -overlay        Record replace, insert and kill commands on writeable\n"
+"                    infiles in an edit overlay instead of writing them; reads\n"
+"                    and undo work on the overlay, and commit writes it out.\n"
+"                    Uncommitted edits are discarded on exit.\n"
+"\n"
+"    -batch          Run the -x commands as one transaction on $0, as if\n"
+"                    preceded by begin and followed by commit: the edits are\n"
+"                    backed up and written together, and undone as one\n"
+"                    operation. If a command fails, nothing is written.\n"
+"\n"
+"    -writeback <SIZE>\n"
+"                    Hold replaced data in memory, up to SIZE octets per file,\n"
+"                    and write it out together once SIZE is reached, on sync,\n"
+"                    before any command other than replace, print, search or\n"
+"                    diff, and on exit. Each write-out is backed up as one\n"
+"                    operation, which undo reverts as a whole.\n"
 "\n"
 "    -recover        Prompt to revert operations recorded in backup files.\n"
 "\n"
+"    -finish         With -recover, finish a kill that was interrupted\n"
+"                    instead of reverting it, and keep the operations\n"
+"                    recorded in backup files, which a later -recover can\n"
+"                    still revert. An interrupted insert can not be finished,\n"
+"                    as the octets it inserts are not recorded.\n"
+"\n"
+"    -check          With -recover, only check that backup records are intact,\n"
+"                    changing nothing.\n"
+"\n"
+"    -dryrun         With -recover, only print what recovery would write,\n"
+"                    changing nothing.\n"
+"\n"
 #ifdef HEXPEEK_TRACE
 "    -trace <FILE>   Trace to the given file.\n"
 "\n"
@@ -260,7 +340,8 @@ char const HelpCmdList[] =
 "Available help topics:\n"
 "    quit, stop, help, files, reset, settings, endian, hex, bits, rlen, slen,\n"
 "    line, cols, group, margin, scalar, prefix, autoskip, diffskip, text, ruler,\n"
-"    Numeric, print, offset, search, ~, replace, insert, kill, ops, undo.\n"
+"    Numeric, print, offset, search, ~, replace, insert, kill, ops, undo,\n"
+"    regex, stats, hash, manifest, verify, commit, begin, sync.\n"
 ;
 
 char const HelpCmdHdr[] = "COMMANDS\n\n";
@@ -355,8 +436,9 @@ char const * HelpText[] =
 "        \"max\" may differ from \"len\" on non-regular files and is not allowed\n"
 "        with write commands.\n"
 "\n"
-"        SUBCOMMAND may be one of: p, /, ~, r, i, k, their long forms, and\n"
-"        offset. If no subcommand is specified, an implicit print is done.\n"
+"        SUBCOMMAND may be one of: p, /, ~, r, i, k, their long forms, regex,\n"
+"        stats, hash, manifest, verify, and offset. If no subcommand is\n"
+"        specified, an implicit print is done.\n"
 "\n"
 "        If \"+\" precedes the filezone, file offset will be incremented before\n"
 "        subcommand is run by the number of octets to be processed. If instead\n"
@@ -393,7 +475,10 @@ char const * HelpText[] =
 "                character (which  matches any value); or\n"
 "            (2) a filezone of the form described above, in which case data\n"
 "                from that zone is used as search input. If filezone length is\n"
-"                unspecified, the default length of 1 is used.\n"
+"                unspecified, the default length of 1 is used. There is no\n"
+"                length limit: a zone longer than " MS(SRCHSZ) " octets is\n"
+"                matched with a rolling hash instead of being read into\n"
+"                memory (both files must be seekable).\n"
 "\n"
 "        If the search succeeds, the file offset is set to the beginning of the\n"
 "        first found match; unless \"+\" follows the filezone, in which case the\n"
@@ -439,6 +524,84 @@ char const * HelpText[] =
 "\n"
 "        Undo the number of operations specified by DEPTH (defaults to 1).\n"
 ,
+"    regex <REGEX>\n"
+"\n"
+"        Search for data matching an octet regular expression within the\n"
+"        specified filezone (or to file end if unspecified). REGEX is built\n"
+"        from octets as in search (\".\" matches any nibble or bit), a lone\n"
+"        \".\" (which matches any octet), and classes such as \"[00-1f 7f]\"\n"
+"        (\"[^...]\" matches octets not listed). These may be grouped with\n"
+"        parentheses, separated by \"|\" for alternation, and followed by \"*\",\n"
+"        \"+\", \"?\", or \"{MIN,MAX}\" for repetition, where MIN and MAX are\n"
+"        scalars. For example, \"7f 45 4c 46 .{0,10} (01|02)\".\n"
+"\n"
+"        The match reported is the one that ends first, extended back to its\n"
+"        earliest start. The file offset is updated as for search, with \"+\"\n"
+"        advancing past the whole match. The expression is compiled lazily to\n"
+"        a DFA, so search time is linear in the size of the filezone.\n"
+,
+"    stats [BLOCKSZ]\n"
+"\n"
+"        Show octet statistics for the filezone (or to file end if HEXLEN is\n"
+"        unspecified). The filezone is divided into blocks of BLOCKSZ octets\n"
+"        (default " MS(DEF_STATS_BLKSZ) ") and an entropy map is printed with one\n"
+"        character per block: \"z\" for all zero, \"f\" for all 0xff, and\n"
+"        otherwise the block's Shannon entropy in bits per octet rounded down\n"
+"        (0 through 8). Low digits suggest text or structured data, high ones\n"
+"        compressed or encrypted data. The map is followed by octet and block\n"
+"        counts, the entropy of the whole filezone, and a histogram of octet\n"
+"        values.\n"
+,
+"    hash [ALGORITHM [LEAFSZ]]\n"
+"\n"
+"        Hash the filezone (or to file end if HEXLEN is unspecified) and print\n"
+"        a single line: the algorithm, the filezone hashed as START,LENGTH,\n"
+"        and the digest in hexadecimal. ALGORITHM is one of crc32c (the\n"
+"        default), crc32, xxh64, or sha256; the CRCs use the SSE4.2 and PCLMUL\n"
+"        instructions when the CPU supports them. If LEAFSZ is given, a tree\n"
+"        hash is computed instead: the filezone is split into leaves of\n"
+"        LEAFSZ octets which are hashed in parallel, and the digest is the\n"
+"        hash of the concatenated leaf digests. The algorithm is then\n"
+"        printed as ALGORITHM/LEAFSZ. Tree mode requires a seekable file.\n"
+,
+"    manifest [BLOCKSZ] PATH\n"
+"\n"
+"        Write a manifest of per-block hashes of the filezone (or to file end\n"
+"        if HEXLEN is unspecified) to PATH, so the data can later be checked\n"
+"        without keeping a copy of it. Blocks are BLOCKSZ octets (default\n"
+"        " MS(DEF_MANIFEST_BLKSZ) ") and are hashed with xxh64 in parallel.\n"
+"        Requires a seekable file.\n"
+,
+"    verify PATH\n"
+"\n"
+"        Check the file against the manifest at PATH, starting at the\n"
+"        filezone offset, and print each range of blocks that differs as\n"
+"        START,LENGTH, which can be used directly as a filezone. Blocks the\n"
+"        file is too short to hold count as different. Like diff, the exit\n"
+"        status of a script ending in verify is 1 if there are differences.\n"
+"        Requires a seekable file.\n"
+,
+"    commit [PATH]\n"
+"\n"
+"        With -overlay or after begin, write the pending edits of $0 out in\n"
+"        one sequential pass. Without PATH the file is updated in place: the\n"
+"        changed region is backed up first as a single operation, which undo\n"
+"        reverts, and a transaction started by begin ends. With PATH a new\n"
+"        file is created holding the edited data, and $0 and its pending\n"
+"        edits are unchanged.\n"
+,
+"    begin\n"
+"\n"
+"        Start a transaction on $0. Replace, insert and kill commands are\n"
+"        staged (reads, ops and undo see them) until commit writes them out\n"
+"        together, with one backup operation for the whole batch, however\n"
+"        many commands it holds. Uncommitted edits are discarded on exit.\n"
+,
+"    sync\n"
+"\n"
+"        Write out replaced data held in memory by -writeback, and flush the\n"
+"        writeable infiles, and backup files awaiting -backup group, to disk.\n"
+,
 };
 
 char const HelpOther[] =
@@ -506,9 +669,18 @@ char const HelpOther[] =
 "    The insert and kill commands are inherently inefficient because they must\n"
 "    move all the data after the point of insertion or deletion. Consider\n"
 "    combining repeated insertions (or kills) into one large operation to limit\n"
-"    the amount of time spent in file rearrangement.\n"
-"\n"
-"    Maximum line, group, and search argument octet width are "
+"    the amount of time spent in file rearrangement. On filesystems that\n"
+"    support it (e.g. ext4, XFS), an insertion or kill whose length is a\n"
+"    multiple of the filesystem block size is done by remapping blocks instead.\n"
+"    Otherwise, with backups, the data after the point is moved in place and\n"
+"    its progress is recorded. An insertion or kill shorter than 0x1000000\n"
+"    octets moves the data 0x1000000 octets at a time, saving the part of\n"
+"    each such window that the move overwrites to the backup file first.\n"
+"    Recovery finishes an interrupted move before reverting the command.\n"
+"    Instead, '"PRGNM" -recover -finish' finishes an interrupted kill from as\n"
+"    far as it got; an interrupted insertion can only be reverted.\n"
+"\n"
+"    Maximum line, group, and literal search argument octet width are "
 #if (MAXW_LINE == MAXW_GROUP && MAXW_LINE == SRCHSZ)
      MS(MAXW_LINE) ".\n"
 #else
@@ -525,11 +697,59 @@ char const HelpOther[] =
 "    sufficient to recover previous data file state in case of program crash or\n"
 "    user error.\n"
 "\n"
+"    A backup file records the device and inode numbers of its data file, and\n"
+"    recovery does not use one made for another file unless told to in\n"
+"    interactive recovery, e.g. after a file was copied with its backups.\n"
+"\n"
 "    When an error occurs, use the undo command to revert it; or use stop and\n"
 "    then invoke '"PRGNM" -recover'. Otherwise, on successful exit, "PRGNM"\n"
 "    automatically unlinks the backup files. A redo can be performed with the\n"
 "    command line history functionality (if built with support).\n"
 "\n"
+"    Data saved to backup files is compressed when there is at least\n"
+"    " MS(BUFSZ) " octets of it, unless -backup raw is given or the file\n"
+"    system can clone it into the backup file. Holes in the data\n"
+"    file are recorded as holes, and runs of one octet value take a few\n"
+"    octets, so e.g. killing a mostly empty region costs little backup space.\n"
+"\n"
+"    A long replace within the file is saved and written a part at a time,\n"
+"    each part being written as soon as its backup is recorded while the next\n"
+"    is saved, rather than after the whole backup.\n"
+"\n"
+"    Each backup record carries CRC32C checksums of itself and of its saved\n"
+"    data; data cloned into the backup file is checksummed as read from the\n"
+"    data file. Recovery checks each record it is to apply before it writes\n"
+"    anything - all of them without prompting, or each one the user accepts\n"
+"    when prompted - and refuses to go on if one is corrupt; corrupt records\n"
+"    it would not apply, such as those -finish leaves, do not stop it.\n"
+"    '"PRGNM" -recover -check' only does the check, of every record.\n"
+"\n"
+"    Without prompting, recovery plans the revert of operations that do not\n"
+"    insert or kill: each octet is written once, from the oldest operation\n"
+"    that saved it, by several threads at once, and the data file is synced\n"
+"    once at the end. '"PRGNM" -recover -dryrun' prints the plan.\n"
+"\n"
+"    How much survives a crash depends on the backup sync policy:\n"
+"\n"
+"    (default)  Backup data is written but not synced. Every operation can be\n"
+"               recovered after "PRGNM" itself crashes or is killed, but not\n"
+"               necessarily after a system crash or power loss.\n"
+"\n"
+"    group      As the default, except that backups are synced once per group\n"
+"               of operations, before waiting at the prompt, and before\n"
+"               exiting with backups kept. This is not write-ahead: after a\n"
+"               system crash or power loss, the data file writes of\n"
+"               operations since the last group sync may survive while\n"
+"               their backups do not, so those operations may not be\n"
+"               recoverable. It must therefore be asked for together with\n"
+"               -unsafegroup.\n"
+"\n"
+"    datasync   Each operation's backup is synced before the data file is\n"
+"               written, so every operation can be recovered after a system\n"
+"               crash or power loss.\n"
+"\n"
+"    sync       As datasync, and file times of backup files are synced too.\n"
+"\n"
 "VERSION\n"
 "\n"
 "    " VERSION_STRING
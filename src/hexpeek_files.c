@@ -26,6 +26,8 @@
 
 #define SRCNAME "hexpeek_files.c"
 
+#define _GNU_SOURCE // copy_file_range(), splice()
+
 #include <hexpeek.h>
 
 #include <stdlib.h>
@@ -36,6 +38,13 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#ifdef __linux__
+    #include <linux/fs.h>
+#endif
 
 
 /**
@@ -85,6 +94,8 @@ char const *fdname(int fd)
                 }
             }
         }
+        if(journalName(fd))
+            return journalName(fd);
     }
     return "";
 }
@@ -140,7 +151,7 @@ rc_t hexpeek_open(char const *path, int flags, mode_t mode, int *fd)
 /**
  * @brief lseek() wrapper with error handling and non-seekable fallback support.
  *        If seek fails due to ESPIPE, hexpeek attempts an implicit seek using
- *        read().
+ *        read(). Infiles with an overlay are seeked in the overlay view.
  *
  * @param[in] fd File descriptor on which to perform a seek
  * @param[in] offset Numeric offset to pass to lseek()
@@ -149,8 +160,10 @@ rc_t hexpeek_open(char const *path, int flags, mode_t mode, int *fd)
  */
 hoff_t hexpeek_seek(int fd, hoff_t offset, int whence)
 {
+    int wf = whichfile(fd);
     errno = 0;
-    hoff_t result = _hexpeek_seek(fd, offset, whence);
+    hoff_t result = overlayActive(wf) ? overlaySeek(wf, offset, whence) :
+                                        _hexpeek_seek(fd, offset, whence);
     if(result < 0) switch(errno)
     {
     case EINVAL:
@@ -161,7 +174,6 @@ hoff_t hexpeek_seek(int fd, hoff_t offset, int whence)
     case ESPIPE:
     {
         // Try a forward-only seek for non-seekable files
-        int wf = whichfile(fd);
         if(wf >= 0 && whence == SEEK_SET && Params.infiles[wf].track <= offset)
         {
             uint8_t discard[PAGESZ];
@@ -233,6 +245,12 @@ ssize_t readfull(int fd, void *buf, size_t count)
     int wf = whichfile(fd);
     ssize_t result = -1;
     size_t octets_read = 0;
+    hoff_t cache_at = -1;
+
+    if(overlayActive(wf))
+        return (ssize_t)overlayRead(wf, buf, (hoff_t)count);
+    if(cacheActive(wf))
+        cache_at = _hexpeek_seek(fd, 0, SEEK_CUR);
 
     while(octets_read < count)
     {
@@ -247,6 +265,8 @@ ssize_t readfull(int fd, void *buf, size_t count)
     }
 
     result = (ssize_t)octets_read;
+    if(cache_at >= 0)
+        cacheRead(wf, cache_at, buf, (hoff_t)octets_read);
 
 end:
     if(wf >= 0)
@@ -351,6 +371,46 @@ rc_t hexpeek_sync(int fd)
     return RC_OK;
 }
 
+/**
+ * @brief Wrapper for fdatasync() with additional error handling code. Unlike
+ *        fsync(), metadata not needed to read the data back (e.g. mtime) is not
+ *        flushed.
+ *
+ * @param[in] fd File descriptor to sync
+ * @return RC_OK on success, RC_CRIT if fdatasync() fails
+ */
+rc_t hexpeek_datasync(int fd)
+{
+    if(fdatasync(fd))
+    {
+        prerr("error syncing %s: %s\n", fdname(fd), strerror(errno));
+        return RC_CRIT;
+    }
+    return RC_OK;
+}
+
+/**
+ * @brief Start writeback of a file region without waiting for it, so that a
+ *        later sync has less left to do. This is only a hint: it does not
+ *        make anything durable, and is a no-op where sync_file_range() is not
+ *        available.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] at File offset of region
+ * @param[in] len Length of region
+ */
+void hexpeek_startsync(int fd, hoff_t at, hoff_t len)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+    if(len > 0)
+        (void)sync_file_range(fd, at, len, SYNC_FILE_RANGE_WRITE);
+#else
+    (void)fd;
+    (void)at;
+    (void)len;
+#endif
+}
+
 /**
  * @brief Perform a sync on the directory containing the file specified by
  *        path.
@@ -434,7 +494,8 @@ end:
 }
 
 /**
- * @brief Wrapper for hexpeek_stat().st_size
+ * @brief Wrapper for hexpeek_stat().st_size, or the size of the overlay view
+ *        if the file has one.
  *
  * @param[in] Hexpeek file index of file whose size is to be evaluated
  * @return File size (never returns a negative number - dies instead)
@@ -442,6 +503,8 @@ end:
 hoff_t filesize(int file_index)
 {
     struct stat info;
+    if(overlayActive(file_index))
+        return overlaySize(file_index);
     assert(hexpeek_stat(DT_FD(file_index), &info) == RC_OK);
     assert(info.st_size >= 0);
     return info.st_size;
@@ -469,8 +532,11 @@ hoff_t pathsize(char const *path)
 }
 
 /**
- * @brief Seek to a given offset and read a specified amount of data. Fail if
- *        the full amount of data cannot be read.
+ * @brief Read a specified amount of data at a given offset with pread(), so
+ *        the shared file offset is left alone. Non-seekable files fall back to
+ *        a forward seek and read, which keeps FileAttr.track up to date. Fail
+ *        if the full amount of data cannot be read. Replaced octets held in
+ *        the write-behind cache are read through.
  *
  * @param[in] fd File descriptor on which to read
  * @param[in] at Offset at which to perform the read
@@ -480,16 +546,58 @@ hoff_t pathsize(char const *path)
  */
 rc_t readat(int fd, hoff_t at, void *buf, hoff_t count)
 {
-    if(hexpeek_seek(fd, at, SEEK_SET) != at)
-        return RC_CRIT;
-    if(readstrict(fd, buf, count) != count)
+    int wf = whichfile(fd);
+    hoff_t done = 0;
+
+    if(count < 0 || (uintmax_t)count > (uintmax_t)SIZE_MAX)
         return RC_CRIT;
+
+    if(overlayActive(wf))
+    {
+        done = overlayPread(wf, buf, count, at);
+        if(done < 0)
+            prerr("error reading from %s: %s\n", fdname(fd), strerror(errno));
+        else if(done != count)
+            prerr(EofErrString, fdname(fd));
+        return (done == count ? RC_OK : RC_CRIT);
+    }
+
+    while(done < count)
+    {
+        ssize_t lcl_rd = pread(fd, (uint8_t*)buf + done, (size_t)(count - done),
+                               (off_t)(at + done));
+        if(lcl_rd < 0 && errno == EINTR)
+            continue;
+        if(lcl_rd < 0 && errno == ESPIPE && done == 0)
+        {
+            if(hexpeek_seek(fd, at, SEEK_SET) != at)
+                return RC_CRIT;
+            if(readstrict(fd, buf, count) != count)
+                return RC_CRIT;
+            return RC_OK;
+        }
+        if(lcl_rd < 0)
+        {
+            prerr("error reading from %s: %s\n", fdname(fd), strerror(errno));
+            return RC_CRIT;
+        }
+        if(lcl_rd == 0)
+        {
+            prerr(EofErrString, fdname(fd));
+            return RC_CRIT;
+        }
+        done += lcl_rd;
+    }
+    cacheRead(wf, at, buf, count);
+
     return RC_OK;
 }
 
 /**
- * @brief Seek to a given offset and write a specified amount of data. Fail if
- *        the specified amount of data cannot be written.
+ * @brief Write a specified amount of data at a given offset with pwrite(), so
+ *        the shared file offset is left alone. Non-seekable files fall back to
+ *        a seek and write. Fail if the specified amount of data cannot be
+ *        written.
  *
  * @param[in] fd File descriptor on which to write
  * @param[in] at Offset at which to perform the write
@@ -499,13 +607,276 @@ rc_t readat(int fd, hoff_t at, void *buf, hoff_t count)
  */
 rc_t writeat(int fd, hoff_t at, const void *buf, hoff_t count)
 {
-    if(hexpeek_seek(fd, at, SEEK_SET) != at)
-        return RC_CRIT;
-    if(hexpeek_write(fd, buf, count) != count)
+    hoff_t done = 0;
+
+    if(count < 0 || (uintmax_t)count > (uintmax_t)SIZE_MAX)
         return RC_CRIT;
+
+    while(done < count)
+    {
+        ssize_t lcl_wr = pwrite(fd, (uint8_t const*)buf + done,
+                                (size_t)(count - done), (off_t)(at + done));
+        if(lcl_wr < 0 && errno == EINTR)
+            continue;
+        if(lcl_wr < 0 && errno == ESPIPE && done == 0)
+        {
+            if(hexpeek_seek(fd, at, SEEK_SET) != at)
+                return RC_CRIT;
+            if(hexpeek_write(fd, buf, count) != count)
+                return RC_CRIT;
+            return RC_OK;
+        }
+        if(lcl_wr <= 0)
+        {
+            prerr("error writing to %s: %s\n", fdname(fd),
+                  lcl_wr < 0 ? strerror(errno) : "short write");
+            return RC_CRIT;
+        }
+        done += lcl_wr;
+    }
+
     return RC_OK;
 }
 
+/**
+ * @brief Write iovcnt buffers back to back at a given offset with pwritev(),
+ *        continuing after partial writes (the shared file offset is left
+ *        alone).
+ *
+ * @param[in] fd File descriptor on which to write
+ * @param[in] at Offset at which to begin writing
+ * @param[in,out] iov Buffers to write; entries are consumed as they are
+ *                written, so the array is modified
+ * @param[in] iovcnt Number of buffers
+ * @return RC_OK on success, RC_CRIT otherwise
+ */
+rc_t writevat(int fd, hoff_t at, struct iovec *iov, int iovcnt)
+{
+    while(iovcnt > 0)
+    {
+        ssize_t lcl_wr = pwritev(fd, iov, MIN(iovcnt, IOV_MAX), (off_t)at);
+        if(lcl_wr < 0 && errno == EINTR)
+            continue;
+        if(lcl_wr < 0)
+        {
+            prerr("error writing to %s: %s\n", fdname(fd), strerror(errno));
+            return RC_CRIT;
+        }
+        at += lcl_wr;
+        for( ; iovcnt > 0 && (size_t)lcl_wr >= iov->iov_len; iov++, iovcnt--)
+            lcl_wr -= iov->iov_len;
+        if(iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + lcl_wr;
+            iov->iov_len -= lcl_wr;
+        }
+    }
+    return RC_OK;
+}
+
+/**
+ * @brief Try to zero a range of a regular file without writing zeros: punch a
+ *        hole (keeping the file sparse), or failing that have the filesystem
+ *        zero the range; the part past end of file is zeroed by extending the
+ *        file.
+ *
+ * @return RC_OK if the range was zeroed, RC_NIL if this is not supported (the
+ *         range is then unchanged), otherwise a hexpeek error code.
+ */
+static rc_t zeroRange(int fd, hoff_t at, hoff_t length)
+{
+    rc_t rc = RC_NIL;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    struct stat info;
+
+    if(fstat(fd, &info) || ! S_ISREG(info.st_mode) || info.st_blksize <= 0)
+        goto end;
+    // Not worth a system call unless at least one whole block is covered
+    if(length < 2 * (hoff_t)info.st_blksize)
+        goto end;
+
+    hoff_t inner = MAX(0, MIN(length, info.st_size - at));
+    if(inner > 0 &&
+       fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, inner) &&
+       fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, at, inner))
+    {
+        trace("fallocate at " TRC_hoff " failed: %s\n", trchoff(at),
+              strerror(errno));
+        if(errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS)
+        {
+            rc = RC_CRIT;
+            prerr("fallocate on %s: %s\n", fdname(fd), strerror(errno));
+        }
+        goto end;
+    }
+    plugin(2, NULL);
+    if(at + length > info.st_size)
+    {
+        rc = hexpeek_truncate(fd, at + length);
+        checkrc(rc);
+    }
+
+    rc = RC_OK;
+
+end:
+#endif
+    return rc;
+}
+
+/**
+ * @brief Find the run of data or of a hole that a file region begins with,
+ *        using SEEK_DATA and SEEK_HOLE where supported. Moves the file offset
+ *        of fd.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] at File offset of the region
+ * @param[in] len Length of the region, which must not extend past end of file
+ * @param[out] p_hole Set to whether the run is a hole
+ * @return Length of the run, at most len
+ */
+static hoff_t sparseRun(int fd, hoff_t at, hoff_t len, bool *p_hole)
+{
+    *p_hole = false;
+#ifdef SEEK_DATA
+    off_t data = lseek(fd, (off_t)at, SEEK_DATA), hole = -1;
+    if(data < 0 && errno == ENXIO)
+    {
+        // No data from at to end of file
+        *p_hole = true;
+        return len;
+    }
+    else if(data > at)
+    {
+        *p_hole = true;
+        return MIN(len, data - at);
+    }
+    else if(data == at && (hole = lseek(fd, (off_t)at, SEEK_HOLE)) > at)
+    {
+        return MIN(len, hole - at);
+    }
+#endif
+    return len;
+}
+
+/**
+ * @brief List the runs of data in a file region; the rest of it is holes (see
+ *        sparseRun()). The file offset of fd is restored afterwards, but is
+ *        moved meanwhile, so the map is made before any other thread may use
+ *        it.
+ *
+ * @param[in] fd File descriptor
+ * @param[in] at File offset of the region
+ * @param[in] len Length of the region, which must not extend past end of file
+ * @param[out] pp_runs_mal Set to a malloc()'d list of the runs in file order,
+ *             each with data NULL, which the caller must free
+ * @return Number of runs
+ */
+size_t sparseMap(int fd, hoff_t at, hoff_t len, FileExtent **pp_runs_mal)
+{
+    FileExtent *runs_mal = NULL;
+    size_t count = 0, cap = 0;
+    off_t fpos = lseek(fd, 0, SEEK_CUR);
+    hoff_t rel = 0, run = 0;
+    bool hole = false;
+
+    for( ; rel < len; rel += run)
+    {
+        run = sparseRun(fd, at + rel, len - rel, &hole);
+        if(hole)
+            continue;
+        if(count == cap)
+        {
+            FileExtent *grown = NULL;
+            cap = MAX(2 * cap, 0x10);
+            grown = Malloc(cap * sizeof *grown);
+            if(count)
+                memcpy(grown, runs_mal, count * sizeof *grown);
+            free(runs_mal);
+            runs_mal = grown;
+        }
+        runs_mal[count].at = at + rel;
+        runs_mal[count].len = run;
+        runs_mal[count].data = NULL;
+        count++;
+    }
+
+    if(fpos >= 0)
+        lseek(fd, fpos, SEEK_SET);
+    *pp_runs_mal = runs_mal;
+    return count;
+}
+
+/**
+ * @brief Fill a file range with repeated copies of a pattern buffer. An all
+ *        zero pattern is handled by zeroRange() where possible; otherwise
+ *        large pwritev() batches are issued whose iovecs all point into the
+ *        one pattern buffer.
+ *
+ * @param[in] fd File descriptor on which to write
+ * @param[in] at Offset at which to begin writing
+ * @param[in] pat Pattern buffer
+ * @param[in] pat_len Size of pattern buffer (must be positive)
+ * @param[in] length Total size of data to be written
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t fillat(int fd, hoff_t at, uint8_t const *pat, hoff_t pat_len,
+            hoff_t length)
+{
+    rc_t rc = RC_UNSPEC;
+    struct iovec iov[IOV_MAX];
+    hoff_t done = 0, ix = 0;
+
+    assert(pat_len > 0);
+
+    for(ix = 0; ix < pat_len && pat[ix] == 0; ix++)
+        ;
+    if(ix == pat_len)
+    {
+        rc = zeroRange(fd, at, length);
+        if(rc != RC_NIL)
+            goto end;
+    }
+
+    while(done < length)
+    {
+        // Start at the pattern phase reached so far
+        hoff_t phase = done % pat_len, batch = 0;
+        int cnt = 0;
+        for(; cnt < IOV_MAX && done + batch < length; cnt++)
+        {
+            hoff_t off = (cnt ? 0 : phase);
+            hoff_t len = MIN(pat_len - off, length - done - batch);
+            iov[cnt].iov_base = (void*)(pat + off);
+            iov[cnt].iov_len = (size_t)len;
+            batch += len;
+        }
+        ssize_t lcl_wr = pwritev(fd, iov, cnt, (off_t)(at + done));
+        if(lcl_wr < 0 && errno == EINTR)
+            continue;
+        if(lcl_wr < 0 && errno == ESPIPE)
+        {
+            // Not seekable; write one pattern at a time at the shared offset
+            rc = writeat(fd, at + done, iov[0].iov_base, iov[0].iov_len);
+            checkrc(rc);
+            lcl_wr = iov[0].iov_len;
+        }
+        else if(lcl_wr <= 0)
+        {
+            rc = RC_CRIT;
+            prerr("error writing to %s: %s\n", fdname(fd),
+                  lcl_wr < 0 ? strerror(errno) : "short write");
+            goto end;
+        }
+        done += lcl_wr;
+        plugin(2, NULL);
+    }
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
 /**
  * @brief Copy data backwards between two file descriptors. This function is
  *        safe for overlapping file regions when src_at <= dst_at.
@@ -584,11 +955,118 @@ end:
     return rc;
 }
 
+#define CPY_CHUNK (BUFSZ * 0x10)
+
+/**
+ * @brief Have the kernel copy up to count octets between two different files
+ *        without passing through a user space buffer: copy_file_range() when
+ *        both are seekable, or splice() from a pipe at its current position.
+ *
+ * @return Octets copied, 0 at end of source, or -1 if the kernel can not do
+ *         this copy (e.g. EXDEV, EINVAL) or failed, with errno set
+ */
+static ssize_t cpykern(int src_fd, hoff_t src_at, int dst_fd, hoff_t dst_at,
+                       size_t count, bool src_pipe)
+{
+#ifdef __linux__
+    loff_t off_in = (loff_t)src_at, off_out = (loff_t)dst_at;
+    ssize_t result = -1;
+    do
+    {
+        if(src_pipe)
+            result = splice(src_fd, NULL, dst_fd, &off_out, count,
+                            SPLICE_F_MOVE);
+        else
+            result = copy_file_range(src_fd, &off_in, dst_fd, &off_out,
+                                     count, 0);
+    } while(result < 0 && errno == EINTR);
+    return result;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#define CLONE_CHUNK (CPY_CHUNK * 0x40)
+
+/**
+ * @brief Find the part of a copy that can be done by cloning (reflinking)
+ *        filesystem blocks: both offsets must sit at the same position within
+ *        a block, and the files must be regular files on one filesystem. The
+ *        result is relative to the start of the copy and empty if cloning
+ *        does not apply; the unaligned head and tail are copied normally.
+ */
+static void cloneWindow(int src_fd, hoff_t src_at, int dst_fd, hoff_t dst_at,
+                        hoff_t length, hoff_t *cl_from, hoff_t *cl_to)
+{
+    *cl_from = *cl_to = 0;
+#ifdef FICLONERANGE
+    struct stat src_info, dst_info;
+    hoff_t blksz = 0, head = 0;
+    if(fstat(src_fd, &src_info) || fstat(dst_fd, &dst_info))
+        return;
+    if( ! S_ISREG(src_info.st_mode) || ! S_ISREG(dst_info.st_mode) ||
+        src_info.st_dev != dst_info.st_dev)
+        return;
+    blksz = MAX(dst_info.st_blksize, PAGESZ);
+    if(src_at % blksz != dst_at % blksz)
+        return;
+    head = distbound_incl(src_at, blksz);
+    if(length - head < blksz)
+        return;
+    *cl_from = head;
+    *cl_to = head + (length - head) / blksz * blksz;
+#endif
+}
+
+/**
+ * @brief Clone a block aligned range from src_fd into dst_fd with
+ *        FICLONERANGE, sharing the underlying storage (btrfs, XFS, ...).
+ *
+ * @return 0 on success, -1 with errno set otherwise (e.g. EOPNOTSUPP)
+ */
+static int cpyclone(int src_fd, hoff_t src_at, int dst_fd, hoff_t dst_at,
+                    hoff_t length)
+{
+#ifdef FICLONERANGE
+    struct file_clone_range fcr;
+    fcr.src_fd = src_fd;
+    fcr.src_offset = (uint64_t)src_at;
+    fcr.src_length = (uint64_t)length;
+    fcr.dest_offset = (uint64_t)dst_at;
+    return ioctl(dst_fd, FICLONERANGE, &fcr);
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/**
+ * @brief Return whether a copy between two different files would be made
+ *        mostly by cloning (see cloneWindow()), which is found out by cloning
+ *        the first block of it. Its destination is thus partly written.
+ */
+bool cloneable(int src_fd, hoff_t src_at, int dst_fd, hoff_t dst_at,
+               hoff_t length)
+{
+    hoff_t cl_from = 0, cl_to = 0;
+    struct stat info;
+
+    cloneWindow(src_fd, src_at, dst_fd, dst_at, length, &cl_from, &cl_to);
+    if(cl_to - cl_from < length / 2 || fstat(dst_fd, &info))
+        return false;
+    return cpyclone(src_fd, src_at + cl_from, dst_fd, dst_at + cl_from,
+                    MAX(info.st_blksize, PAGESZ)) == 0;
+}
+
 /**
  * @brief Copy data between two file descriptors that point to different files.
  *        If the file descriptors point to the same file, data corruption may
  *        result. This function exists because the distinct file requirement
- *        allows less seeking than is done by the functions above.
+ *        allows kernel side copies, unlike the functions above. The copy is
+ *        done in the kernel where possible, in bounded chunks so progress is
+ *        still reported; if the kernel declines, the rest is copied through a
+ *        buffer.
  *
  * @param[in] src_fd File descriptor from which to read data
  * @param[in] src_at Offset at which to begin reading
@@ -606,28 +1084,74 @@ static rc_t cpyext(int src_fd, hoff_t src_at, int dst_fd, hoff_t dst_at,
                    hoff_t length, int isbk)
 {
     rc_t rc = RC_UNSPEC;
-    hoff_t sz = distbound(src_at, PAGESZ);
+    hoff_t sz = 0, rel = 0, cl_from = 0, cl_to = 0;
     uint8_t cpybuf[MAX(BUFSZ, PAGESZ)];
+    int wf = whichfile(src_fd);
+    bool src_pipe = (_hexpeek_seek(src_fd, 0, SEEK_CUR) < 0);
+    bool kern = ! overlayActive(wf);
 
-    rc = seekto(src_fd, src_at);
-    checkrc(rc);
-    rc = seekto(dst_fd, dst_at);
-    checkrc(rc);
+    // Only a pipe is read at the shared offset; everything else is positioned
+    if(src_pipe)
+    {
+        rc = seekto(src_fd, src_at);
+        checkrc(rc);
+    }
 
-    for(hoff_t rel = 0; rel < length; sz = BUFSZ)
+    // An overlaid source must be read through its overlay
+    if( ! src_pipe && kern)
+        cloneWindow(src_fd, src_at, dst_fd, dst_at, length, &cl_from, &cl_to);
+
+    while(rel < length)
     {
-        sz = MIN(sz, length - rel);
         progress(rel, length, isbk);
-        if(readstrict(src_fd, cpybuf, sz) != sz)
+
+        // Clone whole filesystem blocks; offsets are explicit
+        if(rel >= cl_from && rel < cl_to)
         {
-            rc = RC_CRIT;
-            goto end;
+            sz = MIN(CLONE_CHUNK, cl_to - rel);
+            if(cpyclone(src_fd, src_at + rel, dst_fd, dst_at + rel, sz) == 0)
+            {
+                rel += sz;
+                plugin(2, NULL);
+                continue;
+            }
+            trace("clone stopped at " TRC_hoff ": %s\n",
+                  trchoff(rel), strerror(errno));
+            cl_to = rel;
         }
-        if(hexpeek_write(dst_fd, cpybuf, sz) != sz)
+        sz = MIN(CPY_CHUNK, (rel < cl_from ? cl_from : length) - rel);
+
+        // Kernel copy; offsets are explicit
+        if(kern)
         {
-            rc = RC_CRIT;
-            goto end;
+            ssize_t lcl_cp = cpykern(src_fd, src_at + rel, dst_fd, dst_at + rel,
+                                     (size_t)sz, src_pipe);
+            if(lcl_cp > 0)
+            {
+                // Internal tracking for non-seekable files
+                if(src_pipe && wf >= 0)
+                    Params.infiles[wf].track += (hoff_t)lcl_cp;
+                rel += lcl_cp;
+                plugin(2, NULL);
+                continue;
+            }
+            trace("kernel copy stopped at " TRC_hoff ": %s\n",
+                  trchoff(rel), lcl_cp < 0 ? strerror(errno) : "EOF");
+            kern = false;
         }
+
+        // Buffered copy
+        if((src_at + rel) % PAGESZ)
+            sz = MIN(sz, distbound(src_at + rel, PAGESZ));
+        else
+            sz = MIN(sz, BUFSZ);
+        if(src_pipe)
+            rc = (readstrict(src_fd, cpybuf, sz) == sz ? RC_OK : RC_CRIT);
+        else
+            rc = readat(src_fd, src_at + rel, cpybuf, sz);
+        checkrc(rc);
+        rc = writeat(dst_fd, dst_at + rel, cpybuf, sz);
+        checkrc(rc);
         rel += sz;
         plugin(2, NULL);
     }
@@ -643,7 +1167,9 @@ end:
 /**
  * @brief Copy data between file descriptors at specified file offsets. The
  *        file regions may overlap. This function allows for repeated copying
- *        of the same data if src_len is less than dst_len.
+ *        of the same data if src_len is less than dst_len. All I/O is
+ *        positioned, so the shared file offsets are left alone unless the
+ *        source is a pipe.
  *
  * @param[in] src_fd File descriptor from which to read data
  * @param[in] src_at File offset at which to begin reading
@@ -658,7 +1184,7 @@ rc_t filecpy(int src_fd, hoff_t src_at, hoff_t src_len,
              int dst_fd, hoff_t dst_at, hoff_t dst_len)
 {
     rc_t rc = RC_UNSPEC;
-    hoff_t src_before = -1, dst_before = -1, cpy_tot = 0;
+    hoff_t cpy_tot = 0;
 
     traceEntry("%s, " TRC_hoff ", " TRC_hoff ", "
                "%s, " TRC_hoff ", " TRC_hoff,
@@ -673,9 +1199,6 @@ rc_t filecpy(int src_fd, hoff_t src_at, hoff_t src_len,
     assert(dst_len >= 0);
     assert(src_len <= dst_len);
 
-    SAVE_OFFSET(src_fd, src_before);
-    SAVE_OFFSET(dst_fd, dst_before);
-
     bool isbk = isBackupFile(src_fd) ^ isBackupFile(dst_fd);
     bool uniq = isbk || (sameness(src_fd, dst_fd) == 0);
 
@@ -724,10 +1247,6 @@ rc_t filecpy(int src_fd, hoff_t src_at, hoff_t src_len,
     rc = RC_OK;
 
 end:
-    if(src_before >= 0)
-        RESTORE_OFFSET(src_fd, src_before);
-    if(dst_before >= 0)
-        RESTORE_OFFSET(dst_fd, dst_before);
     traceExit(TRC_rc, rc);
     return rc;
 }
@@ -749,6 +1268,508 @@ rc_t lclcpy(int fd, hoff_t src_at, hoff_t dst_at, hoff_t length)
     return filecpy(fd, src_at, length, fd, dst_at, length);
 }
 
+#define MOVE_MAXTHREADS 0x10
+#define MOVE_CHUNK CPY_CHUNK
+// Minimum shift distance for which a tail move records progress in place (see
+// moveTail()) instead of journalling windows of the tail (see moveWindows()).
+// Either way a mark comes at most once per SHIFT_WINDOW moved.
+#define SHIFT_MIN_DIST SHIFT_WINDOW
+// Length of tail moved between progress marks, at most
+#define SHIFT_MARK_LEN (MOVE_CHUNK * 0x40)
+
+/**
+ * @brief Shared state for the workers moving a file tail, one wavefront at a
+ *        time. The workers are started once for the whole move and wait for
+ *        each wavefront to be posted. A wavefront is copied from src_fd to
+ *        dst_fd, or, through a window buffer, only read or only written.
+ */
+typedef struct
+{
+    int src_fd;      // descriptor read from, or negative to write win
+    int dst_fd;      // descriptor written to, or negative to fill win
+    uint8_t *win;    // if non-NULL, buffer of the wavefront's octets
+    hoff_t src_at;   // start of the wavefront's source
+    hoff_t dst_at;   // start of the wavefront's destination
+    hoff_t len;      // wavefront length
+    hoff_t next;     // next relative offset to claim
+    int err;
+    unsigned wave;   // number of wavefronts posted
+    int busy;        // workers yet to finish the current wavefront
+    bool quit;       // no more wavefronts will be posted
+    pthread_mutex_t lock;
+    pthread_cond_t posted;
+    pthread_cond_t drained;
+} MoveWave;
+
+/**
+ * @brief Claim chunks of the current wavefront one at a time and copy each
+ *        with pread() / pwrite() (the shared file offset is left alone), until
+ *        none are left or an error occurs.
+ *
+ * @param[in,out] mw Shared move state
+ * @param[in] buf Buffer of MOVE_CHUNK octets, used unless mw->win is set
+ */
+static void moveChunks(MoveWave *mw, uint8_t *buf)
+{
+    for(;;)
+    {
+        hoff_t rel, len, done = 0;
+        uint8_t *chunk = NULL;
+
+        pthread_mutex_lock(&mw->lock);
+        rel = (mw->err == 0 && mw->next < mw->len) ? mw->next : -1;
+        if(rel >= 0)
+            mw->next += MOVE_CHUNK;
+        pthread_mutex_unlock(&mw->lock);
+        if(rel < 0)
+            break;
+
+        len = MIN(MOVE_CHUNK, mw->len - rel);
+        chunk = (mw->win ? mw->win + rel : buf);
+        for(int wr = (mw->src_fd < 0); wr < (mw->dst_fd < 0 ? 1 : 2); wr++)
+        {
+            for(done = 0; done < len; )
+            {
+                int fd = (wr ? mw->dst_fd : mw->src_fd);
+                off_t at = (off_t)((wr ? mw->dst_at : mw->src_at) + rel + done);
+                ssize_t lcl = wr ? pwrite(fd, chunk + done, len - done, at) :
+                                   pread(fd, chunk + done, len - done, at);
+                if(lcl < 0 && errno == EINTR)
+                    continue;
+                if(lcl <= 0)
+                {
+                    pthread_mutex_lock(&mw->lock);
+                    mw->err = lcl < 0 ? errno : EIO;
+                    pthread_mutex_unlock(&mw->lock);
+                    return;
+                }
+                done += lcl;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Worker: help move each wavefront as it is posted, until told to quit.
+ */
+static void *moveWorker(void *vp)
+{
+    MoveWave *mw = vp;
+    uint8_t *buf = Malloc(MOVE_CHUNK);
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&mw->lock);
+    for(;;)
+    {
+        while( ! mw->quit && mw->wave == seen)
+            pthread_cond_wait(&mw->posted, &mw->lock);
+        if(mw->quit)
+            break;
+        seen = mw->wave;
+        pthread_mutex_unlock(&mw->lock);
+        moveChunks(mw, buf);
+        pthread_mutex_lock(&mw->lock);
+        if(--mw->busy == 0)
+            pthread_cond_signal(&mw->drained);
+    }
+    pthread_mutex_unlock(&mw->lock);
+
+    free(buf);
+    return NULL;
+}
+
+/**
+ * @brief Set up the shared state of a move and start workers for it, enough
+ *        that with the calling thread there are as many threads as chunks in
+ *        its longest wavefront, MOVE_MAXTHREADS and CPUs at most.
+ *
+ * @param[out] mw Shared move state
+ * @param[out] threads Workers started
+ * @param[in] wave Length of the longest wavefront
+ * @return Number of workers started
+ */
+static int startMove(MoveWave *mw, pthread_t *threads, hoff_t wave)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthr = (int)MIN(MIN(MAX(ncpu, 1), MOVE_MAXTHREADS),
+                        (wave + MOVE_CHUNK - 1) / MOVE_CHUNK);
+    int started = 0;
+
+    memset(mw, 0, sizeof *mw);
+    pthread_mutex_init(&mw->lock, NULL);
+    pthread_cond_init(&mw->posted, NULL);
+    pthread_cond_init(&mw->drained, NULL);
+
+    for( ; started < nthr - 1; started++)
+    {
+        if(pthread_create(&threads[started], NULL, moveWorker, mw) != 0)
+            break;
+    }
+
+    return started;
+}
+
+/**
+ * @brief Post the wavefront set up in the shared state of a move to its
+ *        workers, take part in moving it, and wait until it is done.
+ *
+ * @param[in,out] mw Shared move state, with the wavefront set up
+ * @param[in] started Number of workers
+ * @param[in] buf Buffer of MOVE_CHUNK octets, used unless mw->win is set
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t runWave(MoveWave *mw, int started, uint8_t *buf)
+{
+    pthread_mutex_lock(&mw->lock);
+    mw->next = 0;
+    mw->busy = started;
+    mw->wave++;
+    pthread_cond_broadcast(&mw->posted);
+    pthread_mutex_unlock(&mw->lock);
+
+    moveChunks(mw, buf);
+
+    pthread_mutex_lock(&mw->lock);
+    while(mw->busy > 0)
+        pthread_cond_wait(&mw->drained, &mw->lock);
+    pthread_mutex_unlock(&mw->lock);
+
+    if(mw->err)
+    {
+        prerr("error moving data in %s: %s\n",
+              fdname(mw->src_fd >= 0 ? mw->src_fd : mw->dst_fd),
+              strerror(mw->err));
+        return RC_CRIT;
+    }
+    return RC_OK;
+}
+
+/**
+ * @brief Stop the workers of a move and release its shared state.
+ */
+static void endMove(MoveWave *mw, pthread_t *threads, int started)
+{
+    pthread_mutex_lock(&mw->lock);
+    mw->quit = true;
+    pthread_cond_broadcast(&mw->posted);
+    pthread_mutex_unlock(&mw->lock);
+    for(int th = 0; th < started; th++)
+        pthread_join(threads[th], NULL);
+    pthread_mutex_destroy(&mw->lock);
+    pthread_cond_destroy(&mw->posted);
+    pthread_cond_destroy(&mw->drained);
+}
+
+/**
+ * @brief Move a file tail within one file by a short distance, one window of
+ *        up to SHIFT_WINDOW at a time, from the end that is moving into free
+ *        space. A window overwrites part of its own source as it is moved, so
+ *        each is read into memory and that part of it is journalled in the
+ *        backup file with markShiftBackup() before it is written to its
+ *        destination. The rest of the window, as long as the shift distance,
+ *        is only overwritten by the next window, so recovery can still read it
+ *        from the data file. A last window no longer than the distance does
+ *        not overwrite its source and is journalled whole, as it is short.
+ *        Progress is marked once per window. Each window is read and written
+ *        by several threads at once, as by moveTail().
+ *
+ * @param[in] data_fi Hexpeek file index of data file
+ * @param[in] src_at File offset at which the tail begins
+ * @param[in] dst_at File offset to which the tail is moved
+ * @param[in] length Length of the tail
+ * @param[in] moved Length of the tail already moved, from the end that moves
+ *            first; a multiple of SHIFT_WINDOW
+ * @param[in] backup_fd Backup file descriptor in which to journal windows
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t moveWindows(int data_fi, hoff_t src_at, hoff_t dst_at,
+                        hoff_t length, hoff_t moved, int backup_fd)
+{
+    rc_t rc = RC_UNSPEC;
+    int fd = DT_FD(data_fi);
+    MoveWave mw;
+    pthread_t threads[MOVE_MAXTHREADS];
+    int started = 0;
+    uint8_t *win_mal = NULL;
+    hoff_t dist = (dst_at > src_at ? dst_at - src_at : src_at - dst_at);
+
+    if(moved >= length)
+        return RC_OK;
+
+    traceEntry("%s, " TRC_hoff ", " TRC_hoff ", " TRC_hoff ", " TRC_hoff
+               ", %d", fdname(fd), trchoff(src_at), trchoff(dst_at),
+               trchoff(length), trchoff(moved), backup_fd);
+
+    win_mal = Malloc((size_t)MIN(SHIFT_WINDOW, length - moved));
+    started = startMove(&mw, threads, MIN(SHIFT_WINDOW, length - moved));
+    mw.win = win_mal;
+
+    for(hoff_t len = 0; moved < length; moved += len)
+    {
+        len = MIN(SHIFT_WINDOW, length - moved);
+        // Moving forward, begin at the end; moving backward, at the start
+        hoff_t rel = (dst_at > src_at ? length - moved - len : moved);
+        // The overwritten part is the end of the window moving forward
+        hoff_t jnl = (len > dist ? len - dist : len);
+
+        progress(moved, length, 0);
+
+        mw.src_fd = fd;
+        mw.dst_fd = -1;
+        mw.src_at = src_at + rel;
+        mw.len = len;
+        rc = runWave(&mw, started, NULL);
+        checkrc(rc);
+
+        rc = markShiftBackup(data_fi, backup_fd, moved,
+                             win_mal + (dst_at > src_at ? len - jnl : 0), jnl);
+        checkrc(rc);
+
+        mw.src_fd = -1;
+        mw.dst_fd = fd;
+        mw.dst_at = dst_at + rel;
+        rc = runWave(&mw, started, NULL);
+        checkrc(rc);
+        plugin(2, NULL);
+    }
+
+    progress(-1, length, 0);
+
+    rc = RC_OK;
+
+end:
+    endMove(&mw, threads, started);
+    free(win_mal);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Move a file tail within one file using several threads. The region
+ *        is moved in wavefronts no longer than the shift distance, starting
+ *        from the end that is moving into free space: the source and
+ *        destination of one wavefront never overlap, so its chunks can be
+ *        copied in any order, and a wavefront only overwrites source data
+ *        that earlier wavefronts have finished reading. The calling thread
+ *        and up to MOVE_MAXTHREADS - 1 workers, started once for the whole
+ *        move, share the chunks of each wavefront. Small shifts and small
+ *        regions are handed to lclcpy() unless progress is being recorded.
+ *
+ *        With a backup file the move is resumable: before a wavefront would
+ *        take the move more than the shift distance past the last mark, the
+ *        progress is recorded with markShiftBackup(). Up to then nothing the
+ *        move has written overlaps source data not yet moved past the mark, so
+ *        moving again from the mark gives the same result. Progress is also
+ *        marked every SHIFT_MARK_LEN, so that a long move interrupted is not
+ *        repeated from far back.
+ *
+ * @param[in] data_fi Hexpeek file index of data file
+ * @param[in] src_at File offset at which the tail begins
+ * @param[in] dst_at File offset to which the tail is moved
+ * @param[in] length Length of the tail
+ * @param[in] moved Length of the tail already moved, from the end that moves
+ *            first
+ * @param[in] backup_fd Backup file descriptor in which to mark progress, or
+ *            negative if none
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t moveTail(int data_fi, hoff_t src_at, hoff_t dst_at, hoff_t length,
+                     hoff_t moved, int backup_fd)
+{
+    rc_t rc = RC_UNSPEC;
+    int fd = DT_FD(data_fi);
+    MoveWave mw;
+    pthread_t threads[MOVE_MAXTHREADS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthr = (int)MIN(MAX(ncpu, 1), MOVE_MAXTHREADS), started = 0;
+    hoff_t dist = (dst_at > src_at ? dst_at - src_at : src_at - dst_at);
+    hoff_t wave = MIN(dist, nthr * MOVE_CHUNK * 8), marked = moved;
+    uint8_t *buf_mal = NULL;
+
+    if(backup_fd < 0 &&
+       (nthr < 2 || dist < 2 * MOVE_CHUNK || length < 2 * MOVE_CHUNK))
+        return lclcpy(fd, src_at, dst_at, length);
+
+    traceEntry("%s, " TRC_hoff ", " TRC_hoff ", " TRC_hoff ", " TRC_hoff
+               ", %d", fdname(fd), trchoff(src_at), trchoff(dst_at),
+               trchoff(length), trchoff(moved), backup_fd);
+
+    buf_mal = Malloc(MOVE_CHUNK);
+    // The first wavefront is as long as any, so it bounds the workers needed
+    started = startMove(&mw, threads, MIN(wave, length - moved));
+    mw.src_fd = mw.dst_fd = fd;
+
+    while(moved < length)
+    {
+        hoff_t len = MIN(wave, length - moved);
+        // Moving forward, begin at the end; moving backward, at the start
+        hoff_t rel = (dst_at > src_at ? length - moved - len : moved);
+
+        if(backup_fd >= 0 && (moved + len - marked > dist ||
+                              moved - marked >= SHIFT_MARK_LEN))
+        {
+            rc = markShiftBackup(data_fi, backup_fd, moved, NULL, 0);
+            checkrc(rc);
+            marked = moved;
+        }
+
+        progress(moved, length, 0);
+
+        mw.src_at = src_at + rel;
+        mw.dst_at = dst_at + rel;
+        mw.len = len;
+        rc = runWave(&mw, started, buf_mal);
+        checkrc(rc);
+        moved += len;
+        plugin(2, NULL);
+    }
+
+    progress(-1, length, 0);
+
+    rc = RC_OK;
+
+end:
+    endMove(&mw, threads, started);
+    free(buf_mal);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Try to adjust the size of a file with fallocate() INSERT_RANGE or
+ *        COLLAPSE_RANGE (ext4, XFS) so that the file tail is remapped rather
+ *        than copied. The amount must be a multiple of the filesystem block
+ *        size; an unaligned offset is handled by operating on the enclosing
+ *        block and moving only the partial block in front of the offset.
+ *
+ * @param[in] data_fi Hexpeek file index of data file
+ * @param[in] start Offset at which to insert, or at which the kill begins
+ * @param[in] amt Amount of file adjustment (positive inserts, negative kills)
+ * @param[in] backup_fd Backup file descriptor, or negative if none
+ * @return RC_OK if the adjustment was made, RC_NIL if it does not apply or is
+ *         not supported (the file is then unchanged outside of the kill
+ *         range), otherwise a hexpeek error code.
+ */
+static rc_t adjustRange(int data_fi, hoff_t start, hoff_t amt, int backup_fd)
+{
+    rc_t rc = RC_NIL;
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+    int fd = DT_FD(data_fi);
+    struct stat info;
+    hoff_t blksz = 0, head = 0, at = 0, len = (amt < 0 ? -amt : amt);
+
+    if(fstat(fd, &info) || ! S_ISREG(info.st_mode) || info.st_blksize <= 0)
+        goto end;
+    blksz = info.st_blksize;
+    // The kernel refuses ranges that reach end of file; the caller then has
+    // no tail to move anyway.
+    if(len == 0 || len % blksz || start + MAX(0, -amt) >= info.st_size)
+        goto end;
+    head = start % blksz;
+    at = start - head;
+
+    if(amt > 0)
+    {
+        rc = makeAdjRangeBackup(data_fi, backup_fd, at, amt, start, 0);
+        checkrc(rc);
+        if(fallocate(fd, FALLOC_FL_INSERT_RANGE, at, len))
+            goto unsupported;
+        plugin(2, NULL);
+        if(head)
+        {
+            rc = lclcpy(fd, at + len, at, head);
+            checkrc(rc);
+        }
+    }
+    else
+    {
+        // The partial block in front of the kill is moved to the end of the
+        // kill range so it survives the collapse of whole blocks.
+        rc = makeAdjRangeBackup(data_fi, backup_fd, at, amt,
+                                at + len, head);
+        checkrc(rc);
+        if(head)
+        {
+            rc = lclcpy(fd, at, at + len, head);
+            checkrc(rc);
+            plugin(2, NULL);
+        }
+        if(fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, at, len))
+            goto unsupported;
+    }
+
+    rc = clearAdjBackup(backup_fd, NULL);
+    checkrc(rc);
+
+    rc = RC_OK;
+    goto end;
+
+unsupported:
+    trace("fallocate at " TRC_hoff " failed: %s\n", trchoff(at),
+          strerror(errno));
+    if(errno != EOPNOTSUPP && errno != EINVAL && errno != ENOSYS)
+    {
+        rc = RC_CRIT;
+        prerr("fallocate on %s: %s\n", fdname(fd), strerror(errno));
+        goto end;
+    }
+    rc = clearAdjBackup(backup_fd, NULL);
+    checkrc(rc);
+    rc = RC_NIL;
+#else
+    (void)data_fi; (void)start; (void)amt; (void)backup_fd;
+    goto end;
+#endif
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Move the file tail from pos by amt and, for a kill, truncate the file
+ *        after it. This is also how recovery finishes an interrupted move (see
+ *        makeShiftBackup()). With a backup file, a shift shorter than
+ *        SHIFT_MIN_DIST journals windows of the tail (see moveWindows()); a
+ *        longer one marks its progress in place (see moveTail()).
+ *
+ * @param[in] data_fi Hexpeek file index of data file
+ * @param[in] pos File offset at which the tail begins
+ * @param[in] amt Amount of file adjustment (positive inserts, negative kills)
+ * @param[in] f_sz File size before the adjustment
+ * @param[in] moved Length of the tail already moved
+ * @param[in] backup_fd Backup file descriptor in which to mark progress, or
+ *            negative if none
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t shiftTail(int data_fi, hoff_t pos, hoff_t amt, hoff_t f_sz, hoff_t moved,
+               int backup_fd)
+{
+    rc_t rc = RC_UNSPEC;
+
+    if(pos < f_sz && backup_fd >= 0 && (amt < 0 ? -amt : amt) < SHIFT_MIN_DIST)
+    {
+        rc = moveWindows(data_fi, pos, pos + amt, f_sz - pos, moved,
+                         backup_fd);
+        checkrc(rc);
+    }
+    else if(pos < f_sz)
+    {
+        rc = moveTail(data_fi, pos, pos + amt, f_sz - pos, moved, backup_fd);
+        checkrc(rc);
+    }
+
+    if(amt < 0)
+    {
+        rc = hexpeek_truncate(DT_FD(data_fi), f_sz + amt);
+        checkrc(rc);
+    }
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
 /**
  * @brief Adjust the size of file by inserting or killing (deleting) bytes
  *        at a certain file offset.
@@ -777,17 +1798,15 @@ rc_t adjustSize(int data_fi, hoff_t pos, hoff_t amt, int backup_fd)
     if(backup_fd < 0)
         backup_fd = backupFd(data_fi);
 
-    rc = makeAdjBackup(data_fi, backup_fd, pos);
-    checkrc(rc);
+    rc = adjustRange(data_fi, amt < 0 ? pos + amt : pos, amt, backup_fd);
+    if(rc != RC_NIL)
+        goto end;
 
-    if(pos < f_sz)
-    {
-        rc = lclcpy(DT_FD(data_fi), pos, pos + amt, f_sz - pos);
-        checkrc(rc);
-    }
+    rc = makeShiftBackup(data_fi, backup_fd, pos, amt);
+    checkrc(rc);
 
-    if(amt < 0 && hexpeek_truncate(DT_FD(data_fi), f_sz + amt))
-        goto end;
+    rc = shiftTail(data_fi, pos, amt, f_sz, 0, backup_fd);
+    checkrc(rc);
 
     rc = clearAdjBackup(backup_fd, NULL);
     checkrc(rc);
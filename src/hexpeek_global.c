@@ -56,6 +56,11 @@ uintmax_t Masks[MASK_COUNT];
  */
 uint8_t CharLookup[OCTET_COUNT];
 
+/**
+ * @brief Thread that hexpeek started in, set once by initialize().
+ */
+pthread_t MainThread;
+
 // Global variables
 
 /**
@@ -98,6 +103,8 @@ void initialize()
 {
     assert(PRIXMAX[strlen(PRIXMAX) - 1] == 'X');           // @!!X_IN_PRIXMAX
 
+    MainThread = pthread_self();
+
     for(hoff_t flag = 1; flag > 0; flag <<= 1)
     {
         HOFF_MAX |= flag;
@@ -0,0 +1,829 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define SRCNAME "hexpeek_hash.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    #define HASH_X86
+    #include <nmmintrin.h>
+    #include <wmmintrin.h>
+    #include <smmintrin.h>
+#endif
+
+/**
+ * @file hexpeek_hash.c
+ * @brief Checksums and hashes over raw filezone data: CRC32C, CRC32, xxHash64
+ *        and SHA-256, with an optional parallel tree mode.
+ */
+
+#define HASH_RDSZ       (BUFSZ * 0x10)
+#define HASH_BATCH      0x1000
+#define HASH_MAXTHREADS 0x10
+
+static char const *HashNames[HASH_COUNT] =
+{
+    "crc32c", "crc32", "xxh64", "sha256"
+};
+
+static size_t const HashDigestLen[HASH_COUNT] = { 4, 4, 8, 32 };
+
+static uint32_t Crc32Tbl[8][OCTET_COUNT];
+static uint32_t Crc32cTbl[8][OCTET_COUNT];
+static bool HashHwCrc32c = false;
+static bool HashHwClmul = false;
+static bool HashReady = false;
+
+//--------------------------------- Helpers ----------------------------------//
+
+static inline uint32_t ld32(uint8_t const *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t ld64(uint8_t const *p)
+{
+    return (uint64_t)ld32(p) | (uint64_t)ld32(p + 4) << 32;
+}
+
+static inline uint32_t ldbe32(uint8_t const *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline void stbe(uint8_t *p, uint64_t v, int width)
+{
+    for(int ix = width - 1; ix >= 0; ix--, v >>= 8)
+        p[ix] = (uint8_t)v;
+}
+
+static inline uint64_t rotl64(uint64_t v, int sh)
+{
+    return v << sh | v >> (64 - sh);
+}
+
+static inline uint32_t rotr32(uint32_t v, int sh)
+{
+    return v >> sh | v << (32 - sh);
+}
+
+/**
+ * @brief Build the slicing-by-8 tables for a reflected CRC polynomial.
+ */
+static void crcTables(uint32_t tbl[8][OCTET_COUNT], uint32_t poly)
+{
+    for(int oc = 0; oc < OCTET_COUNT; oc++)
+    {
+        uint32_t crc = (uint32_t)oc;
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+        tbl[0][oc] = crc;
+    }
+    for(int oc = 0; oc < OCTET_COUNT; oc++)
+        for(int sl = 1; sl < 8; sl++)
+            tbl[sl][oc] = (tbl[sl - 1][oc] >> 8) ^
+                          tbl[0][tbl[sl - 1][oc] & 0xFF];
+}
+
+/**
+ * @brief One-time setup of lookup tables and CPU feature detection. Called
+ *        from hashInit(), which must run on the main thread before any
+ *        worker threads are started.
+ */
+static void hashSetup()
+{
+    if(HashReady)
+        return;
+    crcTables(Crc32Tbl, 0xEDB88320);
+    crcTables(Crc32cTbl, 0x82F63B78);
+#ifdef HASH_X86
+    __builtin_cpu_init();
+    HashHwCrc32c = __builtin_cpu_supports("sse4.2");
+    HashHwClmul = __builtin_cpu_supports("pclmul") &&
+                  __builtin_cpu_supports("sse4.1");
+#endif
+    trace("hw crc32c %d, hw clmul %d\n", (int)HashHwCrc32c, (int)HashHwClmul);
+    HashReady = true;
+}
+
+//----------------------------------- CRC ------------------------------------//
+
+/**
+ * @brief Table driven CRC, 8 octets per step.
+ */
+static uint32_t crcSlice8(uint32_t tbl[8][OCTET_COUNT], uint32_t crc,
+                          uint8_t const *p, size_t len)
+{
+    for( ; len >= 8; len -= 8, p += 8)
+    {
+        uint32_t lo = crc ^ ld32(p), hi = ld32(p + 4);
+        crc = tbl[7][lo & 0xFF] ^ tbl[6][(lo >> 8) & 0xFF] ^
+              tbl[5][(lo >> 16) & 0xFF] ^ tbl[4][lo >> 24] ^
+              tbl[3][hi & 0xFF] ^ tbl[2][(hi >> 8) & 0xFF] ^
+              tbl[1][(hi >> 16) & 0xFF] ^ tbl[0][hi >> 24];
+    }
+    for( ; len > 0; len--, p++)
+        crc = (crc >> 8) ^ tbl[0][(crc ^ *p) & 0xFF];
+    return crc;
+}
+
+#ifdef HASH_X86
+/**
+ * @brief CRC32C using the SSE4.2 crc32 instruction.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc, uint8_t const *p, size_t len)
+{
+    uint64_t crc64 = crc;
+    for( ; len > 0 && ((uintptr_t)p & 7); len--, p++)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p);
+    for( ; len >= 8; len -= 8, p += 8)
+    {
+        uint64_t wd;
+        memcpy(&wd, p, sizeof wd);
+        crc64 = _mm_crc32_u64(crc64, wd);
+    }
+    for( ; len > 0; len--, p++)
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p);
+    return (uint32_t)crc64;
+}
+
+/**
+ * @brief CRC32 (IEEE 802.3, reflected) by carry-less multiplication: fold
+ *        four 128-bit lanes across the input, fold those to one, then reduce
+ *        to 32 bits with a Barrett reduction. len must be at least 64 and a
+ *        multiple of 16.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32Clmul(uint32_t crc, uint8_t const *p, size_t len)
+{
+    __m128i const k12 = _mm_set_epi64x(0x1C6E41596LL, 0x154442BD4LL);
+    __m128i const k34 = _mm_set_epi64x(0x0CCAA009ELL, 0x1751997D0LL);
+    __m128i const k5 = _mm_set_epi64x(0, 0x163CD6124LL);
+    __m128i const pu = _mm_set_epi64x(0x1F7011641LL, 0x1DB710641LL);
+    __m128i const m32 = _mm_set_epi32(0, 0, 0, -1);
+    __m128i x[4], tmp;
+
+    for(int ln = 0; ln < 4; ln++)
+        x[ln] = _mm_loadu_si128((__m128i const *)(p + 0x10 * ln));
+    x[0] = _mm_xor_si128(x[0], _mm_cvtsi32_si128((int)crc));
+    p += 0x40;
+    len -= 0x40;
+
+    for( ; len >= 0x40; len -= 0x40, p += 0x40)
+    {
+        for(int ln = 0; ln < 4; ln++)
+        {
+            tmp = _mm_clmulepi64_si128(x[ln], k12, 0x00);
+            x[ln] = _mm_clmulepi64_si128(x[ln], k12, 0x11);
+            x[ln] = _mm_xor_si128(x[ln], tmp);
+            x[ln] = _mm_xor_si128(x[ln],
+                        _mm_loadu_si128((__m128i const *)(p + 0x10 * ln)));
+        }
+    }
+
+    for(int ln = 1; ln < 4; ln++)
+    {
+        tmp = _mm_clmulepi64_si128(x[0], k34, 0x00);
+        x[0] = _mm_clmulepi64_si128(x[0], k34, 0x11);
+        x[0] = _mm_xor_si128(_mm_xor_si128(x[0], tmp), x[ln]);
+    }
+    for( ; len >= 0x10; len -= 0x10, p += 0x10)
+    {
+        tmp = _mm_clmulepi64_si128(x[0], k34, 0x00);
+        x[0] = _mm_clmulepi64_si128(x[0], k34, 0x11);
+        x[0] = _mm_xor_si128(_mm_xor_si128(x[0], tmp),
+                             _mm_loadu_si128((__m128i const *)p));
+    }
+
+    // 128 to 64 bits
+    tmp = _mm_srli_si128(x[0], 8);
+    x[0] = _mm_clmulepi64_si128(x[0], k34, 0x10);
+    x[0] = _mm_xor_si128(x[0], tmp);
+
+    // 64 to 32 bits
+    tmp = _mm_srli_si128(x[0], 4);
+    x[0] = _mm_and_si128(x[0], m32);
+    x[0] = _mm_clmulepi64_si128(x[0], k5, 0x00);
+    x[0] = _mm_xor_si128(x[0], tmp);
+
+    // Barrett reduction
+    tmp = x[0];
+    x[0] = _mm_and_si128(x[0], m32);
+    x[0] = _mm_clmulepi64_si128(x[0], pu, 0x10);
+    x[0] = _mm_and_si128(x[0], m32);
+    x[0] = _mm_clmulepi64_si128(x[0], pu, 0x00);
+    x[0] = _mm_xor_si128(x[0], tmp);
+    return (uint32_t)_mm_extract_epi32(x[0], 1);
+}
+#endif
+
+static uint32_t crc32cUpdate(uint32_t crc, uint8_t const *p, size_t len)
+{
+#ifdef HASH_X86
+    if(HashHwCrc32c)
+        return crc32cHw(crc, p, len);
+#endif
+    return crcSlice8(Crc32cTbl, crc, p, len);
+}
+
+static uint32_t crc32Update(uint32_t crc, uint8_t const *p, size_t len)
+{
+#ifdef HASH_X86
+    if(HashHwClmul && len >= 0x40)
+    {
+        size_t bulk = len & ~(size_t)0xF;
+        crc = crc32Clmul(crc, p, bulk);
+        p += bulk;
+        len -= bulk;
+    }
+#endif
+    return crcSlice8(Crc32Tbl, crc, p, len);
+}
+
+//--------------------------------- xxHash64 ---------------------------------//
+
+#define XXP1 0x9E3779B185EBCA87ULL
+#define XXP2 0xC2B2AE3D27D4EB4FULL
+#define XXP3 0x165667B19E3779F9ULL
+#define XXP4 0x85EBCA77C2B2AE63ULL
+#define XXP5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxRound(uint64_t acc, uint64_t in)
+{
+    acc += in * XXP2;
+    acc = rotl64(acc, 31);
+    return acc * XXP1;
+}
+
+static inline uint64_t xxMerge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxRound(0, val);
+    return acc * XXP1 + XXP4;
+}
+
+static void xxStripes(uint64_t v[4], uint8_t const *p, size_t stripes)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    for( ; stripes > 0; stripes--, p += 32)
+    {
+        v0 = xxRound(v0, ld64(p));
+        v1 = xxRound(v1, ld64(p + 8));
+        v2 = xxRound(v2, ld64(p + 16));
+        v3 = xxRound(v3, ld64(p + 24));
+    }
+    v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+}
+
+static uint64_t xxDigest(HashCtx const *hc)
+{
+    uint64_t const *v = hc->st.xxh.v;
+    uint8_t const *p = hc->st.xxh.mem;
+    size_t rem = (size_t)(hc->total & 31);
+    uint64_t h;
+
+    if(hc->total >= 32)
+    {
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) +
+            rotl64(v[2], 12) + rotl64(v[3], 18);
+        for(int ln = 0; ln < 4; ln++)
+            h = xxMerge(h, v[ln]);
+    }
+    else
+    {
+        h = v[2] + XXP5; // v[2] holds the seed
+    }
+    h += hc->total;
+
+    for( ; rem >= 8; rem -= 8, p += 8)
+    {
+        h ^= xxRound(0, ld64(p));
+        h = rotl64(h, 27) * XXP1 + XXP4;
+    }
+    if(rem >= 4)
+    {
+        h ^= (uint64_t)ld32(p) * XXP1;
+        h = rotl64(h, 23) * XXP2 + XXP3;
+        p += 4;
+        rem -= 4;
+    }
+    for( ; rem > 0; rem--, p++)
+    {
+        h ^= *p * XXP5;
+        h = rotl64(h, 11) * XXP1;
+    }
+
+    h ^= h >> 33;
+    h *= XXP2;
+    h ^= h >> 29;
+    h *= XXP3;
+    h ^= h >> 32;
+    return h;
+}
+
+//---------------------------------- SHA-256 ---------------------------------//
+
+static uint32_t const ShaK[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void shaBlocks(uint32_t h[8], uint8_t const *p, size_t blocks)
+{
+    uint32_t w[64];
+    for( ; blocks > 0; blocks--, p += 64)
+    {
+        for(int ix = 0; ix < 16; ix++)
+            w[ix] = ldbe32(p + 4 * ix);
+        for(int ix = 16; ix < 64; ix++)
+        {
+            uint32_t s0 = rotr32(w[ix - 15], 7) ^ rotr32(w[ix - 15], 18) ^
+                          (w[ix - 15] >> 3);
+            uint32_t s1 = rotr32(w[ix - 2], 17) ^ rotr32(w[ix - 2], 19) ^
+                          (w[ix - 2] >> 10);
+            w[ix] = w[ix - 16] + s0 + w[ix - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3],
+                 e = h[4], f = h[5], g = h[6], k = h[7];
+        for(int ix = 0; ix < 64; ix++)
+        {
+            uint32_t t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) +
+                          ((e & f) ^ (~e & g)) + ShaK[ix] + w[ix];
+            uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) +
+                          ((a & b) ^ (a & c) ^ (b & c));
+            k = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+    }
+}
+
+//------------------------------- Hash Context -------------------------------//
+
+/**
+ * @brief Look up a hash algorithm by name.
+ *
+ * @param[in] name Algorithm name
+ * @return HASH_* index, or -1 if the name is not recognized
+ */
+int hashAlgorithm(char const *name)
+{
+    for(int algo = 0; algo < HASH_COUNT; algo++)
+        if(strcmp(name, HashNames[algo]) == 0)
+            return algo;
+    return -1;
+}
+
+/**
+ * @brief Name of a hash algorithm.
+ */
+char const *hashName(int algo)
+{
+    assert(algo >= 0 && algo < HASH_COUNT);
+    return HashNames[algo];
+}
+
+/**
+ * @brief Begin a hash computation.
+ *
+ * @param[out] hc Context to initialize
+ * @param[in] algo HASH_* index
+ * @return Length in octets of the digest hashFinal() will produce
+ */
+size_t hashInit(HashCtx *hc, int algo)
+{
+    static uint32_t const sha_iv[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    assert(algo >= 0 && algo < HASH_COUNT);
+    hashSetup();
+    memset(hc, 0, sizeof *hc);
+    hc->algo = algo;
+    switch(algo)
+    {
+    case HASH_CRC32C:
+    case HASH_CRC32:
+        hc->st.crc = 0xFFFFFFFF;
+        break;
+    case HASH_XXH64:
+        hc->st.xxh.v[0] = XXP1 + XXP2;
+        hc->st.xxh.v[1] = XXP2;
+        hc->st.xxh.v[2] = 0;
+        hc->st.xxh.v[3] = 0 - XXP1;
+        break;
+    case HASH_SHA256:
+        memcpy(hc->st.sha.h, sha_iv, sizeof sha_iv);
+        break;
+    }
+    return HashDigestLen[algo];
+}
+
+/**
+ * @brief Add data to a hash computation.
+ */
+void hashUpdate(HashCtx *hc, void const *buf, size_t len)
+{
+    uint8_t const *p = buf;
+    size_t blk = 0, have = 0;
+    uint8_t *mem = NULL;
+
+    switch(hc->algo)
+    {
+    case HASH_CRC32C:
+        hc->st.crc = crc32cUpdate(hc->st.crc, p, len);
+        hc->total += len;
+        return;
+    case HASH_CRC32:
+        hc->st.crc = crc32Update(hc->st.crc, p, len);
+        hc->total += len;
+        return;
+    case HASH_XXH64:
+        blk = 32;
+        mem = hc->st.xxh.mem;
+        break;
+    case HASH_SHA256:
+        blk = 64;
+        mem = hc->st.sha.mem;
+        break;
+    }
+
+    have = (size_t)(hc->total % blk);
+    hc->total += len;
+    if(have > 0)
+    {
+        size_t take = MIN(blk - have, len);
+        memcpy(mem + have, p, take);
+        p += take;
+        len -= take;
+        if(have + take < blk)
+            return;
+        if(hc->algo == HASH_XXH64)
+            xxStripes(hc->st.xxh.v, mem, 1);
+        else
+            shaBlocks(hc->st.sha.h, mem, 1);
+    }
+    if(len >= blk)
+    {
+        if(hc->algo == HASH_XXH64)
+            xxStripes(hc->st.xxh.v, p, len / blk);
+        else
+            shaBlocks(hc->st.sha.h, p, len / blk);
+        p += len - len % blk;
+        len %= blk;
+    }
+    memcpy(mem, p, len);
+}
+
+/**
+ * @brief Finish a hash computation. Digests are written most significant
+ *        octet first, so they print the way each algorithm is conventionally
+ *        displayed.
+ *
+ * @param[in] hc Context (left unusable)
+ * @param[out] digest Buffer of at least HASH_MAXDIGEST octets
+ */
+void hashFinal(HashCtx *hc, uint8_t *digest)
+{
+    switch(hc->algo)
+    {
+    case HASH_CRC32C:
+    case HASH_CRC32:
+        stbe(digest, ~hc->st.crc, 4);
+        break;
+    case HASH_XXH64:
+        stbe(digest, xxDigest(hc), 8);
+        break;
+    case HASH_SHA256:
+    {
+        uint64_t bits = hc->total * 8;
+        uint8_t pad[72];
+        size_t padlen = 64 - (size_t)((hc->total + 8) % 64);
+        memset(pad, 0, sizeof pad);
+        pad[0] = 0x80;
+        stbe(pad + padlen, bits, 8);
+        hashUpdate(hc, pad, padlen + 8);
+        for(int ix = 0; ix < 8; ix++)
+            stbe(digest + 4 * ix, hc->st.sha.h[ix], 4);
+        break;
+    }
+    }
+}
+
+//------------------------------ Block Hashing -------------------------------//
+
+/**
+ * @brief Shared state for the block hashing workers of one batch.
+ */
+typedef struct
+{
+    int algo;
+    int fi;
+    int fd;
+    hoff_t at;       // start of the first block
+    hoff_t end;      // no block extends past this offset
+    hoff_t blksz;
+    hoff_t count;    // blocks in this batch
+    hoff_t next;     // next block to claim
+    size_t dlen;
+    uint8_t *digests;
+    int err;
+    pthread_mutex_t lock;
+} BlockBatch;
+
+/**
+ * @brief Worker: claim blocks one at a time, read each with pread() (the
+ *        shared file offset is left alone) and store its digest.
+ */
+static void *blockWorker(void *vp)
+{
+    BlockBatch *bb = vp;
+    uint8_t *rd_buf = Malloc(BUFSZ);
+
+    for(;;)
+    {
+        hoff_t blk, at, len;
+        HashCtx hc;
+
+        pthread_mutex_lock(&bb->lock);
+        blk = (bb->err == 0 && bb->next < bb->count) ? bb->next++ : -1;
+        pthread_mutex_unlock(&bb->lock);
+        if(blk < 0)
+            break;
+
+        at = bb->at + blk * bb->blksz;
+        len = MIN(bb->blksz, bb->end - at);
+        hashInit(&hc, bb->algo);
+        while(len > 0)
+        {
+            ssize_t lcl_rd = overlayActive(bb->fi) ?
+                (ssize_t)overlayPread(bb->fi, rd_buf, MIN(BUFSZ, len), at) :
+                pread(bb->fd, rd_buf, (size_t)MIN(BUFSZ, len), (off_t)at);
+            if(lcl_rd < 0 && errno == EINTR)
+                continue;
+            if(lcl_rd <= 0)
+            {
+                pthread_mutex_lock(&bb->lock);
+                bb->err = lcl_rd < 0 ? errno : EIO;
+                pthread_mutex_unlock(&bb->lock);
+                break;
+            }
+            hashUpdate(&hc, rd_buf, (size_t)lcl_rd);
+            at += lcl_rd;
+            len -= lcl_rd;
+        }
+        hashFinal(&hc, bb->digests + (size_t)blk * bb->dlen);
+    }
+
+    free(rd_buf);
+    return NULL;
+}
+
+/**
+ * @brief Hash count consecutive blocks of a seekable file in parallel. The
+ *        last block is cut short if it would pass end, which must not be
+ *        beyond the end of the file.
+ *
+ * @param[in] fi File index
+ * @param[in] at Offset of the first block
+ * @param[in] end Offset no block extends past
+ * @param[in] algo HASH_* index
+ * @param[in] blksz Block size
+ * @param[in] count Number of blocks
+ * @param[out] digests count digests of the algorithm's length, in order
+ * @return RC_OK on success; else a hexpeek error code
+ */
+rc_t hashBlocks(int fi, hoff_t at, hoff_t end, int algo, hoff_t blksz,
+                hoff_t count, uint8_t *digests)
+{
+    rc_t rc = RC_UNSPEC;
+    BlockBatch bb;
+    HashCtx hc;
+    pthread_t threads[HASH_MAXTHREADS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthr = (int)MIN(MAX(ncpu, 1), MIN(HASH_MAXTHREADS, count));
+    int started = 0;
+
+    assert(blksz > 0);
+    assert(count >= 0);
+    assert(count == 0 || at + (count - 1) * blksz < end);
+
+    memset(&bb, 0, sizeof bb);
+    bb.algo = algo;
+    bb.fi = fi;
+    bb.fd = DT_FD(fi);
+    bb.at = at;
+    bb.end = end;
+    bb.blksz = blksz;
+    bb.count = count;
+    bb.dlen = hashInit(&hc, algo); // also completes one-time setup
+    bb.digests = digests;
+    pthread_mutex_init(&bb.lock, NULL);
+
+    for( ; started < nthr; started++)
+    {
+        if(pthread_create(&threads[started], NULL, blockWorker, &bb) != 0)
+            break;
+    }
+    if(started == 0)
+        blockWorker(&bb);
+    for(int th = 0; th < started; th++)
+        pthread_join(threads[th], NULL);
+    pthread_mutex_destroy(&bb.lock);
+
+    if(bb.err)
+    {
+        rc = RC_CRIT;
+        prerr("error reading %s: %s\n", DT_NAME(fi), strerror(bb.err));
+        goto end;
+    }
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Tree hash: the filezone is split into leaves of leafsz octets which
+ *        are hashed in parallel, and the result is the hash of the
+ *        concatenated leaf digests. Leaves are processed in bounded batches
+ *        so memory use does not depend on the filezone size.
+ */
+static rc_t treeHash(int fi, hoff_t start, hoff_t len, int algo,
+                     hoff_t leafsz, uint8_t *digest)
+{
+    rc_t rc = RC_UNSPEC;
+    HashCtx root;
+    size_t dlen = hashInit(&root, algo);
+    uint8_t *digests = Malloc(dlen * HASH_BATCH);
+    hoff_t end = start + len, count = 0;
+
+    for(hoff_t at = start; at < end; at += count * leafsz)
+    {
+        count = MIN(HASH_BATCH, (end - at - 1) / leafsz + 1);
+        rc = hashBlocks(fi, at, end, algo, leafsz, count, digests);
+        checkrc(rc);
+        hashUpdate(&root, digests, dlen * (size_t)count);
+    }
+    hashFinal(&root, digest);
+
+    rc = RC_OK;
+
+end:
+    free(digests);
+    return rc;
+}
+
+//--------------------------------- Command ----------------------------------//
+
+/**
+ * @brief Hash a filezone and print one line: the algorithm (with "/LEAFSZ"
+ *        appended in tree mode), the filezone actually hashed, and the
+ *        digest in hexadecimal. The line is meant to be easy to consume from
+ *        scripts.
+ *
+ * @param[in] fz Filezone to hash; for sequential hashing the file must
+ *               already be positioned at fz->start
+ * @param[in] algo HASH_* index
+ * @param[in] leafsz Leaf size for tree mode, or 0 to hash sequentially
+ * @param[out] octets_processed Amount of data hashed
+ * @return RC_OK on success; else a hexpeek error code
+ */
+rc_t hashZone(FileZone const *fz, int algo, hoff_t leafsz,
+              hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    uint8_t *rd_buf = NULL;
+    uint8_t digest[HASH_MAXDIGEST];
+    size_t dlen = 0;
+    hoff_t length = fz->len, tot = 0;
+    bool eof = false;
+
+    assert(leafsz >= 0);
+
+    if(leafsz > 0)
+    {
+        hoff_t fsz = -1;
+        if( ! isseekable(fz->fi) || (fsz = filesize(fz->fi)) < 0)
+        {
+            rc = RC_USER;
+            prohibcmd("tree hash requires a seekable file\n");
+            goto end;
+        }
+        tot = MIN(length, MAX(fsz - fz->start, 0));
+        eof = (tot < length);
+        if(tot > 0)
+        {
+            rc = treeHash(fz->fi, fz->start, tot, algo, leafsz, digest);
+            checkrc(rc);
+        }
+        else
+        {
+            HashCtx hc;
+            hashInit(&hc, algo);
+            hashFinal(&hc, digest);
+        }
+        dlen = HashDigestLen[algo];
+    }
+    else
+    {
+        HashCtx hc;
+        dlen = hashInit(&hc, algo);
+        rd_buf = Malloc(HASH_RDSZ);
+#ifdef POSIX_FADV_SEQUENTIAL
+        if(isseekable(fz->fi))
+            posix_fadvise(DT_FD(fz->fi), fz->start,
+                          length == HOFF_MAX ? 0 : length,
+                          POSIX_FADV_SEQUENTIAL);
+#endif
+        while(length > 0)
+        {
+            hoff_t lcl_rd = hexpeek_read(DT_FD(fz->fi), rd_buf,
+                                         MIN(HASH_RDSZ, length));
+            if(lcl_rd < 0)
+            {
+                rc = RC_CRIT;
+                goto end;
+            }
+            if(lcl_rd == 0)
+            {
+                eof = true;
+                break;
+            }
+            hashUpdate(&hc, rd_buf, (size_t)lcl_rd);
+            tot += lcl_rd;
+            length -= lcl_rd;
+        }
+        hashFinal(&hc, digest);
+    }
+
+    consoleOutf("%s", HashNames[algo]);
+    if(leafsz > 0)
+        consoleOutf("/" PRI_hoff, prihoff(leafsz));
+    consoleOutf(" " PRI_hoff "," PRI_hoff MarginPost,
+                prihoff(fz->start), prihoff(tot));
+    for(size_t ix = 0; ix < dlen; ix++)
+        consoleOutf("%s", BinLookup_hexl[digest[ix]]);
+    consoleOutf("%s", LineTerm);
+
+    *octets_processed = tot;
+    rc = RC_OK;
+
+    if(eof && ! fz->tolerate_eof)
+    {
+        rc = RC_USER;
+        prerr(EofErrString, DT_NAME(fz->fi));
+    }
+
+end:
+    consoleFlush();
+    free(rd_buf);
+    return rc;
+}
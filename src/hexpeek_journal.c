@@ -0,0 +1,438 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#define SRCNAME "hexpeek_journal.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/**
+ * @file hexpeek_journal.c
+ * @brief Undo journal (-journal): rather than truncating the backup file of
+ *        the round before last when a new round of backup operations starts,
+ *        move it aside as a journal segment named by its first operation, so
+ *        undo and recovery can go back further than the two backup files.
+ *
+ * Segments are never written again, except that recovery moves one back into
+ * place as a backup file before reverting its operations. So the segment
+ * holding any operation is found by name, without reading another file. Once
+ * the segments of an infile exceed the -journal size, the oldest are unlinked
+ * by a background thread.
+ */
+
+/**
+ * @struct Journal
+ *
+ * @brief Journal segments kept for one infile, which are always those of a
+ *        run of consecutive rounds.
+ *
+ * @var Journal::oldest
+ * First operation of the oldest segment.
+ * @var Journal::step
+ * Operations per round.
+ * @var Journal::count
+ * Number of segments.
+ * @var Journal::octets
+ * Total size of the segments.
+ * @var Journal::read_fd
+ * Descriptor of the segment last opened by journalOpen().
+ * @var Journal::read_name_mal
+ * Its name for messages (see journalName()), or NULL.
+ */
+typedef struct
+{
+    uint64_t oldest;
+    uint64_t step;
+    long count;
+    hoff_t octets;
+    int read_fd;
+    char *read_name_mal;
+} Journal;
+
+static Journal Journals[MAX_INFILES];
+
+/**
+ * @struct TrimJob
+ *
+ * @brief Segments for the background thread to unlink, oldest first.
+ *
+ * @var TrimJob::paths_mal
+ * Malloc()-d array of malloc()-d paths.
+ * @var TrimJob::count
+ * Number of paths.
+ */
+typedef struct
+{
+    char **paths_mal;
+    size_t count;
+} TrimJob;
+
+static pthread_t Trimmer;
+static bool TrimmerLive = false;
+
+/**
+ * @brief Path of the journal segment of an infile starting at an operation.
+ *
+ * @return Malloc-d buffer of path text.
+ */
+static char *segmentPath(int data_fi, uint64_t firstop)
+{
+    return genSegmentName(DT_PATH(data_fi), DT_FD(data_fi), firstop);
+}
+
+/**
+ * @brief Thread entry point unlinking the segments of a TrimJob.
+ *
+ * @param[in] vp Malloc()-d TrimJob, freed here
+ * @return NULL
+ */
+static void *trimWorker(void *vp)
+{
+    TrimJob *job = vp;
+    for(size_t ix = 0; ix < job->count; ix++)
+    {
+        unlink(job->paths_mal[ix]);
+        free(job->paths_mal[ix]);
+    }
+    free(job->paths_mal);
+    free(job);
+    return NULL;
+}
+
+/**
+ * @brief Wait for the background unlinking of segments to finish.
+ */
+static void trimWait(void)
+{
+    if(TrimmerLive)
+    {
+        pthread_join(Trimmer, NULL);
+        TrimmerLive = false;
+    }
+}
+
+/**
+ * @brief Drop the oldest segments of an infile until they fit in the
+ *        -journal size. The segments are unlinked by a background thread (or
+ *        here, if one can not be started) in order oldest first, so those
+ *        left on disk are always of consecutive rounds.
+ *
+ * @param[in] data_fi Infile file index
+ */
+static void trim(int data_fi)
+{
+    Journal *jr = &Journals[data_fi];
+    TrimJob *job = NULL;
+
+    if(jr->octets <= Params.journal)
+        return;
+
+    job = Malloc(sizeof *job);
+    job->count = 0;
+    job->paths_mal = Malloc(jr->count * sizeof *job->paths_mal);
+    while(jr->count > 0 && jr->octets > Params.journal)
+    {
+        char *path = segmentPath(data_fi, jr->oldest);
+        jr->octets -= MAX(0, pathsize(path));
+        jr->oldest += jr->step;
+        jr->count--;
+        job->paths_mal[job->count++] = path;
+    }
+    if(jr->count == 0)
+        jr->octets = 0;
+
+    trimWait();
+    if(pthread_create(&Trimmer, NULL, trimWorker, job) == 0)
+        TrimmerLive = true;
+    else
+        trimWorker(job);
+}
+
+/**
+ * @brief Check that an infile about to get new backup files has no journal
+ *        segments left over from an earlier run, which recovery would take
+ *        as older rounds of this one.
+ *
+ * @param[in] data_fi Infile file index
+ * @return RC_OK if there are none, else RC_CRIT
+ */
+rc_t journalCheck(int data_fi)
+{
+    rc_t rc = RC_UNSPEC;
+    DIR *dir = NULL;
+    char *model = NULL, *dirbuf = NULL;
+    char const *base = NULL;
+    size_t baselen = 0, digits_at = 0;
+
+    if( ! DT_PATH(data_fi))
+    {
+        rc = RC_OK;
+        goto end;
+    }
+
+    // Segment names differ only in the hex digits of their first operation
+    model = segmentPath(data_fi, 0);
+    dirbuf = strdup(model);
+    if( ! dirbuf)
+        die();
+    base = strrchr(model, '/') ? strrchr(model, '/') + 1 : model;
+    baselen = strlen(base);
+    digits_at = baselen - strlen("." BACKUP_EXT) - 16;
+
+    dir = opendir(dirname(dirbuf));
+    if( ! dir)
+    {
+        rc = RC_OK;
+        goto end;
+    }
+    for(struct dirent *ent = readdir(dir); ent; ent = readdir(dir))
+    {
+        bool match = (strlen(ent->d_name) == baselen &&
+                      memcmp(ent->d_name, base, digits_at) == 0 &&
+                      streq(ent->d_name + digits_at + 16,
+                            base + digits_at + 16));
+        for(size_t ix = digits_at; match && ix < digits_at + 16; ix++)
+            match = (CharLookup[(uint8_t)ent->d_name[ix]] <= 0xF);
+        if(match)
+        {
+            rc = RC_CRIT;
+            prerr("journal segment \"%s\" already exists; either run '" PRGNM
+                  " -recover' or delete it\n", cleanstring(ent->d_name));
+            goto end;
+        }
+    }
+
+    rc = RC_OK;
+
+end:
+    if(dir)
+        closedir(dir);
+    free(model);
+    free(dirbuf);
+    return rc;
+}
+
+/**
+ * @brief Return whether an infile has a journal segment starting at an
+ *        operation. Segments being unlinked in the background are waited
+ *        for, so they are not found.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] firstop First operation of the segment
+ */
+bool journalHas(int data_fi, uint64_t firstop)
+{
+    char *path = segmentPath(data_fi, firstop);
+    bool has = false;
+    trimWait();
+    has = (pathsize(path) > 0);
+    free(path);
+    return has;
+}
+
+/**
+ * @brief Open a journal segment read-only.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] firstop First operation of the segment
+ * @param[out] fd File descriptor of the segment
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t journalOpen(int data_fi, uint64_t firstop, int *fd)
+{
+    Journal *jr = &Journals[data_fi];
+    char *path = segmentPath(data_fi, firstop);
+    rc_t rc = hexpeek_open(path, O_RDONLY, 0, fd);
+
+    if(rc == RC_OK)
+    {
+        char const *clean = cleanstring(path);
+        size_t length = 16 + 1 + strlen(clean) + 1 + 1;
+        free(jr->read_name_mal);
+        jr->read_name_mal = Malloc(length);
+        snprintf(jr->read_name_mal, length, "journal segment \"%s\"", clean);
+        jr->read_fd = *fd;
+    }
+    free(path);
+    return rc;
+}
+
+/**
+ * @brief Name a segment opened by journalOpen() for messages, as fdname()
+ *        does other files.
+ *
+ * @param[in] fd File descriptor
+ * @return The name, or NULL if fd is not such a segment
+ */
+char const *journalName(int fd)
+{
+    for(int fi = 0; fi < MAX_INFILES; fi++)
+    {
+        if(Journals[fi].read_name_mal && Journals[fi].read_fd == fd)
+            return Journals[fi].read_name_mal;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Move a backup file aside as a journal segment and put a new, empty
+ *        backup file in its place.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] bidx Backup index of the backup file
+ * @param[in] firstop First operation recorded in the backup file
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t journalArchive(int data_fi, int bidx, uint64_t firstop)
+{
+    rc_t rc = RC_UNSPEC;
+    Journal *jr = &Journals[data_fi];
+    char *path = segmentPath(data_fi, firstop);
+
+    traceEntry("%d, %d, %" PRIu64, data_fi, bidx, firstop);
+
+    if(Params.backup_sync != BACKUP_SYNC_NONE)
+    {
+        rc = hexpeek_datasync(BK_FD(data_fi, bidx));
+        checkrc(rc);
+    }
+    close(BK_FD(data_fi, bidx));
+    BK_FD(data_fi, bidx) = -1;
+
+    if(rename(BK_PATH(data_fi, bidx), path))
+    {
+        rc = RC_CRIT;
+        prerr("error renaming %s: %s\n", BK_NAME(data_fi, bidx),
+              strerror(errno));
+        goto end;
+    }
+
+    rc = hexpeek_open(BK_PATH(data_fi, bidx), O_RDWR|O_CREAT|O_EXCL, PERM,
+                      &BK_FD(data_fi, bidx));
+    checkrc(rc);
+    if(Params.backup_sync != BACKUP_SYNC_NONE)
+    {
+        rc = hexpeek_syncdir(path);
+        checkrc(rc);
+    }
+
+    if(jr->count == 0)
+    {
+        jr->oldest = firstop;
+        jr->step = BackupDepth;
+    }
+    jr->count++;
+    jr->octets += MAX(0, pathsize(path));
+    trim(data_fi);
+
+    rc = RC_OK;
+
+end:
+    free(path);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Move a journal segment back into place as a backup file, replacing
+ *        the backup file there, so that its operations can be reverted.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] bidx Backup index of the backup file to replace, all of whose
+ *            operations must have been recovered
+ * @param[in] firstop First operation of the segment, which must be the newest
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t journalRestore(int data_fi, int bidx, uint64_t firstop)
+{
+    rc_t rc = RC_UNSPEC;
+    Journal *jr = &Journals[data_fi];
+    char *path = segmentPath(data_fi, firstop);
+    hoff_t octets = MAX(0, pathsize(path));
+
+    traceEntry("%d, %d, %" PRIu64, data_fi, bidx, firstop);
+
+    close(BK_FD(data_fi, bidx));
+    BK_FD(data_fi, bidx) = -1;
+
+    if(rename(path, BK_PATH(data_fi, bidx)))
+    {
+        rc = RC_CRIT;
+        prerr("error renaming journal segment \"%s\": %s\n", cleanstring(path),
+              strerror(errno));
+        goto end;
+    }
+
+    rc = hexpeek_open(BK_PATH(data_fi, bidx), O_RDWR, 0, &BK_FD(data_fi, bidx));
+    checkrc(rc);
+
+    if(jr->count > 0)
+    {
+        jr->count--;
+        jr->octets = (jr->count > 0 ? MAX(0, jr->octets - octets) : 0);
+    }
+
+    rc = RC_OK;
+
+end:
+    free(path);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Finish with the journal of an infile on exit.
+ *
+ * @param[in] data_fi Infile file index
+ * @param[in] discard Unlink the segments (as the backup files are unlinked)
+ */
+void journalClose(int data_fi, bool discard)
+{
+    Journal *jr = &Journals[data_fi];
+
+    trimWait();
+    if(discard)
+    {
+        for(long ix = 0; ix < jr->count; ix++)
+        {
+            char *path = segmentPath(data_fi, jr->oldest + ix * jr->step);
+            unlink(path);
+            free(path);
+        }
+    }
+    free(jr->read_name_mal);
+    memset(jr, 0, sizeof *jr);
+}
@@ -0,0 +1,311 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define SRCNAME "hexpeek_manifest.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+/**
+ * @file hexpeek_manifest.c
+ * @brief Per-block hash manifests: write one for a filezone, and verify a
+ *        filezone against one, reporting the block ranges that differ.
+ *
+ * A manifest is text. The first line is
+ *
+ *     hexpeek-manifest VERSION ALGORITHM BLOCKSZ START LENGTH
+ *
+ * with the numbers in decimal, followed by one hexadecimal digest per block.
+ */
+
+#define MANIFEST_MAGIC   "hexpeek-manifest"
+#define MANIFEST_VERSION 1
+#define MANIFEST_ALGO    HASH_XXH64
+#define MANIFEST_BATCH   0x1000
+
+/**
+ * @brief Determine how much of the filezone is present in the file.
+ */
+static rc_t manifestExtent(FileZone const *fz, hoff_t limit, hoff_t *avail)
+{
+    rc_t rc = RC_UNSPEC;
+    hoff_t fsz = -1;
+
+    if( ! isseekable(fz->fi) || (fsz = filesize(fz->fi)) < 0)
+    {
+        rc = RC_USER;
+        prohibcmd("manifests require a seekable file\n");
+        goto end;
+    }
+    *avail = MIN(limit, MAX(fsz - fz->start, 0));
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Write a manifest of per-block hashes for a filezone. Blocks are
+ *        hashed in parallel.
+ *
+ * @param[in] fz Filezone to cover
+ * @param[in] blksz Block size
+ * @param[in] path Manifest file to create or overwrite
+ * @param[out] octets_processed Amount of data hashed
+ * @return RC_OK on success; else a hexpeek error code
+ */
+rc_t manifestWrite(FileZone const *fz, hoff_t blksz, char const *path,
+                   hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    FILE *outfp = NULL;
+    uint8_t *digests = NULL;
+    size_t dlen = HASH_MAXDIGEST;
+    hoff_t len = 0, end = 0, count = 0;
+
+    assert(blksz > 0);
+
+    rc = manifestExtent(fz, fz->len, &len);
+    checkrc(rc);
+    if(len < fz->len && ! fz->tolerate_eof)
+    {
+        rc = RC_USER;
+        prerr(EofErrString, DT_NAME(fz->fi));
+        goto end;
+    }
+    end = fz->start + len;
+
+    outfp = fopen(path, "w");
+    if( ! outfp)
+    {
+        rc = RC_USER;
+        prerr("error opening %s: %s\n", path, strerror(errno));
+        goto end;
+    }
+    {
+        HashCtx hc;
+        dlen = hashInit(&hc, MANIFEST_ALGO);
+    }
+    digests = Malloc(dlen * MANIFEST_BATCH);
+
+    fprintf(outfp, "%s %d %s %" PRIdMAX " %" PRIdMAX " %" PRIdMAX "\n",
+            MANIFEST_MAGIC, MANIFEST_VERSION, hashName(MANIFEST_ALGO),
+            (intmax_t)blksz, (intmax_t)fz->start, (intmax_t)len);
+    for(hoff_t at = fz->start; at < end; at += count * blksz)
+    {
+        count = MIN(MANIFEST_BATCH, (end - at - 1) / blksz + 1);
+        rc = hashBlocks(fz->fi, at, end, MANIFEST_ALGO, blksz, count, digests);
+        checkrc(rc);
+        for(hoff_t blk = 0; blk < count; blk++)
+        {
+            for(size_t ix = 0; ix < dlen; ix++)
+                fputs(BinLookup_hexl[digests[blk * dlen + ix]], outfp);
+            fputc('\n', outfp);
+        }
+    }
+
+    if(fflush(outfp) || ferror(outfp))
+    {
+        rc = RC_CRIT;
+        prerr("error writing %s: %s\n", path, strerror(errno));
+        goto end;
+    }
+    if(interactive())
+        consoleOutf("Wrote " PRI_hoff " block hashes.%s",
+                    prihoff((len + blksz - 1) / blksz), LineTerm);
+
+    *octets_processed = len;
+    rc = RC_OK;
+
+end:
+    if(outfp && fclose(outfp) && rc == RC_OK)
+    {
+        rc = RC_CRIT;
+        prerr("error closing %s: %s\n", path, strerror(errno));
+    }
+    free(digests);
+    return rc;
+}
+
+/**
+ * @brief Parse one digest line of a manifest.
+ */
+static bool manifestDigest(char const *str, ssize_t slen, size_t dlen,
+                           uint8_t *digest)
+{
+    if(slen < (ssize_t)(2 * dlen) ||
+       (slen > (ssize_t)(2 * dlen) && str[2 * dlen] != '\n'))
+        return false;
+    for(size_t ix = 0; ix < dlen; ix++)
+    {
+        uint8_t hi = CharLookup[(uint8_t)str[2 * ix]];
+        uint8_t lo = CharLookup[(uint8_t)str[2 * ix + 1]];
+        if(hi > 0xF || lo > 0xF)
+            return false;
+        digest[ix] = (uint8_t)(hi << 4 | lo);
+    }
+    return true;
+}
+
+/**
+ * @brief Print a range of mismatched blocks, clipped to the manifest.
+ */
+static void manifestReport(hoff_t start, hoff_t end, hoff_t blksz,
+                           hoff_t from, hoff_t to)
+{
+    hoff_t at = start + from * blksz;
+    hoff_t len = MIN(to * blksz, end - start) - from * blksz;
+    consoleOutf(PRI_hoff "," PRI_hoff "%s", prihoff(at), prihoff(len),
+                LineTerm);
+}
+
+/**
+ * @brief Verify a filezone against a manifest, block by block, printing each
+ *        range of differing blocks as START,LENGTH. Block 0 of the manifest
+ *        is compared with the block at the filezone start. Blocks that the
+ *        file is too short to contain count as differing.
+ *
+ * @param[in] fz Filezone to verify; it is extended to whole blocks and
+ *               limited to the length the manifest covers
+ * @param[in] path Manifest file
+ * @param[out] octets_processed Amount of data hashed
+ * @return RC_OK if all blocks match, RC_DIFF if any differ; else a hexpeek
+ *         error code
+ */
+rc_t manifestVerify(FileZone const *fz, char const *path,
+                    hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    FILE *infp = NULL;
+    char *str_mal = NULL;
+    size_t str_sz = 0;
+    ssize_t slen = -1;
+    uint8_t *digests = NULL;
+    uint8_t expect[HASH_MAXDIGEST];
+    char magic[0x20], name[0x10];
+    int version = -1, algo = -1;
+    intmax_t m_blksz = -1, m_start = -1, m_len = -1;
+    hoff_t blksz = 0, cover = 0, avail = 0, end = 0;
+    hoff_t nblocks = 0, nhash = 0, count = 0, open_from = -1;
+    size_t dlen = 0;
+    bool differ = false;
+
+    infp = fopen(path, "r");
+    if( ! infp)
+    {
+        rc = RC_USER;
+        prerr("error opening %s: %s\n", path, strerror(errno));
+        goto end;
+    }
+
+    errno = 0;
+    slen = getline(&str_mal, &str_sz, infp);
+    if(slen <= 0 ||
+       sscanf(str_mal, "%31s %d %15s %" SCNdMAX " %" SCNdMAX " %" SCNdMAX,
+              magic, &version, name, &m_blksz, &m_start, &m_len) != 6 ||
+       ! streq(magic, MANIFEST_MAGIC) || version != MANIFEST_VERSION ||
+       (algo = hashAlgorithm(name)) < 0 ||
+       m_blksz <= 0 || m_blksz > HOFF_MAX || m_len < 0 || m_len > HOFF_MAX)
+    {
+        rc = RC_USER;
+        prerr("%s is not a valid manifest\n", path);
+        goto end;
+    }
+    blksz = (hoff_t)m_blksz;
+    trace("manifest %s: algo %d, blksz " TRC_hoff ", start %jd, len %jd\n",
+          path, algo, trchoff(blksz), m_start, m_len);
+
+    // Whole blocks overlapping the filezone, within the manifest
+    cover = (hoff_t)m_len;
+    if(fz->len < cover)
+        cover = MIN(cover, (fz->len + blksz - 1) / blksz * blksz);
+    rc = manifestExtent(fz, (hoff_t)m_len, &avail);
+    checkrc(rc);
+    end = fz->start + (hoff_t)m_len;
+    nblocks = (cover + blksz - 1) / blksz;
+    nhash = (avail == (hoff_t)m_len) ? nblocks : MIN(nblocks, avail / blksz);
+
+    {
+        HashCtx hc;
+        dlen = hashInit(&hc, algo);
+    }
+    digests = Malloc(dlen * MANIFEST_BATCH);
+
+    for(hoff_t base = 0; base < nblocks; base += count)
+    {
+        count = MIN(MANIFEST_BATCH, nblocks - base);
+        if(base < nhash)
+        {
+            rc = hashBlocks(fz->fi, fz->start + base * blksz, end, algo,
+                            blksz, MIN(count, nhash - base), digests);
+            checkrc(rc);
+        }
+        for(hoff_t blk = base; blk < base + count; blk++)
+        {
+            bool same = false;
+            errno = 0;
+            slen = getline(&str_mal, &str_sz, infp);
+            if( ! manifestDigest(str_mal, slen, dlen, expect))
+            {
+                rc = RC_USER;
+                prerr("%s: malformed or missing digest for block " TRC_hoff
+                      "\n", path, trchoff(blk));
+                goto end;
+            }
+            if(blk < nhash)
+                same = (memcmp(expect, digests + (blk - base) * dlen,
+                               dlen) == 0);
+            if(same && open_from >= 0)
+            {
+                manifestReport(fz->start, end, blksz, open_from, blk);
+                open_from = -1;
+            }
+            else if( ! same && open_from < 0)
+            {
+                open_from = blk;
+                differ = true;
+            }
+        }
+    }
+    if(open_from >= 0)
+        manifestReport(fz->start, end, blksz, open_from, nblocks);
+
+    *octets_processed = MIN(cover, avail);
+    rc = differ ? RC_DIFF : RC_OK;
+
+end:
+    consoleFlush();
+    if(infp)
+        fclose(infp);
+    free(str_mal);
+    free(digests);
+    return rc;
+}
@@ -92,6 +92,8 @@ void doErr(char const *file, int line, int op, char const *fmt, ...)
 void doDie(char const *file, int line)
 {
     doErr(file, line, 0, PGPRE "irrecoverable error encountered, aborting.\n");
+    // Backup files are kept, so do not leave them waiting on a group sync
+    syncBackups();
     terminate(RC_CRIT);
 }
 
@@ -572,10 +574,14 @@ char *cleanstring(char const *original_path)
 }
 
 /**
- * @brief Display visible progress on hexpeek operations
+ * @brief Display visible progress on hexpeek operations. Only the main thread
+ *        reports progress; helper threads (e.g. the writer of a pipelined
+ *        replace) work on part of an operation the main thread reports on.
  */
 void outputProgress(hoff_t complete, hoff_t total, int isbackup)
 {
+    if( ! pthread_equal(pthread_self(), MainThread))
+        return;
     if(interactive() && total > 0x10 * BUFSZ)
     {
         static uint64_t lasttm = 0;
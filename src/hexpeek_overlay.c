@@ -0,0 +1,1031 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define SRCNAME "hexpeek_overlay.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+/**
+ * @file hexpeek_overlay.c
+ * @brief Edit overlay (-overlay): replace, insert and kill commands are
+ *        recorded in a piece table over the original file instead of being
+ *        written to it, and commit writes the result out in one pass.
+ *
+ * A piece refers to a run of octets in the original file, in the add store (a
+ * temporary file holding all data ever replaced or inserted), or to a run of
+ * zeros (a hole). An edit replaces a run of pieces of the table with new ones
+ * and keeps the pieces it replaced, so undo just puts them back.
+ */
+
+#define OV_ORIG 0
+#define OV_ADD  1
+#define OV_ZERO 2
+
+/**
+ * @struct Piece
+ *
+ * @brief A run of octets in the overlay view.
+ *
+ * @var Piece::at
+ * Offset of this piece in the overlay view.
+ * @var Piece::src
+ * Where the octets come from (one of OV_*).
+ * @var Piece::off
+ * Offset in the original file or add store (unused for OV_ZERO).
+ * @var Piece::len
+ * Length of this piece.
+ */
+typedef struct
+{
+    hoff_t at;
+    int src;
+    hoff_t off;
+    hoff_t len;
+} Piece;
+
+/**
+ * @struct Table
+ *
+ * @brief The current piece table of an overlay.
+ *
+ * @var Table::pieces_mal
+ * Malloc()-d array of pieces in order of Piece::at.
+ * @var Table::count
+ * Number of pieces.
+ * @var Table::cap
+ * Allocated size of pieces_mal.
+ * @var Table::size
+ * Size of the overlay view.
+ */
+typedef struct
+{
+    Piece *pieces_mal;
+    size_t count;
+    size_t cap;
+    hoff_t size;
+} Table;
+
+/**
+ * @struct Version
+ *
+ * @brief What one edit changed in the piece table, so that undo can put it
+ *        back: the pieces from index first on that it replaced, and how many
+ *        pieces replaced them.
+ *
+ * @var Version::first
+ * Index of the first piece replaced.
+ * @var Version::old_mal
+ * Malloc()-d array of the pieces replaced, as they were.
+ * @var Version::old_count
+ * Number of pieces replaced.
+ * @var Version::new_count
+ * Number of pieces that replaced them.
+ * @var Version::old_size
+ * Size of the overlay view before the edit.
+ * @var Version::last_at
+ * File offset before the edit, restored on undo.
+ * @var Version::origcmd_mal
+ * Malloc()-d command string of the edit.
+ */
+typedef struct
+{
+    size_t first;
+    Piece *old_mal;
+    size_t old_count;
+    size_t new_count;
+    hoff_t old_size;
+    hoff_t last_at;
+    char *origcmd_mal;
+} Version;
+
+/**
+ * @struct Overlay
+ *
+ * @brief Overlay state of one infile.
+ *
+ * @var Overlay::active
+ * Boolean whether reads and edits of the infile go through the overlay.
+ * @var Overlay::txn
+ * Boolean whether the overlay was started by begin (or -batch) and ends at the
+ * next in place commit.
+ * @var Overlay::add_fp
+ * Temporary file used as add store.
+ * @var Overlay::add_len
+ * Length of data in the add store.
+ * @var Overlay::pos
+ * Current offset in the overlay view.
+ * @var Overlay::tab
+ * Current piece table.
+ * @var Overlay::hist_mal
+ * Malloc()-d array of the edits made, oldest first.
+ * @var Overlay::depth
+ * Number of edits.
+ * @var Overlay::cap
+ * Allocated size of hist_mal.
+ */
+typedef struct
+{
+    bool active;
+    bool txn;
+    FILE *add_fp;
+    hoff_t add_len;
+    hoff_t pos;
+    Table tab;
+    Version *hist_mal;
+    size_t depth;
+    size_t cap;
+} Overlay;
+
+static Overlay Overlays[MAX_INFILES];
+
+#define AddFd(ov) fileno((ov)->add_fp)
+
+//-------------------------------- Piece Table --------------------------------//
+
+/**
+ * @brief Append a piece to an array of new pieces, which must have room.
+ */
+static void pushPiece(Piece *pcs, size_t *p_count, hoff_t at, int src,
+                      hoff_t off, hoff_t len)
+{
+    if(len <= 0)
+        return;
+    pcs[*p_count].at  = at;
+    pcs[*p_count].src = src;
+    pcs[*p_count].off = off;
+    pcs[*p_count].len = len;
+    ++*p_count;
+}
+
+/**
+ * @brief Return index of the piece containing offset at (binary search), or
+ *        the piece count if at is not below the view size.
+ */
+static size_t findPiece(Table const *t, hoff_t at)
+{
+    size_t lo = 0, hi = t->count;
+    if(at >= t->size)
+        return t->count;
+    while(hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(t->pieces_mal[mid].at <= at)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Replace pieces [first, first + old_count) of a table with new_count
+ *        new pieces and move the pieces after them by the change in length.
+ */
+static void splicePieces(Table *t, size_t first, size_t old_count,
+                         Piece const *pcs, size_t new_count, hoff_t new_size)
+{
+    size_t tail = t->count - first - old_count;
+    hoff_t shift = new_size - t->size;
+
+    if(t->count - old_count + new_count > t->cap)
+    {
+        size_t ncap = MAX(2 * t->cap, t->count - old_count + new_count);
+        Piece *grown = Malloc(ncap * sizeof *grown);
+        if(t->count)
+            memcpy(grown, t->pieces_mal, t->count * sizeof *grown);
+        free(t->pieces_mal);
+        t->pieces_mal = grown;
+        t->cap = ncap;
+    }
+    memmove(t->pieces_mal + first + new_count,
+            t->pieces_mal + first + old_count, tail * sizeof(Piece));
+    if(new_count)
+        memcpy(t->pieces_mal + first, pcs, new_count * sizeof(Piece));
+    for(size_t ix = first + new_count; ix < first + new_count + tail; ix++)
+        t->pieces_mal[ix].at += shift;
+    t->count = first + new_count + tail;
+    t->size = new_size;
+}
+
+/**
+ * @brief Release the memory of one version.
+ */
+static void freeVersion(Version *v)
+{
+    free(v->old_mal);
+    free(v->origcmd_mal);
+    memset(v, 0, sizeof *v);
+}
+
+/**
+ * @brief Drop all versions and make the (current) original file the only
+ *        piece.
+ */
+static void resetHistory(Overlay *ov, hoff_t size)
+{
+    while(ov->depth > 0)
+        freeVersion(&ov->hist_mal[--ov->depth]);
+    ov->tab.count = 0;
+    ov->tab.size = 0;
+    if(size > 0)
+    {
+        Piece base = { 0, OV_ORIG, 0, size };
+        splicePieces(&ov->tab, 0, 0, &base, 1, size);
+    }
+}
+
+//-------------------------------- Interface ---------------------------------//
+
+/**
+ * @brief Return whether the given infile is read and edited through an
+ *        overlay.
+ */
+bool overlayActive(int fi)
+{
+    return (fi >= 0 && fi < MAX_INFILES && Overlays[fi].active);
+}
+
+/**
+ * @brief Start an overlay over an open infile.
+ *
+ * @param[in] fi Infile file index
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t overlayOpen(int fi)
+{
+    rc_t rc = RC_UNSPEC;
+    Overlay *ov = &Overlays[fi];
+
+    traceEntry("%d", fi);
+
+    assert( ! ov->active);
+
+    if( ! isseekable(fi))
+    {
+        rc = RC_USER;
+        prerr("overlay requires a seekable file, %s is not\n", DT_NAME(fi));
+        goto end;
+    }
+
+    ov->add_fp = tmpfile();
+    if( ! ov->add_fp)
+    {
+        rc = RC_CRIT;
+        prerr("error creating overlay store: %s\n", strerror(errno));
+        goto end;
+    }
+    ov->add_len = 0;
+    ov->pos = hexpeek_seek(DT_FD(fi), 0, SEEK_CUR);
+    ov->cap = 0x10;
+    ov->hist_mal = Malloc(ov->cap * sizeof(Version));
+    memset(ov->hist_mal, 0, ov->cap * sizeof(Version));
+    ov->depth = 0;
+    resetHistory(ov, filesize(fi));
+    ov->active = true;
+
+    rc = RC_OK;
+
+end:
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief End the overlay of an infile, discarding (with a warning) any edits
+ *        that were not committed.
+ *
+ * @param[in] fi Infile file index
+ */
+void overlayClose(int fi)
+{
+    Overlay *ov = &Overlays[fi];
+
+    if( ! ov->active)
+        return;
+
+    if(ov->depth > 0)
+        prwarn("discarding x%zX uncommitted edit%s to %s\n",
+               plrztn(ov->depth), DT_NAME(fi));
+
+    while(ov->depth > 0)
+        freeVersion(&ov->hist_mal[--ov->depth]);
+    free(ov->hist_mal);
+    free(ov->tab.pieces_mal);
+    fclose(ov->add_fp);
+    memset(ov, 0, sizeof *ov);
+}
+
+/**
+ * @brief Begin a transaction on an infile: later edits are staged in an
+ *        overlay until commit writes them out as one backup operation.
+ *
+ * @param[in] fi Infile file index
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t overlayBegin(int fi)
+{
+    rc_t rc = RC_UNSPEC;
+
+    if(overlayActive(fi))
+    {
+        rc = RC_USER;
+        prohibcmd("edits of %s are already staged until commit\n",
+                  DT_NAME(fi));
+        goto end;
+    }
+    if( ! (DT_MODE(fi) & O_RDWR))
+    {
+        rc = RC_USER;
+        prerr("file $%d opened read-only\n", fi);
+        goto end;
+    }
+
+    rc = overlayOpen(fi);
+    checkrc(rc);
+    Overlays[fi].txn = true;
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Size of the overlay view of an infile.
+ */
+hoff_t overlaySize(int fi)
+{
+    return Overlays[fi].tab.size;
+}
+
+/**
+ * @brief lseek() equivalent on the overlay view of an infile.
+ *
+ * @return Resulting offset, or -1 with errno set to EINVAL
+ */
+hoff_t overlaySeek(int fi, hoff_t offset, int whence)
+{
+    Overlay *ov = &Overlays[fi];
+    hoff_t base = 0;
+
+    if(whence == SEEK_CUR)
+        base = ov->pos;
+    else if(whence == SEEK_END)
+        base = overlaySize(fi);
+
+    if((offset < 0 && base + offset < 0) ||
+       (offset > 0 && base > HOFF_MAX - offset))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    ov->pos = base + offset;
+    return ov->pos;
+}
+
+/**
+ * @brief pread() equivalent on the overlay view of an infile. It does not
+ *        touch the overlay offset, so it may be called from worker threads.
+ *
+ * @return Octets read (less than count only at end of the view), or -1 with
+ *         errno set
+ */
+hoff_t overlayPread(int fi, void *buf, hoff_t count, hoff_t at)
+{
+    Overlay *ov = &Overlays[fi];
+    Table const *t = &ov->tab;
+    hoff_t done = 0;
+
+    if(at >= t->size)
+        return 0;
+    count = MIN(count, t->size - at);
+
+    for(size_t ix = findPiece(t, at); done < count; ix++)
+    {
+        Piece const *pc = &t->pieces_mal[ix];
+        hoff_t rel = at + done - pc->at;
+        hoff_t len = MIN(pc->len - rel, count - done);
+        if(pc->src == OV_ZERO)
+        {
+            memset((uint8_t*)buf + done, 0, (size_t)len);
+            done += len;
+            continue;
+        }
+        int fd = (pc->src == OV_ORIG ? DT_FD(fi) : AddFd(ov));
+        for(hoff_t got = 0; got < len; )
+        {
+            ssize_t lcl_rd = pread(fd, (uint8_t*)buf + done + got,
+                                   (size_t)(len - got),
+                                   (off_t)(pc->off + rel + got));
+            if(lcl_rd < 0 && errno == EINTR)
+                continue;
+            if(lcl_rd <= 0)
+            {
+                if(lcl_rd == 0)
+                    errno = EIO; // original file shrank under us
+                return -1;
+            }
+            got += lcl_rd;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+/**
+ * @brief read() equivalent on the overlay view of an infile.
+ */
+hoff_t overlayRead(int fi, void *buf, hoff_t count)
+{
+    Overlay *ov = &Overlays[fi];
+    hoff_t result = overlayPread(fi, buf, count, ov->pos);
+    if(result > 0)
+        ov->pos += result;
+    return result;
+}
+
+/**
+ * @brief Record a replace, insert or kill command in the overlay of its
+ *        infile. New data is appended to the add store and the pieces the
+ *        edit covers are replaced, at most two of them being cut; the infile
+ *        itself is not written.
+ *
+ * @param[in,out] ppc Command to record (the pattern buffer may be expanded)
+ * @param[out] octets_processed Octets replaced or inserted
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t overlayChange(ParsedCommand *ppc, hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    int fi = ppc->fz.fi;
+    Overlay *ov = &Overlays[fi];
+    Table *t = &ov->tab;
+    Version nv;
+    Piece pcs[4];
+    size_t first = 0, last = 0, count = 0;
+    hoff_t start = ppc->fz.start, len = ppc->fz.len, add_at = ov->add_len;
+    hoff_t to = 0, new_size = 0;
+
+    traceEntry("%d, %d, " TRC_hoff ", " TRC_hoff,
+               fi, ppc->cmd, trchoff(start), trchoff(len));
+
+    memset(&nv, 0, sizeof nv);
+    assert(ov->active);
+
+    // Stage new data in the add store
+    if(ppc->cmd != CMD_KILL && ppc->arg_cv.mem.count > 0)
+    {
+        hoff_t wr_cnt = ppc->arg_cv.mem.count, wr_tot = 0;
+        uint8_t *wr_ptr = ppc->arg_cv.mem.octets_mal;
+        if(len >= 2 * wr_cnt)
+        {
+            // Optimize repeated write
+            hoff_t step = wr_cnt;
+            while(wr_cnt + step <= MIN(ppc->arg_cv.mem.sz, len))
+            {
+                memcpy(wr_ptr + wr_cnt, wr_ptr, step);
+                wr_cnt += step;
+            }
+        }
+        while(wr_tot < len)
+        {
+            hoff_t try_len = MIN(len - wr_tot, wr_cnt);
+            rc = writeat(AddFd(ov), add_at + wr_tot, wr_ptr, try_len);
+            checkrc(rc);
+            wr_tot += try_len;
+        }
+    }
+    else if(ppc->cmd != CMD_KILL)
+    {
+        // Reads of an overlaid source go through its overlay
+        rc = filecpy(DT_FD(ppc->arg_cv.fz.fi), ppc->arg_cv.fz.start,
+                     ppc->arg_cv.fz.len, AddFd(ov), add_at, len);
+        checkrc(rc);
+    }
+
+    // The view [start, to) is replaced; pieces [first, last) cover it
+    to = (ppc->cmd == CMD_INSERT ? start : MIN(start + len, t->size));
+    first = findPiece(t, MIN(start, t->size));
+    last = findPiece(t, to);
+    if(last < t->count && t->pieces_mal[last].at < to)
+        last++;
+    if(ppc->cmd == CMD_KILL)
+        new_size = t->size - (to - MIN(start, t->size));
+    else if(ppc->cmd == CMD_INSERT)
+        new_size = MAX(t->size, start) + len;
+    else
+        new_size = MAX(t->size, start + len);
+
+    // New pieces: the part of the first piece before start, zeros past the
+    // end of the view, the new data, and the part of the last piece after to
+    if(first < t->count)
+    {
+        Piece const *pc = &t->pieces_mal[first];
+        pushPiece(pcs, &count, pc->at, pc->src, pc->off,
+                  MIN(start, t->size) - pc->at);
+    }
+    if(ppc->cmd != CMD_KILL)
+    {
+        if(start > t->size)
+            pushPiece(pcs, &count, t->size, OV_ZERO, 0, start - t->size);
+        pushPiece(pcs, &count, start, OV_ADD, add_at, len);
+        ov->add_len += len;
+        *octets_processed = len;
+    }
+    if(last > first)
+    {
+        Piece const *pc = &t->pieces_mal[last - 1];
+        hoff_t rel = MAX(to, pc->at) - pc->at;
+        pushPiece(pcs, &count, to + (new_size - t->size), pc->src,
+                  pc->off + rel, pc->len - rel);
+    }
+
+    nv.first = first;
+    nv.old_count = last - first;
+    nv.new_count = count;
+    nv.old_size = t->size;
+    nv.old_mal = Malloc(MAX(nv.old_count, 1) * sizeof(Piece));
+    memcpy(nv.old_mal, t->pieces_mal + first, nv.old_count * sizeof(Piece));
+    nv.last_at = Params.infiles[fi].last_at;
+    nv.origcmd_mal = Malloc(strlen(ppc->origcmd ? ppc->origcmd : "") + 1);
+    strcpy(nv.origcmd_mal, ppc->origcmd ? ppc->origcmd : "");
+
+    if(ov->depth == ov->cap)
+    {
+        Version *grown = Malloc(2 * ov->cap * sizeof(Version));
+        memcpy(grown, ov->hist_mal, ov->cap * sizeof(Version));
+        free(ov->hist_mal);
+        ov->hist_mal = grown;
+        ov->cap *= 2;
+    }
+    memcpy(&ov->hist_mal[ov->depth++], &nv, sizeof nv);
+    memset(&nv, 0, sizeof nv);
+    splicePieces(t, first, last - first, pcs, count, new_size);
+
+    rc = RC_OK;
+
+end:
+    freeVersion(&nv);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Show edits available to be undone, most recent first, in the same
+ *        form as the ops command does for backups.
+ *
+ * @param[in] fi Infile file index
+ */
+void overlayOps(int fi)
+{
+    Overlay *ov = &Overlays[fi];
+    for(size_t ix = ov->depth, counter = 1; ix > 0; ix--, counter++)
+    {
+        console("%zX, edit #x%zX, command '%s'\n",
+                counter, ix, ov->hist_mal[ix - 1].origcmd_mal);
+    }
+}
+
+/**
+ * @brief Undo edits by putting back the pieces the newest ones replaced.
+ *
+ * @param[in] fi Infile file index
+ * @param[in] count Number of edits to undo
+ */
+void overlayUndo(int fi, int count)
+{
+    Overlay *ov = &Overlays[fi];
+    for( ; count > 0 && ov->depth > 0; count--)
+    {
+        Version *v = &ov->hist_mal[ov->depth - 1];
+        splicePieces(&ov->tab, v->first, v->new_count, v->old_mal,
+                     v->old_count, v->old_size);
+        Params.infiles[fi].at = v->last_at;
+        freeVersion(v);
+        ov->depth--;
+    }
+}
+
+/**
+ * @brief Write one piece to dst_fd at its offset in the overlay view. Holes
+ *        are only written when filling in place.
+ */
+static rc_t writePiece(Overlay *ov, int fi, Piece const *pc, int dst_fd,
+                       bool inplace)
+{
+    rc_t rc = RC_UNSPEC;
+    static uint8_t const zeros[BUFSZ];
+
+    switch(pc->src)
+    {
+    case OV_ORIG:
+        if(inplace)
+            rc = lclcpy(dst_fd, pc->off, pc->at, pc->len);
+        else
+            rc = filecpy(DT_FD(fi), pc->off, pc->len, dst_fd, pc->at, pc->len);
+        break;
+    case OV_ADD:
+        rc = filecpy(AddFd(ov), pc->off, pc->len, dst_fd, pc->at, pc->len);
+        break;
+    case OV_ZERO:
+        rc = RC_OK;
+        for(hoff_t done = 0; inplace && rc == RC_OK && done < pc->len; )
+        {
+            hoff_t cnt = MIN((hoff_t)sizeof zeros, pc->len - done);
+            rc = writeat(dst_fd, pc->at + done, zeros, cnt);
+            done += cnt;
+        }
+        break;
+    default:
+        die();
+    }
+
+    return rc;
+}
+
+/**
+ * @brief Find whether an in place commit of the piece table v can shift the
+ *        file tail once, as an insert or kill would, and then write only new
+ *        data: each piece of original data either stays where it is, before
+ *        the shift, or moves by the change in file size, after it.
+ *
+ * @param[in] v Piece table to be committed
+ * @param[in] orig_sz Size of the original file
+ * @param[out] p_pos Set to the offset of the shift (see adjustSize())
+ * @return Boolean whether the commit is such a shift
+ */
+static bool singleShift(Table const *v, hoff_t orig_sz, hoff_t *p_pos)
+{
+    hoff_t amt = v->size - orig_sz, tail = orig_sz;
+
+    for(size_t ix = 0; ix < v->count; ix++)
+    {
+        Piece const *p = &v->pieces_mal[ix];
+        if(p->src != OV_ORIG)
+            continue;
+        if(p->at == p->off && tail == orig_sz)
+            continue;
+        if(amt == 0 || p->at - p->off != amt)
+            return false;
+        tail = MIN(tail, p->off);
+    }
+
+    *p_pos = tail + MIN(0, amt);
+    return true;
+}
+
+/**
+ * @brief Add the run [at, end) of the original file, cut off at orig_sz, to a
+ *        list of runs in ascending order, joining it to the last if they meet.
+ */
+static void pushRun(FileExtent *exts, size_t *p_count, hoff_t at, hoff_t end,
+                    hoff_t orig_sz)
+{
+    FileExtent *last = (*p_count > 0 ? &exts[*p_count - 1] : NULL);
+
+    end = MIN(end, orig_sz);
+    if(at >= end)
+        return;
+    if(last && last->at + last->len == at)
+    {
+        last->len += end - at;
+        return;
+    }
+    last = &exts[(*p_count)++];
+    last->at = at;
+    last->len = end - at;
+    last->data = NULL;
+}
+
+/**
+ * @brief List the runs of the original file that an in place commit which
+ *        shifts the tail at pos (see singleShift()) overwrites or kills, in
+ *        the offsets of the original file.
+ *
+ * @param[in] v Piece table to be committed
+ * @param[in] orig_sz Size of the original file
+ * @param[in] pos Offset of the shift
+ * @param[out] exts Array of at least 2 * v->count + 1 runs
+ * @return Number of runs
+ */
+static size_t shiftRuns(Table const *v, hoff_t orig_sz, hoff_t pos,
+                        FileExtent *exts)
+{
+    hoff_t amt = v->size - orig_sz;
+    size_t count = 0;
+
+    // New data before the shift, what a kill cuts out, then new data after
+    // the shift (but not in the space an insert opens)
+    for(size_t ix = 0; ix < v->count; ix++)
+    {
+        Piece const *p = &v->pieces_mal[ix];
+        if(p->src != OV_ORIG)
+            pushRun(exts, &count, p->at, MIN(p->at + p->len, pos), orig_sz);
+    }
+    pushRun(exts, &count, pos, pos - MIN(0, amt), orig_sz);
+    for(size_t ix = 0; ix < v->count; ix++)
+    {
+        Piece const *p = &v->pieces_mal[ix];
+        if(p->src != OV_ORIG)
+            pushRun(exts, &count, MAX(p->at, pos + MAX(0, amt)) - amt,
+                    p->at + p->len - amt, orig_sz);
+    }
+
+    return count;
+}
+
+/**
+ * @brief Back up what an in place commit of the piece table v will change,
+ *        as a single operation. A commit that shifts the tail once (see
+ *        singleShift()) is backed up as a scatter operation with the shift,
+ *        saving only the original runs it overwrites or kills. Otherwise the
+ *        region from the first change is saved and, if the file size changes,
+ *        it runs to the original end of file, so that recovery can truncate
+ *        and restore it.
+ *
+ * @param[in] ov Overlay
+ * @param[in] fi Infile file index (the overlay must be inactive)
+ * @param[in] v Piece table to be committed
+ * @param[in] shift Whether the commit shifts the tail once
+ * @param[in] pos Offset of the shift
+ * @param[out] bked Boolean result if backup occurred
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t backupCommit(Overlay const *ov, int fi, Table const *v,
+                         bool shift, hoff_t pos, bool *bked)
+{
+    rc_t rc = RC_UNSPEC;
+    ParsedCommand pc;
+    hoff_t orig_sz = filesize(fi), from = HOFF_MAX, to = 0;
+    char *cmds_mal = NULL;
+    size_t cmds_sz = 0x100, cmds_len = 0, count = 0;
+    FileExtent *exts_mal = NULL;
+
+    if(shift)
+    {
+        exts_mal = Malloc((2 * v->count + 1) * sizeof *exts_mal);
+        count = shiftRuns(v, orig_sz, pos, exts_mal);
+        if(count == 0 && v->size == orig_sz)
+        {
+            rc = RC_OK;
+            goto end;
+        }
+    }
+    else
+    {
+        for(size_t ix = 0; ix < v->count; ix++)
+        {
+            Piece const *p = &v->pieces_mal[ix];
+            if(p->src != OV_ORIG || p->off != p->at)
+            {
+                from = MIN(from, p->at);
+                to = p->at + p->len;
+            }
+        }
+        if(v->size != orig_sz)
+        {
+            from = MIN(from, MIN(v->size, orig_sz));
+            to = MAX(to, orig_sz);
+        }
+        if(from >= to)
+        {
+            rc = RC_OK;
+            goto end;
+        }
+    }
+
+    // Record the edits as the command string, e.g. "0r11; 2i2233"
+    cmds_mal = Malloc(cmds_sz);
+    cmds_mal[0] = '\0';
+    for(size_t ix = 0; ix < ov->depth && cmds_len + 1 < cmds_sz; ix++)
+    {
+        int wr = snprintf(cmds_mal + cmds_len, cmds_sz - cmds_len, "%s%s",
+                          ix > 0 ? "; " : "", ov->hist_mal[ix].origcmd_mal);
+        cmds_len = MIN(cmds_sz - 1, cmds_len + (size_t)MAX(wr, 0));
+    }
+
+    // An undo returns to where the first edit was made
+    Params.infiles[fi].last_at = ov->hist_mal[0].last_at;
+
+    if(shift)
+    {
+        rc = makeScatterBackup(fi, exts_mal, count, pos, v->size - orig_sz,
+                               cmds_mal);
+        checkrc(rc);
+    }
+    else
+    {
+        memset(&pc, 0, sizeof pc);
+        pc.cmd = CMD_REPLACE;
+        pc.fz.fi = fi;
+        pc.fz.start = from;
+        pc.fz.len = to - from;
+        pc.origcmd = cmds_mal;
+        rc = makeBackup(&pc);
+        checkrc(rc);
+    }
+    *bked = (BackupDepth > 0);
+
+    rc = RC_OK;
+
+end:
+    free(exts_mal);
+    free(cmds_mal);
+    return rc;
+}
+
+/**
+ * @brief Merge pieces that continue one another, both in the overlay view and
+ *        in where their octets come from, into runs that are each written at
+ *        once.
+ *
+ * @param[in] v Piece table
+ * @param[out] runs Array of at least v->count pieces
+ * @return Number of runs
+ */
+static size_t mergeRuns(Table const *v, Piece *runs)
+{
+    size_t count = 0;
+
+    for(size_t ix = 0; ix < v->count; ix++)
+    {
+        Piece const *p = &v->pieces_mal[ix];
+        Piece *last = (count > 0 ? &runs[count - 1] : NULL);
+        if(last && p->src == last->src && p->at == last->at + last->len &&
+           (p->src == OV_ZERO || p->off == last->off + last->len))
+            last->len += p->len;
+        else
+            runs[count++] = *p;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Write the overlay view of an infile out in one pass: to a new file
+ *        at path, leaving the infile and its pending edits alone, or else in
+ *        place.
+ *
+ * In place, the changes are first backed up as one operation (see
+ * backupCommit()), so the commit can be undone or recovered like a single
+ * command; the overlay's own edit history is then cleared, and a transaction
+ * started by begin ends. Original data that moves is moved first: when it all
+ * moves by the same amount past one point, as by adjustSize(); otherwise runs
+ * moving toward the start of the file are copied in ascending order, then
+ * runs moving toward the end in descending order. Runs keep their order, so
+ * neither pass overwrites data that is still to be read. Replaced and inserted
+ * data is written last, with pieces that continue one another merged.
+ *
+ * @param[in] fi Infile file index
+ * @param[in] path Path of a new file to create, or NULL or "" for in place
+ * @param[out] bked Boolean result if backup occurred
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t overlayCommit(int fi, char const *path, bool *bked)
+{
+    rc_t rc = RC_UNSPEC;
+    Overlay *ov = &Overlays[fi];
+    Table const *v = NULL;
+    Piece *runs_mal = NULL;
+    size_t nrun = 0;
+    int dst_fd = -1;
+    bool inplace = ( ! path || *path == '\0' ), shift = false;
+    hoff_t orig_sz = 0, pos = 0;
+
+    traceEntry("%d, '%s'", fi, inplace ? "" : path);
+
+    if( ! overlayActive(fi))
+    {
+        rc = RC_USER;
+        prohibcmd("commit requires -overlay or begin\n");
+        goto end;
+    }
+    v = &ov->tab;
+
+    if(inplace)
+    {
+        if(ov->depth == 0)
+        {
+            rc = RC_OK;
+            goto end;
+        }
+        dst_fd = DT_FD(fi);
+    }
+    else
+    {
+        rc = hexpeek_open(path, O_WRONLY | O_CREAT | O_EXCL, PERM, &dst_fd);
+        checkrc(rc);
+    }
+
+    // Work on the underlying files directly
+    ov->active = false;
+
+    runs_mal = Malloc(MAX(v->count, 1) * sizeof *runs_mal);
+    nrun = mergeRuns(v, runs_mal);
+
+    if(inplace)
+    {
+        orig_sz = filesize(fi);
+        shift = singleShift(v, orig_sz, &pos);
+        rc = backupCommit(ov, fi, v, shift, pos, bked);
+        checkrc(rc);
+    }
+    if(shift && v->size != orig_sz && pos - MIN(0, v->size - orig_sz) < orig_sz)
+    {
+        rc = adjustSize(fi, pos, v->size - orig_sz, -1);
+        checkrc(rc);
+    }
+    else if(inplace && ! shift)
+    {
+        for(size_t ix = 0; ix < nrun; ix++)
+        {
+            Piece const *pc = &runs_mal[ix];
+            if(pc->src == OV_ORIG && pc->off > pc->at)
+            {
+                rc = writePiece(ov, fi, pc, dst_fd, true);
+                checkrc(rc);
+            }
+        }
+        for(size_t ix = nrun; ix > 0; ix--)
+        {
+            Piece const *pc = &runs_mal[ix - 1];
+            if(pc->src == OV_ORIG && pc->off < pc->at)
+            {
+                rc = writePiece(ov, fi, pc, dst_fd, true);
+                checkrc(rc);
+            }
+        }
+    }
+    for(size_t ix = 0; ix < nrun; ix++)
+    {
+        Piece const *pc = &runs_mal[ix];
+        if(pc->src != OV_ORIG || ! inplace)
+        {
+            rc = writePiece(ov, fi, pc, dst_fd, inplace);
+            checkrc(rc);
+        }
+        plugin(2, NULL);
+    }
+    if(filesize(fi) != v->size || ! inplace)
+    {
+        rc = hexpeek_truncate(dst_fd, v->size);
+        checkrc(rc);
+    }
+
+    rc = hexpeek_sync(dst_fd);
+    checkrc(rc);
+
+    if(inplace)
+    {
+        resetHistory(ov, v->size);
+        rc = hexpeek_truncate(AddFd(ov), 0);
+        checkrc(rc);
+        ov->add_len = 0;
+    }
+
+    rc = RC_OK;
+
+end:
+    free(runs_mal);
+    if(v)
+        ov->active = true;
+    if(inplace && rc == RC_OK && ov->txn)
+        overlayClose(fi);
+    if( ! inplace && dst_fd >= 0 && close(dst_fd))
+    {
+        if(rc == RC_OK)
+            rc = RC_CRIT;
+        prerr("error closing %s: %s\n", cleanstring(path), strerror(errno));
+    }
+    traceExit(TRC_rc, rc);
+    return rc;
+}
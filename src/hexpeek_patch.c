@@ -0,0 +1,750 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#define SRCNAME "hexpeek_patch.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+
+/**
+ * @file hexpeek_patch.c
+ * @brief Check a patch file against a data file and apply it as one backup
+ *        operation.
+ *
+ * Three patch formats are understood:
+ *  - IPS, recognized by its "PATCH" magic (the truncation extension is not
+ *    supported);
+ *  - the output of -diff in hex mode, whose left side gives the old octets
+ *    and right side the new ones ("__" marks an octet that did not change);
+ *  - lines of the form "OFFSET NEW" or "OFFSET OLD NEW" in hexadecimal,
+ *    where '#' starts a comment.
+ *
+ * Old octets are always checked against the data file as it was before the
+ * patch; where edits overlap, the one later in the patch wins.
+ */
+
+#define IPS_MAGIC     "PATCH"
+#define IPS_MAGIC_SZ  5
+#define IPS_EOF       0x454F46
+#define PATCH_NO_OLD  SIZE_MAX
+
+/**
+ * @struct PatchEdit
+ *
+ * @brief Struct representing one edit read from a patch.
+ *
+ * @var PatchEdit::at
+ * Data file offset of the edit.
+ * @var PatchEdit::len
+ * Number of octets the edit replaces.
+ * @var PatchEdit::new_off
+ * Offset of the new octets in the patch arena.
+ * @var PatchEdit::old_off
+ * Offset of the expected old octets in the patch arena, else PATCH_NO_OLD.
+ * @var PatchEdit::seq
+ * Position of the edit in the patch.
+ */
+typedef struct
+{
+    hoff_t at;
+    hoff_t len;
+    size_t new_off;
+    size_t old_off;
+    size_t seq;
+} PatchEdit;
+
+/**
+ * @struct Patch
+ *
+ * @brief Struct holding the edits of a patch, with their octets in an arena.
+ */
+typedef struct
+{
+    PatchEdit *edits_mal;
+    size_t count;
+    size_t cap;
+    uint8_t *arena_mal;
+    size_t used;
+    size_t asz;
+} Patch;
+
+/**
+ * @brief Reserve len octets at the end of the patch arena.
+ *
+ * @return Arena offset of the reserved octets
+ */
+static size_t arenaTake(Patch *pt, size_t len)
+{
+    size_t off = pt->used;
+    if(pt->asz - pt->used < len)
+    {
+        size_t nsz = MAX(2 * pt->asz, pt->used + len);
+        uint8_t *grown = Malloc(MAX(nsz, 1));
+        if(pt->used)
+            memcpy(grown, pt->arena_mal, pt->used);
+        free(pt->arena_mal);
+        pt->arena_mal = grown;
+        pt->asz = nsz;
+    }
+    pt->used += len;
+    return off;
+}
+
+/**
+ * @brief Append an edit of len octets at the given offset and reserve arena
+ *        space for its new (and, if has_old, old) octets.
+ *
+ * @return Pointer to the new edit
+ */
+static PatchEdit *addEdit(Patch *pt, hoff_t at, hoff_t len, bool has_old)
+{
+    PatchEdit *pe = NULL;
+
+    if(pt->count == pt->cap)
+    {
+        size_t ncap = MAX(2 * pt->cap, 0x40);
+        PatchEdit *grown = Malloc(ncap * sizeof *grown);
+        if(pt->count)
+            memcpy(grown, pt->edits_mal, pt->count * sizeof *grown);
+        free(pt->edits_mal);
+        pt->edits_mal = grown;
+        pt->cap = ncap;
+    }
+    pe = &pt->edits_mal[pt->count];
+    pe->at = at;
+    pe->len = len;
+    pe->seq = pt->count;
+    pe->new_off = arenaTake(pt, (size_t)len);
+    pe->old_off = has_old ? arenaTake(pt, (size_t)len) : PATCH_NO_OLD;
+    pt->count++;
+    return pe;
+}
+
+/**
+ * @brief Read a whole file into a Malloc()-d buffer.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t slurp(char const *path, uint8_t **p_buf, size_t *p_len)
+{
+    rc_t rc = RC_UNSPEC;
+    FILE *infp = NULL;
+    uint8_t *buf_mal = NULL;
+    size_t len = 0, sz = BUFSZ;
+
+    infp = fopen(path, "rb");
+    if( ! infp)
+    {
+        rc = RC_USER;
+        prerr("cannot open %s: %s\n", path, strerror(errno));
+        goto end;
+    }
+    buf_mal = Malloc(sz);
+    for(;;)
+    {
+        size_t got = fread(buf_mal + len, 1, sz - len, infp);
+        len += got;
+        if(len < sz)
+            break;
+        uint8_t *grown = Malloc(2 * sz);
+        memcpy(grown, buf_mal, len);
+        free(buf_mal);
+        buf_mal = grown;
+        sz *= 2;
+    }
+    if(ferror(infp))
+    {
+        rc = RC_CRIT;
+        prerr("error reading %s: %s\n", path, strerror(errno));
+        goto end;
+    }
+
+    *p_buf = buf_mal;
+    buf_mal = NULL;
+    *p_len = len;
+    rc = RC_OK;
+
+end:
+    free(buf_mal);
+    if(infp)
+        fclose(infp);
+    return rc;
+}
+
+/**
+ * @brief Parse an IPS patch.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t parseIps(Patch *pt, uint8_t const *in, size_t len,
+                     char const *path)
+{
+    rc_t rc = RC_UNSPEC;
+    size_t ix = IPS_MAGIC_SZ;
+
+    for(;;)
+    {
+        hoff_t at = 0, sz = 0;
+        PatchEdit *pe = NULL;
+
+        if(len - ix < 3)
+            goto malformed;
+        at = (hoff_t)in[ix] << 16 | (hoff_t)in[ix + 1] << 8 | in[ix + 2];
+        ix += 3;
+        if(at == IPS_EOF)
+            break;
+        if(len - ix < 2)
+            goto malformed;
+        sz = (hoff_t)in[ix] << 8 | in[ix + 1];
+        ix += 2;
+        if(sz > 0)
+        {
+            if(len - ix < (size_t)sz)
+                goto malformed;
+            pe = addEdit(pt, at, sz, false);
+            memcpy(pt->arena_mal + pe->new_off, in + ix, (size_t)sz);
+            ix += (size_t)sz;
+        }
+        else
+        {
+            // Run-length encoded record
+            if(len - ix < 3)
+                goto malformed;
+            sz = (hoff_t)in[ix] << 8 | in[ix + 1];
+            pe = addEdit(pt, at, sz, false);
+            memset(pt->arena_mal + pe->new_off, in[ix + 2], (size_t)sz);
+            ix += 3;
+        }
+    }
+    if(ix != len)
+    {
+        rc = RC_USER;
+        prerr("%s: IPS truncation is not supported\n", path);
+        goto end;
+    }
+
+    rc = RC_OK;
+    goto end;
+
+malformed:
+    rc = RC_USER;
+    prerr("%s: IPS patch is cut short\n", path);
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Parse a run of hex digit pairs up to any other character.
+ *
+ * @param[out] out If non-NULL, receives the octets parsed
+ * @return Number of octets parsed, else -1 if a pair is malformed
+ */
+static ssize_t parseOctets(char const **p_str, uint8_t *out)
+{
+    char const *str = *p_str;
+    ssize_t n = 0;
+
+    while(CharLookup[(uint8_t)str[0]] <= 0xF)
+    {
+        if(CharLookup[(uint8_t)str[1]] > 0xF)
+            return -1;
+        if(out)
+            out[n] = (uint8_t)(CharLookup[(uint8_t)str[0]] << 4 |
+                               CharLookup[(uint8_t)str[1]]);
+        str += 2;
+        n++;
+    }
+
+    *p_str = str;
+    return n;
+}
+
+/**
+ * @brief Parse the next octet of one side of a -diff line, skipping spaces
+ *        before it. A pair "__" stands for an octet that is unknown.
+ *
+ * @param[in,out] p_str Position in the line, advanced past what is parsed
+ * @param[out] p_val If non-NULL, set to the octet (zero if unknown)
+ * @return 1 for an octet, 0 for an unknown octet, else -1 (at the end of the
+ *         side or at a malformed pair)
+ */
+static int diffOctet(char const **p_str, uint8_t *p_val)
+{
+    char const *str = *p_str;
+    int rv = -1;
+
+    stripLeadingSpaces(str);
+    if(str[0] == '_' && str[1] == '_')
+    {
+        rv = 0;
+        if(p_val)
+            *p_val = 0;
+        str += 2;
+    }
+    else if(CharLookup[(uint8_t)str[0]] <= 0xF &&
+            CharLookup[(uint8_t)str[1]] <= 0xF)
+    {
+        rv = 1;
+        if(p_val)
+            *p_val = (uint8_t)(CharLookup[(uint8_t)str[0]] << 4 |
+                               CharLookup[(uint8_t)str[1]]);
+        str += 2;
+    }
+
+    *p_str = str;
+    return rv;
+}
+
+/**
+ * @brief Parse one line of -diff output: the left side gives old octets and
+ *        the right side new ones. Octets only on the right are appended. The
+ *        line is checked and its octets counted in a first pass, then parsed
+ *        again straight into the patch arena.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t parseDiffLine(Patch *pt, hoff_t at, char const *str,
+                          char const *bar)
+{
+    char const *left = str, *right = bar + 1;
+    ssize_t n_left = 0, n_right = 0;
+
+    while(diffOctet(&left, NULL) >= 0)
+        n_left++;
+    while(diffOctet(&right, NULL) >= 0)
+        n_right++;
+    if(left != bar || *right != '\0')
+        return RC_USER;
+    // The new side ending early would mean truncation, which is not supported
+    if(n_left > n_right)
+        return RC_USER;
+
+    left = str;
+    right = bar + 1;
+    for(ssize_t ix = 0; ix < n_right; )
+    {
+        char const *peek = right;
+        ssize_t end = ix;
+        bool has_old = (ix < n_left);
+        PatchEdit *pe = NULL;
+
+        if(diffOctet(&peek, NULL) == 0)
+        {
+            right = peek;
+            if(has_old)
+                diffOctet(&left, NULL);
+            ix++;
+            continue;
+        }
+        // Group a run of changed octets that either all have old octets or
+        // all are appended
+        for(peek = right; end < n_right && (end < n_left) == has_old &&
+                          diffOctet(&peek, NULL) > 0; end++)
+            ;
+        pe = addEdit(pt, at + ix, end - ix, has_old);
+        for(ssize_t rel = 0; rel < end - ix; rel++)
+        {
+            diffOctet(&right, pt->arena_mal + pe->new_off + rel);
+            if(has_old)
+                diffOctet(&left, pt->arena_mal + pe->old_off + rel);
+        }
+        ix = end;
+    }
+
+    return RC_OK;
+}
+
+/**
+ * @brief Parse one line of "OFFSET NEW" or "OFFSET OLD NEW" format, str
+ *        pointing past the offset.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t parseSimpleLine(Patch *pt, hoff_t at, char const *str)
+{
+    char const *first = str, *second = NULL;
+    ssize_t n_first = parseOctets(&first, NULL), n_second = 0;
+    PatchEdit *pe = NULL;
+
+    if(n_first <= 0 || (*first != ' ' && *first != '\0'))
+        return RC_USER;
+    second = first;
+    stripLeadingSpaces(second);
+    if(*second == '\0')
+    {
+        pe = addEdit(pt, at, n_first, false);
+        parseOctets(&str, pt->arena_mal + pe->new_off);
+        return RC_OK;
+    }
+
+    first = second;
+    n_second = parseOctets(&second, NULL);
+    if(n_second != n_first || *second != '\0')
+        return RC_USER;
+    pe = addEdit(pt, at, n_first, true);
+    parseOctets(&str, pt->arena_mal + pe->old_off);
+    parseOctets(&first, pt->arena_mal + pe->new_off);
+    return RC_OK;
+}
+
+/**
+ * @brief Parse the hexadecimal offset at the start of a text patch line.
+ *
+ * @return RC_OK on success, else RC_USER
+ */
+static rc_t parseOffset(char const **p_str, hoff_t *p_at)
+{
+    char *endtmp = NULL;
+    intmax_t tmpi = 0;
+
+    if(CharLookup[(uint8_t)**p_str] > 0xF)
+        return RC_USER;
+    errno = 0;
+    tmpi = strtoimax(*p_str, &endtmp, 0x10);
+    if(errno || tmpi < 0 || tmpi > HOFF_MAX)
+        return RC_USER;
+    *p_at = (hoff_t)tmpi;
+    *p_str = endtmp;
+    return RC_OK;
+}
+
+/**
+ * @brief Parse a text patch, either -diff output or the simple format.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t parseText(Patch *pt, char *in, size_t len, char const *path)
+{
+    rc_t rc = RC_UNSPEC;
+    size_t lineno = 0;
+
+    for(char *line = in, *next = NULL; line < in + len; line = next)
+    {
+        char *eol = memchr(line, '\n', (size_t)(in + len - line));
+        char const *str = line, *bar = NULL;
+        hoff_t at = 0;
+
+        next = eol ? eol + 1 : in + len;
+        if(eol)
+            *eol = '\0';
+        else
+            in[len] = '\0';
+        lineno++;
+        if(eol && eol > line && eol[-1] == '\r')
+            eol[-1] = '\0';
+        if(strchr(line, '#'))
+            *strchr(line, '#') = '\0';
+        stripTrailingSpaces(line);
+        stripLeadingSpaces(str);
+        // Blank lines, and lines that -diff uses to mark skipped output
+        if(*str == '\0' || *str == '*')
+            continue;
+
+        rc = parseOffset(&str, &at);
+        if(rc)
+            goto malformed;
+        if(*str == ':')
+            str++;
+        stripLeadingSpaces(str);
+        bar = strchr(str, '|');
+        if(bar)
+            rc = parseDiffLine(pt, at, str, bar);
+        else
+            rc = parseSimpleLine(pt, at, str);
+        if(rc)
+            goto malformed;
+    }
+
+    rc = RC_OK;
+    goto end;
+
+malformed:
+    rc = RC_USER;
+    prerr("%s: malformed patch line %zu\n", path, lineno);
+
+end:
+    return rc;
+}
+
+/**
+ * @brief qsort() comparator ordering edits by offset, then by position in
+ *        the patch.
+ */
+static int compareAt(void const *a, void const *b)
+{
+    PatchEdit const *ea = a, *eb = b;
+    if(ea->at != eb->at)
+        return ea->at < eb->at ? -1 : 1;
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+/**
+ * @brief qsort() comparator ordering edits by position in the patch.
+ */
+static int compareSeq(void const *a, void const *b)
+{
+    PatchEdit const *ea = a, *eb = b;
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+/**
+ * @brief Write one run of coalesced edits (pt->edits_mal[first..first+count),
+ *        sorted by offset and covering [at, at+len) without gaps).
+ *        Non-overlapping edits are written straight from the patch arena with
+ *        pwritev(); overlapping ones are first merged in patch order.
+ *
+ * @return RC_OK on success, else a hexpeek error code
+ */
+static rc_t writeRun(int fi, Patch const *pt, size_t first, size_t count,
+                     hoff_t at, hoff_t len)
+{
+    rc_t rc = RC_UNSPEC;
+    PatchEdit const *run = pt->edits_mal + first;
+    PatchEdit *order_mal = NULL;
+    uint8_t *merged_mal = NULL;
+    struct iovec *iov_mal = NULL;
+    bool overlap = false;
+
+    for(size_t ix = 1; ix < count; ix++)
+        if(run[ix].at < run[ix - 1].at + run[ix - 1].len)
+            overlap = true;
+
+    if(overlap)
+    {
+        order_mal = Malloc(count * sizeof *order_mal);
+        memcpy(order_mal, run, count * sizeof *order_mal);
+        qsort(order_mal, count, sizeof *order_mal, compareSeq);
+        merged_mal = Malloc((size_t)len);
+        for(size_t ix = 0; ix < count; ix++)
+            memcpy(merged_mal + (order_mal[ix].at - at),
+                   pt->arena_mal + order_mal[ix].new_off,
+                   (size_t)order_mal[ix].len);
+        rc = writeat(DT_FD(fi), at, merged_mal, len);
+        checkrc(rc);
+    }
+    else
+    {
+        iov_mal = Malloc(MIN(count, IOV_MAX) * sizeof *iov_mal);
+        for(size_t ix = 0; ix < count; ix += IOV_MAX)
+        {
+            size_t cnt = MIN(count - ix, IOV_MAX);
+            for(size_t rel = 0; rel < cnt; rel++)
+            {
+                iov_mal[rel].iov_base = pt->arena_mal + run[ix + rel].new_off;
+                iov_mal[rel].iov_len = (size_t)run[ix + rel].len;
+            }
+            rc = writevat(DT_FD(fi), run[ix].at, iov_mal, (int)cnt);
+            checkrc(rc);
+        }
+    }
+
+    rc = RC_OK;
+
+end:
+    free(order_mal);
+    free(merged_mal);
+    free(iov_mal);
+    return rc;
+}
+
+/**
+ * @brief Check the patch at path against an infile and, if the infile is
+ *        writeable, apply it. Edits are sorted by offset and coalesced into
+ *        runs; every old octet the patch names is checked before anything is
+ *        written, and the original octets of all runs are saved by one
+ *        backup operation.
+ *
+ * @param[in] fi Infile file index
+ * @param[in] path Path of the patch file
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t patchApply(int fi, char const *path)
+{
+    rc_t rc = RC_UNSPEC;
+    Patch pt;
+    uint8_t *in_mal = NULL, *orig_mal = NULL;
+    size_t in_len = 0, nrun = 0, orig_len = 0, *firsts_mal = NULL;
+    FileExtent *runs_mal = NULL;
+    hoff_t f_sz = -1, bad_at = -1, bad_cnt = 0;
+    char origcmd[0x100];
+
+    traceEntry("%d, \"%s\"", fi, path);
+
+    memset(&pt, 0, sizeof pt);
+
+    if( ! isseekable(fi))
+    {
+        rc = RC_USER;
+        prerr("patching requires a seekable file, %s is not\n", DT_NAME(fi));
+        goto end;
+    }
+    if(overlayActive(fi))
+    {
+        rc = RC_USER;
+        prerr("cannot patch %s while edits are staged\n", DT_NAME(fi));
+        goto end;
+    }
+
+    rc = slurp(path, &in_mal, &in_len);
+    checkrc(rc);
+    if(in_len >= IPS_MAGIC_SZ && memcmp(in_mal, IPS_MAGIC, IPS_MAGIC_SZ) == 0)
+        rc = parseIps(&pt, in_mal, in_len, path);
+    else
+        rc = parseText(&pt, (char*)in_mal, in_len, path);
+    checkrc(rc);
+    free(in_mal);
+    in_mal = NULL;
+
+    // Coalesce edits that overlap or touch into runs
+    for(size_t ix = 0; ix < pt.count; ix++)
+        if(pt.edits_mal[ix].len > 0)
+            pt.edits_mal[nrun++] = pt.edits_mal[ix];
+    pt.count = nrun;
+    nrun = 0;
+    qsort(pt.edits_mal, pt.count, sizeof *pt.edits_mal, compareAt);
+    runs_mal = Malloc(MAX(pt.count, 1) * sizeof *runs_mal);
+    firsts_mal = Malloc((pt.count + 1) * sizeof *firsts_mal);
+    for(size_t ix = 0; ix < pt.count; ix++)
+    {
+        PatchEdit const *pe = &pt.edits_mal[ix];
+        if(nrun > 0 &&
+           pe->at <= runs_mal[nrun - 1].at + runs_mal[nrun - 1].len)
+        {
+            FileExtent *fe = &runs_mal[nrun - 1];
+            fe->len = MAX(fe->len, pe->at + pe->len - fe->at);
+        }
+        else
+        {
+            firsts_mal[nrun] = ix;
+            runs_mal[nrun].at = pe->at;
+            runs_mal[nrun].len = pe->len;
+            nrun++;
+        }
+    }
+    firsts_mal[nrun] = pt.count;
+
+    // Read the original octets of each run, for checking and for backup
+    f_sz = filesize(fi);
+    if(nrun > 0 && runs_mal[nrun - 1].at > f_sz)
+    {
+        rc = RC_USER;
+        prerr("patch would write past end of %s\n", DT_NAME(fi));
+        goto end;
+    }
+    for(size_t ix = 0; ix < nrun; ix++)
+        orig_len += (size_t)MAX(0, MIN(runs_mal[ix].len,
+                                       f_sz - runs_mal[ix].at));
+    orig_mal = Malloc(MAX(orig_len, 1));
+    orig_len = 0;
+    for(size_t ix = 0; ix < nrun; ix++)
+    {
+        hoff_t olen = MAX(0, MIN(runs_mal[ix].len, f_sz - runs_mal[ix].at));
+        rc = readat(DT_FD(fi), runs_mal[ix].at, orig_mal + orig_len, olen);
+        checkrc(rc);
+        runs_mal[ix].data = orig_mal + orig_len;
+        orig_len += (size_t)olen;
+    }
+
+    // Check old octets
+    for(size_t rx = 0; rx < nrun; rx++)
+    {
+        FileExtent const *fe = &runs_mal[rx];
+        hoff_t olen = MAX(0, MIN(fe->len, f_sz - fe->at));
+        for(size_t ix = firsts_mal[rx]; ix < firsts_mal[rx + 1]; ix++)
+        {
+            PatchEdit const *pe = &pt.edits_mal[ix];
+            if(pe->old_off == PATCH_NO_OLD)
+                continue;
+            for(hoff_t rel = 0; rel < pe->len; rel++)
+            {
+                hoff_t off = pe->at - fe->at + rel;
+                if(off < olen && fe->data[off] ==
+                                 pt.arena_mal[pe->old_off + (size_t)rel])
+                    continue;
+                if(bad_at < 0)
+                    bad_at = pe->at + rel;
+                bad_cnt++;
+            }
+        }
+    }
+    if(bad_cnt > 0)
+    {
+        rc = RC_USER;
+        prerr("%s does not match the patch: " TRC_hoff " old octet%s differ,"
+              " first at " TRC_hoff "\n", DT_NAME(fi), trchoff(bad_cnt),
+              (bad_cnt == 1 ? "" : "s"), trchoff(bad_at));
+        goto end;
+    }
+
+    if( ! (DT_MODE(fi) & O_RDWR))
+    {
+        consoleOutf("Patch applies: " PRI_hoff " run%s.%s",
+                    prihcnt((hoff_t)nrun), LineTerm);
+        rc = RC_OK;
+        goto end;
+    }
+
+    // Back up all runs as one operation, then write them
+    for(size_t ix = 0; ix < nrun; ix++)
+        runs_mal[ix].len = MAX(0, MIN(runs_mal[ix].len,
+                                      f_sz - runs_mal[ix].at));
+    snprintf(origcmd, sizeof origcmd, "patch %s", path);
+    rc = makeScatterBackup(fi, runs_mal, nrun, 0, 0, origcmd);
+    checkrc(rc);
+    if(BackupDepth > 0)
+        DT_OPCNT(fi)++;
+
+    for(size_t rx = 0; rx < nrun; rx++)
+    {
+        size_t first = firsts_mal[rx], count = firsts_mal[rx + 1] - first;
+        hoff_t end = runs_mal[rx].at;
+        for(size_t ix = first; ix < first + count; ix++)
+            end = MAX(end, pt.edits_mal[ix].at + pt.edits_mal[ix].len);
+        rc = writeRun(fi, &pt, first, count, runs_mal[rx].at,
+                      end - runs_mal[rx].at);
+        checkrc(rc);
+        plugin(2, NULL);
+    }
+
+    rc = RC_OK;
+
+end:
+    free(in_mal);
+    free(orig_mal);
+    free(runs_mal);
+    free(firsts_mal);
+    free(pt.edits_mal);
+    free(pt.arena_mal);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
@@ -0,0 +1,1112 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define SRCNAME "hexpeek_regex.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+/**
+ * @file hexpeek_regex.c
+ * @brief Octet regular expressions: parser, Thompson NFA, and a lazily
+ *        constructed DFA used to scan file data in linear time.
+ */
+
+//------------------------------ Definitions ---------------------------------//
+
+#define RX_MAXREP     0x400    // largest finite repetition count
+#define RX_MAXNFA     0x10000  // NFA state limit
+#define RX_DFA_MAX    0x800    // cached DFA states before the cache is flushed
+#define RX_DFA_POOL   0x40000  // cached NFA state indices before flush
+#define RX_PREFIX_MAX 0x10
+
+#define RXN_EMPTY 0
+#define RXN_SET   1
+#define RXN_CAT   2
+#define RXN_ALT   3
+#define RXN_REP   4
+
+#define RXS_CHAR  0
+#define RXS_SPLIT 1
+#define RXS_MATCH 2
+
+#define RX_INF    -1
+
+typedef struct
+{
+    uint8_t bits[OCTET_COUNT / CHAR_BIT];
+} RxSet;
+
+#define rxsetHas(s, o) ( (s)->bits[(o) >> 3] &   (1 << ((o) & 7)) )
+#define rxsetAdd(s, o) ( (s)->bits[(o) >> 3] |=  (1 << ((o) & 7)) )
+
+typedef struct RxNode
+{
+    int type;
+    int set;
+    int min;
+    int max;
+    struct RxNode *a;
+    struct RxNode *b;
+} RxNode;
+
+typedef struct
+{
+    int type;
+    int out;
+    int out1;
+    int set;
+} RxState;
+
+/**
+ * @brief Lazily built DFA over NFA state sets. Each DFA state is a sorted
+ *        list of NFA CHAR/MATCH state indices stored in pool. Transitions
+ *        are indexed by octet equivalence class and are -1 until computed.
+ */
+typedef struct
+{
+    int start;
+    bool unanchored;
+    int count;
+    int *trans;
+    int *set_off;
+    int *set_len;
+    bool *accept;
+    int *pool;
+    int pool_used;
+    int *hash;
+    int init;
+} RxDfa;
+
+#define RX_HASHSZ (RX_DFA_MAX * 2)
+
+struct ByteRegex
+{
+    RxSet *sets;
+    int nsets;
+    RxState *nfa;
+    int nnfa;
+    int nfa_sz;
+    int match;
+    uint8_t eqc[OCTET_COUNT];
+    uint8_t rep[OCTET_COUNT];
+    int ncls;
+    uint8_t prefix[RX_PREFIX_MAX];
+    int prefix_len;
+    RxDfa fwd;
+    RxDfa rev;
+    int *mark;
+    int stamp;
+    int *stack;
+    int *list;
+};
+
+//--------------------------------- Parsing ----------------------------------//
+
+typedef struct
+{
+    char const *str;
+    int mode;
+    RxNode *nodes;
+    int nnodes;
+    int nodes_sz;
+    ByteRegex *rx;
+} RxParser;
+
+static RxNode *rxAlt(RxParser *pp);
+
+/**
+ * @brief Allocate an AST node of the given type from the parser's pool.
+ */
+static RxNode *rxNode(RxParser *pp, int type)
+{
+    assert(pp->nnodes < pp->nodes_sz);
+    RxNode *n = &pp->nodes[pp->nnodes++];
+    memset(n, 0, sizeof *n);
+    n->type = type;
+    n->set = -1;
+    return n;
+}
+
+/**
+ * @brief Append an empty octet set to the regex.
+ *
+ * @return Index of the new set, or -1 on allocation failure
+ */
+static int rxNewSet(RxParser *pp)
+{
+    ByteRegex *rx = pp->rx;
+    RxSet *tmp = realloc(rx->sets, sizeof(RxSet) * (rx->nsets + 1));
+    if( ! tmp)
+        return -1;
+    rx->sets = tmp;
+    memset(&rx->sets[rx->nsets], 0, sizeof(RxSet));
+    return rx->nsets++;
+}
+
+/**
+ * @brief Parse one octet in the current display mode. The "." character
+ *        matches any nibble (or bit) just as it does for search.
+ *
+ * @param[in,out] pp Parser state
+ * @param[out] val Octet value with wildcarded positions zeroed
+ * @param[out] mask Mask of significant positions in val
+ * @return RC_OK on success, RC_USER on malformed input
+ */
+static rc_t rxOctet(RxParser *pp, uint8_t *val, uint8_t *mask)
+{
+    const uint8_t full = (pp->mode == MODE_HEX ? 0xF : 1);
+    const int distance = CHAR_BIT / MODE_CHCNT(pp->mode);
+
+    *val = 0;
+    *mask = 0xFF;
+    for(int c_ix = MODE_CHCNT(pp->mode) - 1; c_ix >= 0; c_ix--, pp->str++)
+    {
+        uint8_t tmp8 = CharLookup[(unsigned char)*pp->str];
+        if(tmp8 <= full)
+            *val |= tmp8 << (c_ix * distance);
+        else if(*pp->str == '.')
+            *mask &= ~(full << (c_ix * distance));
+        else
+        {
+            malcmd("octets not fully specified in regex\n");
+            return RC_USER;
+        }
+    }
+    return RC_OK;
+}
+
+/**
+ * @brief Return true if ch may begin an octet in the parser's mode.
+ */
+static bool rxOctetStart(RxParser const *pp, char ch)
+{
+    uint8_t const full = (pp->mode == MODE_HEX ? 0xF : 1);
+    return ch == '.' || CharLookup[(unsigned char)ch] <= full;
+}
+
+/**
+ * @brief Add every octet equal to val in the bits selected by mask to set.
+ */
+static void rxAddMasked(RxSet *set, uint8_t val, uint8_t mask)
+{
+    for(int oc = 0; oc < OCTET_COUNT; oc++)
+    {
+        if((oc & mask) == val)
+            rxsetAdd(set, oc);
+    }
+}
+
+/**
+ * @brief Parse an octet class "[...]" into a set node.
+ */
+static rc_t rxClass(RxParser *pp, RxNode **out)
+{
+    rc_t rc = RC_UNSPEC;
+    bool negate = false;
+    RxSet tmp;
+    int si = -1;
+
+    memset(&tmp, 0, sizeof tmp);
+    pp->str++; // '['
+    stripLeadingSpaces(pp->str);
+    if(*pp->str == '^')
+    {
+        negate = true;
+        pp->str++;
+    }
+    for(;;)
+    {
+        uint8_t lo = 0, lo_mask = 0, hi = 0, hi_mask = 0;
+        stripLeadingSpaces(pp->str);
+        if(*pp->str == ']')
+            break;
+        if( ! rxOctetStart(pp, *pp->str))
+        {
+            rc = RC_USER;
+            malcmd("unterminated octet class in regex\n");
+            goto end;
+        }
+        rc = rxOctet(pp, &lo, &lo_mask);
+        checkrc(rc);
+        stripLeadingSpaces(pp->str);
+        if(*pp->str == '-')
+        {
+            pp->str++;
+            stripLeadingSpaces(pp->str);
+            rc = rxOctet(pp, &hi, &hi_mask);
+            checkrc(rc);
+            if(lo_mask != 0xFF || hi_mask != 0xFF || hi < lo)
+            {
+                rc = RC_USER;
+                malcmd("invalid octet range in regex\n");
+                goto end;
+            }
+            for(int oc = lo; oc <= hi; oc++)
+                rxsetAdd(&tmp, oc);
+        }
+        else
+        {
+            rxAddMasked(&tmp, lo, lo_mask);
+        }
+    }
+    pp->str++; // ']'
+
+    if(negate)
+    {
+        for(size_t bi = 0; bi < sizeof tmp.bits; bi++)
+            tmp.bits[bi] = ~tmp.bits[bi];
+    }
+
+    if((si = rxNewSet(pp)) < 0)
+    {
+        rc = RC_CRIT;
+        prerr("error allocating memory: %s\n", strerror(errno));
+        goto end;
+    }
+    pp->rx->sets[si] = tmp;
+    *out = rxNode(pp, RXN_SET);
+    (*out)->set = si;
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Parse a repetition count (in the scalar base).
+ */
+static rc_t rxCount(RxParser *pp, int *result)
+{
+    char *endptr = NULL;
+    long tmpl = strtol(pp->str, &endptr, Params.scalar_base);
+    if(endptr == pp->str || tmpl < 0 || tmpl > RX_MAXREP)
+    {
+        malcmd("invalid repetition count in regex (maximum %x)\n",
+               RX_MAXREP);
+        return RC_USER;
+    }
+    pp->str = endptr;
+    *result = (int)tmpl;
+    return RC_OK;
+}
+
+/**
+ * @brief Parse a group, class, any-octet ".", or octet literal.
+ */
+static rc_t rxAtom(RxParser *pp, RxNode **out)
+{
+    rc_t rc = RC_UNSPEC;
+    int si = -1;
+
+    *out = NULL;
+    if(*pp->str == '(')
+    {
+        pp->str++;
+        *out = rxAlt(pp);
+        if( ! *out)
+            return RC_USER;
+        if(*pp->str != ')')
+        {
+            malcmd("unbalanced parentheses in regex\n");
+            return RC_USER;
+        }
+        pp->str++;
+        return RC_OK;
+    }
+    if(*pp->str == '[')
+        return rxClass(pp, out);
+    if( ! rxOctetStart(pp, *pp->str))
+    {
+        malcmd("unrecognized character '%c' in regex\n", *pp->str);
+        return RC_USER;
+    }
+
+    if((si = rxNewSet(pp)) < 0)
+    {
+        prerr("error allocating memory: %s\n", strerror(errno));
+        return RC_CRIT;
+    }
+    if(pp->str[0] == '.' && ! rxOctetStart(pp, pp->str[1]))
+    {
+        // a lone "." matches any octet
+        pp->str++;
+        memset(&pp->rx->sets[si], 0xFF, sizeof(RxSet));
+    }
+    else
+    {
+        uint8_t val = 0, mask = 0;
+        rc = rxOctet(pp, &val, &mask);
+        if(rc)
+            return rc;
+        rxAddMasked(&pp->rx->sets[si], val, mask);
+    }
+    *out = rxNode(pp, RXN_SET);
+    (*out)->set = si;
+    return RC_OK;
+}
+
+/**
+ * @brief Parse an atom followed by any number of repetition operators.
+ *
+ * @return Node, or NULL on error (already reported)
+ */
+static RxNode *rxRep(RxParser *pp)
+{
+    RxNode *atom = NULL;
+    if(rxAtom(pp, &atom))
+        return NULL;
+    for(;;)
+    {
+        int min = 0, max = 0;
+        stripLeadingSpaces(pp->str);
+        if(*pp->str == '*')
+            min = 0, max = RX_INF;
+        else if(*pp->str == '+')
+            min = 1, max = RX_INF;
+        else if(*pp->str == '?')
+            min = 0, max = 1;
+        else if(*pp->str == '{')
+        {
+            pp->str++;
+            stripLeadingSpaces(pp->str);
+            if(*pp->str != ',' && rxCount(pp, &min))
+                return NULL;
+            stripLeadingSpaces(pp->str);
+            if(*pp->str == ',')
+            {
+                pp->str++;
+                stripLeadingSpaces(pp->str);
+                max = RX_INF;
+                if(*pp->str != '}' && rxCount(pp, &max))
+                    return NULL;
+                stripLeadingSpaces(pp->str);
+            }
+            else
+                max = min;
+            if(*pp->str != '}' || (max != RX_INF && max < min))
+            {
+                malcmd("invalid repetition in regex\n");
+                return NULL;
+            }
+        }
+        else
+            break;
+        pp->str++;
+        RxNode *rep = rxNode(pp, RXN_REP);
+        rep->min = min;
+        rep->max = max;
+        rep->a = atom;
+        atom = rep;
+    }
+    return atom;
+}
+
+/**
+ * @brief Parse a (possibly empty) concatenation.
+ *
+ * @return Node, or NULL on error (already reported)
+ */
+static RxNode *rxCat(RxParser *pp)
+{
+    RxNode *result = NULL;
+    for(;;)
+    {
+        stripLeadingSpaces(pp->str);
+        if(*pp->str == '\0' || *pp->str == '|' || *pp->str == ')')
+            break;
+        RxNode *next = rxRep(pp);
+        if( ! next)
+            return NULL;
+        if(result)
+        {
+            RxNode *cat = rxNode(pp, RXN_CAT);
+            cat->a = result;
+            cat->b = next;
+            next = cat;
+        }
+        result = next;
+    }
+    if( ! result)
+        result = rxNode(pp, RXN_EMPTY);
+    return result;
+}
+
+/**
+ * @brief Parse an alternation - the top level of the regex grammar.
+ *
+ * @return Node, or NULL on error (already reported)
+ */
+static RxNode *rxAlt(RxParser *pp)
+{
+    RxNode *result = rxCat(pp);
+    while(result && *pp->str == '|')
+    {
+        pp->str++;
+        RxNode *next = rxCat(pp);
+        if( ! next)
+            return NULL;
+        RxNode *alt = rxNode(pp, RXN_ALT);
+        alt->a = result;
+        alt->b = next;
+        result = alt;
+    }
+    return result;
+}
+
+//------------------------------ NFA Building --------------------------------//
+
+/**
+ * @brief Append an NFA state.
+ *
+ * @return Index of the new state, or -1 if an argument is invalid or the
+ *         NFA size limit was reached
+ */
+static int rxEmit(ByteRegex *rx, int type, int out, int out1, int set)
+{
+    if(out < 0 || out1 < -1 || rx->nnfa >= RX_MAXNFA)
+        return -1;
+    if(rx->nnfa >= rx->nfa_sz)
+    {
+        int nsz = rx->nfa_sz ? rx->nfa_sz * 2 : 0x100;
+        RxState *tmp = realloc(rx->nfa, sizeof(RxState) * nsz);
+        if( ! tmp)
+            return -1;
+        rx->nfa = tmp;
+        rx->nfa_sz = nsz;
+    }
+    RxState *st = &rx->nfa[rx->nnfa];
+    st->type = type;
+    st->out = out;
+    st->out1 = out1;
+    st->set = set;
+    return rx->nnfa++;
+}
+
+/**
+ * @brief Build NFA states for node n in continuation-passing style: the
+ *        returned state matches n and then continues to state next. If rev
+ *        is set, the NFA matches the reversed language.
+ *
+ * @return Entry NFA state index, or -1 if the NFA size limit was exceeded
+ */
+static int rxBuild(ByteRegex *rx, RxNode const *n, int next, bool rev)
+{
+    if(next < 0)
+        return -1;
+    switch(n->type)
+    {
+    case RXN_EMPTY:
+        return next;
+    case RXN_SET:
+        return rxEmit(rx, RXS_CHAR, next, -1, n->set);
+    case RXN_CAT:
+        if(rev)
+            return rxBuild(rx, n->b, rxBuild(rx, n->a, next, rev), rev);
+        return rxBuild(rx, n->a, rxBuild(rx, n->b, next, rev), rev);
+    case RXN_ALT:
+    {
+        int l = rxBuild(rx, n->a, next, rev);
+        int r = rxBuild(rx, n->b, next, rev);
+        if(l < 0 || r < 0)
+            return -1;
+        return rxEmit(rx, RXS_SPLIT, l, r, -1);
+    }
+    case RXN_REP:
+    {
+        int chain = next;
+        if(n->max == RX_INF)
+        {
+            // loop state is created first so the body can refer back to it
+            int loop = rxEmit(rx, RXS_SPLIT, next, next, -1);
+            if(loop < 0)
+                return -1;
+            int body = rxBuild(rx, n->a, loop, rev);
+            if(body < 0)
+                return -1;
+            rx->nfa[loop].out = body;
+            chain = loop;
+        }
+        else
+        {
+            for(int ii = n->min; ii < n->max; ii++)
+            {
+                int body = rxBuild(rx, n->a, chain, rev);
+                chain = rxEmit(rx, RXS_SPLIT, body, next, -1);
+                if(chain < 0)
+                    return -1;
+            }
+        }
+        for(int ii = 0; ii < n->min; ii++)
+        {
+            chain = rxBuild(rx, n->a, chain, rev);
+            if(chain < 0)
+                return -1;
+        }
+        return chain;
+    }
+    }
+    return -1;
+}
+
+/**
+ * @brief Collect the longest literal prefix of the expression for use as a
+ *        prefilter while the forward DFA is in its initial state.
+ *
+ * @return true if all of n is a literal (so a following node may extend it)
+ */
+static bool rxPrefix(ByteRegex *rx, RxNode const *n)
+{
+    if(n->type == RXN_CAT)
+        return rxPrefix(rx, n->a) && rxPrefix(rx, n->b);
+    if(n->type != RXN_SET || rx->prefix_len >= RX_PREFIX_MAX)
+        return false;
+    int found = -1;
+    for(int oc = 0; oc < OCTET_COUNT; oc++)
+    {
+        if(rxsetHas(&rx->sets[n->set], oc))
+        {
+            if(found >= 0)
+                return false;
+            found = oc;
+        }
+    }
+    if(found < 0)
+        return false;
+    rx->prefix[rx->prefix_len++] = (uint8_t)found;
+    return true;
+}
+
+/**
+ * @brief Partition octets into equivalence classes which no octet set in the
+ *        expression distinguishes, shrinking the DFA transition tables.
+ */
+static void rxClasses(ByteRegex *rx)
+{
+    memset(rx->eqc, 0, sizeof rx->eqc);
+    rx->ncls = 1;
+    for(int si = 0; si < rx->nsets; si++)
+    {
+        int remap[OCTET_COUNT][2];
+        int ncls = 0;
+        for(int ci = 0; ci < rx->ncls; ci++)
+            remap[ci][0] = remap[ci][1] = -1;
+        for(int oc = 0; oc < OCTET_COUNT; oc++)
+        {
+            int in = rxsetHas(&rx->sets[si], oc) ? 1 : 0;
+            int *slot = &remap[rx->eqc[oc]][in];
+            if(*slot < 0)
+                *slot = ncls++;
+            rx->eqc[oc] = (uint8_t)*slot;
+        }
+        rx->ncls = ncls;
+    }
+    for(int oc = OCTET_COUNT - 1; oc >= 0; oc--)
+        rx->rep[rx->eqc[oc]] = (uint8_t)oc;
+}
+
+//-------------------------------- Lazy DFA ----------------------------------//
+
+/**
+ * @brief Add the epsilon closure of NFA state from to rx->list, skipping
+ *        states already marked with the current stamp.
+ */
+static void rxClosure(ByteRegex *rx, int from, int *len)
+{
+    int depth = 0;
+    rx->stack[depth++] = from;
+    while(depth > 0)
+    {
+        int si = rx->stack[--depth];
+        if(rx->mark[si] == rx->stamp)
+            continue;
+        rx->mark[si] = rx->stamp;
+        if(rx->nfa[si].type == RXS_SPLIT)
+        {
+            rx->stack[depth++] = rx->nfa[si].out1;
+            rx->stack[depth++] = rx->nfa[si].out;
+        }
+        else
+        {
+            rx->list[(*len)++] = si;
+        }
+    }
+}
+
+/**
+ * @brief qsort() comparator for NFA state indices.
+ */
+static int rxIntCmp(void const *a, void const *b)
+{
+    return *(int const *)a - *(int const *)b;
+}
+
+/**
+ * @brief FNV-1a hash of an NFA state list.
+ */
+static unsigned rxHash(int const *set, int len)
+{
+    unsigned hv = 2166136261u;
+    for(int ii = 0; ii < len; ii++)
+        hv = (hv ^ (unsigned)set[ii]) * 16777619u;
+    return hv;
+}
+
+/**
+ * @brief Discard all cached DFA states.
+ */
+static void rxDfaFlush(RxDfa *d)
+{
+    trace("flushing regex DFA cache (%d states)\n", d->count);
+    d->count = 0;
+    d->pool_used = 0;
+    for(int hi = 0; hi < RX_HASHSZ; hi++)
+        d->hash[hi] = -1;
+}
+
+/**
+ * @brief Return the DFA state for the sorted NFA state list rx->list[0..len),
+ *        adding it to the cache (flushing the cache first if full).
+ *
+ * @param[out] flushed Set true if the cache was flushed
+ */
+static int rxDfaState(ByteRegex *rx, RxDfa *d, int len, bool *flushed)
+{
+    qsort(rx->list, len, sizeof(int), rxIntCmp);
+    unsigned hv = rxHash(rx->list, len) % RX_HASHSZ;
+    for(;; hv = (hv + 1) % RX_HASHSZ)
+    {
+        int ds = d->hash[hv];
+        if(ds < 0)
+            break;
+        if(d->set_len[ds] == len &&
+           memcmp(d->pool + d->set_off[ds], rx->list, len * sizeof(int)) == 0)
+            return ds;
+    }
+
+    if(d->count >= RX_DFA_MAX || d->pool_used + len > RX_DFA_POOL)
+    {
+        rxDfaFlush(d);
+        *flushed = true;
+        hv = rxHash(rx->list, len) % RX_HASHSZ;
+    }
+
+    int ds = d->count++;
+    d->set_off[ds] = d->pool_used;
+    d->set_len[ds] = len;
+    memcpy(d->pool + d->pool_used, rx->list, len * sizeof(int));
+    d->pool_used += len;
+    d->accept[ds] = false;
+    for(int ii = 0; ii < len; ii++)
+    {
+        if(rx->list[ii] == rx->match)
+            d->accept[ds] = true;
+    }
+    for(int ci = 0; ci < rx->ncls; ci++)
+        d->trans[ds * rx->ncls + ci] = -1;
+    while(d->hash[hv] >= 0)
+        hv = (hv + 1) % RX_HASHSZ;
+    d->hash[hv] = ds;
+    return ds;
+}
+
+/**
+ * @brief (Re)create the initial DFA state.
+ */
+static void rxDfaBase(ByteRegex *rx, RxDfa *d)
+{
+    bool flushed = false;
+    int len = 0;
+    rx->stamp++;
+    rxClosure(rx, d->start, &len);
+    d->init = rxDfaState(rx, d, len, &flushed);
+}
+
+/**
+ * @brief Compute (and cache) the transition from DFA state ds on octet
+ *        class ci. May flush the cache, in which case ds is invalidated.
+ */
+static int rxDfaNext(ByteRegex *rx, RxDfa *d, int ds, int ci)
+{
+    bool flushed = false;
+    int len = 0;
+    int const *set = d->pool + d->set_off[ds];
+    int set_len = d->set_len[ds];
+    uint8_t oc = rx->rep[ci];
+
+    rx->stamp++;
+    for(int ii = 0; ii < set_len; ii++)
+    {
+        RxState const *st = &rx->nfa[set[ii]];
+        if(st->type == RXS_CHAR && rxsetHas(&rx->sets[st->set], oc))
+            rxClosure(rx, st->out, &len);
+    }
+    if(d->unanchored)
+        rxClosure(rx, d->start, &len);
+
+    int result = rxDfaState(rx, d, len, &flushed);
+    if(flushed)
+    {
+        // copy out the target set, rebuild base states, then re-add it
+        int *keep = Malloc(sizeof(int) * (len + 1));
+        memcpy(keep, d->pool + d->set_off[result], sizeof(int) * len);
+        rxDfaFlush(d);
+        rxDfaBase(rx, d);
+        memcpy(rx->list, keep, sizeof(int) * len);
+        free(keep);
+        flushed = false;
+        result = rxDfaState(rx, d, len, &flushed);
+        assert( ! flushed);
+    }
+    else
+    {
+        d->trans[ds * rx->ncls + ci] = result;
+    }
+    return result;
+}
+
+/**
+ * @brief Allocate a lazy DFA for the NFA rooted at start. An unanchored DFA
+ *        restarts the NFA at every input position.
+ */
+static rc_t rxDfaInit(ByteRegex *rx, RxDfa *d, int start, bool unanchored)
+{
+    memset(d, 0, sizeof *d);
+    d->start = start;
+    d->unanchored = unanchored;
+    d->trans = malloc(sizeof(int) * RX_DFA_MAX * rx->ncls);
+    d->set_off = malloc(sizeof(int) * RX_DFA_MAX);
+    d->set_len = malloc(sizeof(int) * RX_DFA_MAX);
+    d->accept = malloc(sizeof(bool) * RX_DFA_MAX);
+    d->pool = malloc(sizeof(int) * RX_DFA_POOL);
+    d->hash = malloc(sizeof(int) * RX_HASHSZ);
+    if( ! (d->trans && d->set_off && d->set_len && d->accept && d->pool &&
+           d->hash))
+    {
+        prerr("error allocating memory: %s\n", strerror(errno));
+        return RC_CRIT;
+    }
+    rxDfaFlush(d);
+    rxDfaBase(rx, d);
+    return RC_OK;
+}
+
+/**
+ * @brief Release a lazy DFA.
+ */
+static void rxDfaFree(RxDfa *d)
+{
+    free(d->trans);
+    free(d->set_off);
+    free(d->set_len);
+    free(d->accept);
+    free(d->pool);
+    free(d->hash);
+    memset(d, 0, sizeof *d);
+}
+
+#define rxStep(rx, d, ds, oc) do { \
+    int _ci = (rx)->eqc[(oc)]; \
+    int _nx = (d)->trans[(ds) * (rx)->ncls + _ci]; \
+    (ds) = (_nx >= 0 ? _nx : rxDfaNext((rx), (d), (ds), _ci)); \
+} while(0)
+
+//------------------------------- Public API ---------------------------------//
+
+/**
+ * @brief Release a compiled octet regex.
+ *
+ * @param[in] rx Regex returned by regexCompile() (NULL is allowed)
+ */
+void regexFree(ByteRegex *rx)
+{
+    if( ! rx)
+        return;
+    rxDfaFree(&rx->fwd);
+    rxDfaFree(&rx->rev);
+    free(rx->sets);
+    free(rx->nfa);
+    free(rx->mark);
+    free(rx->stack);
+    free(rx->list);
+    free(rx);
+}
+
+/**
+ * @brief Compile an octet regex. Atoms are octets in the display mode (with
+ *        "." nibble or bit wildcards), a lone "." for any octet, and "[...]"
+ *        classes of octets and ranges (negated by a leading "^"). Atoms may be
+ *        grouped with "(...)", separated by "|", and repeated with "*", "+",
+ *        "?", or "{m,n}" where counts use the scalar base.
+ *
+ * @param[in] str Regex text
+ * @param[in] mode Display mode used to interpret octets (MODE_HEX/MODE_BITS)
+ * @param[out] prx Compiled regex, to be released with regexFree()
+ * @return RC_OK on success, RC_USER on malformed input, RC_CRIT otherwise
+ */
+rc_t regexCompile(char const *str, int mode, ByteRegex **prx)
+{
+    rc_t rc = RC_UNSPEC;
+    RxParser ps;
+    RxNode *root = NULL;
+    ByteRegex *rx = NULL;
+    int fwd = -1, rev = -1;
+
+    assert(str);
+    assert(prx);
+
+    traceEntry("'%s'", str);
+
+    memset(&ps, 0, sizeof ps);
+    *prx = NULL;
+    rx = Malloc(sizeof *rx);
+    memset(rx, 0, sizeof *rx);
+
+    ps.str = str;
+    ps.mode = mode;
+    ps.rx = rx;
+    ps.nodes_sz = 3 * strlen(str) + 4;
+    ps.nodes = Malloc(sizeof(RxNode) * ps.nodes_sz);
+
+    stripLeadingSpaces(ps.str);
+    if(*ps.str == '\0')
+    {
+        rc = RC_USER;
+        malcmd("empty argument\n");
+        goto end;
+    }
+    root = rxAlt(&ps);
+    if( ! root)
+    {
+        rc = RC_USER;
+        goto end;
+    }
+    if(*ps.str != '\0')
+    {
+        rc = RC_USER;
+        malcmd("unbalanced parentheses in regex\n");
+        goto end;
+    }
+
+    rx->match = rxEmit(rx, RXS_MATCH, 0, -1, -1);
+    fwd = rxBuild(rx, root, rx->match, false);
+    rev = rxBuild(rx, root, rx->match, true);
+    if(fwd < 0 || rev < 0)
+    {
+        rc = RC_USER;
+        malcmd("regex too complex\n");
+        goto end;
+    }
+
+    rx->mark = calloc(rx->nnfa, sizeof(int));
+    rx->stack = malloc(sizeof(int) * 2 * rx->nnfa);
+    rx->list = malloc(sizeof(int) * rx->nnfa);
+    if( ! (rx->mark && rx->stack && rx->list))
+    {
+        rc = RC_CRIT;
+        prerr("error allocating memory: %s\n", strerror(errno));
+        goto end;
+    }
+
+    rxClasses(rx);
+    rxPrefix(rx, root);
+
+    rc = rxDfaInit(rx, &rx->fwd, fwd, true);
+    checkrc(rc);
+    rc = rxDfaInit(rx, &rx->rev, rev, false);
+    checkrc(rc);
+
+    if(rx->fwd.accept[rx->fwd.init])
+    {
+        rc = RC_USER;
+        malcmd("regex matches empty input\n");
+        goto end;
+    }
+
+    trace("regex: %d NFA states, %d classes, prefix length %d\n",
+          rx->nnfa, rx->ncls, rx->prefix_len);
+
+    *prx = rx;
+    rc = RC_OK;
+
+end:
+    free(ps.nodes);
+    if(rc)
+        regexFree(rx);
+    traceExit(TRC_rc, rc);
+    return rc;
+}
+
+/**
+ * @brief Find the leftmost start of a match ending at file offset end by
+ *        running the reverse DFA backwards, first over data still held in
+ *        memory and then (for seekable files) over data re-read from the file.
+ */
+static rc_t rxStart(ByteRegex *rx, FileZone const *fz, hoff_t end,
+                    uint8_t const *win, hoff_t win_at, hoff_t *start)
+{
+    rc_t rc = RC_UNSPEC;
+    RxDfa *d = &rx->rev;
+    int ds = d->init;
+    uint8_t buf[BUFSZ];
+
+    *start = HOFF_NIL;
+    for(hoff_t at = end; at > fz->start; )
+    {
+        uint8_t const *src = NULL;
+        hoff_t chunk = 0;
+        if(at > win_at)
+        {
+            chunk = at - MAX(win_at, fz->start);
+            src = win + (at - chunk - win_at);
+        }
+        else if(isseekable(fz->fi))
+        {
+            chunk = MIN(BUFSZ, at - fz->start);
+            rc = readat(DT_FD(fz->fi), at - chunk, buf, chunk);
+            checkrc(rc);
+            src = buf;
+        }
+        else
+        {
+            rc = RC_USER;
+            prerr("regex match exceeds search window of non-seekable file\n");
+            goto end;
+        }
+        for(hoff_t ix = chunk - 1; ix >= 0; ix--)
+        {
+            rxStep(rx, d, ds, src[ix]);
+            if(d->accept[ds])
+                *start = at - chunk + ix;
+            else if(d->set_len[ds] == 0)
+                goto found;
+        }
+        at -= chunk;
+    }
+
+found:
+    assert(*start != HOFF_NIL);
+    rc = RC_OK;
+
+end:
+    return rc;
+}
+
+/**
+ * @brief Search a filezone for the first match of a compiled regex, i.e. the
+ *        match which ends first, extended to its leftmost start. The zone's
+ *        file must already be positioned at fz->start. The forward DFA state
+ *        carries across reads, so each octet is examined once.
+ *
+ * @param[in] rx Compiled regex
+ * @param[in] fz Filezone to search
+ * @param[out] match File offset of match start or HOFF_NIL if none found
+ * @param[out] match_len Length of match
+ * @param[out] scanned Octets read when no match was found
+ * @return RC_OK on success, else a hexpeek error code
+ */
+rc_t regexSearch(ByteRegex *rx, FileZone const *fz,
+                 hoff_t *match, hoff_t *match_len, hoff_t *scanned)
+{
+    rc_t rc = RC_UNSPEC;
+    RxDfa *d = &rx->fwd;
+    int ds = d->init;
+    uint8_t win[SRCHSZ * 2];
+    hoff_t win_at = fz->start, win_len = 0;
+    hoff_t remain = fz->len;
+
+    assert(rx);
+    assert(fz->fi >= 0);
+
+    *match = HOFF_NIL;
+    *match_len = 0;
+    *scanned = 0;
+
+    while(remain > 0)
+    {
+        if(win_len + BUFSZ > (hoff_t)sizeof win)
+        {
+            // retain the previous buffer for locating the match start
+            hoff_t drop = win_len - BUFSZ;
+            memmove(win, win + drop, BUFSZ);
+            win_at += drop;
+            win_len = BUFSZ;
+        }
+        uint8_t *buf = win + win_len;
+        hoff_t lcl_rd = hexpeek_read(DT_FD(fz->fi), buf, MIN(BUFSZ, remain));
+        if(lcl_rd < 0)
+        {
+            rc = RC_CRIT;
+            goto end;
+        }
+        if(lcl_rd == 0)
+            break;
+        win_len += lcl_rd;
+        remain -= lcl_rd;
+        for(hoff_t ix = 0; ix < lcl_rd; ix++)
+        {
+            if(ds == d->init && rx->prefix_len > 0)
+            {
+                // Prefilter: no match can start before the next prefix
+                uint8_t const *hit = buf + ix;
+                for(;;)
+                {
+                    hit = memchr(hit, rx->prefix[0], buf + lcl_rd - hit);
+                    if( ! hit)
+                        break;
+                    hoff_t avail = MIN(rx->prefix_len, buf + lcl_rd - hit);
+                    if(memcmp(hit, rx->prefix, avail) == 0)
+                        break;
+                    hit++;
+                }
+                if( ! hit)
+                    break;
+                ix = hit - buf;
+            }
+            rxStep(rx, d, ds, buf[ix]);
+            if(d->accept[ds])
+            {
+                hoff_t end_at = *scanned + ix + 1 + fz->start;
+                rc = rxStart(rx, fz, end_at, win, win_at, match);
+                checkrc(rc);
+                *match_len = end_at - *match;
+                rc = RC_OK;
+                goto end;
+            }
+        }
+        *scanned += lcl_rd;
+    }
+
+    rc = RC_OK;
+
+end:
+    return rc;
+}
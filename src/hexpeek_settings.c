@@ -572,6 +572,11 @@ rc_t parseArgv(int argc, char **argv)
         {
             setupDiff();
         }
+        else if(streq(argv[ix], "-patch"))
+        {
+            advanceArgs();
+            Params.patch_path = argv[ix];
+        }
         else if(streq(argv[ix], "-s"))
         {
             advanceArgs();
@@ -726,7 +731,13 @@ rc_t parseArgv(int argc, char **argv)
         {
             advanceArgs();
             if(streq(argv[ix], "sync"))
-                Params.backup_sync = true;
+                Params.backup_sync = BACKUP_SYNC_FULL;
+            else if(streq(argv[ix], "datasync"))
+                Params.backup_sync = BACKUP_SYNC_DATA;
+            else if(streq(argv[ix], "group"))
+                Params.backup_sync = BACKUP_SYNC_GROUP;
+            else if(streq(argv[ix], "raw"))
+                Params.backup_compress = false;
             else if(streq(argv[ix], "max"))
                 Params.backup_depth = MAX_BACKUP_DEPTH;
             else
@@ -746,6 +757,66 @@ rc_t parseArgv(int argc, char **argv)
                 }
             }
         }
+        else if(streq(argv[ix], "-backupdir"))
+        {
+            struct stat info;
+            advanceArgs();
+            if(stat(argv[ix], &info) || ! S_ISDIR(info.st_mode))
+            {
+                rc = RC_USER;
+                prerr("invalid argument to -backupdir: %s\n",
+                      cleanstring(argv[ix]));
+                goto end;
+            }
+            Params.backup_dir = argv[ix];
+        }
+        else if(streq(argv[ix], "-unsafegroup"))
+        {
+            Params.unsafe_group = true;
+        }
+        else if(streq(argv[ix], "-syncgroup"))
+        {
+            char *endptr = NULL, *msptr = NULL;
+            advanceArgs();
+            Params.sync_group_ops = strtol(argv[ix], &endptr,
+                                           Params.scalar_base);
+            if(endptr != argv[ix] && *endptr == ',')
+            {
+                msptr = endptr + 1;
+                Params.sync_group_ms = strtol(msptr, &endptr,
+                                              Params.scalar_base);
+            }
+            if( ! msptr || endptr == msptr || *endptr != '\0' ||
+               Params.sync_group_ops <= 0 || Params.sync_group_ms < 0)
+            {
+                rc = RC_USER;
+                prerr("invalid argument to -syncgroup\n");
+                goto end;
+            }
+            Params.backup_sync = BACKUP_SYNC_GROUP;
+        }
+        else if(streq(argv[ix], "-journal"))
+        {
+            advanceArgs();
+            rc = strtosz(argv[ix], &Params.journal);
+            if(rc)
+                goto end;
+        }
+        else if(streq(argv[ix], "-overlay"))
+        {
+            Params.overlay = true;
+        }
+        else if(streq(argv[ix], "-batch"))
+        {
+            Params.batch = true;
+        }
+        else if(streq(argv[ix], "-writeback"))
+        {
+            advanceArgs();
+            rc = strtosz(argv[ix], &Params.writeback);
+            if(rc)
+                goto end;
+        }
         else if(streq(argv[ix], "-recover"))
         {
             if(Params.recover_interactive)
@@ -766,6 +837,18 @@ rc_t parseArgv(int argc, char **argv)
             }
             Params.recover_auto = true;
         }
+        else if(streq(argv[ix], "-finish"))
+        {
+            Params.recover_finish = true;
+        }
+        else if(streq(argv[ix], "-check"))
+        {
+            Params.recover_check = true;
+        }
+        else if(streq(argv[ix], "-dryrun"))
+        {
+            Params.recover_dryrun = true;
+        }
 #ifdef HEXPEEK_TRACE
         else if(streq(argv[ix], "-trace"))
         {
@@ -908,13 +991,15 @@ process_infile:
         counter++;
     if(Params.do_pack)
         counter++;
+    if(Params.patch_path)
+        counter++;
     if(Params.recover_interactive || Params.recover_auto)
         counter++;
     if(counter > 1)
     {
         rc = RC_USER;
-        prerr("more than one of -x, -dump / -list, -diff, -pack, and -recover"
-              " specified\n");
+        prerr("more than one of -x, -dump / -list, -diff, -pack, -patch, and"
+              " -recover specified\n");
         goto end;
     }
     if(do_dump)
@@ -936,6 +1021,15 @@ process_infile:
             goto end;
         }
     }
+    else if(Params.patch_path)
+    {
+        if(file_count != 1)
+        {
+            rc = RC_USER;
+            prerr("need one file to patch\n");
+            goto end;
+        }
+    }
     else if(do_diff)
     {
         if(file_count != 2)
@@ -947,6 +1041,14 @@ process_infile:
         generateCommand(2, cmd_at, cmd_len);
     }
 
+    if(Params.backup_sync == BACKUP_SYNC_GROUP && ! Params.unsafe_group)
+    {
+        rc = RC_USER;
+        prerr("-backup group is not safe against a system crash, "
+              "add -unsafegroup to use it\n");
+        goto end;
+    }
+
     // Recovery mode
     if(Params.recover_interactive && Params.recover_auto)
     {
@@ -954,6 +1056,39 @@ process_infile:
         prerr("-recover and -AutoRecover conflict\n");
         goto end;
     }
+    if(Params.recover_finish &&
+       ! (Params.recover_interactive || Params.recover_auto))
+    {
+        rc = RC_USER;
+        prerr("-finish requires -recover or -AutoRecover\n");
+        goto end;
+    }
+    if(Params.recover_check &&
+       ! (Params.recover_interactive || Params.recover_auto))
+    {
+        rc = RC_USER;
+        prerr("-check requires -recover or -AutoRecover\n");
+        goto end;
+    }
+    if(Params.recover_check && Params.recover_finish)
+    {
+        rc = RC_USER;
+        prerr("-check and -finish conflict\n");
+        goto end;
+    }
+    if(Params.recover_dryrun &&
+       ! (Params.recover_interactive || Params.recover_auto))
+    {
+        rc = RC_USER;
+        prerr("-dryrun requires -recover or -AutoRecover\n");
+        goto end;
+    }
+    if(Params.recover_dryrun && (Params.recover_check || Params.recover_finish))
+    {
+        rc = RC_USER;
+        prerr("-dryrun conflicts with -check and -finish\n");
+        goto end;
+    }
     if(Params.recover_interactive || Params.recover_auto)
     {
         if(file_count > 1)
@@ -0,0 +1,298 @@
+// Copyright 2020, 2025 Michael Reilly (mreilly@mreilly.dev).
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions
+// are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. Neither the names of the copyright holders nor the names of the
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDERS
+// OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#define SRCNAME "hexpeek_stats.c"
+
+#include <hexpeek.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+/**
+ * @file hexpeek_stats.c
+ * @brief Octet statistics over a filezone: histogram, Shannon entropy, and a
+ *        per-block entropy map.
+ */
+
+#define STATS_RDSZ    (BUFSZ * 0x10)
+#define STATS_MAPW    0x40
+#define STATS_TBLMAX  BUFSZ
+
+#define MAP_ZERO      'z'
+#define MAP_FF        'f'
+
+/**
+ * @brief Base 2 logarithm for positive x without depending on libm: split
+ *        off the binary exponent and evaluate the atanh series on the
+ *        mantissa (accurate to about 1e-10, far beyond what is printed).
+ */
+static double log2d(double x)
+{
+    union { double d; uint64_t u; } v = { .d = x };
+    int ex = (int)((v.u >> 52) & 0x7FF) - 0x3FF;
+    v.u = (v.u & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL; // [1, 2)
+    if(v.d > 1.4142135623730951)
+    {
+        v.d /= 2;
+        ex++;
+    }
+    double t = (v.d - 1) / (v.d + 1), t2 = t * t, sum = 0, pw = t;
+    for(int term = 1; term <= 17; term += 2, pw *= t2)
+        sum += pw / term;
+    return ex + sum * 2.8853900817779268; // 2 / ln(2)
+}
+
+/**
+ * @brief Accumulate a histogram of buf into four interleaved sub-histograms
+ *        so consecutive increments rarely hit the same counter, which would
+ *        otherwise serialize on store-to-load forwarding.
+ */
+static void histAccum(uint32_t sub[4][OCTET_COUNT], uint8_t const *buf,
+                      size_t len)
+{
+    size_t ix = 0;
+    for( ; ix + 8 <= len; ix += 8)
+    {
+        uint64_t wd;
+        memcpy(&wd, buf + ix, sizeof wd);
+        sub[0][(uint8_t)(wd      )]++;
+        sub[1][(uint8_t)(wd >>  8)]++;
+        sub[2][(uint8_t)(wd >> 16)]++;
+        sub[3][(uint8_t)(wd >> 24)]++;
+        sub[0][(uint8_t)(wd >> 32)]++;
+        sub[1][(uint8_t)(wd >> 40)]++;
+        sub[2][(uint8_t)(wd >> 48)]++;
+        sub[3][(uint8_t)(wd >> 56)]++;
+    }
+    for( ; ix < len; ix++)
+        sub[0][buf[ix]]++;
+}
+
+/**
+ * @brief Fold sub-histograms into hist and zero them.
+ */
+static void histFold(uint32_t sub[4][OCTET_COUNT], uint64_t *hist)
+{
+    for(int oc = 0; oc < OCTET_COUNT; oc++)
+        hist[oc] += (uint64_t)sub[0][oc] + sub[1][oc] + sub[2][oc] + sub[3][oc];
+    memset(sub, 0, sizeof(uint32_t) * 4 * OCTET_COUNT);
+}
+
+/**
+ * @brief Shannon entropy in bits per octet of a histogram totalling count.
+ *
+ * @param[in] clogc If non-NULL, table of c * log2(c) valid for c <= count
+ */
+static double entropy(uint64_t const *hist, uint64_t count, double const *clogc)
+{
+    double sum = 0;
+    if(count == 0)
+        return 0;
+    for(int oc = 0; oc < OCTET_COUNT; oc++)
+    {
+        if(hist[oc] == 0)
+            continue;
+        sum += clogc ? clogc[hist[oc]] : hist[oc] * log2d((double)hist[oc]);
+    }
+    double result = log2d((double)count) - sum / count;
+    return result < 0 ? 0 : result;
+}
+
+/**
+ * @brief Classify a finished block, append its entropy map character, and
+ *        flush a line of the map when it fills.
+ */
+static void mapBlock(uint64_t const *hist, uint64_t count, double const *clogc,
+                     char *line, int *lpos, hoff_t blk_at, hoff_t *line_at,
+                     hoff_t counts[2])
+{
+    char ch = '\0';
+    if(hist[0] == count)
+    {
+        ch = MAP_ZERO;
+        counts[0]++;
+    }
+    else if(hist[0xFF] == count)
+    {
+        ch = MAP_FF;
+        counts[1]++;
+    }
+    else
+    {
+        int digit = (int)entropy(hist, count, clogc);
+        ch = (char)('0' + MIN(digit, 8));
+    }
+    if(*lpos == 0)
+        *line_at = blk_at;
+    line[(*lpos)++] = ch;
+    if(*lpos == STATS_MAPW)
+    {
+        consoleOutf(PRI_hoff MarginPost "%.*s%s",
+                    prihoff(*line_at), *lpos, line, LineTerm);
+        *lpos = 0;
+    }
+}
+
+/**
+ * @brief Compute and print octet statistics for a filezone: an entropy map
+ *        with one character per block, the count of all-zero and all-0xFF
+ *        blocks, overall entropy, and a 256-bin histogram. The file must
+ *        already be positioned at fz->start.
+ *
+ * @param[in] fz Filezone to examine
+ * @param[in] blksz Block size for the entropy map and block counts
+ * @param[out] octets_processed Amount of data read
+ * @return RC_OK on success; else a hexpeek error code
+ */
+rc_t statsZone(FileZone const *fz, hoff_t blksz, hoff_t *octets_processed)
+{
+    rc_t rc = RC_UNSPEC;
+    uint8_t *rd_buf = NULL;
+    uint32_t (*sub)[OCTET_COUNT] = NULL;
+    uint64_t total[OCTET_COUNT], block[OCTET_COUNT];
+    double *clogc = NULL;
+    hoff_t length = fz->len, tot = 0, in_blk = 0, blocks = 0, unfolded = 0;
+    hoff_t counts[2] = { 0, 0 }, line_at = 0;
+    char line[STATS_MAPW];
+    int lpos = 0;
+    bool eof = false;
+
+    assert(blksz > 0);
+
+    rd_buf = Malloc(STATS_RDSZ);
+    sub = Malloc(sizeof(uint32_t) * 4 * OCTET_COUNT);
+    memset(sub, 0, sizeof(uint32_t) * 4 * OCTET_COUNT);
+    memset(total, 0, sizeof total);
+    memset(block, 0, sizeof block);
+
+    if(blksz <= STATS_TBLMAX)
+    {
+        clogc = Malloc(sizeof(double) * (blksz + 1));
+        clogc[0] = 0;
+        for(hoff_t cc = 1; cc <= blksz; cc++)
+            clogc[cc] = cc * log2d((double)cc);
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    if(isseekable(fz->fi))
+        posix_fadvise(DT_FD(fz->fi), fz->start,
+                      fz->len == HOFF_MAX ? 0 : fz->len, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    consoleOutf("At " PRI_hoff " (block size " PRI_hoff ", \"%c\" zero, "
+                "\"%c\" 0x%s, else entropy digit) :%s",
+                prihoff(fz->start), prihoff(blksz), MAP_ZERO, MAP_FF,
+                BinLookup_hexl[0xFF], LineTerm);
+
+    while(length > 0)
+    {
+        hoff_t lcl_rd = hexpeek_read(DT_FD(fz->fi), rd_buf,
+                                     MIN(STATS_RDSZ, length));
+        if(lcl_rd < 0)
+        {
+            rc = RC_CRIT;
+            goto end;
+        }
+        if(lcl_rd == 0)
+        {
+            eof = true;
+            break;
+        }
+        for(hoff_t ix = 0; ix < lcl_rd; )
+        {
+            hoff_t seg = MIN(lcl_rd - ix, blksz - in_blk);
+            if(unfolded > UINT32_MAX - seg)
+            {
+                // only possible with huge blocks; keep 32-bit counters exact
+                histFold(sub, block);
+                unfolded = 0;
+            }
+            histAccum(sub, rd_buf + ix, (size_t)seg);
+            unfolded += seg;
+            ix += seg;
+            in_blk += seg;
+            if(in_blk == blksz)
+            {
+                histFold(sub, block);
+                unfolded = 0;
+                mapBlock(block, in_blk, clogc, line, &lpos,
+                         fz->start + tot + ix - in_blk, &line_at, counts);
+                for(int oc = 0; oc < OCTET_COUNT; oc++)
+                    total[oc] += block[oc];
+                memset(block, 0, sizeof block);
+                in_blk = 0;
+                blocks++;
+            }
+        }
+        tot += lcl_rd;
+        length -= lcl_rd;
+    }
+
+    if(in_blk > 0)
+    {
+        histFold(sub, block);
+        mapBlock(block, in_blk, clogc, line, &lpos,
+                 fz->start + tot - in_blk, &line_at, counts);
+        for(int oc = 0; oc < OCTET_COUNT; oc++)
+            total[oc] += block[oc];
+        blocks++;
+    }
+    if(lpos > 0)
+    {
+        consoleOutf(PRI_hoff MarginPost "%.*s%s",
+                    prihoff(line_at), lpos, line, LineTerm);
+    }
+
+    consoleOutf("octets " PRI_hoff ", blocks " PRI_hoff " (" PRI_hoff " zero, "
+                PRI_hoff " 0x%s), entropy %.4f bits per octet%s",
+                prihoff(tot), prihoff(blocks), prihoff(counts[0]),
+                prihoff(counts[1]), BinLookup_hexl[0xFF],
+                entropy(total, (uint64_t)tot, NULL), LineTerm);
+    for(int oc = 0; oc < OCTET_COUNT; oc += 8)
+    {
+        consoleOutf("%s" MarginPost, BinLookup_hexl[oc]);
+        for(int ix = oc; ix < oc + 8; ix++)
+            consoleOutf(PRI_hoff "%s", prihoff((hoff_t)total[ix]),
+                        ix < oc + 7 ? " " : LineTerm);
+    }
+
+    *octets_processed = tot;
+    rc = RC_OK;
+
+    if(eof && ! fz->tolerate_eof)
+    {
+        rc = RC_USER;
+        prerr(EofErrString, DT_NAME(fz->fi));
+    }
+
+end:
+    consoleFlush();
+    free(rd_buf);
+    free(sub);
+    free(clogc);
+    return rc;
+}
@@ -74,8 +74,20 @@ void Settings_init(Settings *st)
     st->assume_ttys                 = -1;
     st->recover_interactive         = false;
     st->recover_auto                = false;
+    st->recover_finish              = false;
+    st->recover_check               = false;
+    st->recover_dryrun              = false;
     st->backup_depth                = -1;
-    st->backup_sync                 = false;
+    st->backup_sync                 = BACKUP_SYNC_NONE;
+    st->backup_compress             = true;
+    st->backup_dir                  = NULL;
+    st->unsafe_group                = false;
+    st->sync_group_ops              = DEFAULT_SYNC_GROUP_OPS;
+    st->sync_group_ms               = DEFAULT_SYNC_GROUP_MS;
+    st->journal                     = 0;
+    st->overlay                     = false;
+    st->batch                       = false;
+    st->writeback                   = 0;
     st->permissive                  = false;
     st->fail_strict                 = -1;
 #ifdef HEXPEEK_EDITABLE_CONSOLE
@@ -85,6 +97,7 @@ void Settings_init(Settings *st)
 #endif
     st->command                     = NULL;
     st->do_pack                     = false;
+    st->patch_path                  = NULL;
     for(int fi = 0; fi < MAX_INFILES; fi++)
     {
         st->infiles[fi].path                  = NULL;
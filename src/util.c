@@ -179,11 +179,14 @@ void trace_fmt(FILE *fp, char const *fmt, ...)
 {
     if(fp)
     {
+        // Keep each line whole when several threads trace
         va_list vl;
+        flockfile(fp);
         va_start(vl, fmt);
         vfprintf(fp, fmt, vl);
         va_end(vl);
         fflush(fp);
+        funlockfile(fp);
     }
 }
 
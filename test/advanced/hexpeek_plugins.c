@@ -60,6 +60,9 @@ static int PluginData_DeathCount = -1;
 
 static bool PluginData_AllowBackupDeath = false;
 
+// Guards the death count, which write loops of several threads count down
+static pthread_mutex_t PluginData_DeathLock = PTHREAD_MUTEX_INITIALIZER;
+
 //--------------------------- Argument Interpreter ---------------------------//
 
 rc_t plugin_argv(int argc, char **argv, int *which)
@@ -156,16 +159,22 @@ void* plugin(int type, void *vp)
         validate(vp);
         break;
     case 2:
+        pthread_mutex_lock(&PluginData_DeathLock);
         if(PluginData_DeathCount > 0)
         {
             PluginData_DeathCount--;
+            // Die at once, as a crash would: other threads may be writing, so
+            // exit handlers must not run under them. The lock is kept so no
+            // other thread gets past its next write loop cycle.
             if(PluginData_DeathCount == 0)
-                exit(60);
+                _exit(60);
         }
+        pthread_mutex_unlock(&PluginData_DeathLock);
         break;
     case 3:
         if( ! PluginData_AllowBackupDeath)
         {
+            pthread_mutex_lock(&PluginData_DeathLock);
             switch((int)vp)
             {
             case 0:
@@ -177,6 +186,7 @@ void* plugin(int type, void *vp)
                 saved_death_count = -1;
                 break;
             }
+            pthread_mutex_unlock(&PluginData_DeathLock);
         }
         break;
     case -1: